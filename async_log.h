@@ -0,0 +1,209 @@
+// Asynchronous logger used by server.cpp through login().
+//
+// Every logging thread gets its own single-producer/single-consumer byte ring of variable-length
+// records; logging is a bounded memcpy into the ring and one atomic store, no lock and no
+// syscall. A background flusher drains all rings, prefixes each line with a timestamp that is
+// formatted once per second, and hands the batch to the log fd with one writev().
+// A full ring, or a thread over its --log-rate budget, drops lines (WARN/ERROR are never rate
+// limited); the flusher reports how many were lost.
+// Lines from different threads are ordered per thread, not globally.
+#ifndef CAMPUS_ASYNC_LOG_H
+#define CAMPUS_ASYNC_LOG_H
+#include<atomic>
+#include<chrono>
+#include<cerrno>
+#include<cstdint>
+#include<cstdio>
+#include<cstring>
+#include<ctime>
+#include<mutex>
+#include<string>
+#include<thread>
+#include<unistd.h>
+#include<sys/uio.h>
+
+enum { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG };
+
+const int LOG_MAX_THREADS = 64;
+const size_t LOG_RING = 1u << 20;   // bytes per thread (power of two)
+const size_t LOG_TEXT = 1024;       // longer lines are truncated
+const int LOG_IOV = 512;            // iovecs per writev()
+const uint32_t LOG_WRAP = 0xFFFFFFFF; // record length marking "rest of the ring is unused"
+
+// Record header; the text follows and the whole record is padded to 8 bytes
+struct log_rec {
+    uint32_t len;                   // text bytes, or LOG_WRAP
+    uint32_t level;
+    int64_t sec;
+    char* text() { return (char*)(this+1); }
+};
+
+struct log_ring {
+    std::atomic<uint64_t> head;     // bytes ever written by the producer
+    std::atomic<uint64_t> tail;     // bytes ever released by the flusher
+    std::atomic<uint64_t> dropped;  // ring full or over the rate budget
+    std::atomic<bool> used;
+    time_t rateSec;                 // producer only: token bucket second
+    uint32_t rateLeft;
+    alignas(8) char buf[LOG_RING];
+    log_rec* at(uint64_t pos) { return (log_rec*)(buf + (pos & (LOG_RING-1))); }
+};
+
+inline int logFd = STDOUT_FILENO;
+inline std::atomic<int> logLevel(LOG_INFO);
+inline uint32_t logRate = 10000;            // INFO/DEBUG lines per second per thread
+inline std::atomic<time_t> logNow(0);       // cached clock, advanced by the flusher
+inline std::atomic<log_ring*> logRings[LOG_MAX_THREADS]; // threads may register while the flusher scans
+inline std::atomic<int> logRingCount(0);
+inline thread_local log_ring* logSelf = nullptr;
+
+inline log_ring* logRegister() {
+    int i = logRingCount.fetch_add(1);
+    if (i >= LOG_MAX_THREADS) { logRingCount--; return nullptr; }
+    log_ring* r = new log_ring();
+    r->head = 0; r->tail = 0; r->dropped = 0; r->rateSec = 0; r->rateLeft = 0;
+    logRings[i].store(r, std::memory_order_release);
+    r->used.store(true, std::memory_order_release);
+    logSelf = r;
+    return r;
+}
+
+inline bool logEnabled(int level) { return level <= logLevel.load(std::memory_order_relaxed); }
+
+inline void logWrite(int level, const char* s, size_t n) {
+    if (!logEnabled(level)) return;
+    log_ring* r = logSelf ? logSelf : logRegister();
+    if (!r) return;
+    time_t now = logNow.load(std::memory_order_relaxed);
+    if (level >= LOG_INFO) {
+        if (r->rateSec != now) { r->rateSec = now; r->rateLeft = logRate; }
+        if (r->rateLeft == 0) { r->dropped.fetch_add(1, std::memory_order_relaxed); return; }
+        r->rateLeft--;
+    }
+    if (n > LOG_TEXT) n = LOG_TEXT;
+    size_t need = (sizeof(log_rec) + n + 7) & ~(size_t)7;
+    uint64_t h = r->head.load(std::memory_order_relaxed);
+    size_t toEnd = LOG_RING - (h & (LOG_RING-1));
+    size_t waste = need > toEnd ? toEnd : 0; // records never straddle the end of the ring
+    if (h + waste + need - r->tail.load(std::memory_order_acquire) > LOG_RING) {
+        r->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (waste) { r->at(h)->len = LOG_WRAP; h += waste; }
+    log_rec* rec = r->at(h);
+    rec->len = (uint32_t)n;
+    rec->level = (uint32_t)level;
+    rec->sec = now;
+    memcpy(rec->text(), s, n);
+    r->head.store(h + need, std::memory_order_release);
+}
+
+// ---- flusher -------------------------------------------------------------------------------
+
+struct log_flusher {
+    time_t stampSec = -1;
+    char stamp[32];             // "[Sat Oct 17 12:00:00 2026] "
+    size_t stampLen = 0;
+    std::mutex drainMtx;        // one drain() at a time (flusher thread or logFlushNow)
+
+    const char* stampFor(time_t t) {
+        if (t != stampSec) {
+            char tb[26]; ctime_r(&t, tb); tb[24] = 0; // drop the newline
+            stampLen = (size_t)snprintf(stamp, sizeof(stamp), "[%s] ", tb);
+            stampSec = t;
+        }
+        return stamp;
+    }
+
+    static void writeAll(iovec* iov, int n) {
+        while (n > 0) {
+            ssize_t w = writev(logFd, iov, n);
+            if (w < 0) { if (errno == EINTR) continue; return; }
+            while (n > 0 && (size_t)w >= iov->iov_len) { w -= iov->iov_len; iov++; n--; }
+            if (n > 0) { iov->iov_base = (char*)iov->iov_base + w; iov->iov_len -= w; }
+        }
+    }
+
+    // iovecs point into the rings and at the one stamp buffer; only after they are written may
+    // the stamp change or the rings' tails move on
+    void flush(iovec* iov, int &n, log_ring** rings, uint64_t* tails, int &pending) {
+        if (n) writeAll(iov, n);
+        n = 0;
+        for (int i=0;i<pending;i++) rings[i]->tail.store(tails[i], std::memory_order_release);
+        pending = 0;
+    }
+
+    // One pass over every ring, batched into as few writev() calls as possible.
+    // Returns the number of records written.
+    size_t drain() {
+        static const char* tags[] = { "ERROR: ", "WARN: ", "", "debug: " };
+        static const char nl = '\n';
+        std::lock_guard<std::mutex> lk(drainMtx);
+        iovec iov[LOG_IOV];
+        log_ring* held[LOG_MAX_THREADS];
+        uint64_t tails[LOG_MAX_THREADS];
+        int n = 0, pending = 0;
+        size_t total = 0;
+        uint64_t lost = 0;
+        int rings = logRingCount.load(std::memory_order_acquire);
+        for (int i=0;i<rings;i++) {
+            log_ring* r = logRings[i].load(std::memory_order_acquire);
+            if (!r || !r->used.load(std::memory_order_acquire)) continue;
+            lost += r->dropped.exchange(0, std::memory_order_relaxed);
+            uint64_t t = r->tail.load(std::memory_order_relaxed);
+            uint64_t h = r->head.load(std::memory_order_acquire);
+            if (t == h) continue;
+            held[pending] = r; tails[pending] = t; pending++;
+            while (t != h) {
+                log_rec* rec = r->at(t);
+                if (rec->len == LOG_WRAP) { t += LOG_RING - (t & (LOG_RING-1)); continue; }
+                if (n + 4 > LOG_IOV || (n && rec->sec != stampSec)) {
+                    tails[pending-1] = t;
+                    flush(iov, n, held, tails, pending);
+                    held[0] = r; tails[0] = t; pending = 1;
+                }
+                stampFor(rec->sec);
+                iov[n++] = iovec{stamp, stampLen};
+                const char* tag = tags[rec->level <= LOG_DEBUG ? rec->level : (uint32_t)LOG_INFO];
+                if (*tag) iov[n++] = iovec{(void*)tag, strlen(tag)};
+                iov[n++] = iovec{rec->text(), rec->len};
+                iov[n++] = iovec{(void*)&nl, 1};
+                t += (sizeof(log_rec) + rec->len + 7) & ~(size_t)7;
+                total++;
+            }
+            tails[pending-1] = t;
+        }
+        flush(iov, n, held, tails, pending);
+        if (lost) {
+            char note[96];
+            int len = snprintf(note, sizeof(note), "%sWARN: %llu log lines dropped (rate limit or full buffer)\n",
+                               stampFor(logNow.load()), (unsigned long long)lost);
+            iovec v{note, (size_t)len};
+            writeAll(&v, 1);
+        }
+        return total;
+    }
+
+    void run() {
+        while (true) {
+            logNow.store(time(NULL), std::memory_order_relaxed);
+            if (drain() == 0) std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+};
+
+inline log_flusher* logFlusher = nullptr;
+
+// Start the background flusher (call once, before logging from many threads)
+inline void logStart() {
+    logNow.store(time(NULL));
+    logFlusher = new log_flusher();
+    std::thread([]{ logFlusher->run(); }).detach();
+}
+
+// Write out whatever is queued now (right before exit)
+inline void logFlushNow() {
+    if (logFlusher) logFlusher->drain();
+}
+
+#endif
@@ -0,0 +1,675 @@
+// Embeddable asynchronous client for the campus protocol, built on campus_client.h, for
+// programs that send from code rather than from a menu (client.cpp is one).
+//
+// connect() logs in, following a federation's redirects, and starts the client's own thread.
+// That thread runs an epoll loop that owns the socket:
+// - It writes the queued requests and reads frames.
+// - It sends the UDP heartbeat every ASYNC_HB_SEC and takes admin announcements off the same
+//   socket.
+// - If the connection drops, it resumes the session, or logs in again. A resumed session keeps
+//   the requests waiting for replies (the server resends those it wrote meanwhile) and sends
+//   the ones that never got out; only the files under way are lost.
+// With clientTls set (campus_client.h) every connection it makes is encrypted.
+// send() and sendFile() only queue. Every request gets its own sequence id and goes out behind
+// the ones before it, without waiting for their replies. The server's FT_REPLY is matched to
+// the request by that id, and the result comes back through a callback or a std::future. At
+// most `window` requests can be unanswered at once; past that, send() waits for a reply.
+// Files go out a chunk at a time, in turn with the other files under way, and every request,
+// acknowledgement or stream start queued meanwhile goes before the next chunk, so a message
+// waits for at most one chunk (plus ASYNC_NOTSENT_LOWAT in the kernel). With the server's
+// agreement (;Flow:window) each file only sends as far as its FT_WINDOW credit.
+// Callbacks run on the client's thread and must not block. They may send (from that thread
+// the window is not enforced) but not close().
+#ifndef CAMPUS_ASYNC_H
+#define CAMPUS_ASYNC_H
+#include<algorithm>
+#include<atomic>
+#include<deque>
+#include<functional>
+#include<future>
+#include<memory>
+#include<mutex>
+#include<condition_variable>
+#include<thread>
+#include<unordered_map>
+#include<vector>
+#include<ctime>
+#include<sys/epoll.h>
+#include<sys/eventfd.h>
+#include<netinet/tcp.h>
+#include "campus_client.h"
+
+const int ASYNC_HB_SEC = 5;               // heartbeat interval
+const int ASYNC_RECONNECT_SEC = 120;      // give up on a lost server after this long
+const size_t ASYNC_WINDOW = 256;          // default unanswered requests before send() waits
+const int ASYNC_NOTSENT_LOWAT = 128 << 10; // unsent bytes the kernel may hold for the socket
+
+// Statuses the client reports itself (all others are the server's reply)
+const char* const ASYNC_LOST = "CONNECTION_LOST";     // the connection dropped before the reply came
+const char* const ASYNC_CLOSED = "CLIENT_CLOSED";     // close() came first
+const char* const ASYNC_NO_FILE = "FILE_UNREADABLE";  // sendFile() could not open or read it
+
+enum async_event {
+    ASYNC_RECONNECTING,    // the connection dropped; trying to get back on
+    ASYNC_RESUMED,         // the session was resumed; nothing sent to us was lost
+    ASYNC_LOGGED_IN,       // logged in again; anything sent to us meanwhile may be lost
+    ASYNC_GAVE_UP,         // no server took us back within ASYNC_RECONNECT_SEC; the client stops
+    ASYNC_SERVER_NOTE,     // an FT_REPLY no request is waiting for (detail: its text)
+};
+
+struct campus_message {
+    std::string sender, text;
+    bool stored;           // kept in the server's spool while we were offline
+};
+
+struct campus_file {
+    std::string sender, name;
+    std::string path;      // where it was saved (removed again if !ok)
+    bool ok;               // false: the sender aborted it or the connection was lost
+};
+
+typedef std::function<void(const std::string &status)> reply_fn;
+
+struct async_client {
+    // Set these before connect()
+    std::function<void(const campus_message &)> onMessage;    // unset: messages wait for receive()
+    std::function<void(const campus_file &)> onFile;
+    std::function<void(const std::string &)> onAnnouncement;  // admin broadcast
+    std::function<void(async_event, const std::string &)> onEvent;
+    std::string rxDir;         // received files go here ("": the working directory), as received_<sender>_<name>
+    size_t window = ASYNC_WINDOW;
+
+    async_client() {}
+    async_client(const async_client &) = delete;
+    async_client &operator=(const async_client &) = delete;
+    ~async_client() { close(); }
+
+    // Log in (asking for compression and a resumable session) and start the client's thread.
+    // A server that sheds the login (SERVER_BUSY) is asked again after the wait it named,
+    // jittered, for up to ASYNC_RECONNECT_SEC. Returns the server's reply line; the client runs
+    // only if authOk() holds for it. "" if no server could be reached.
+    std::string connect(const std::string &host, int port, const std::string &campus, const std::string &pass) {
+        name = campus; password = pass;
+        frame_reader got;
+        std::string resp;
+        time_t giveUp = time(NULL) + ASYNC_RECONNECT_SEC;
+        int s, wait;
+        while (true) {
+            entryHost = serverHost = host; entryPort = serverPort = port;
+            got = frame_reader();
+            s = loginServer(serverHost, serverPort, campus, pass, got, resp, true, true, true);
+            if ((wait = busyRetry(resp)) < 0 || time(NULL) >= giveUp) break;
+            if (s >= 0) ::close(s); // a TLS server sheds before the handshake: no socket
+            usleep(jittered(wait) * 1000);
+        }
+        if (s < 0 || !authOk(resp)) { if (s >= 0) ::close(s); return resp; }
+        ep = epoll_create1(EPOLL_CLOEXEC);
+        wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        udp = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        watch(wake, W_WAKE, EPOLLIN);
+        watch(udp, W_UDP, EPOLLIN);
+        adopt(s, got);
+        loggedIn(resp);
+        loopThread = std::thread([this] { loop(); });
+        return resp;
+    }
+
+    // Queue a message for a campus, "*" or "@group"; done gets the server's status
+    // (DELIVERED, STORED, TARGET_OFFLINE, ...) or one of the ASYNC_* ones
+    void send(const std::string &target, const std::string &text, reply_fn done) {
+        uint32_t seq = ++lastSeq;
+        std::string req = sendRequest(target, text, seq, comp.load());
+        std::unique_lock<std::mutex> lk(m);
+        if (!waitRoom(lk)) { lk.unlock(); if (done) done(stopped ? ASYNC_LOST : ASYNC_CLOSED); return; }
+        waiting[seq] = std::move(done);
+        outbox.push_back(std::move(req));
+        lk.unlock();
+        kick();
+    }
+    std::future<std::string> send(const std::string &target, const std::string &text) {
+        auto p = std::make_shared<std::promise<std::string>>();
+        std::future<std::string> f = p->get_future();
+        send(target, text, [p](const std::string &st) { p->set_value(st); });
+        return f;
+    }
+
+    // Queue a file. A file for Islamabad is offered by its chunk hashes first (hashed here, on
+    // the caller's thread) and only the chunks the server lacks are sent; anything else is
+    // streamed. done gets FILE_FORWARDED, FILE_SAVED_ON_SERVER, ... once the server has it all.
+    void sendFile(const std::string &target, const std::string &path, reply_fn done) {
+        upload* u = new upload();
+        u->target = target; u->path = path;
+        u->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (u->fd < 0 || fstat(u->fd, &st) < 0) {
+            if (u->fd >= 0) ::close(u->fd);
+            delete u;
+            if (done) done(ASYNC_NO_FILE);
+            return;
+        }
+        u->size = st.st_size;
+        u->offering = target == "Islamabad" && (size_t)st.st_size >= CDC_MIN && chunkFile(u->fd, u->chunks);
+        if (!u->offering) u->chunks.clear();
+        std::unique_lock<std::mutex> lk(m);
+        if (!waitRoom(lk)) { lk.unlock(); ::close(u->fd); delete u; if (done) done(stopped ? ASYNC_LOST : ASYNC_CLOSED); return; }
+        u->id = ++lastSeq;
+        waiting[u->id] = std::move(done);
+        newUploads.push_back(u);
+        lk.unlock();
+        kick();
+    }
+    std::future<std::string> sendFile(const std::string &target, const std::string &path) {
+        auto p = std::make_shared<std::promise<std::string>>();
+        std::future<std::string> f = p->get_future();
+        sendFile(target, path, [p](const std::string &st) { p->set_value(st); });
+        return f;
+    }
+
+    // Next message sent to us, when onMessage is not set. Messages nobody asked for yet are kept.
+    std::future<campus_message> receive() {
+        std::promise<campus_message> p;
+        std::future<campus_message> f = p.get_future();
+        std::lock_guard<std::mutex> lk(m);
+        if (!inbox.empty()) { p.set_value(std::move(inbox.front())); inbox.pop_front(); }
+        else receivers.push_back(std::move(p));
+        return f;
+    }
+
+    // Requests sent but not answered yet
+    size_t pending() {
+        std::lock_guard<std::mutex> lk(m);
+        return waiting.size();
+    }
+
+    // Stop the client's thread and close the connection. Unanswered requests get
+    // CLIENT_CLOSED; pending receive() futures are broken.
+    void close() {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            if (closing) return;
+            closing = true;
+            room.notify_all();
+        }
+        kick();
+        if (loopThread.joinable()) loopThread.join();
+        if (sock >= 0) ::close(sock);
+        sock = -1;
+        for (upload* u : uploads) { ::close(u->fd); delete u; }
+        uploads.clear();
+        abortRx();
+        failAll(ASYNC_CLOSED);
+        std::lock_guard<std::mutex> lk(m);
+        receivers.clear();
+        for (int fd : {ep, wake, udp}) if (fd >= 0) ::close(fd);
+        ep = wake = udp = -1;
+    }
+
+    // ---- internals -------------------------------------------------------------------------
+
+    struct upload {
+        uint32_t id = 0;
+        int fd = -1;
+        std::string target, path;
+        uint64_t size = 0, off = 0;
+        bool offering = false;             // offer sent, waiting for FT_FILE_NEED
+        std::vector<chunk_ref> chunks;     // offered chunks; empty: streamed
+        std::string need;                  // FT_FILE_NEED bitmap
+        size_t next = 0;                   // next chunk to consider
+        int64_t window = FILE_WINDOW;      // chunk bytes it may still send (;Flow:window)
+        bool failed = false;               // the server answered before END: only END follows
+    };
+    struct rx_file { int fd; campus_file f; };
+    enum { W_WAKE, W_UDP, W_SOCK };
+
+    // Shared with callers, under m
+    std::mutex m;
+    std::condition_variable room;              // a reply freed a place in the window
+    std::unordered_map<uint32_t, reply_fn> waiting;
+    std::vector<std::string> outbox;           // request frames not handed to the loop yet
+    std::vector<upload*> newUploads;
+    std::deque<campus_message> inbox;
+    std::deque<std::promise<campus_message>> receivers;
+    bool closing = false;
+    bool stopped = false;                      // the loop gave up on the server
+    std::atomic<uint32_t> lastSeq{0};
+    std::atomic<bool> comp{false};             // the server agreed to compression
+    bool flow = false;                         // ...and to flow-controlled uploads (client's thread)
+    std::atomic<bool> kicked{false};           // wake is signalled and not yet read
+
+    // The client's thread only (connect() sets them up before it starts)
+    std::thread loopThread;
+    int ep = -1, wake = -1, udp = -1, sock = -1;
+    std::string entryHost, serverHost, name, password, token;
+    int entryPort = TCP_port, serverPort = TCP_port;
+    frame_reader in;
+    uint64_t framesIn = 0;                     // frames received on the session (a resume says so)
+    std::string wbuf;                          // bytes for the socket, sent up to woff: control
+    size_t woff = 0;                           // frames, then at most one file chunk
+    std::string ctrl;                          // control frames waiting for wbuf
+    std::vector<upload*> uploads;              // files under way, in the order they were queued
+    size_t nextUp = 0;                         // the one whose turn it is to send a chunk
+    std::unordered_map<uint32_t, rx_file> rx;  // files arriving, by transfer id
+    std::string chunk = std::string(FRAME_HDR + FILE_CHUNK, '\0');
+    std::string z, unpacked;
+
+    void watch(int fd, int tag, uint32_t events) {
+        epoll_event e;
+        memset(&e, 0, sizeof(e));
+        e.events = events;
+        e.data.u32 = tag;
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &e);
+    }
+
+    void kick() {
+        if (wake >= 0 && !kicked.exchange(true)) { uint64_t one = 1; ssize_t r = write(wake, &one, sizeof(one)); (void)r; }
+    }
+
+    // Caller holds m. False if the request cannot be queued (closed or given up).
+    bool waitRoom(std::unique_lock<std::mutex> &lk) {
+        if (std::this_thread::get_id() != loopThread.get_id())
+            room.wait(lk, [this] { return closing || stopped || waiting.size() < window; });
+        return !closing && !stopped;
+    }
+
+    // Hand a request's status to whoever waits for it
+    void complete(uint32_t seq, const std::string &status) {
+        reply_fn f;
+        bool note = false;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            auto it = waiting.find(seq);
+            if (it == waiting.end()) note = true;
+            else {
+                f = std::move(it->second);
+                waiting.erase(it);
+                room.notify_all();
+            }
+        }
+        // outside m: callbacks may send
+        if (note) { if (onEvent) onEvent(ASYNC_SERVER_NOTE, status); }
+        else if (f) f(status);
+    }
+
+    // The requests in ids, if still unanswered, end with status
+    void fail(const std::vector<uint32_t> &ids, const char* status) {
+        std::vector<reply_fn> fs;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            for (uint32_t id : ids) {
+                auto it = waiting.find(id);
+                if (it == waiting.end()) continue;
+                fs.push_back(std::move(it->second));
+                waiting.erase(it);
+            }
+            room.notify_all();
+        }
+        for (reply_fn &f : fs) if (f) f(status);
+    }
+
+    // Every request not answered yet, queued or not, ends with status
+    void failAll(const char* status) {
+        std::unordered_map<uint32_t, reply_fn> w;
+        std::vector<upload*> ups;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            w.swap(waiting);
+            ups.swap(newUploads);
+            outbox.clear();
+            room.notify_all();
+        }
+        for (upload* u : ups) { ::close(u->fd); delete u; }
+        for (auto &e : w) if (e.second) e.second(status);
+    }
+
+    void adopt(int s, frame_reader &got) {
+        sock = s;
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // requests are batched here already
+        setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &ASYNC_NOTSENT_LOWAT, sizeof(ASYNC_NOTSENT_LOWAT));
+        in = got;
+        watch(sock, W_SOCK, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    }
+
+    void loggedIn(const std::string &resp) {
+        token = sessionToken(resp);
+        comp = compressionOn(resp);
+        flow = windowsOn(resp);
+        framesIn = 0;
+    }
+
+    static uint64_t nowMs() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    void loop() {
+        epoll_event evs[4];
+        uint64_t nextHb = 0;
+        if (!dispatch() && !reconnect()) return; // frames that came in right behind AUTH_OK
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lk(m);
+                if (closing) return;
+            }
+            uint64_t now = nowMs();
+            if (now >= nextHb) {
+                std::string hb = heartbeat(name);
+                sockaddr_in a = serverAddr(serverHost, heartbeatPort(serverPort));
+                sendto(udp, hb.data(), hb.size(), 0, (sockaddr*)&a, sizeof(a));
+                nextHb = now + ASYNC_HB_SEC * 1000;
+            }
+            int n = epoll_wait(ep, evs, 4, (int)(nextHb - now));
+            bool readable = false;
+            for (int i=0;i<n;i++) {
+                if (evs[i].data.u32 == W_WAKE) {
+                    uint64_t v;
+                    while (read(wake, &v, sizeof(v)) > 0) {}
+                    kicked = false;
+                } else if (evs[i].data.u32 == W_UDP) {
+                    readAnnouncements();
+                } else if (evs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    readable = true;
+                }
+            }
+            if ((readable && !readFrames()) || !writeQueued()) {
+                if (!reconnect()) return;
+            }
+        }
+    }
+
+    // Read until the socket is empty, handling every complete frame; false if it closed
+    bool readFrames() {
+        char buf[65536];
+        while (true) {
+            ssize_t r = read(sock, buf, sizeof(buf));
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            if (r <= 0) return false;
+            in.feed(buf, r);
+            if (!dispatch()) return false;
+        }
+    }
+
+    // Take what callers queued, then write: each time wbuf is out, the control frames queued
+    // meanwhile and one chunk of the next file
+    bool writeQueued() {
+        std::vector<std::string> reqs;
+        std::vector<upload*> ups;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            reqs.swap(outbox);
+            ups.swap(newUploads);
+        }
+        for (const std::string &r : reqs) ctrl += r;
+        for (upload* u : ups) startUpload(u);
+        while (true) {
+            if (woff == wbuf.size()) {
+                wbuf.clear(); woff = 0;
+                wbuf.swap(ctrl);
+                nextBulk();
+                if (wbuf.empty()) return true;
+            }
+            ssize_t w = write(sock, wbuf.data() + woff, wbuf.size() - woff);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true; // EPOLLOUT brings us back
+            if (w <= 0) return false;
+            woff += w;
+        }
+    }
+
+    void startUpload(upload* u) {
+        if (u->offering) {
+            std::string req = offerRequest(u->target, u->path, u->size, u->chunks, u->id);
+            if (!req.empty()) { ctrl += req; uploads.push_back(u); return; }
+            u->offering = false; // too many chunks for one offer
+            u->chunks.clear();
+        }
+        ctrl += makeFrame(FT_FILE_START, ID_BY_NAME, u->id, fields(u->target, u->path, std::to_string(u->size)));
+        uploads.push_back(u);
+    }
+
+    // Next frame of the files under way, round robin over those that may send
+    void nextBulk() {
+        for (size_t k=0;k<uploads.size();k++) {
+            size_t i = (nextUp + k) % uploads.size();
+            upload* u = uploads[i];
+            if (u->offering || (flow && !u->failed && u->window <= 0)) continue;
+            if (nextChunk(u)) { nextUp = i + 1; return; }
+            ::close(u->fd);
+            delete u;
+            uploads.erase(uploads.begin() + i);
+            nextUp = i;
+            return;
+        }
+    }
+
+    // Append u's next FILE_CHUNK frame to wbuf; once it has none left, its END, and false
+    bool nextChunk(upload* u) {
+        ssize_t r;
+        if (u->failed) r = -1;
+        else if (!u->chunks.empty()) { // the chunks the server asked for, whole
+            while (u->next < u->chunks.size() && !(u->next / 8 < u->need.size() && (u->need[u->next / 8] & (1 << (u->next % 8)))))
+                u->off += u->chunks[u->next++].len;
+            if (u->next == u->chunks.size()) r = 0;
+            else {
+                size_t len = u->chunks[u->next].len;
+                r = pread(u->fd, &chunk[FRAME_HDR], len, u->off);
+                if (r != (ssize_t)len) r = -1;
+                else { u->off += len; u->next++; }
+            }
+        } else {
+            while ((r = pread(u->fd, &chunk[FRAME_HDR], FILE_CHUNK, u->off)) < 0 && errno == EINTR) {}
+            if (r > 0) u->off += r;
+        }
+        if (r > 0) {
+            std::pair<const char*, size_t> f = chunkFrame(&chunk[0], r, u->id, comp.load(), z);
+            wbuf.append(f.first, f.second);
+            u->window -= (int64_t)(f.second - FRAME_HDR);
+            return true;
+        }
+        wbuf += makeFrame(FT_FILE_END, ID_BY_NAME, u->id, r < 0 ? "ABORTED" : "OK");
+        return false;
+    }
+
+    upload* uploadOf(uint32_t id) {
+        for (upload* u : uploads) if (u->id == id) return u;
+        return nullptr;
+    }
+
+    // The server's answer to an offer: the chunks to send, or stream the whole file after all
+    // (no store there, or an older server), or a refusal that is the request's answer
+    void offerAnswered(upload* u, const frame_hdr &h, const std::string &body) {
+        u->offering = false;
+        if (h.type == FT_FILE_NEED) { u->need = body; return; }
+        if (body == "OFFER_DECLINED" || body == "UNKNOWN_CMD") {
+            u->chunks.clear();
+            ctrl += makeFrame(FT_FILE_START, ID_BY_NAME, u->id, fields(u->target, u->path, std::to_string(u->size)));
+            return;
+        }
+        uploads.erase(std::find(uploads.begin(), uploads.end(), u));
+        uint32_t id = u->id;
+        ::close(u->fd);
+        delete u;
+        complete(id, body);
+    }
+
+    // Handle the complete frames in `in`; false on a protocol error
+    bool dispatch() {
+        frame_hdr h; const char* payload;
+        while (in.next(h, payload)) {
+            framesIn++;
+            const char* p = payload;
+            const char* end = payload + h.len;
+            std::string_view sender, fname;
+            if (h.type == FT_REPLY || h.type == FT_FILE_NEED) {
+                std::string body(p, end - p);
+                upload* u = uploadOf(h.seq);
+                if (u && u->offering) { offerAnswered(u, h, body); continue; }
+                if (h.type != FT_REPLY) continue;
+                if (u) u->failed = true; // answered before its END: refused or aborted
+                complete(h.seq, body);
+            }
+            else if (h.type == FT_WINDOW) {
+                if (upload* u = uploadOf(h.seq)) u->window += h.target;
+            }
+            else if (h.type == FT_MSG) {
+                if (!takeField(p, end, sender) || !frameBody(h, p, end, unpacked)) continue;
+                deliver(campus_message{std::string(sender), std::string(p, end - p), (h.flags & FF_STORED) != 0});
+            }
+            else if (h.type == FT_FILE_START) {
+                if (!takeField(p, end, sender) || !takeField(p, end, fname)) continue;
+                rxStart(h.seq, std::string(sender), std::string(fname));
+            }
+            else if (h.type == FT_FILE_CHUNK) {
+                auto it = rx.find(h.seq);
+                if (it == rx.end() || !frameBody(h, p, end, unpacked)) continue;
+                if (it->second.fd >= 0 && !writeFully(it->second.fd, p, end - p)) { ::close(it->second.fd); it->second.fd = -1; }
+            }
+            else if (h.type == FT_FILE_END) {
+                rxEnd(h.seq, std::string_view(p, end - p) == "OK");
+            }
+            // spooled delivery: the server can forget it now
+            if ((h.flags & FF_STORED) && (h.type == FT_MSG || h.type == FT_FILE_END)) {
+                char ack[FRAME_HDR];
+                encodeHdr(ack, FT_ACK, 0, ID_BY_NAME, h.seq);
+                ctrl.append(ack, sizeof(ack));
+            }
+        }
+        return !in.bad;
+    }
+
+    void deliver(campus_message msg) {
+        if (onMessage) { onMessage(msg); return; }
+        std::lock_guard<std::mutex> lk(m);
+        if (receivers.empty()) { inbox.push_back(std::move(msg)); return; }
+        receivers.front().set_value(std::move(msg));
+        receivers.pop_front();
+    }
+
+    void rxStart(uint32_t id, const std::string &sender, const std::string &fname) {
+        rx_file f;
+        f.f.sender = sender; f.f.name = fname; f.f.ok = false;
+        f.f.path = (rxDir.empty() ? "" : rxDir + "/") + "received_" + sender + "_" + fname;
+        f.fd = open(f.f.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        rx[id] = f;
+    }
+
+    void rxEnd(uint32_t id, bool ok) {
+        auto it = rx.find(id);
+        if (it == rx.end()) return;
+        rx_file f = it->second;
+        rx.erase(it);
+        f.f.ok = ok && f.fd >= 0;
+        if (f.fd >= 0) ::close(f.fd);
+        if (!f.f.ok) unlink(f.f.path.c_str());
+        if (onFile) onFile(f.f);
+    }
+
+    // Files half received when the session was lost for good: their rest is not coming
+    void abortRx() {
+        std::vector<uint32_t> ids;
+        for (auto &e : rx) ids.push_back(e.first);
+        for (uint32_t id : ids) rxEnd(id, false);
+    }
+
+    void readAnnouncements() {
+        char buf[8192];
+        while (true) {
+            ssize_t r = recv(udp, buf, sizeof(buf), 0);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) return;
+            if (onAnnouncement) onAnnouncement(std::string(buf, strnlen(buf, r)));
+        }
+    }
+
+    // Messages and acknowledgements in wbuf that were not wholly written, then those in ctrl: a
+    // resumed session sends them again. The server never saw a torn frame, so none of them
+    // reached it. File frames are left out; their streams ended with the connection.
+    std::string unwritten() {
+        std::string keep;
+        auto pick = [&keep](const std::string &b, size_t from) {
+            frame_hdr h;
+            for (size_t p = 0; p + FRAME_HDR <= b.size() && decodeHdr(&b[p], h); p += FRAME_HDR + h.len)
+                if (p + FRAME_HDR + h.len > from && (h.type == FT_SEND || h.type == FT_ACK)) keep.append(b, p, FRAME_HDR + h.len);
+        };
+        pick(wbuf, woff);
+        pick(ctrl, 0);
+        return keep;
+    }
+
+    // The connection broke: resume the session or log in again, with jittered exponential
+    // backoff, or after the wait a SERVER_BUSY named. The files under way fail with
+    // CONNECTION_LOST at once. Other requests wait for the outcome: on a resume the unwritten
+    // ones go out again and the rest are answered by the frames the server resends; a fresh
+    // login (the server may or may not have got them) or giving up fails them all.
+    // False if no server took us back in time, or close() was called meanwhile.
+    bool reconnect() {
+        epoll_ctl(ep, EPOLL_CTL_DEL, sock, nullptr);
+        ::close(sock);
+        sock = -1;
+        std::string resend = unwritten();
+        wbuf.clear(); woff = 0;
+        ctrl.clear();
+        std::vector<uint32_t> broken;
+        for (upload* u : uploads) { broken.push_back(u->id); ::close(u->fd); delete u; }
+        uploads.clear();
+        nextUp = 0;
+        fail(broken, ASYNC_LOST);
+        if (onEvent) onEvent(ASYNC_RECONNECTING, serverHost + ":" + std::to_string(serverPort));
+        time_t giveUp = time(NULL) + ASYNC_RECONNECT_SEC;
+        unsigned backoff = 100, wait = jittered(backoff); // ms
+        while (time(NULL) < giveUp) {
+            usleep(wait * 1000);
+            backoff = std::min(backoff * 2, 5000u);
+            wait = jittered(backoff);
+            {
+                std::lock_guard<std::mutex> lk(m);
+                if (closing) return false;
+            }
+            frame_reader got;
+            std::string resp;
+            if (!token.empty()) {
+                int s = connectServer(serverHost, serverPort, &resp);
+                if (s < 0 && busyRetry(resp) >= 0) { wait = jittered(busyRetry(resp)); continue; }
+                if (s < 0) { serverHost = entryHost; serverPort = entryPort; continue; } // a federated server may be gone for good
+                if (!resumeSession(s, token, framesIn, got, &resp)) {
+                    ::close(s);
+                    if (busyRetry(resp) >= 0) wait = jittered(busyRetry(resp)); // shed: the session is still there
+                    else token.clear(); // expired: log in next round
+                    continue;
+                }
+                adopt(s, got);
+                ctrl = resend; // kept if the resumed connection drops too
+                if (onEvent) onEvent(ASYNC_RESUMED, serverHost + ":" + std::to_string(serverPort));
+            } else {
+                int s = loginServer(serverHost, serverPort, name, password, got, resp, true, true, true);
+                if (busyRetry(resp) >= 0) wait = jittered(busyRetry(resp));
+                if (s < 0) { if (busyRetry(resp) < 0) { serverHost = entryHost; serverPort = entryPort; } continue; }
+                if (!authOk(resp)) { ::close(s); continue; } // e.g. the old login is still registered
+                resend.clear();
+                ctrl.clear(); // what a resume that dropped again left there
+                failAll(ASYNC_LOST); // a new session: nothing sent on the old one is answered
+                loggedIn(resp);
+                abortRx();
+                adopt(s, got);
+                if (onEvent) onEvent(ASYNC_LOGGED_IN, serverHost + ":" + std::to_string(serverPort));
+            }
+            if (dispatch()) return true; // frames that came in with the reply
+            epoll_ctl(ep, EPOLL_CTL_DEL, sock, nullptr);
+            ::close(sock);
+            sock = -1;
+        }
+        {
+            std::lock_guard<std::mutex> lk(m);
+            stopped = true;
+            room.notify_all();
+        }
+        failAll(ASYNC_LOST);
+        if (onEvent) onEvent(ASYNC_GAVE_UP, "");
+        return false;
+    }
+};
+
+#endif
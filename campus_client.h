@@ -0,0 +1,266 @@
+// Client side of the campus protocol, shared by campus_async.h (and so client.cpp) and loadgen.cpp
+// (benchmark): connect, auth handshake and session resume, SEND and FILE requests (streamed, or
+// offered by chunk hashes first; compressed when negotiated), heartbeats.
+// Nothing here locks; callers that write one socket from several threads serialise themselves.
+#ifndef CAMPUS_CLIENT_H
+#define CAMPUS_CLIENT_H
+#include<cerrno>
+#include<cstdlib>
+#include<cstring>
+#include<ctime>
+#include<string>
+#include<unistd.h>
+#include<fcntl.h>
+#include<sys/stat.h>
+#include<sys/socket.h>
+#include<arpa/inet.h>
+#include<netinet/in.h>
+#include "protocol.h"
+#include "dedup_store.h"
+#include "compress.h"
+#include "tls.h"
+
+const int TCP_port = 5000;     // default server port
+const int UDP_port = 6000;     // heartbeats go to the server's TCP port + 1000
+const int MCAST_port = 6001;   // server's --mcast announcements
+
+inline sockaddr_in serverAddr(const std::string &host, int port) {
+    sockaddr_in a; memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &a.sin_addr);
+    return a;
+}
+
+// Heartbeat port of the server listening on TCP port `port`
+inline int heartbeatPort(int port) { return port + (UDP_port - TCP_port); }
+
+// Set (tlsClientContext) to talk to servers run with --tls-cert: every connection starts with
+// a TLS handshake, and then the kernel encrypts and decrypts (tls.h)
+inline SSL_CTX* clientTls = nullptr;
+
+// TCP connection to the server, -1 on failure. With clientTls the handshake is done and the
+// socket is encrypted; a server that sheds the connection answers in plaintext instead, and
+// that line goes to `early` (a failed handshake leaves its reason in tlsFailure).
+inline int connectServer(const std::string &host, int port = TCP_port, std::string* early = nullptr) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    sockaddr_in a = serverAddr(host, port);
+    if (connect(sock, (sockaddr*)&a, sizeof(a)) < 0) { close(sock); return -1; }
+    if (clientTls && !tlsConnect(clientTls, sock, host, early)) { close(sock); return -1; }
+    return sock;
+}
+
+// write() until everything is out (large files need several calls)
+inline bool writeFully(int sock, const char* p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(sock, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w; n -= w;
+    }
+    return true;
+}
+
+// Read the server's one-line answer to a handshake ("" if the connection broke). Frames that
+// arrived right behind it are fed to `in`.
+inline std::string readReplyLine(int sock, frame_reader &in) {
+    char buf[4096];
+    std::string resp;
+    size_t nl;
+    while ((nl = resp.find('\n')) == std::string::npos) {
+        ssize_t r = read(sock, buf, sizeof(buf));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        resp.append(buf, r);
+    }
+    if (nl != std::string::npos) {
+        in.feed(resp.data()+nl+1, resp.size()-nl-1);
+        resp.erase(nl);
+    }
+    return resp;
+}
+
+// Auth handshake asking for the framed protocol (and a resumable session if `session`,
+// compression if `compress`, flow-controlled uploads if `windows`). Returns the server's reply
+// line: "AUTH_OK;Proto:N[;Comp:lz4][;Flow:window][;Session:TOKEN]", "AUTH_REDIRECT:host:port"
+// (see authRedirect), "SERVER_BUSY;Retry:MS" (see busyRetry) or a failure word (AUTH_FAIL,
+// AUTH_FAIL_DUPLICATE, SERVER_FULL), "" if the connection broke.
+inline std::string authenticate(int sock, const std::string &campus, const std::string &pass, frame_reader &in, bool session = false, bool compress = false, bool windows = false) {
+    std::string auth = "Campus:" + campus + ";Pass:" + pass + ";Proto:" + std::to_string(PROTO_VERSION)
+        + (compress ? ";Comp:lz4" : "") + (windows ? ";Flow:window" : "") + (session ? ";Session:new" : "") + "\n";
+    if (!writeFully(sock, auth.data(), auth.size())) return "";
+    return readReplyLine(sock, in);
+}
+
+inline bool authOk(const std::string &resp) {
+    std::string ok = "AUTH_OK;Proto:" + std::to_string(PROTO_VERSION);
+    return resp == ok || resp.compare(0, ok.size() + 1, ok + ";") == 0;
+}
+
+// "AUTH_REDIRECT:host:port": the server is one of a federation (server --node) and another
+// one owns this campus. Sets host and port to that one.
+inline bool authRedirect(const std::string &resp, std::string &host, int &port) {
+    if (resp.compare(0, 14, "AUTH_REDIRECT:") != 0) return false;
+    size_t c = resp.rfind(':');
+    if (c < 14) return false;
+    host = resp.substr(14, c - 14);
+    port = atoi(resp.c_str() + c + 1);
+    return !host.empty() && port > 0;
+}
+
+// "SERVER_BUSY;Retry:MS": the server shed the connection before reading it (too many logins
+// under way, or too many connections from this address). Returns MS, -1 for any other reply.
+inline int busyRetry(const std::string &resp) {
+    if (resp.compare(0, 18, "SERVER_BUSY;Retry:") != 0) return -1;
+    return atoi(resp.c_str() + 18);
+}
+
+// A wait of about ms, anywhere in [ms/2, 3ms/2], so that campuses turned away together do not
+// all come back together
+inline unsigned jittered(unsigned ms) {
+    static thread_local unsigned seed = (unsigned)time(nullptr) ^ (unsigned)(uintptr_t)&seed;
+    return ms / 2 + (unsigned)(rand_r(&seed) % (ms + 1));
+}
+
+const int MAX_REDIRECTS = 4;   // a federation that is still settling may bounce a login around
+
+// Connect to host:port and authenticate, following redirects. Returns the socket (-1 if no
+// server took the login) with the last reply in resp; host and port name the server that
+// answered it.
+inline int loginServer(std::string &host, int &port, const std::string &campus, const std::string &pass, frame_reader &in, std::string &resp, bool session = false, bool compress = false, bool windows = false) {
+    for (int hop=0;hop<=MAX_REDIRECTS;hop++) {
+        resp.clear();
+        int sock = connectServer(host, port, &resp);
+        if (sock < 0) return -1; // resp: SERVER_BUSY from a TLS server, or nothing
+        resp = authenticate(sock, campus, pass, in, session, compress, windows);
+        if (!authRedirect(resp, host, port)) return sock;
+        close(sock);
+        in = frame_reader();
+    }
+    return -1;
+}
+
+// The server agreed to compression: FF_COMPRESSED frames may go both ways
+inline bool compressionOn(const std::string &resp) { return authOk(resp) && resp.find(";Comp:lz4") != std::string::npos; }
+
+// The server agreed to flow-controlled uploads: each stream waits for FT_WINDOW beyond FILE_WINDOW
+inline bool windowsOn(const std::string &resp) { return authOk(resp) && resp.find(";Flow:window") != std::string::npos; }
+
+// Token of the session granted with AUTH_OK, "" if none
+inline std::string sessionToken(const std::string &resp) {
+    size_t p = resp.find(";Session:");
+    return p == std::string::npos ? "" : resp.substr(p + 9);
+}
+
+// Pick a dropped session up again on a new connection: no credentials, one round trip. `last`
+// is the number of frames received on the session so far; the server resends what follows.
+// True on "RESUMED"; the resent frames go to `in` (start it empty). False on RESUME_FAIL
+// (expired, or too far behind): log in again. The reply line goes to `resp` if given, so a
+// SERVER_BUSY can be told apart (the session is still there: try again later).
+inline bool resumeSession(int sock, const std::string &token, uint64_t last, frame_reader &in, std::string* resp = nullptr) {
+    std::string req = "Resume:" + token + ";Last:" + std::to_string(last) + ";Proto:" + std::to_string(PROTO_VERSION) + "\n";
+    std::string line;
+    if (writeFully(sock, req.data(), req.size())) line = readReplyLine(sock, in);
+    bool ok = line == "RESUMED;Proto:" + std::to_string(PROTO_VERSION);
+    if (resp) *resp = std::move(line);
+    return ok;
+}
+
+// FT_SEND request: text for a campus, "*" (everyone) or "@group"; packed if `compress` and
+// the text is worth it
+inline std::string sendRequest(const std::string &target, const std::string &text, uint32_t seq, bool compress = false) {
+    std::string z;
+    if (compress && packBody(text, z)) return makeFrame(FT_SEND, ID_BY_NAME, seq, fields(target, z), FF_COMPRESSED);
+    return makeFrame(FT_SEND, ID_BY_NAME, seq, fields(target, text));
+}
+
+// Body [p, end) of a received frame: if it is packed (FF_COMPRESSED), unpack it into buf and
+// point p/end there. False if it is malformed.
+inline bool frameBody(const frame_hdr &h, const char* &p, const char* &end, std::string &buf) {
+    if (!(h.flags & FF_COMPRESSED)) return true;
+    if (!unpackBody(p, end - p, buf)) return false;
+    p = buf.data(); end = p + buf.size();
+    return true;
+}
+
+// One FILE_CHUNK frame for n bytes at chunk+FRAME_HDR (room for FRAME_HDR + FILE_CHUNK).
+// Packed into z when `compress` and it shrinks; returns the frame to write.
+inline std::pair<const char*, size_t> chunkFrame(char* chunk, size_t n, uint32_t id, bool compress, std::string &z) {
+    if (compress) {
+        z.resize(FRAME_HDR + COMP_HDR + lz4Bound(FILE_CHUNK));
+        size_t k = packBody(chunk + FRAME_HDR, n, &z[FRAME_HDR]);
+        if (k) {
+            encodeHdr(&z[0], FT_FILE_CHUNK, (uint32_t)k, ID_BY_NAME, id, FF_COMPRESSED);
+            return {z.data(), FRAME_HDR + k};
+        }
+    }
+    encodeHdr(chunk, FT_FILE_CHUNK, (uint32_t)n, ID_BY_NAME, id);
+    return {chunk, FRAME_HDR + n};
+}
+
+// UDP heartbeat datagram
+inline std::string heartbeat(const std::string &campus) { return "Campus:" + campus + ";HB:online"; }
+
+// Stream a file to a campus as transfer `id`: START, FILE_CHUNK frames, END. `chunk` must hold
+// FRAME_HDR + FILE_CHUNK bytes; each header is built in front of its data, so a chunk is one
+// write(sock, p, n) call, whatever the file size. With `compress` chunks that shrink are sent
+// packed.
+template<class W> bool streamFile(W write, const std::string &target, const std::string &path, uint32_t id, char* chunk, bool compress = false) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0) { close(fd); return false; }
+
+    std::string start = makeFrame(FT_FILE_START, ID_BY_NAME, id, fields(target, path, std::to_string(st.st_size)));
+    bool ok = write(start.data(), start.size());
+    bool readErr = false;
+    std::string z;
+    while (ok) {
+        ssize_t r = read(fd, chunk+FRAME_HDR, FILE_CHUNK);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) readErr = true;
+        if (r <= 0) break;
+        std::pair<const char*, size_t> f = chunkFrame(chunk, r, id, compress, z);
+        ok = write(f.first, f.second);
+    }
+    close(fd);
+    if (ok) {
+        std::string end = makeFrame(FT_FILE_END, ID_BY_NAME, id, readErr ? "ABORTED" : "OK");
+        ok = write(end.data(), end.size());
+    }
+    return ok && !readErr;
+}
+
+// Deduplicated upload, first half: FT_FILE_OFFER with the file's chunk list (chunkFile) as
+// transfer `id`. "" if the list does not fit in one frame; stream the file instead.
+inline std::string offerRequest(const std::string &target, const std::string &name, uint64_t size, const std::vector<chunk_ref> &chunks, uint32_t id) {
+    std::string p = fields(target, name, std::to_string(size)) + '\0';
+    if (p.size() + chunks.size() * CHUNK_REF_WIRE > MAX_FRAME) return "";
+    for (const chunk_ref &r : chunks) putChunkRef(p, r);
+    return makeFrame(FT_FILE_OFFER, ID_BY_NAME, id, p);
+}
+
+// Second half, once FT_FILE_NEED came back: each chunk whose bit is set in `need`, whole in one
+// FILE_CHUNK frame, then END. `chunk` and `compress` as for streamFile.
+template<class W> bool sendNeeded(W write, const std::string &path, const std::vector<chunk_ref> &chunks, const std::string &need, uint32_t id, char* chunk, bool compress = false) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = true, readErr = false;
+    std::string z;
+    off_t off = 0;
+    for (size_t i=0; ok && i<chunks.size(); off += chunks[i].len, i++) {
+        if (i / 8 >= need.size() || !(need[i / 8] & (1 << (i % 8)))) continue;
+        if (pread(fd, chunk+FRAME_HDR, chunks[i].len, off) != (ssize_t)chunks[i].len) { readErr = true; break; }
+        std::pair<const char*, size_t> f = chunkFrame(chunk, chunks[i].len, id, compress, z);
+        ok = write(f.first, f.second);
+    }
+    close(fd);
+    if (ok) {
+        std::string end = makeFrame(FT_FILE_END, ID_BY_NAME, id, readErr ? "ABORTED" : "OK");
+        ok = write(end.data(), end.size());
+    }
+    return ok && !readErr;
+}
+
+#endif
@@ -0,0 +1,310 @@
+// Received-files catalog, used by server.cpp (files saved on the server) and client.cpp (files
+// received by a campus): persistent, and indexed so it can hold millions of entries.
+//
+//   <path>      append-only log: one record per file (sender, original name, stored name)
+//   <path>.idx  mmap'd index: chain heads, then one fixed 32-byte entry per record
+//
+// An entry's id is its position in the index. Entries whose sender (or original name) hashes to
+// the same bucket are chained newest first through the index, so a lookup by sender or name
+// visits only the matching entries and the odd hash collision. Receive times never go backwards
+// (an entry is stamped with at least its predecessor's time), so a time range is a binary search.
+//
+// Opening reads the index header and nothing else. Records the index missed (a crash between
+// the two writes) are indexed again from the log tail; a missing or damaged index is rebuilt
+// from the log. Appends are queued and written by the catalog's own thread (writerLoop), so a
+// reactor saving a file never waits for the disk. Queries take the catalog's mutex only for
+// the entries they return.
+#ifndef CAMPUS_CATALOG_H
+#define CAMPUS_CATALOG_H
+#include<algorithm>
+#include<condition_variable>
+#include<cstdint>
+#include<cstring>
+#include<ctime>
+#include<mutex>
+#include<string>
+#include<vector>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+
+const uint32_t CAT_MAGIC = 0x31544143;     // "CAT1"
+const uint32_t CAT_BUCKETS = 1u << 16;     // chain heads per key kind
+const uint64_t CAT_MIN_CAP = 1u << 16;     // index entries mapped at first; doubles as it fills
+const uint16_t CAT_FIELD_MAX = 0xFFFF;     // longer strings are cut
+
+// Log record: header, then the three strings back to back
+struct cat_rec {
+    uint32_t len;          // bytes of strings following
+    uint32_t sum;          // FNV-1a of them: a torn tail after a crash fails this check
+    int64_t at;            // receive time (unix seconds)
+    uint16_t senderLen, nameLen, storedLen, pad;
+};
+
+// Index entry (id = position). Chain links are id + 1, 0 ends the chain.
+struct cat_ent {
+    uint64_t off;          // record position in the log
+    int64_t at;
+    uint32_t senderHash, nameHash;
+    uint32_t prevSender, prevName;
+};
+
+struct cat_hdr {
+    uint32_t magic, buckets;
+    uint64_t count;        // entries in the index
+    uint64_t logEnd;       // log bytes they cover
+    uint32_t senderHead[CAT_BUCKETS];
+    uint32_t nameHead[CAT_BUCKETS];
+};
+const size_t CAT_HDR_SIZE = (sizeof(cat_hdr) + 4095) & ~(size_t)4095;
+
+inline uint32_t catHash(const std::string &s) {
+    uint32_t h = 2166136261u;
+    for (unsigned char ch : s) { h ^= ch; h *= 16777619u; }
+    return h;
+}
+
+struct catalog_entry {
+    uint64_t id = 0;
+    time_t at = 0;
+    std::string sender, name, stored;
+};
+
+// Position in a paged listing; start with a default-constructed one
+struct catalog_cursor {
+    int kind = 0;          // 0 = all, 1 = by sender, 2 = by name, 3 = time range
+    std::string key;
+    uint64_t next = 0;     // id + 1 of the next entry to look at (0 = none)
+    uint64_t lo = 0;       // time range: lowest id in it
+    bool started = false;
+    bool done = false;
+};
+
+struct file_catalog {
+    std::string path;
+    std::mutex m;                  // the index and its mapping (queries too: it may be remapped)
+    int logFd = -1, idxFd = -1;
+    char* map = nullptr;
+    uint64_t cap = 0;              // entries the mapping holds
+    uint64_t logEnd = 0;           // writer thread only: where the next batch goes
+
+    std::mutex qm;                 // append queue
+    std::condition_variable qcv, idle;
+    std::vector<catalog_entry> queue;
+    bool writing = false;
+
+    cat_hdr* hdr() { return (cat_hdr*)map; }
+    cat_ent* ents() { return (cat_ent*)(map + CAT_HDR_SIZE); }
+
+    bool mapIndex(uint64_t entries) {
+        size_t want = CAT_HDR_SIZE + entries * sizeof(cat_ent);
+        if (ftruncate(idxFd, want) < 0) return false;
+        char* p = map ? (char*)mremap(map, CAT_HDR_SIZE + cap * sizeof(cat_ent), want, MREMAP_MAYMOVE)
+                      : (char*)mmap(nullptr, want, PROT_READ | PROT_WRITE, MAP_SHARED, idxFd, 0);
+        if (p == MAP_FAILED) return false;
+        map = p;
+        cap = entries;
+        return true;
+    }
+
+    // Read and check the record at off; false if it is torn or past the end
+    bool readRec(uint64_t off, cat_rec &r, std::string &body) {
+        if (pread(logFd, &r, sizeof(r), off) != (ssize_t)sizeof(r)) return false;
+        if ((uint64_t)r.senderLen + r.nameLen + r.storedLen != r.len) return false;
+        body.resize(r.len);
+        if (r.len && pread(logFd, &body[0], r.len, off + sizeof(r)) != (ssize_t)r.len) return false;
+        return catHash(body) == r.sum;
+    }
+
+    // Add the record at off to the index (m held or not shared yet)
+    bool indexRec(uint64_t off, const cat_rec &r, const std::string &body) {
+        cat_hdr* h = hdr();
+        if (h->count == cap && !mapIndex(cap * 2)) return false;
+        h = hdr();
+        cat_ent &e = ents()[h->count];
+        e.off = off;
+        e.at = r.at;
+        e.senderHash = catHash(body.substr(0, r.senderLen));
+        e.nameHash = catHash(body.substr(r.senderLen, r.nameLen));
+        uint32_t &sh = h->senderHead[e.senderHash % CAT_BUCKETS];
+        uint32_t &nh = h->nameHead[e.nameHash % CAT_BUCKETS];
+        e.prevSender = sh;
+        e.prevName = nh;
+        h->count++;
+        sh = nh = (uint32_t)h->count;
+        h->logEnd = off + sizeof(r) + r.len;
+        return true;
+    }
+
+    // Index whatever valid records follow the indexed part of the log; cut a torn tail
+    void recoverTail() {
+        cat_rec r;
+        std::string body;
+        uint64_t off = hdr()->logEnd;
+        while (readRec(off, r, body) && indexRec(off, r, body)) off += sizeof(r) + r.len;
+        if (ftruncate(logFd, off) < 0) {}
+        logEnd = off;
+    }
+
+    bool open(const std::string &p, std::string &err) {
+        path = p;
+        logFd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        idxFd = ::open((path + ".idx").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (logFd < 0 || idxFd < 0) { err = "cannot open " + path + ": " + strerror(errno); return false; }
+        struct stat st;
+        if (fstat(idxFd, &st) < 0) { err = strerror(errno); return false; }
+        uint64_t have = st.st_size >= (off_t)CAT_HDR_SIZE ? (st.st_size - CAT_HDR_SIZE) / sizeof(cat_ent) : 0;
+        bool fresh = st.st_size < (off_t)CAT_HDR_SIZE;
+        if (!mapIndex(std::max(have, CAT_MIN_CAP))) { err = "cannot map " + path + ".idx"; return false; }
+        cat_hdr* h = hdr();
+        if (fresh || h->magic != CAT_MAGIC || h->buckets != CAT_BUCKETS || h->count > have) {
+            // new, or not ours: rebuild from the log
+            memset(map, 0, CAT_HDR_SIZE);
+            h->magic = CAT_MAGIC;
+            h->buckets = CAT_BUCKETS;
+        }
+        recoverTail();
+        return true;
+    }
+
+    // Queue a file for the catalog (any thread); writerLoop stores it
+    void add(const std::string &sender, const std::string &name, const std::string &stored) {
+        catalog_entry e;
+        e.at = time(NULL);
+        e.sender = sender.substr(0, CAT_FIELD_MAX);
+        e.name = name.substr(0, CAT_FIELD_MAX);
+        e.stored = stored.substr(0, CAT_FIELD_MAX);
+        std::lock_guard<std::mutex> lk(qm);
+        queue.push_back(std::move(e));
+        qcv.notify_one();
+    }
+
+    // Catalog thread: append each batch to the log with one write, make it durable, index it
+    void writerLoop() {
+        std::vector<catalog_entry> batch;
+        std::string buf;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lk(qm);
+                writing = false;
+                idle.notify_all();
+                qcv.wait(lk, [this] { return !queue.empty(); });
+                batch.swap(queue);
+                writing = true;
+            }
+            buf.clear();
+            int64_t last;
+            {
+                std::lock_guard<std::mutex> lk(m);
+                uint64_t n = hdr()->count;
+                last = n ? ents()[n-1].at : 0;
+            }
+            for (catalog_entry &e : batch) {
+                std::string body = e.sender + e.name + e.stored;
+                cat_rec r;
+                memset(&r, 0, sizeof(r));
+                r.len = (uint32_t)body.size();
+                r.sum = catHash(body);
+                r.at = last = std::max<int64_t>(last, e.at);
+                r.senderLen = (uint16_t)e.sender.size();
+                r.nameLen = (uint16_t)e.name.size();
+                r.storedLen = (uint16_t)e.stored.size();
+                buf.append((const char*)&r, sizeof(r));
+                buf += body;
+            }
+            batch.clear();
+            size_t done = 0;
+            while (done < buf.size()) {
+                ssize_t w = pwrite(logFd, buf.data() + done, buf.size() - done, logEnd + done);
+                if (w < 0 && errno == EINTR) continue;
+                if (w <= 0) break;
+                done += w;
+            }
+            if (done < buf.size()) { if (ftruncate(logFd, logEnd) < 0) {} continue; } // disk full: lose the batch, keep the log whole
+            fdatasync(logFd);
+            std::lock_guard<std::mutex> lk(m);
+            recoverTail(); // indexes exactly what was just written
+        }
+    }
+
+    // Wait until everything added so far is in the catalog
+    void flush() {
+        std::unique_lock<std::mutex> lk(qm);
+        idle.wait(lk, [this] { return queue.empty() && !writing; });
+    }
+
+    uint64_t size() {
+        std::lock_guard<std::mutex> lk(m);
+        return hdr()->count;
+    }
+
+    bool getLocked(uint64_t id, catalog_entry &e) {
+        if (id >= hdr()->count) return false;
+        cat_rec r;
+        std::string body;
+        if (!readRec(ents()[id].off, r, body)) return false;
+        e.id = id;
+        e.at = (time_t)r.at;
+        e.sender = body.substr(0, r.senderLen);
+        e.name = body.substr(r.senderLen, r.nameLen);
+        e.stored = body.substr(r.senderLen + r.nameLen);
+        return true;
+    }
+
+    bool get(uint64_t id, catalog_entry &e) {
+        std::lock_guard<std::mutex> lk(m);
+        return getLocked(id, e);
+    }
+
+    // First id received at or after t
+    uint64_t lowerBound(time_t t) {
+        uint64_t lo = 0, hi = hdr()->count;
+        while (lo < hi) {
+            uint64_t mid = (lo + hi) / 2;
+            if (ents()[mid].at < (int64_t)t) lo = mid + 1; else hi = mid;
+        }
+        return lo;
+    }
+
+    catalog_cursor all() { return catalog_cursor(); }
+    catalog_cursor bySender(const std::string &s) { catalog_cursor c; c.kind = 1; c.key = s; return c; }
+    catalog_cursor byName(const std::string &s) { catalog_cursor c; c.kind = 2; c.key = s; return c; }
+    // Files received in [from, to)
+    catalog_cursor byTime(time_t from, time_t to) {
+        std::lock_guard<std::mutex> lk(m);
+        catalog_cursor c;
+        c.kind = 3;
+        c.lo = lowerBound(from);
+        c.next = std::max(lowerBound(to), c.lo); // id + 1 of the newest is lowerBound(to)
+        c.started = true;
+        return c;
+    }
+
+    // Up to n more entries of a listing, newest first
+    std::vector<catalog_entry> page(catalog_cursor &c, size_t n) {
+        std::vector<catalog_entry> out;
+        std::lock_guard<std::mutex> lk(m);
+        cat_hdr* h = hdr();
+        uint32_t hash = catHash(c.key);
+        if (!c.started) {
+            c.next = c.kind == 1 ? h->senderHead[hash % CAT_BUCKETS]
+                   : c.kind == 2 ? h->nameHead[hash % CAT_BUCKETS] : h->count;
+            c.started = true;
+        }
+        while (!c.done && out.size() < n) {
+            if (c.next == 0 || (c.kind == 3 && c.next <= c.lo)) { c.done = true; break; }
+            uint64_t id = c.next - 1;
+            const cat_ent &e = ents()[id];
+            bool hashHit = c.kind == 0 || c.kind == 3 || (c.kind == 1 ? e.senderHash : e.nameHash) == hash;
+            c.next = c.kind == 1 ? e.prevSender : c.kind == 2 ? e.prevName : id;
+            catalog_entry ce;
+            if (!hashHit || !getLocked(id, ce)) continue;
+            if ((c.kind == 1 && ce.sender != c.key) || (c.kind == 2 && ce.name != c.key)) continue;
+            out.push_back(std::move(ce));
+        }
+        return out;
+    }
+};
+
+#endif
@@ -1,106 +1,39 @@
 #include<iostream>
 #include<thread>
 #include<string>
+#include<string_view>
 #include<cstring>
-#include<mutex>
+#include<cerrno>
 #include<fstream>
 #include<unistd.h>
+#include<fcntl.h>
+#include<csignal>
+#include<sys/stat.h>
 #include<arpa/inet.h>
 #include <netinet/in.h>
+#include "campus_async.h"
+#include "catalog.h"
 using namespace std;
-const int TCP_port = 5000;
-const int UDP_port = 6000;
 const int BUF = 8192;
 
-// We will store up to 100 received files
-struct RecFile {
-    bool used;
-    char storedName[256];   // name on disk
-} recFiles[100];
+const int LIST_PAGE = 20; // received files shown per page
 
-mutex fileMtx; // protect recFiles[]
+file_catalog* recFiles; // files we received (catalog.h), kept in received_files_<campus>.catalog
+async_client cli;       // the connection: sends, replies, incoming frames, heartbeats (campus_async.h)
 
 string CAMPUS; // current campus name after login
+string PASS;
+string ENTRY_HOST = "127.0.0.1";  // --server: where logins start
+int ENTRY_PORT = TCP_port;
 
-// Save a received file to disk and index it
-void saveReceivedFile(const string &sender, const string &filename, const string &content) {
-    // Save as: received_<sender>_<filename>
-    string stored = "received_" + sender + "_" + filename;
-
-    ofstream ofs(stored.c_str(), ios::out | ios::binary);
-    if (!ofs) {
-        cout << "Error saving received file.\n";
-        return;
-    }
-    ofs << content;
-    ofs.close();
-
-    fileMtx.lock();
-    for (int i=0;i<100;i++) {
-        if (!recFiles[i].used) {
-            recFiles[i].used = true;
-            strncpy(recFiles[i].storedName, stored.c_str(), sizeof(recFiles[i].storedName)-1);
-            break;
-        }
-    }
-    fileMtx.unlock();
-
-    cout << "File saved as: " << stored << endl;
-}
-
-// TCP listener: receives forwarded messages or files
-void tcpListener(int sock) {
-    char buf[BUF];
-
-    while (true) {
-        memset(buf,0,sizeof(buf));
-        ssize_t r = read(sock, buf, sizeof(buf)-1);
-        if (r <= 0) {
-            cout << "\nDisconnected from server.\n";
-            exit(0);
-        }
-
-        string inc(buf);
-
-        // FILE packet: FILE|Source|Filename|<content>
-        if (inc.rfind("FILE|",0)==0) {
-            size_t p1 = inc.find("|",5);
-            size_t p2 = (p1==string::npos? string::npos : inc.find("|", p1+1));
-            if (p1==string::npos || p2==string::npos) continue;
-
-            string sender = inc.substr(5, p1-5);
-            string fname = inc.substr(p1+1, p2-(p1+1));
-            string content = inc.substr(p2+1);
-
-            cout << "\n--- File received from " << sender << ": " << fname << " ---\n";
-            saveReceivedFile(sender, fname, content);
-            cout << "--- End File ---\n";
-        }
-        else {
-            // Normal text message
-            cout << "\n" << inc << endl;
-        }
-    }
-}
-
-// Send heartbeat via UDP every 5 sec
-void hbThreadFunc(int udpSock, sockaddr_in serv) {
-    while (true) {
-        string hb = "Campus:" + CAMPUS + ";HB:online";
-        sendto(udpSock, hb.c_str(), hb.size(), 0, (sockaddr*)&serv, sizeof(serv));
-        sleep(5);
-    }
-}
-
-// UDP listener for admin announcements
+// UDP listener for admin announcements sent to a multicast group
 void udpListener(int udpSock) {
     char buf[BUF];
     while (true) {
-        memset(buf,0,sizeof(buf));
         sockaddr_in sender; socklen_t sl = sizeof(sender);
-        ssize_t r = recvfrom(udpSock, buf, sizeof(buf)-1, 0, (sockaddr*)&sender, &sl);
+        ssize_t r = recvfrom(udpSock, buf, sizeof(buf), 0, (sockaddr*)&sender, &sl);
         if (r>0) {
-            cout << "\n[ADMIN BROADCAST]: " << buf << endl;
+            cout << "\n[ADMIN BROADCAST]: " << string_view(buf, strnlen(buf, r)) << endl;
         }
     }
 }
@@ -127,24 +60,43 @@ bool createNewFile(string &outFilename) {
     return true;
 }
 
-// Load existing file fully
-bool loadFileContent(const string &fname, string &content) {
-    ifstream ifs(fname.c_str());
-    if (!ifs) return false;
-
-    string line;
-    content="";
-    while (getline(ifs,line)) {
-        content += line + "\n";
-    }
-    ifs.close();
-    return true;
+// Socket joined to the server's announcement multicast group, -1 on failure
+int joinMulticast(const string &group) {
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0) return -1;
+    int opt = 1; setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)); // several clients per host
+    sockaddr_in addr; memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET; addr.sin_port = htons(MCAST_port); addr.sin_addr.s_addr = INADDR_ANY;
+    ip_mreq mr; memset(&mr,0,sizeof(mr));
+    mr.imr_interface.s_addr = INADDR_ANY;
+    if (inet_pton(AF_INET, group.c_str(), &mr.imr_multiaddr) != 1
+        || bind(s, (sockaddr*)&addr, sizeof(addr)) < 0
+        || setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mr, sizeof(mr)) < 0) { close(s); return -1; }
+    return s;
 }
 
-// Main client
-int main() {
-    memset(recFiles,0,sizeof(recFiles));
-
+// Main client. Options: --mcast ADDR          also listen for announcements on that multicast group
+//                       --server HOST[:PORT]  log in there (default 127.0.0.1:5000)
+//                       --tls-ca FILE         the server runs TLS (--tls-cert); its certificate chains to FILE
+int main(int argc, char** argv) {
+    string mcast, tlsCa;
+    for (int i=1;i<argc;i++) {
+        string a = argv[i];
+        string v = (i+1 < argc) ? argv[i+1] : "";
+        if (a == "--mcast" && !v.empty()) { mcast = v; i++; }
+        else if (a == "--server" && !v.empty()) {
+            size_t c = v.find(':');
+            ENTRY_HOST = v.substr(0, c);
+            if (c != string::npos) ENTRY_PORT = atoi(v.c_str() + c + 1);
+            i++;
+        }
+        else if (a == "--tls-ca" && !v.empty()) { tlsCa = v; i++; }
+        else { cerr << "Usage: " << argv[0] << " [--mcast ADDR] [--server HOST[:PORT]] [--tls-ca FILE]\n"; return 1; }
+    }
+    if (!tlsCa.empty()) {
+        string err;
+        if (!(clientTls = tlsClientContext(tlsCa, err))) { cerr << "TLS: " << err << "\n"; return 1; }
+    }
     // Get campus name
     cout << "Enter Campus Name: ";
     getline(cin, CAMPUS);
@@ -156,34 +108,42 @@ int main() {
 
     // Get password
     cout << "Enter Password: ";
-    string pass;
-    getline(cin, pass);
+    getline(cin, PASS);
 
-    // TCP connect
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock<0) { cout << "TCP socket error.\n"; return 0; }
+    signal(SIGPIPE, SIG_IGN); // a send while the connection is down fails instead of killing us
 
-    sockaddr_in server;
-    server.sin_family = AF_INET;
-    server.sin_port = htons(TCP_port);
-    inet_pton(AF_INET, "127.0.0.1", &server.sin_addr);
-
-    if (connect(sock, (sockaddr*)&server, sizeof(server))<0) {
-        cout << "Connect error.\n"; return 0;
+    // Frames may follow right behind the login reply, so everything they land in is ready first
+    string catErr;
+    recFiles = new file_catalog(); // never destroyed: its thread waits on it until exit
+    if (!recFiles->open("received_files_" + CAMPUS + ".catalog", catErr)) {
+        cout << "Received-files catalog: " << catErr << "\n"; return 0;
     }
-
-    // AUTH packet
-    string auth = "Campus:" + CAMPUS + ";Pass:" + pass;
-    write(sock, auth.c_str(), auth.size());
-
-    char buf[BUF];
-    memset(buf,0,sizeof(buf));
-    ssize_t r = read(sock, buf, sizeof(buf)-1);
-    if (r <= 0) {
-        cout << "Auth response read error.\n"; return 0;
+    thread([] { recFiles->writerLoop(); }).detach();
+
+    cli.onMessage = [](const campus_message &m) {
+        cout << "\nFrom " << m.sender << (m.stored ? " (stored while offline)" : "") << ": " << m.text << endl;
+    };
+    cli.onFile = [](const campus_file &f) {
+        if (!f.ok) { cout << "\nTransfer of " << f.name << " from " << f.sender << " was aborted or cut off.\n"; return; }
+        recFiles->add(f.sender, f.name, f.path);
+        cout << "\n--- File from " << f.sender << ": " << f.name << " saved as: " << f.path << " ---\n";
+    };
+    cli.onAnnouncement = [](const string &text) { cout << "\n[ADMIN BROADCAST]: " << text << endl; };
+    cli.onEvent = [](async_event e, const string &detail) {
+        if (e == ASYNC_RECONNECTING) cout << "\nConnection to server lost, reconnecting...\n";
+        else if (e == ASYNC_RESUMED) cout << "Reconnected (session resumed).\n";
+        else if (e == ASYNC_LOGGED_IN) cout << "Reconnected (logged in again; messages sent meanwhile may be lost).\n";
+        else if (e == ASYNC_SERVER_NOTE) cout << "\n[Server] " << detail << endl;
+        else if (e == ASYNC_GAVE_UP) { cout << "\nDisconnected from server.\n"; recFiles->flush(); _exit(0); }
+    };
+
+    // TCP connect and AUTH packet, asking for the framed protocol, compression and a resumable
+    // session. A federated server may send us on to the one that owns our campus; a busy one
+    // is asked again until it takes us (or two minutes pass).
+    string resp = cli.connect(ENTRY_HOST, ENTRY_PORT, CAMPUS, PASS);
+    if (resp.empty()) {
+        cout << "Connect error" << (tlsFailure.empty() ? "" : " (TLS: " + tlsFailure + ")") << ".\n"; return 0;
     }
-
-    string resp(buf);
     if (resp=="AUTH_FAIL") {
         cout << "Authentication failed.\n";
         return 0;
@@ -196,39 +156,28 @@ int main() {
         cout << "Server full.\n";
         return 0;
     }
-    if (resp!="AUTH_OK") {
+    if (busyRetry(resp) >= 0) {
+        cout << "Server busy, try again later.\n";
+        return 0;
+    }
+    if (!authOk(resp)) {
         cout << "Unexpected server response.\n";
         return 0;
     }
 
     cout << "\nAuthenticated successfully.\n";
 
-    // Start TCP listener
-    thread t1(tcpListener, sock);
-    t1.detach();
-
-    // Prepare UDP for heartbeat and broadcasts
-    int udpSock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (udpSock < 0) { cout<<"UDP socket error\n"; return 0;}
-
-    sockaddr_in servHB;
-    servHB.sin_family = AF_INET;
-    servHB.sin_port = htons(UDP_port);
-    inet_pton(AF_INET, "127.0.0.1", &servHB.sin_addr);
-
-    // start heartbeat thread
-    thread t2(hbThreadFunc, udpSock, servHB);
-    t2.detach();
-
-    // start udp listener
-    thread t3(udpListener, udpSock);
-    t3.detach();
+    if (!mcast.empty()) {
+        int mcSock = joinMulticast(mcast);
+        if (mcSock < 0) cout << "Could not join multicast group " << mcast << "\n";
+        else thread(udpListener, mcSock).detach();
+    }
 
     // Main menu
     while (true) {
         cout << "\n--- CLIENT MENU ("<<CAMPUS<<") ---\n";
         cout << "1) Send message to campus\n";
-        cout << "2) Send text file to campus\n";
+        cout << "2) Send file to campus\n";
         cout << "3) Open a received file\n";
         cout << "4) Exit\n";
         cout << "Choice: ";
@@ -237,14 +186,14 @@ int main() {
         getline(cin, choice);
 
         if (choice=="1") {
-            cout << "Enter target campus: ";
+            cout << "Enter target campus (* = all, @name = group): ";
             string target; getline(cin,target);
 
             cout << "Enter message text: ";
             string msg; getline(cin,msg);
 
-            string packet = "SEND|" + target + "|" + msg;
-            write(sock, packet.c_str(), packet.size());
+            // the server's answer is printed when it comes; the menu does not wait for it
+            cli.send(target, msg, [target](const string &st) { cout << "\n[Server] Message to " << target << ": " << st << endl; });
         }
         else if (choice=="2") {
             cout << "Send file to which campus? ";
@@ -254,13 +203,12 @@ int main() {
             string sel; getline(cin,sel);
 
             string actualFile;
-            string content;
 
             if (sel=="1") {
                 cout << "Enter existing filename: ";
                 getline(cin, actualFile);
 
-                if (!loadFileContent(actualFile, content)) {
+                if (access(actualFile.c_str(), R_OK) != 0) {
                     cout << "File does not exist or cannot be read.\n";
                     continue;    // **IMPORTANT** return to menu cleanly
                 }
@@ -270,48 +218,43 @@ int main() {
                     cout << "Error creating file.\n";
                     continue;
                 }
-                if (!loadFileContent(actualFile, content)) {
-                    cout << "Error reloading created file.\n";
-                    continue;
-                }
             }
             else {
                 cout << "Invalid option.\n";
                 continue;
             }
 
-            // Construct file packet
-            string packet = "FILE|" + target + "|" + actualFile + "|" + content;
-            write(sock, packet.c_str(), packet.size());
-
-            cout << "File sent.\n";
+            // Streamed (or offered by chunk hashes) in the background
+            cout << "Sending " << actualFile << "...\n";
+            cli.sendFile(target, actualFile, [target, actualFile](const string &st) {
+                cout << "\n[Server] File " << actualFile << " to " << target << ": " << st << endl;
+            });
 
             // Safely return to menu
             cin.clear();
         }
         else if (choice=="3") {
-            // List received files
-            fileMtx.lock();
+            // List received files, newest first, a page at a time
             cout << "\n--- Received Files ---\n";
-            for (int i=0;i<100;i++) {
-                if (recFiles[i].used) {
-                    cout << i << ") " << recFiles[i].storedName << endl;
-                }
+            catalog_cursor cur = recFiles->all();
+            while (true) {
+                for (const catalog_entry &e : recFiles->page(cur, LIST_PAGE)) cout << e.id << ") " << e.stored << endl;
+                if (cur.done) break;
+                cout << "-- Enter for more, q to stop -- ";
+                string more; getline(cin, more);
+                if (more == "q") break;
             }
-            fileMtx.unlock();
 
             cout << "Enter index to open: ";
             string idxs; getline(cin, idxs);
-            int idx = atoi(idxs.c_str());
+            long long idx = atoll(idxs.c_str());
 
-            fileMtx.lock();
-            if (idx<0 || idx>=100 || !recFiles[idx].used) {
-                fileMtx.unlock();
+            catalog_entry e;
+            if (idx<0 || !recFiles->get(idx, e)) {
                 cout << "Invalid index.\n";
                 continue;
             }
-            string filepath = recFiles[idx].storedName;
-            fileMtx.unlock();
+            string filepath = e.stored;
 
             ifstream ifs(filepath.c_str());
             if (!ifs) {
@@ -329,6 +272,8 @@ int main() {
         }
         else if (choice=="4") {
             cout << "Exiting client.\n";
+            cli.close();
+            recFiles->flush();
             exit(0);
         }
         else {
@@ -0,0 +1,146 @@
+// Frame payload compression negotiated at login (";Comp:lz4", see protocol.h): an in-tree
+// codec for the LZ4 block format, and the packed body layout FF_COMPRESSED frames carry.
+//
+// The compressor is the plain greedy LZ4 scheme: a 4-byte hash table of recent positions, a
+// match is at least 4 bytes within 64 KB, literals are copied as they are. It does one pass
+// with no entropy stage, so it costs little next to a socket write; text compresses 2-3x,
+// already-compressed data not at all (and then it is simply sent unpacked).
+#ifndef CAMPUS_COMPRESS_H
+#define CAMPUS_COMPRESS_H
+#include<cstdint>
+#include<cstring>
+#include<string>
+#include "protocol.h"
+
+const size_t COMP_MIN = 128;          // bodies below this are always sent as they are
+const size_t COMP_HDR = 4;            // packed body: big-endian raw length, then the LZ4 block
+const int LZ4_HASH_BITS = 12;
+const size_t LZ4_MIN_MATCH = 4;
+const size_t LZ4_LAST_LITERALS = 5;   // format rule: the block ends with at least 5 literals
+const size_t LZ4_MFLIMIT = 12;        // ... and no match starts in its last 12 bytes
+
+// Worst case output for n input bytes (incompressible data grows a little)
+inline size_t lz4Bound(size_t n) { return n + n / 255 + 16; }
+
+inline uint32_t lz4Read32(const uint8_t* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+inline uint32_t lz4Hash(uint32_t v) { return (v * 2654435761u) >> (32 - LZ4_HASH_BITS); }
+
+inline uint8_t* lz4PutLen(uint8_t* o, size_t n) {
+    for (; n >= 255; n -= 255) *o++ = 255;
+    *o++ = (uint8_t)n;
+    return o;
+}
+
+// Compress src[0, n) into dst (room for lz4Bound(n)); returns the block size
+inline size_t lz4Compress(const char* src, size_t n, char* dst) {
+    const uint8_t* in = (const uint8_t*)src;
+    const uint8_t* end = in + n;
+    const uint8_t* anchor = in;         // first literal not yet written
+    uint8_t* o = (uint8_t*)dst;
+    uint32_t table[1 << LZ4_HASH_BITS];  // position + 1 of the last 4 bytes seen with each hash, 0 = none
+    memset(table, 0, sizeof(table));
+    if (n > LZ4_MFLIMIT) {
+        const uint8_t* limit = end - LZ4_MFLIMIT;
+        const uint8_t* matchEnd = end - LZ4_LAST_LITERALS;
+        const uint8_t* p = in;
+        size_t misses = 0;                 // since the last match: step further through data that does not compress
+        while (p < limit) {
+            uint32_t h = lz4Hash(lz4Read32(p));
+            const uint8_t* ref = table[h] ? in + table[h] - 1 : nullptr;
+            table[h] = (uint32_t)(p - in) + 1;
+            if (!ref || p - ref > 65535 || lz4Read32(ref) != lz4Read32(p)) { p += 1 + (misses++ >> 6); continue; }
+            misses = 0;
+            const uint8_t* q = p + LZ4_MIN_MATCH;
+            const uint8_t* r = ref + LZ4_MIN_MATCH;
+            bool differ = false;
+            while (q + 8 <= matchEnd) {
+                uint64_t a, b;
+                memcpy(&a, q, 8); memcpy(&b, r, 8);
+                if (a != b) { q += __builtin_ctzll(a ^ b) >> 3; differ = true; break; } // little-endian: first differing byte
+                q += 8; r += 8;
+            }
+            if (!differ) while (q < matchEnd && *q == *r) { q++; r++; }
+            size_t lit = p - anchor, mlen = (q - p) - LZ4_MIN_MATCH;
+            uint8_t* token = o++;
+            *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4 | (mlen >= 15 ? 15 : mlen));
+            if (lit >= 15) o = lz4PutLen(o, lit - 15);
+            memcpy(o, anchor, lit); o += lit;
+            uint16_t off = (uint16_t)(p - ref);
+            *o++ = (uint8_t)off; *o++ = (uint8_t)(off >> 8);
+            if (mlen >= 15) o = lz4PutLen(o, mlen - 15);
+            anchor = p = q;
+        }
+    }
+    size_t lit = end - anchor;
+    *o++ = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) o = lz4PutLen(o, lit - 15);
+    memcpy(o, anchor, lit); o += lit;
+    return o - (uint8_t*)dst;
+}
+
+// Decompress a block that must expand to exactly n bytes into dst; false if it is malformed
+inline bool lz4Decompress(const char* src, size_t srcLen, char* dst, size_t n) {
+    const uint8_t* p = (const uint8_t*)src;
+    const uint8_t* pe = p + srcLen;
+    uint8_t* o = (uint8_t*)dst;
+    uint8_t* oe = o + n;
+    while (p < pe) {
+        uint8_t token = *p++;
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do { if (p == pe) return false; b = *p++; lit += b; } while (b == 255);
+        }
+        if ((size_t)(pe - p) < lit || (size_t)(oe - o) < lit) return false;
+        memcpy(o, p, lit); o += lit; p += lit;
+        if (p == pe) break;                          // last sequence: literals only
+        if (pe - p < 2) return false;
+        size_t off = p[0] | (size_t)p[1] << 8;
+        p += 2;
+        if (off == 0 || off > (size_t)(o - (uint8_t*)dst)) return false;
+        size_t mlen = (token & 15);
+        if (mlen == 15) {
+            uint8_t b;
+            do { if (p == pe) return false; b = *p++; mlen += b; } while (b == 255);
+        }
+        mlen += LZ4_MIN_MATCH;
+        if ((size_t)(oe - o) < mlen) return false;
+        const uint8_t* r = o - off;
+        if (off >= mlen) { memcpy(o, r, mlen); o += mlen; }
+        else while (mlen--) *o++ = *r++;             // overlapping: byte by byte repeats the pattern
+    }
+    return o == oe;
+}
+
+// Raw length of a packed body, from its header (0 if it is too short to have one)
+inline size_t packedRawLen(const char* p, size_t n) {
+    if (n < COMP_HDR) return 0;
+    const uint8_t* b = (const uint8_t*)p;
+    return (size_t)b[0] << 24 | (size_t)b[1] << 16 | (size_t)b[2] << 8 | b[3];
+}
+
+// Pack body [p, p+n) into dst (room for COMP_HDR + lz4Bound(n)). Returns the packed size, or 0
+// if the body is too small or would not shrink: send it as it is then.
+inline size_t packBody(const char* p, size_t n, char* dst) {
+    if (n < COMP_MIN) return 0;
+    uint8_t* b = (uint8_t*)dst;
+    b[0] = (uint8_t)(n >> 24); b[1] = (uint8_t)(n >> 16); b[2] = (uint8_t)(n >> 8); b[3] = (uint8_t)n;
+    size_t z = COMP_HDR + lz4Compress(p, n, dst + COMP_HDR);
+    return z < n ? z : 0;
+}
+inline bool packBody(const std::string &s, std::string &out) {
+    out.resize(COMP_HDR + lz4Bound(s.size()));
+    size_t z = packBody(s.data(), s.size(), &out[0]);
+    out.resize(z);
+    return z != 0;
+}
+
+// Unpack a packed body into out; false if it is malformed or would exceed MAX_FRAME
+inline bool unpackBody(const char* p, size_t n, std::string &out) {
+    size_t raw = packedRawLen(p, n);
+    if (n < COMP_HDR || raw > MAX_FRAME) return false;
+    out.resize(raw);
+    return lz4Decompress(p + COMP_HDR, n - COMP_HDR, &out[0], raw);
+}
+
+#endif
@@ -0,0 +1,373 @@
+// Content-addressed file store used by server.cpp (--store DIR) for files saved on the server,
+// and the chunking both sides agree on so a client can offer a file by chunk hashes first.
+//
+// Files are cut into chunks at content-defined boundaries (a gear rolling hash, FastCDC
+// style): an edit only moves the boundaries next to it, so a changed timetable shares all
+// but a chunk or two with the previous one. Each chunk is kept once, named by its SHA-256:
+//
+//   DIR/chunks/ab/abcd...   chunk bytes (file name = hex SHA-256)
+//   DIR/files/<name>        manifest: the file's chunk list, in order
+//
+// A chunk's reference count is the number of manifest entries naming it plus the pins of
+// transfers in progress; it lives in memory (rebuilt from the manifests at open) and the
+// chunk file is deleted when it drops to zero. Saving under an existing name replaces that
+// manifest and releases the old one's chunks. Chunks no manifest names (a crash mid-transfer)
+// are removed at open.
+#ifndef CAMPUS_DEDUP_STORE_H
+#define CAMPUS_DEDUP_STORE_H
+#include<algorithm>
+#include<cerrno>
+#include<cstdint>
+#include<cstdio>
+#include<cstring>
+#include<mutex>
+#include<string>
+#include<vector>
+#include<unordered_map>
+#include<dirent.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/stat.h>
+
+// ---- SHA-256 -------------------------------------------------------------------------------
+
+struct sha256_ctx {
+    uint32_t s[8];
+    uint64_t bytes = 0;
+    uint8_t buf[64];
+    size_t fill = 0;
+
+    sha256_ctx() {
+        static const uint32_t iv[8] = {0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19};
+        memcpy(s, iv, sizeof(s));
+    }
+    static uint32_t ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+    void block(const uint8_t* p) {
+        static const uint32_t k[64] = {
+            0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+            0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+            0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+            0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+            0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+            0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+            0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+            0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2};
+        uint32_t w[64];
+        for (int i=0;i<16;i++) w[i] = (uint32_t)p[4*i]<<24 | (uint32_t)p[4*i+1]<<16 | (uint32_t)p[4*i+2]<<8 | p[4*i+3];
+        for (int i=16;i<64;i++) {
+            uint32_t s0 = ror(w[i-15],7) ^ ror(w[i-15],18) ^ (w[i-15]>>3);
+            uint32_t s1 = ror(w[i-2],17) ^ ror(w[i-2],19) ^ (w[i-2]>>10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+        uint32_t a=s[0],b=s[1],c=s[2],d=s[3],e=s[4],f=s[5],g=s[6],h=s[7];
+        for (int i=0;i<64;i++) {
+            uint32_t t1 = h + (ror(e,6) ^ ror(e,11) ^ ror(e,25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (ror(a,2) ^ ror(a,13) ^ ror(a,22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h=g; g=f; f=e; e=d+t1; d=c; c=b; b=a; a=t1+t2;
+        }
+        s[0]+=a; s[1]+=b; s[2]+=c; s[3]+=d; s[4]+=e; s[5]+=f; s[6]+=g; s[7]+=h;
+    }
+    void update(const void* data, size_t n) {
+        const uint8_t* p = (const uint8_t*)data;
+        bytes += n;
+        if (fill) {
+            size_t k = std::min(n, 64 - fill);
+            memcpy(buf + fill, p, k); fill += k; p += k; n -= k;
+            if (fill < 64) return;
+            block(buf); fill = 0;
+        }
+        for (; n >= 64; p += 64, n -= 64) block(p);
+        memcpy(buf, p, n); fill = n;
+    }
+    void final(uint8_t out[32]) {
+        uint64_t bits = bytes * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (fill != 56) update(&pad, 1);
+        uint8_t len[8];
+        for (int i=0;i<8;i++) len[i] = (uint8_t)(bits >> (56 - 8*i));
+        update(len, 8);
+        for (int i=0;i<8;i++) { out[4*i]=s[i]>>24; out[4*i+1]=s[i]>>16; out[4*i+2]=s[i]>>8; out[4*i+3]=s[i]; }
+    }
+};
+
+// ---- Content-defined chunking --------------------------------------------------------------
+
+const size_t CDC_MIN = 4u << 10;     // no boundary before this many bytes
+const size_t CDC_MAX = 64u << 10;    // forced boundary (one chunk always fits one FT_FILE_CHUNK)
+const int CDC_BITS = 14;             // boundary where the top CDC_BITS of the hash are 0: ~16 KB past CDC_MIN
+
+// Gear table: fixed pseudo-random values (splitmix64), identical on every build
+inline const uint64_t* cdcGear() {
+    static uint64_t g[256];
+    static bool init = [] {
+        uint64_t x = 0x43616d7075734344ull;
+        for (int i=0;i<256;i++) {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            g[i] = z ^ (z >> 31);
+        }
+        return true;
+    }();
+    (void)init;
+    return g;
+}
+
+// Streaming chunker: feed bytes in any pieces, get the same boundaries as for the whole file.
+// The top bits of a gear hash depend on the last 64 bytes, so that is the rolling window.
+struct cdc_chunker {
+    uint64_t h = 0;
+    size_t len = 0;            // bytes in the current chunk so far
+    // Bytes of p[0..n) that belong to the current chunk; *cut is set when the chunk ends there
+    size_t scan(const char* p, size_t n, bool* cut) {
+        const uint64_t* g = cdcGear();
+        *cut = false;
+        for (size_t i=0;i<n;i++) {
+            h = (h << 1) + g[(uint8_t)p[i]];
+            if (++len >= CDC_MAX || (len >= CDC_MIN && (h >> (64 - CDC_BITS)) == 0)) {
+                *cut = true; h = 0; len = 0;
+                return i + 1;
+            }
+        }
+        return n;
+    }
+};
+
+// ---- Chunk lists ---------------------------------------------------------------------------
+
+const size_t CHUNK_HASH = 32;
+const size_t CHUNK_REF_WIRE = CHUNK_HASH + 4;   // hash + big-endian length (manifests, offers)
+const char STORE_MANIFEST_MAGIC[4] = {'C','D','M','1'};
+
+struct chunk_ref {
+    uint8_t hash[CHUNK_HASH];
+    uint32_t len;
+    std::string key() const { return std::string((const char*)hash, CHUNK_HASH); }
+};
+
+inline chunk_ref chunkOf(const char* p, size_t n) {
+    chunk_ref r;
+    sha256_ctx h;
+    h.update(p, n);
+    h.final(r.hash);
+    r.len = (uint32_t)n;
+    return r;
+}
+
+inline void putChunkRef(std::string &out, const chunk_ref &r) {
+    out.append((const char*)r.hash, CHUNK_HASH);
+    uint8_t l[4] = {(uint8_t)(r.len >> 24), (uint8_t)(r.len >> 16), (uint8_t)(r.len >> 8), (uint8_t)r.len};
+    out.append((const char*)l, 4);
+}
+
+inline chunk_ref getChunkRef(const char* p) {
+    chunk_ref r;
+    memcpy(r.hash, p, CHUNK_HASH);
+    const uint8_t* l = (const uint8_t*)p + CHUNK_HASH;
+    r.len = (uint32_t)l[0] << 24 | (uint32_t)l[1] << 16 | (uint32_t)l[2] << 8 | l[3];
+    return r;
+}
+
+inline std::string hexOf(const uint8_t* p, size_t n) {
+    static const char hx[] = "0123456789abcdef";
+    std::string s;
+    for (size_t i=0;i<n;i++) { s += hx[p[i] >> 4]; s += hx[p[i] & 15]; }
+    return s;
+}
+
+// Chunk list of a whole file (what a client offers); false on a read error
+inline bool chunkFile(int fd, std::vector<chunk_ref> &out) {
+    static thread_local char buf[CDC_MAX]; // clients may hash files on several threads
+    cdc_chunker cdc;
+    sha256_ctx h;
+    out.clear();
+    while (true) {
+        ssize_t r = read(fd, buf, sizeof(buf));
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return false;
+        if (r == 0) break;
+        for (size_t off = 0; off < (size_t)r; ) {
+            bool cut;
+            size_t k = cdc.scan(buf + off, r - off, &cut);
+            h.update(buf + off, k);
+            off += k;
+            if (!cut) continue;
+            chunk_ref c;
+            c.len = (uint32_t)h.bytes;
+            h.final(c.hash);
+            out.push_back(c);
+            h = sha256_ctx();
+        }
+    }
+    if (h.bytes) {
+        chunk_ref c;
+        c.len = (uint32_t)h.bytes;
+        h.final(c.hash);
+        out.push_back(c);
+    }
+    return true;
+}
+
+// ---- Store ---------------------------------------------------------------------------------
+
+struct dedup_store {
+    std::string dir;
+    std::mutex m;                                   // refs and the files under dir
+    std::unordered_map<std::string, uint32_t> refs; // chunk hash -> references
+    uint64_t tmpSeq = 0;
+
+    std::string chunkPath(const chunk_ref &r) const {
+        std::string h = hexOf(r.hash, CHUNK_HASH);
+        return dir + "/chunks/" + h.substr(0, 2) + "/" + h;
+    }
+    std::string manifestPath(const std::string &name) const { return dir + "/files/" + name; }
+    bool isManifest(const std::string &path) const { return path.compare(0, dir.size() + 7, dir + "/files/") == 0; }
+
+    static bool readManifest(const std::string &path, std::vector<chunk_ref> &out, uint64_t* size = nullptr) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        std::string b;
+        char buf[65536];
+        ssize_t r;
+        while ((r = read(fd, buf, sizeof(buf))) > 0) b.append(buf, r);
+        close(fd);
+        if (b.size() < 16 || memcmp(b.data(), STORE_MANIFEST_MAGIC, 4) != 0) return false;
+        uint64_t sz; uint32_t n;
+        memcpy(&sz, b.data() + 4, 8);
+        memcpy(&n, b.data() + 12, 4);
+        if (b.size() != 16 + (size_t)n * CHUNK_REF_WIRE) return false;
+        out.clear();
+        for (uint32_t i=0;i<n;i++) out.push_back(getChunkRef(b.data() + 16 + (size_t)i * CHUNK_REF_WIRE));
+        if (size) *size = sz;
+        return true;
+    }
+
+    bool open(const std::string &d) {
+        dir = d;
+        mkdir(dir.c_str(), 0755);
+        mkdir((dir + "/files").c_str(), 0755);
+        mkdir((dir + "/chunks").c_str(), 0755);
+        if (DIR* fd = opendir((dir + "/files").c_str())) {
+            while (dirent* e = readdir(fd)) {
+                std::vector<chunk_ref> v;
+                if (e->d_name[0] == '.') continue;
+                std::string p = dir + "/files/" + e->d_name;
+                if (strncmp(e->d_name, "tmp.", 4) == 0) { unlink(p.c_str()); continue; }
+                if (readManifest(p, v)) for (const chunk_ref &r : v) refs[r.key()]++;
+            }
+            closedir(fd);
+        }
+        // drop chunks nothing refers to and leftovers of interrupted writes
+        DIR* top = opendir((dir + "/chunks").c_str());
+        if (!top) return false;
+        while (dirent* e = readdir(top)) {
+            if (e->d_name[0] == '.') continue;
+            std::string sub = dir + "/chunks/" + e->d_name;
+            if (DIR* s = opendir(sub.c_str())) {
+                while (dirent* f = readdir(s)) {
+                    if (f->d_name[0] == '.') continue;
+                    std::string name = f->d_name;
+                    chunk_ref r;
+                    bool ok = name.size() == 2 * CHUNK_HASH;
+                    for (size_t i=0; ok && i<CHUNK_HASH; i++) ok = sscanf(name.c_str() + 2*i, "%2hhx", &r.hash[i]) == 1;
+                    if (!ok || !refs.count(r.key())) unlink((sub + "/" + name).c_str());
+                }
+                closedir(s);
+            }
+        }
+        closedir(top);
+        return true;
+    }
+
+    // Pin a chunk that is already stored; false if it is not
+    bool pin(const chunk_ref &r) {
+        std::lock_guard<std::mutex> lk(m);
+        auto it = refs.find(r.key());
+        if (it == refs.end()) return false;
+        it->second++;
+        return true;
+    }
+
+    // Store a chunk's bytes (r = chunkOf(p, n)) and pin it. Returns 1 if it was new, 0 if it
+    // was already there, -1 on a write error.
+    int put(const chunk_ref &r, const char* p, size_t n) {
+        if (pin(r)) return 0;
+        std::string path = chunkPath(r);
+        std::string tmp;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            tmp = path + ".tmp" + std::to_string(++tmpSeq);
+        }
+        mkdir(path.substr(0, path.rfind('/')).c_str(), 0755);
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = fd >= 0;
+        while (ok && n > 0) {
+            ssize_t w = write(fd, p, n);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) ok = false; else { p += w; n -= w; }
+        }
+        if (fd >= 0) close(fd);
+        std::lock_guard<std::mutex> lk(m);
+        auto it = refs.find(r.key());
+        if (it != refs.end()) { it->second++; unlink(tmp.c_str()); return 0; } // raced with another writer
+        if (!ok || rename(tmp.c_str(), path.c_str()) < 0) { unlink(tmp.c_str()); return -1; }
+        refs[r.key()] = 1;
+        return 1;
+    }
+
+    void unrefLocked(const chunk_ref &r) {
+        auto it = refs.find(r.key());
+        if (it == refs.end() || --it->second) return;
+        refs.erase(it);
+        unlink(chunkPath(r).c_str());
+    }
+    void unref(const std::vector<chunk_ref> &v) {
+        std::lock_guard<std::mutex> lk(m);
+        for (const chunk_ref &r : v) unrefLocked(r);
+    }
+
+    // Save the pinned chunk list as file `name` (the pins become its references). A file saved
+    // under that name before is replaced and its chunks released.
+    bool commit(const std::string &name, const std::vector<chunk_ref> &chunks, uint64_t size) {
+        std::string b(STORE_MANIFEST_MAGIC, 4);
+        uint32_t n = (uint32_t)chunks.size();
+        b.append((const char*)&size, 8);
+        b.append((const char*)&n, 4);
+        for (const chunk_ref &r : chunks) putChunkRef(b, r);
+        std::lock_guard<std::mutex> lk(m);
+        std::string path = manifestPath(name);
+        std::string tmp = dir + "/files/tmp." + std::to_string(++tmpSeq);
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+        bool ok = write(fd, b.data(), b.size()) == (ssize_t)b.size();
+        close(fd);
+        std::vector<chunk_ref> old;
+        bool hadOld = readManifest(path, old);
+        if (!ok || rename(tmp.c_str(), path.c_str()) < 0) { unlink(tmp.c_str()); return false; }
+        if (hadOld) for (const chunk_ref &r : old) unrefLocked(r);
+        return true;
+    }
+
+    // Call f(fd, len) for each chunk of a stored file, in order; false if one is missing
+    template<class F> bool forEachChunk(const std::string &manifest, F f) {
+        std::vector<chunk_ref> v;
+        if (!readManifest(manifest, v)) return false;
+        for (const chunk_ref &r : v) {
+            int fd = ::open(chunkPath(r).c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return false;
+            bool go = f(fd, (size_t)r.len);
+            close(fd);
+            if (!go) return false;
+        }
+        return true;
+    }
+
+    size_t chunkCount() {
+        std::lock_guard<std::mutex> lk(m);
+        return refs.size();
+    }
+};
+
+#endif
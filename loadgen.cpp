@@ -0,0 +1,667 @@
+// Headless load generator and latency benchmark for server.cpp.
+//
+// Logs in a set of campuses over TCP with the framed protocol (same auth, SEND, FILE and
+// heartbeat code as client.cpp, from campus_client.h), drives them from sender threads and
+// reads them from receiver threads, and sends heartbeats for them plus any number of UDP-only
+// campuses. Every message carries its send time, so the receiving campus measures end-to-end
+// latency; the sender measures request -> FT_REPLY time. At the end it prints throughput and
+// p50/p99/p99.9/max of each latency as recorded in log-linear (HDR-style) histograms, the
+// bytes that crossed the sockets and the CPU time loadgen itself used.
+//
+// For the compression trade-off, run the same load with and without --compress, with message
+// and file bodies taken from real text (random filler and zero-filled files are meaningless):
+//   ./loadgen --corpus /usr/share/dict/words --sizes 200:50,2000:50 --file-size 1000000
+//   ./loadgen --corpus /usr/share/dict/words --sizes 200:50,2000:50 --file-size 1000000 --compress
+//
+// The server only admits campuses it has credentials for; for more than the five built-in ones:
+//   ./loadgen --emit-creds 2000 > lg.creds
+//   ./server --creds lg.creds --max-clients 8192
+//   ./loadgen --creds lg.creds --campuses 2000 --hb-campuses 5000 --duration 10
+//
+// For the cost of encryption, run the same load against a server with and without --tls-cert
+// (kernel TLS: files still go through sendfile/splice on the server):
+//   ./server --tls-cert campus.pem --tls-key campus.key
+//   ./loadgen --sizes 1024:100 --file-size 4000000 --file-every 10 --tls campus.pem
+//
+// --alloc-check PORT asserts that routing does not touch the server's heap: it reads
+// campus_heap_allocations_total from the server's --metrics PORT when the measured run starts
+// and when it ends, and exits 1 unless the two are equal. Drive direct and fan-out routing:
+//   ./server --metrics 9100
+//   ./loadgen --fanout 4 --alloc-check 9100
+//
+// --storm measures recovery instead: every campus connects and logs in at the same moment, as
+// when the backbone comes back, and it reports how long until all of them were in:
+//   ./loadgen --emit-creds 10000 > lg.creds
+//   ./server --creds lg.creds --max-clients 16384
+//   ./loadgen --creds lg.creds --storm --sources 64
+#include<iostream>
+#include<fstream>
+#include<thread>
+#include<string>
+#include<cstring>
+#include<cstdio>
+#include<cstdlib>
+#include<ctime>
+#include<cerrno>
+#include<atomic>
+#include<vector>
+#include<map>
+#include<queue>
+#include<unistd.h>
+#include<csignal>
+#include<sys/epoll.h>
+#include<sys/resource.h>
+#include<netinet/tcp.h>
+#include "campus_client.h"
+using namespace std;
+
+const int RX_BUF = 256 << 10;      // bytes per receiver read()
+const int MAX_WINDOW = 1024;       // requests in flight per campus
+const int HB_TICK_MS = 10;         // heartbeat pacing granularity
+const uint8_t FANOUT_MARK = 'F';   // message text byte 8: sent to the fan-out target
+const uint8_t DIRECT_MARK = 'x';
+
+// ---- options ---------------------------------------------------------------------------------
+string HOST = "127.0.0.1";         // --host / --port: server the logins start at (a federation may redirect them)
+int PORT = TCP_port;
+int SENDERS = 4;                   // --threads: sender threads (and as many receiver threads)
+int CAMPUSES = 0;                  // --campuses: TCP campuses to log in (0 = every credential)
+double DURATION = 10;              // --duration seconds
+double WARMUP = 1;                 // --warmup seconds not counted
+int WINDOW = 16;                   // --window: requests in flight per campus
+double RATE = 0;                   // --rate: requests per second per campus (0 = as fast as the window allows)
+size_t FILE_SIZE = 0;              // --file-size: bytes per file transfer (0 = no files)
+int FILE_EVERY = 100;              // --file-every: every Nth request of a campus is a file
+int FANOUT_EVERY = 0;              // --fanout: every Nth message goes to FANOUT_TARGET (0 = never)
+string FANOUT_TARGET = "*";        // --fanout-target: "*" or "@group"
+int HB_CAMPUSES = 0;               // --hb-campuses: extra UDP-only campuses
+double HB_RATE = 0.2;              // --hb-rate: heartbeats per second per campus (clients send one every 5 s)
+bool COMPRESS = false;             // --compress: negotiate compression and pack bodies worth it
+string CORPUS;                     // --corpus FILE: message text and file contents come from FILE
+string TLS_CA;                     // --tls CAFILE: connect over TLS, checking the server's certificate against CAFILE
+bool STORM = false;                // --storm: time a reconnect storm of all campuses instead
+int SOURCES = 1;                   // --sources N: storm campuses connect from N loopback addresses
+int SILENT = 0;                    // --silent N: storm connections from one other address that never log in
+int ALLOC_CHECK = 0;               // --alloc-check PORT: fail if the server's heap allocation count moves during the run
+const double STORM_LIMIT = 120;    // seconds a storm may take before the stragglers are given up on
+const int STORM_WAVE = 64;         // connects started between two looks at the ones under way
+
+struct size_class { size_t bytes; int weight; };
+vector<size_class> SIZES = { {64, 80}, {1024, 15}, {16384, 5} }; // --sizes BYTES:WEIGHT,...
+int SIZE_WEIGHT = 100;
+
+// ---- histogram -------------------------------------------------------------------------------
+// Log-linear buckets like HdrHistogram: exact below 2^SUB_BITS, above that every power of two
+// is split into 2^SUB_BITS buckets, so any recorded value is off by less than 1/2^SUB_BITS.
+struct hdr_hist {
+    static const int SUB_BITS = 7;
+    static const int SUB = 1 << SUB_BITS;
+    static const int BUCKETS = (64 - SUB_BITS + 1) * SUB;
+    vector<uint64_t> counts;
+    uint64_t total = 0, maxV = 0;
+    double sum = 0;
+
+    hdr_hist() : counts(BUCKETS, 0) {}
+
+    static int index(uint64_t v) {
+        if (v < (uint64_t)SUB) return (int)v;
+        int e = 63 - __builtin_clzll(v);                // e >= SUB_BITS
+        return (e - SUB_BITS + 1) * SUB + (int)((v >> (e - SUB_BITS)) & (SUB - 1));
+    }
+    // highest value that lands in bucket i
+    static uint64_t upper(int i) {
+        if (i < SUB) return (uint64_t)i;
+        int e = i / SUB + SUB_BITS - 1;
+        uint64_t lo = ((uint64_t)SUB + (uint64_t)(i % SUB)) << (e - SUB_BITS);
+        return lo + ((1ull << (e - SUB_BITS)) - 1);
+    }
+    void record(uint64_t v) {
+        counts[index(v)]++;
+        total++;
+        sum += (double)v;
+        if (v > maxV) maxV = v;
+    }
+    void merge(const hdr_hist &o) {
+        for (int i=0;i<BUCKETS;i++) counts[i] += o.counts[i];
+        total += o.total; sum += o.sum;
+        if (o.maxV > maxV) maxV = o.maxV;
+    }
+    uint64_t percentile(double q) const {
+        if (!total) return 0;
+        uint64_t want = (uint64_t)(q / 100.0 * (double)total + 0.5);
+        if (want < 1) want = 1;
+        uint64_t seen = 0;
+        for (int i=0;i<BUCKETS;i++) {
+            seen += counts[i];
+            if (seen >= want) return min(upper(i), maxV);
+        }
+        return maxV;
+    }
+};
+
+// ---- per-thread state ------------------------------------------------------------------------
+struct stats {
+    hdr_hist msgLat;       // direct message: send -> delivered to the target campus
+    hdr_hist fanLat;       // fan-out message: send -> delivered, per recipient
+    hdr_hist replyLat;     // message request -> FT_REPLY
+    hdr_hist fileLat;      // file START written -> FT_REPLY (FILE_FORWARDED)
+    uint64_t sentMsgs = 0, sentFiles = 0, sentBytes = 0;
+    uint64_t rxMsgs = 0, rxFanout = 0, rxFiles = 0, rxBytes = 0;
+    uint64_t replies = 0, heartbeats = 0;
+    uint64_t wireOut = 0, wireIn = 0;   // bytes written to / read from the sockets
+    map<string,uint64_t> failures;   // non-success replies by status
+};
+
+struct campus {
+    string name, pass;
+    string host;                                     // server it is logged in to
+    int port = 0;
+    int sock = -1;
+    frame_reader in;
+    uint32_t seq = 0;                                // sender thread only
+    uint64_t nextDue = 0;                            // --rate pacing (sender thread)
+    uint64_t ops = 0;
+    atomic<int> inflight{0};
+    atomic<uint64_t> sentNs[MAX_WINDOW];             // by seq % MAX_WINDOW, 0 = nothing pending
+    atomic<bool> isFile[MAX_WINDOW];
+};
+
+vector<campus*> campuses;
+atomic<bool> running(true);
+atomic<bool> measuring(false);
+string filePath;                   // --file-size: the file every transfer sends
+string corpus;                     // --corpus contents
+
+uint64_t monoNs() {
+    timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// xorshift64*: cheap per-thread randomness for targets and sizes
+struct rng {
+    uint64_t s;
+    uint64_t next() { s ^= s >> 12; s ^= s << 25; s ^= s >> 27; return s * 2685821657736338717ull; }
+    size_t below(size_t n) { return (size_t)(next() % n); }
+};
+
+size_t pickSize(rng &r) {
+    int w = (int)r.below(SIZE_WEIGHT);
+    for (const size_class &c : SIZES) { if (w < c.weight) return c.bytes; w -= c.weight; }
+    return SIZES.back().bytes;
+}
+
+bool okStatus(const string &s) {
+    return s == "DELIVERED" || s == "FILE_FORWARDED" || s.compare(0, 20, "BROADCAST_DELIVERED:") == 0
+        || s == "STORED_FOR_DELIVERY" || s == "FILE_STORED_FOR_DELIVERY";
+}
+
+// ---- sender ----------------------------------------------------------------------------------
+// Owns campuses[first, first+count): whenever one has window room (and is due under --rate),
+// send its next request.
+void senderThread(int first, int count, stats* st) {
+    rng r{0x9E3779B97F4A7C15ull * (uint64_t)(first + 1)};
+    string text;
+    vector<char> chunk(FRAME_HDR + FILE_CHUNK);
+    uint64_t gap = RATE > 0 ? (uint64_t)(1e9 / RATE) : 0;
+    int n = (int)campuses.size();
+    while (running.load(memory_order_relaxed)) {
+        bool any = false;
+        uint64_t now = monoNs();
+        for (int k=first; k<first+count; k++) {
+            campus* c = campuses[k];
+            if (c->inflight.load(memory_order_acquire) >= WINDOW) continue;
+            if (gap && now < c->nextDue) continue;
+            if (gap) c->nextDue = max(c->nextDue + gap, now - 10 * gap); // catch up, but not forever
+            any = true;
+            uint32_t seq = ++c->seq;
+            int slot = (int)(seq % MAX_WINDOW);
+            c->inflight.fetch_add(1, memory_order_relaxed);
+            uint64_t op = ++c->ops;
+            bool isFile = FILE_SIZE && op % FILE_EVERY == 0;
+            c->isFile[slot].store(isFile, memory_order_relaxed);
+            c->sentNs[slot].store(now, memory_order_release);
+            bool m = measuring.load(memory_order_relaxed);
+
+            int t = (int)r.below(n - 1);
+            const string &target = campuses[t >= k ? t + 1 : t]->name;
+            bool ok;
+            if (isFile) {
+                int sock = c->sock;
+                ok = streamFile([sock, st, m](const char* p, size_t len) { if (m) st->wireOut += len; return writeFully(sock, p, len); },
+                                target, filePath, seq, chunk.data(), COMPRESS);
+                if (m) { st->sentFiles++; st->sentBytes += FILE_SIZE; }
+            } else {
+                bool fan = FANOUT_EVERY && op % FANOUT_EVERY == 0;
+                size_t len = max(pickSize(r), (size_t)9);
+                text.assign(len, (char)(fan ? FANOUT_MARK : DIRECT_MARK));
+                memcpy(&text[0], &now, 8);
+                if (!corpus.empty()) {
+                    size_t at = r.below(corpus.size());
+                    for (size_t k=9; k<len; k++) { text[k] = corpus[at]; if (++at == corpus.size()) at = 0; }
+                }
+                string f = sendRequest(fan ? FANOUT_TARGET : target, text, seq, COMPRESS);
+                ok = writeFully(c->sock, f.data(), f.size());
+                if (m) { st->sentMsgs++; st->sentBytes += len; st->wireOut += f.size(); }
+            }
+            if (!ok && running) { cerr << c->name << ": connection lost\n"; running = false; }
+        }
+        if (!any) this_thread::sleep_for(chrono::microseconds(20));
+    }
+}
+
+// ---- receiver --------------------------------------------------------------------------------
+void onFrame(campus* c, const frame_hdr &h, const char* p, stats* st) {
+    static thread_local string unpacked;
+    const char* end = p + h.len;
+    uint64_t now = monoNs();
+    bool m = measuring.load(memory_order_relaxed);
+    if (h.type == FT_MSG) {
+        string sender;
+        if (!takeField(p, end, sender) || !frameBody(h, p, end, unpacked) || end - p < 9) return;
+        uint64_t sent; memcpy(&sent, p, 8);
+        if (!m) return;
+        bool fan = (uint8_t)p[8] == FANOUT_MARK;
+        (fan ? st->fanLat : st->msgLat).record(now - sent);
+        (fan ? st->rxFanout : st->rxMsgs)++;
+        st->rxBytes += end - p;
+    }
+    else if (h.type == FT_FILE_CHUNK) { if (frameBody(h, p, end, unpacked) && m) st->rxBytes += end - p; }
+    else if (h.type == FT_FILE_END) { if (m) st->rxFiles++; }
+    else if (h.type == FT_REPLY) {
+        int slot = (int)(h.seq % MAX_WINDOW);
+        uint64_t sent = c->sentNs[slot].exchange(0, memory_order_acq_rel);
+        if (!sent) return; // not a request of ours, or already answered
+        bool isFile = c->isFile[slot].load(memory_order_relaxed);
+        c->inflight.fetch_sub(1, memory_order_release);
+        if (!m) return;
+        st->replies++;
+        (isFile ? st->fileLat : st->replyLat).record(now - sent);
+        string s(p, end - p);
+        if (!okStatus(s)) st->failures[s]++;
+    }
+    // spooled deliveries (server run with --spool) want an ack; the sender thread owns the
+    // socket's writes, and a benchmark has no use for redelivery, so they are left unacked
+}
+
+void receiverThread(vector<campus*> mine, stats* st) {
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    for (campus* c : mine) {
+        epoll_event ev; ev.events = EPOLLIN; ev.data.ptr = c;
+        epoll_ctl(ep, EPOLL_CTL_ADD, c->sock, &ev);
+    }
+    vector<char> buf(RX_BUF);
+    epoll_event evs[256];
+    while (running.load(memory_order_relaxed)) {
+        int n = epoll_wait(ep, evs, 256, 100);
+        for (int i=0;i<n;i++) {
+            campus* c = (campus*)evs[i].data.ptr;
+            ssize_t r = read(c->sock, buf.data(), buf.size());
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                if (running) cerr << c->name << ": disconnected by the server\n";
+                running = false;
+                break;
+            }
+            if (measuring.load(memory_order_relaxed)) st->wireIn += r;
+            c->in.feed(buf.data(), r);
+            frame_hdr h; const char* payload;
+            while (c->in.next(h, payload)) onFrame(c, h, payload, st);
+            if (c->in.bad) { cerr << c->name << ": protocol error\n"; running = false; }
+        }
+    }
+    close(ep);
+}
+
+// ---- heartbeats ------------------------------------------------------------------------------
+// Every campus (TCP and UDP-only) sends HB_RATE heartbeats a second, spread evenly, to the
+// server it is logged in to (UDP-only ones to --host)
+void heartbeatThread(vector<pair<string,sockaddr_in>> names, stats* st) {
+    int s = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (s < 0) { cerr << "UDP socket error\n"; return; }
+    vector<string> pkts;
+    for (const auto &n : names) pkts.push_back(heartbeat(n.first));
+    double perTick = HB_RATE * (double)pkts.size() * HB_TICK_MS / 1000.0, owed = 0;
+    size_t at = 0;
+    while (running.load(memory_order_relaxed)) {
+        owed += perTick;
+        for (; owed >= 1; owed -= 1) {
+            const string &p = pkts[at];
+            const sockaddr_in &to = names[at].second;
+            at = (at + 1) % pkts.size();
+            if (sendto(s, p.data(), p.size(), 0, (sockaddr*)&to, sizeof(to)) > 0 && measuring.load(memory_order_relaxed)) st->heartbeats++;
+        }
+        this_thread::sleep_for(chrono::milliseconds(HB_TICK_MS));
+    }
+    close(s);
+}
+
+// ---- setup and report ------------------------------------------------------------------------
+bool parseSizes(const string &spec) {
+    vector<size_class> v;
+    string list = spec + ",";
+    int total = 0;
+    for (size_t p = 0, q; (q = list.find(',', p)) != string::npos; p = q + 1) {
+        string item = list.substr(p, q - p);
+        if (item.empty()) continue;
+        size_t colon = item.find(':');
+        size_class c{(size_t)atoll(item.c_str()), colon == string::npos ? 1 : atoi(item.c_str() + colon + 1)};
+        if (c.bytes == 0 || c.bytes + 64 > MAX_FRAME || c.weight <= 0) return false;
+        total += c.weight;
+        v.push_back(c);
+    }
+    if (v.empty()) return false;
+    SIZES = v; SIZE_WEIGHT = total;
+    return true;
+}
+
+void printLatency(const char* what, const hdr_hist &h) {
+    if (!h.total) { printf("  %-24s no samples\n", what); return; }
+    printf("  %-24s n=%-10llu mean %9.1f  p50 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f us\n", what,
+           (unsigned long long)h.total, h.sum / h.total / 1000.0, h.percentile(50) / 1000.0,
+           h.percentile(99) / 1000.0, h.percentile(99.9) / 1000.0, h.maxV / 1000.0);
+}
+
+// ---- reconnect storm (--storm) ----------------------------------------------------------------
+// All campuses at once, from one thread: non-blocking connects, the auth line as soon as each
+// is up, the reply. A campus the server sheds (SERVER_BUSY;Retry:MS) comes back after the
+// jittered wait it was given; one whose connect failed or that got no reply backs off
+// exponentially, jittered too, as campus_async.h does. Campus i connects from 127.0.0.(1 + i %
+// SOURCES) + ..., so a per-address limit on the server sees SOURCES addresses. --silent opens
+// connections from 127.255.255.254 first that never send an auth line (a stuck or hostile
+// host), held open for the whole storm.
+struct storm_campus {
+    int fd = -1;
+    bool authSent = false, done = false;
+    unsigned backoff = 100;        // ms
+    string got;
+};
+
+int runStorm(const vector<pair<string,string>> &creds) {
+    vector<storm_campus> cs(CAMPUSES);
+    priority_queue<pair<uint64_t,int>, vector<pair<uint64_t,int>>, greater<pair<uint64_t,int>>> due;
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    sockaddr_in to = serverAddr(HOST, PORT);
+    hdr_hist loginLat;
+    uint64_t attempts = 0, shed = 0, noReply = 0, connFailed = 0;
+    map<string,uint64_t> refused;
+    int left = CAMPUSES;
+    uint64_t t0 = monoNs(), last = t0;
+
+    auto retry = [&](int i, int ms) {
+        storm_campus &c = cs[i];
+        epoll_ctl(ep, EPOLL_CTL_DEL, c.fd, nullptr);
+        close(c.fd);
+        c.fd = -1;
+        if (ms < 0) { ms = (int)c.backoff; c.backoff = min(c.backoff * 2, 5000u); }
+        due.push({monoNs() + (uint64_t)jittered((unsigned)ms) * 1000000, i});
+    };
+    auto attempt = [&](int i) -> bool {
+        storm_campus &c = cs[i];
+        attempts++;
+        c.authSent = false; c.got.clear();
+        c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (c.fd < 0) { cerr << "socket: " << strerror(errno) << "\n"; return false; }
+        if (SOURCES > 1) {
+            sockaddr_in from; memset(&from, 0, sizeof(from));
+            from.sin_family = AF_INET;
+            from.sin_addr.s_addr = htonl(0x7F000001u + (uint32_t)(i % SOURCES));
+            if (bind(c.fd, (sockaddr*)&from, sizeof(from)) < 0) { cerr << "bind: " << strerror(errno) << " (--sources needs a loopback --host)\n"; return false; }
+        }
+        if (connect(c.fd, (sockaddr*)&to, sizeof(to)) < 0 && errno != EINPROGRESS) { connFailed++; retry(i, -1); return true; }
+        epoll_event ev; ev.events = EPOLLOUT; ev.data.u32 = (uint32_t)i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, c.fd, &ev);
+        return true;
+    };
+    // The reply line (or whatever came before the connection closed)
+    auto answered = [&](int i) {
+        storm_campus &c = cs[i];
+        string resp = c.got.substr(0, c.got.find('\n'));
+        int wait;
+        if (authOk(resp)) {
+            epoll_ctl(ep, EPOLL_CTL_DEL, c.fd, nullptr); // stays open: the campus is back on
+            c.done = true; left--;
+            last = monoNs();
+            loginLat.record(last - t0);
+        }
+        else if ((wait = busyRetry(resp)) >= 0) { shed++; retry(i, wait); }
+        else if (resp.empty()) { noReply++; retry(i, -1); }
+        else { refused[resp]++; c.done = true; left--; epoll_ctl(ep, EPOLL_CTL_DEL, c.fd, nullptr); }
+    };
+
+    vector<int> silent;
+    for (int i=0;i<SILENT;i++) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        sockaddr_in from; memset(&from, 0, sizeof(from));
+        from.sin_family = AF_INET;
+        from.sin_addr.s_addr = htonl(0x7FFFFFFEu);
+        if (fd < 0 || bind(fd, (sockaddr*)&from, sizeof(from)) < 0) { cerr << "--silent: " << strerror(errno) << " (needs a loopback --host)\n"; return 1; }
+        if (connect(fd, (sockaddr*)&to, sizeof(to)) < 0 && errno != EINPROGRESS) { close(fd); continue; }
+        silent.push_back(fd);
+    }
+    t0 = monoNs();
+    for (int i=0;i<CAMPUSES;i++) due.push({t0, i});
+    epoll_event evs[256];
+    char buf[4096];
+    while (left > 0 && monoNs() - t0 < (uint64_t)(STORM_LIMIT * 1e9)) {
+        uint64_t now = monoNs();
+        // a wave at a time, so campuses already connected send their auth line in between
+        for (int k=0; k<STORM_WAVE && !due.empty() && due.top().first <= now; k++) { int i = due.top().second; due.pop(); if (!attempt(i)) return 1; }
+        int wait = due.empty() ? 100 : due.top().first <= now ? 0 : (int)min<uint64_t>(100, (due.top().first - now) / 1000000 + 1);
+        int n = epoll_wait(ep, evs, 256, wait);
+        for (int k=0;k<n;k++) {
+            int i = (int)evs[k].data.u32;
+            storm_campus &c = cs[i];
+            if (!c.authSent) {
+                int err = 0; socklen_t el = sizeof(err);
+                getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &el);
+                string auth = "Campus:" + creds[i].first + ";Pass:" + creds[i].second + ";Proto:" + to_string(PROTO_VERSION) + "\n";
+                if (err || send(c.fd, auth.data(), auth.size(), MSG_NOSIGNAL) != (ssize_t)auth.size()) { connFailed++; retry(i, -1); continue; }
+                c.authSent = true;
+                epoll_event ev; ev.events = EPOLLIN; ev.data.u32 = (uint32_t)i;
+                epoll_ctl(ep, EPOLL_CTL_MOD, c.fd, &ev);
+                continue;
+            }
+            ssize_t r = read(c.fd, buf, sizeof(buf));
+            if (r < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+            if (r > 0) c.got.append(buf, r);
+            if (r <= 0 || c.got.find('\n') != string::npos) answered(i);
+        }
+    }
+    double all = (last - t0) / 1e9;
+    printf("storm: %d campuses from %d source address%s", CAMPUSES, SOURCES, SOURCES == 1 ? "" : "es");
+    if (SILENT) printf(", %d silent connections", SILENT);
+    printf("\n");
+    if (left) printf("  %d not logged in after %.0f s\n", left, STORM_LIMIT);
+    printf("  logged in %llu, the last after %.2f s (%.0f logins/s)\n", (unsigned long long)loginLat.total, all, all > 0 ? loginLat.total / all : 0.0);
+    printLatency("time to log in", loginLat);
+    printf("  attempts  %llu: %llu shed (SERVER_BUSY), %llu closed without a reply, %llu connects failed\n",
+           (unsigned long long)attempts, (unsigned long long)shed, (unsigned long long)noReply, (unsigned long long)connFailed);
+    for (auto &f : refused) printf("  refused %s: %llu\n", f.first.c_str(), (unsigned long long)f.second);
+    for (storm_campus &c : cs) if (c.fd >= 0) close(c.fd);
+    for (int fd : silent) close(fd);
+    close(ep);
+    return left ? 1 : 0;
+}
+
+// campus_heap_allocations_total from the server's metrics endpoint on HOST:port, -1 if unreadable
+long long scrapeAllocs(int port) {
+    sockaddr_in a = serverAddr(HOST, port);
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0) return -1;
+    string page;
+    const char req[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    if (connect(s, (sockaddr*)&a, sizeof(a)) == 0 && writeFully(s, req, sizeof(req) - 1)) {
+        char buf[16384];
+        ssize_t r;
+        while ((r = read(s, buf, sizeof(buf))) > 0) page.append(buf, r);
+    }
+    close(s);
+    size_t p = page.find("\ncampus_heap_allocations_total ");
+    return p == string::npos ? -1 : atoll(page.c_str() + p + 32);
+}
+
+int usage(const char* prog) {
+    cerr << "Usage: " << prog << " [--host ADDR] [--port N] [--creds FILE] [--campuses N] [--threads N] [--duration S] [--warmup S]"
+            " [--window N] [--rate R] [--sizes BYTES:WEIGHT,...] [--file-size BYTES] [--file-every N]"
+            " [--fanout N] [--fanout-target T] [--hb-campuses N] [--hb-rate R] [--compress] [--corpus FILE] [--tls CAFILE] [--alloc-check METRICS_PORT]\n"
+         << "       " << prog << " --storm [--sources N] [--silent N] [--host ADDR] [--port N] [--creds FILE] [--campuses N]   (reconnect storm)\n"
+         << "       " << prog << " --emit-creds N   (print N campus credentials for server --creds)\n";
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    vector<pair<string,string>> creds = { {"Lahore","NU-LHR-123"}, {"Karachi","NU-KHI-123"}, {"Multan","NU-MULT-123"}, {"Peshawar","NU-PSH-123"}, {"CFD","NU-CFD-123"} };
+    for (int i=1;i<argc;i++) {
+        string a = argv[i];
+        string v = (i+1 < argc) ? argv[i+1] : "";
+        if (a == "--emit-creds" && atoi(v.c_str()) > 0) {
+            for (int k=1;k<=atoi(v.c_str());k++) printf("LG%05d lg-pass-%05d\n", k, k);
+            return 0;
+        }
+        else if (a == "--host" && !v.empty()) { HOST = v; i++; }
+        else if (a == "--port" && atoi(v.c_str()) > 0) { PORT = atoi(v.c_str()); i++; }
+        else if (a == "--creds" && !v.empty()) {
+            ifstream in(v);
+            if (!in) { cerr << "Cannot open credentials file " << v << "\n"; return 1; }
+            creds.clear();
+            string camp, pass;
+            while (in >> camp >> pass) creds.push_back({camp, pass});
+            i++;
+        }
+        else if (a == "--campuses" && atoi(v.c_str()) > 0) { CAMPUSES = atoi(v.c_str()); i++; }
+        else if (a == "--threads" && atoi(v.c_str()) > 0) { SENDERS = atoi(v.c_str()); i++; }
+        else if (a == "--duration" && atof(v.c_str()) > 0) { DURATION = atof(v.c_str()); i++; }
+        else if (a == "--warmup" && atof(v.c_str()) >= 0 && !v.empty()) { WARMUP = atof(v.c_str()); i++; }
+        else if (a == "--window" && atoi(v.c_str()) > 0) { WINDOW = min(atoi(v.c_str()), MAX_WINDOW / 2); i++; }
+        else if (a == "--rate" && atof(v.c_str()) > 0) { RATE = atof(v.c_str()); i++; }
+        else if (a == "--sizes" && parseSizes(v)) i++;
+        else if (a == "--file-size" && atoll(v.c_str()) > 0) { FILE_SIZE = (size_t)atoll(v.c_str()); i++; }
+        else if (a == "--file-every" && atoi(v.c_str()) > 0) { FILE_EVERY = atoi(v.c_str()); i++; }
+        else if (a == "--fanout" && atoi(v.c_str()) >= 0 && !v.empty()) { FANOUT_EVERY = atoi(v.c_str()); i++; }
+        else if (a == "--fanout-target" && (v == "*" || (v.size() > 1 && v[0] == '@'))) { FANOUT_TARGET = v; i++; }
+        else if (a == "--hb-campuses" && atoi(v.c_str()) >= 0 && !v.empty()) { HB_CAMPUSES = atoi(v.c_str()); i++; }
+        else if (a == "--hb-rate" && atof(v.c_str()) >= 0 && !v.empty()) { HB_RATE = atof(v.c_str()); i++; }
+        else if (a == "--compress") COMPRESS = true;
+        else if (a == "--corpus" && !v.empty()) { CORPUS = v; i++; }
+        else if (a == "--tls" && !v.empty()) { TLS_CA = v; i++; }
+        else if (a == "--storm") STORM = true;
+        else if (a == "--sources" && atoi(v.c_str()) > 0) { SOURCES = atoi(v.c_str()); i++; }
+        else if (a == "--silent" && atoi(v.c_str()) > 0) { SILENT = atoi(v.c_str()); i++; }
+        else if (a == "--alloc-check" && atoi(v.c_str()) > 0) { ALLOC_CHECK = atoi(v.c_str()); i++; }
+        else return usage(argv[0]);
+    }
+    if (CAMPUSES == 0 || CAMPUSES > (int)creds.size()) CAMPUSES = (int)creds.size();
+    if (CAMPUSES < 2) { cerr << "Need at least two campuses to send between\n"; return 1; }
+    SENDERS = min(SENDERS, CAMPUSES);
+    signal(SIGPIPE, SIG_IGN);
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) { rl.rlim_cur = rl.rlim_max; setrlimit(RLIMIT_NOFILE, &rl); }
+    if (STORM && !TLS_CA.empty()) { cerr << "--storm logs in over plaintext only\n"; return 1; }
+    if (STORM) return runStorm(creds);
+    if (!TLS_CA.empty()) {
+        string err;
+        if (!(clientTls = tlsClientContext(TLS_CA, err))) { cerr << "TLS: " << err << "\n"; return 1; }
+    }
+
+    if (!CORPUS.empty()) {
+        ifstream in(CORPUS, ios::binary);
+        corpus.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        if (corpus.empty()) { cerr << "Cannot read corpus " << CORPUS << "\n"; return 1; }
+    }
+    if (FILE_SIZE) {
+        char tmpl[] = "/tmp/loadgen_XXXXXX";
+        int fd = mkstemp(tmpl);
+        bool ok = fd >= 0;
+        if (ok && corpus.empty()) ok = ftruncate(fd, FILE_SIZE) == 0;
+        for (size_t done = 0; ok && !corpus.empty() && done < FILE_SIZE; done += corpus.size())
+            ok = writeFully(fd, corpus.data(), min(corpus.size(), FILE_SIZE - done));
+        if (!ok) { cerr << "Cannot create the transfer file\n"; return 1; }
+        close(fd);
+        filePath = tmpl;
+    }
+
+    // log everyone in before any traffic starts
+    for (int i=0;i<CAMPUSES;i++) {
+        campus* c = new campus();
+        c->name = creds[i].first; c->pass = creds[i].second;
+        for (int k=0;k<MAX_WINDOW;k++) { c->sentNs[k] = 0; c->isFile[k] = false; }
+        c->host = HOST; c->port = PORT;
+        string resp;
+        c->sock = loginServer(c->host, c->port, c->name, c->pass, c->in, resp, false, COMPRESS);
+        if (c->sock < 0 && resp.empty()) { cerr << "Cannot connect to " << c->host << ":" << c->port << (tlsFailure.empty() ? "" : " (TLS: " + tlsFailure + ")") << "\n"; return 1; }
+        if (c->sock >= 0) { int one = 1; setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); }
+        if (!authOk(resp)) { cerr << c->name << ": " << (resp.empty() ? "no auth reply" : resp) << "\n"; return 1; }
+        if (COMPRESS && !compressionOn(resp)) { cerr << "The server did not agree to compression\n"; return 1; }
+        campuses.push_back(c);
+    }
+
+    vector<stats*> all;
+    vector<thread> threads;
+    for (int t=0;t<SENDERS;t++) {
+        int first = (int)((long long)CAMPUSES * t / SENDERS), last = (int)((long long)CAMPUSES * (t+1) / SENDERS);
+        stats* tx = new stats(); stats* rx = new stats();
+        all.push_back(tx); all.push_back(rx);
+        threads.emplace_back(senderThread, first, last - first, tx);
+        threads.emplace_back(receiverThread, vector<campus*>(campuses.begin() + first, campuses.begin() + last), rx);
+    }
+    vector<pair<string,sockaddr_in>> hbNames;
+    for (campus* c : campuses) hbNames.push_back({c->name, serverAddr(c->host, heartbeatPort(c->port))});
+    for (int i=1;i<=HB_CAMPUSES;i++) { char nm[32]; snprintf(nm, sizeof(nm), "LGU%06d", i); hbNames.push_back({nm, serverAddr(HOST, heartbeatPort(PORT))}); }
+    if (HB_RATE > 0) {
+        stats* hb = new stats();
+        all.push_back(hb);
+        threads.emplace_back(heartbeatThread, hbNames, hb);
+    }
+
+    this_thread::sleep_for(chrono::duration<double>(WARMUP));
+    rusage ru0, ru1;
+    getrusage(RUSAGE_SELF, &ru0);
+    long long allocs0 = ALLOC_CHECK ? scrapeAllocs(ALLOC_CHECK) : 0;
+    measuring = true;
+    uint64_t t0 = monoNs();
+    this_thread::sleep_for(chrono::duration<double>(DURATION));
+    measuring = false;
+    long long allocs1 = ALLOC_CHECK ? scrapeAllocs(ALLOC_CHECK) : 0;
+    double secs = (monoNs() - t0) / 1e9;
+    getrusage(RUSAGE_SELF, &ru1);
+    auto tv = [](const timeval &a, const timeval &b) { return (b.tv_sec - a.tv_sec) + (b.tv_usec - a.tv_usec) / 1e6; };
+    double cpuUser = tv(ru0.ru_utime, ru1.ru_utime), cpuSys = tv(ru0.ru_stime, ru1.ru_stime);
+    running = false;
+    for (campus* c : campuses) shutdown(c->sock, SHUT_RDWR);
+    for (thread &t : threads) t.join();
+    if (!filePath.empty()) unlink(filePath.c_str());
+
+    stats sum;
+    for (stats* s : all) {
+        sum.msgLat.merge(s->msgLat); sum.fanLat.merge(s->fanLat); sum.replyLat.merge(s->replyLat); sum.fileLat.merge(s->fileLat);
+        sum.sentMsgs += s->sentMsgs; sum.sentFiles += s->sentFiles; sum.sentBytes += s->sentBytes;
+        sum.rxMsgs += s->rxMsgs; sum.rxFanout += s->rxFanout; sum.rxFiles += s->rxFiles; sum.rxBytes += s->rxBytes;
+        sum.replies += s->replies; sum.heartbeats += s->heartbeats;
+        sum.wireOut += s->wireOut; sum.wireIn += s->wireIn;
+        for (auto &f : s->failures) sum.failures[f.first] += f.second;
+    }
+    printf("%d campuses (%d UDP-only), %d sender + %d receiver threads, window %d, %.1f s measured%s\n",
+           CAMPUSES, HB_CAMPUSES, SENDERS, SENDERS, WINDOW, secs, clientTls ? ", over TLS" : "");
+    printf("  sent      %llu msgs (%.0f/s), %llu files, %.1f MB/s\n", (unsigned long long)sum.sentMsgs, sum.sentMsgs / secs,
+           (unsigned long long)sum.sentFiles, sum.sentBytes / secs / 1e6);
+    printf("  delivered %llu msgs (%.0f/s), %llu fan-out copies (%.0f/s), %llu files, %.1f MB/s\n",
+           (unsigned long long)sum.rxMsgs, sum.rxMsgs / secs, (unsigned long long)sum.rxFanout, sum.rxFanout / secs,
+           (unsigned long long)sum.rxFiles, sum.rxBytes / secs / 1e6);
+    printf("  replies   %llu (%.0f/s)\n", (unsigned long long)sum.replies, sum.replies / secs);
+    printf("  heartbeats %llu (%.0f/s)\n", (unsigned long long)sum.heartbeats, sum.heartbeats / secs);
+    printf("  wire      out %.1f MB/s (%.2f of payload), in %.1f MB/s (%.2f of payload)%s\n",
+           sum.wireOut / secs / 1e6, sum.sentBytes ? (double)sum.wireOut / sum.sentBytes : 0.0,
+           sum.wireIn / secs / 1e6, sum.rxBytes ? (double)sum.wireIn / sum.rxBytes : 0.0, COMPRESS ? ", compressed" : "");
+    printf("  cpu       %.2f s user + %.2f s sys in loadgen (%.0f%% of a core)\n", cpuUser, cpuSys, (cpuUser + cpuSys) / secs * 100);
+    printLatency("message end-to-end", sum.msgLat);
+    printLatency("fan-out end-to-end", sum.fanLat);
+    printLatency("request -> reply", sum.replyLat);
+    printLatency("file -> reply", sum.fileLat);
+    for (auto &f : sum.failures) printf("  reply %s: %llu\n", f.first.c_str(), (unsigned long long)f.second);
+    if (ALLOC_CHECK) {
+        if (allocs0 < 0 || allocs1 < 0) { printf("  alloc-check FAILED: no campus_heap_allocations_total on port %d\n", ALLOC_CHECK); return 1; }
+        printf("  alloc-check %s: %lld server heap allocations during the run\n", allocs1 == allocs0 ? "ok" : "FAILED", allocs1 - allocs0);
+        if (allocs1 != allocs0) return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,240 @@
+// Server metrics used by server.cpp (--metrics): global counters and the routing latency
+// histogram.
+//
+// Every thread that counts something gets its own cache-line aligned block and is its only
+// writer, so an increment is a plain relaxed load+store on a line no other core writes: no
+// lock prefix, no sharing. Nothing is summed until the endpoint is scraped; the reader adds up
+// all blocks then, and may see a thread's latest increment one scrape late.
+#ifndef CAMPUS_METRICS_H
+#define CAMPUS_METRICS_H
+#include<atomic>
+#include<cstdint>
+#include<cstdio>
+#include<ctime>
+#include<mutex>
+#include<string>
+
+enum metric_id {
+    M_MSGS_ROUTED,         // messages handed to a connected campus (each fan-out copy counts)
+    M_MSG_BYTES,           // their text bytes
+    M_MSGS_STORED,         // messages put in a spool for an offline campus
+    M_MSGS_OFFLINE,        // refused: target not connected (and no spool)
+    M_MSGS_BUSY,           // refused: target queue full (--overflow drop) or spool full
+    M_FANOUTS,             // "*" / "@group" requests
+    M_FILES_FORWARDED,
+    M_FILES_STORED,        // into a spool
+    M_FILES_SAVED,         // on the server (target Islamabad)
+    M_FILE_BYTES,          // bytes of completed transfers
+    M_STORE_NEW_BYTES,     // bytes of files saved in the dedup store (--store) that it did not have
+    M_STORE_DEDUP_BYTES,   // ... and that it already had (not written again)
+    M_AUTH_OK,
+    M_AUTH_FAIL,           // bad credentials
+    M_AUTH_DUPLICATE,
+    M_AUTH_FULL,           // no free slot
+    M_RESUME_OK,           // session resumes
+    M_RESUME_FAIL,         // ... refused (unknown/expired token, or frames no longer kept)
+    M_PACKED_FRAMES,       // FF_COMPRESSED frames received
+    M_PACKED_SAVED,        // ... bytes they were smaller than unpacked
+    M_HEARTBEATS,
+    M_SPILLED,             // messages moved to a spill file (--overflow spill)
+    M_SPILL_ERRORS,        // spill files that could not be read back (their connection was closed)
+    M_FED_MSGS,            // messages forwarded to the server that owns the target (--node)
+    M_FED_FILES,           // file streams forwarded to it
+    M_AUTH_REDIRECT,       // logins sent on to the server that owns the campus
+    M_WINDOWS_HELD,        // upload windows held back until the stream's destination drained
+    M_SHED_AUTH,           // connections shed at accept: --auth-max were waiting to authenticate
+    M_SHED_RATE,           // ... over their source address's --src-rate
+    M_AUTH_TIMEOUT,        // connections dropped for sending no auth line within AUTH_TIMEOUT_SEC
+    M_TLS_OK,              // TLS handshakes through, keys handed to the kernel (--tls-cert)
+    M_TLS_FAIL,            // ... that failed
+    M_MTX_LOCKS,           // acquisitions of the server's global mtx
+    M_MTX_CONTENDED,       // ... that had to wait
+    M_MTX_WAIT_NS,         // total time spent waiting for it
+    M_HEAP_ALLOCS,         // heap allocations, every entry point (server.cpp counts them)
+    M_COUNT
+};
+
+struct metric_desc { const char* name; const char* help; };
+const metric_desc metricDescs[M_COUNT] = {
+    {"campus_messages_routed_total", "Messages handed to a connected campus (each fan-out copy counts)."},
+    {"campus_message_bytes_total", "Text bytes of routed messages."},
+    {"campus_messages_stored_total", "Messages stored in a spool for an offline campus."},
+    {"campus_messages_offline_total", "Messages refused because the target was not connected."},
+    {"campus_messages_busy_total", "Messages refused because the target queue or spool was full."},
+    {"campus_fanouts_total", "Messages sent to \"*\" or a group."},
+    {"campus_files_forwarded_total", "File transfers forwarded to a connected campus."},
+    {"campus_files_stored_total", "File transfers stored in a spool for an offline campus."},
+    {"campus_files_saved_total", "File transfers saved on the server."},
+    {"campus_file_bytes_total", "Bytes of completed file transfers."},
+    {"campus_store_new_bytes_total", "Bytes of saved files written to the dedup store as new chunks."},
+    {"campus_store_dedup_bytes_total", "Bytes of saved files the dedup store already held."},
+    {"campus_auth_ok_total", "Successful logins."},
+    {"campus_auth_failed_total", "Logins refused for bad credentials."},
+    {"campus_auth_duplicate_total", "Logins refused because the campus was already connected."},
+    {"campus_auth_full_total", "Logins refused because no campus slot was free."},
+    {"campus_session_resumes_total", "Sessions resumed without a new login."},
+    {"campus_session_resume_failed_total", "Session resumes refused (unknown or expired token, or missed frames no longer kept)."},
+    {"campus_compressed_frames_total", "Compressed (FF_COMPRESSED) frames received."},
+    {"campus_compression_saved_bytes_total", "Bytes compressed frames were smaller than their content."},
+    {"campus_heartbeats_total", "Heartbeat datagrams received."},
+    {"campus_spilled_total", "Messages moved to a spill file (--overflow spill)."},
+    {"campus_spill_errors_total", "Spill files that could not be read back; their connection was closed."},
+    {"campus_federation_messages_total", "Messages forwarded to the server that owns the target campus."},
+    {"campus_federation_files_total", "File transfers forwarded to the server that owns the target campus."},
+    {"campus_auth_redirected_total", "Logins redirected to the server that owns the campus."},
+    {"campus_file_windows_held_total", "Upload windows held back until the stream's destination drained (;Flow:window)."},
+    {"campus_shed_auth_full_total", "Connections shed at accept because --auth-max were waiting to authenticate."},
+    {"campus_shed_rate_total", "Connections shed at accept because their source address was over --src-rate."},
+    {"campus_auth_timeouts_total", "Connections dropped for sending no auth line in time."},
+    {"campus_tls_handshakes_total", "TLS handshakes completed and handed to kernel TLS."},
+    {"campus_tls_handshake_failures_total", "TLS handshakes that failed (bad certificate, no kernel TLS, peer gone)."},
+    {"campus_mutex_acquisitions_total", "Acquisitions of the server's global mutex."},
+    {"campus_mutex_contended_total", "Acquisitions of the global mutex that had to wait."},
+    {"campus_mutex_wait_seconds_total", "Time spent waiting for the global mutex."},
+    {"campus_heap_allocations_total", "Heap allocations made by the server's threads."},
+};
+
+// Routing latency: bucket i counts values <= 2^(i+MET_HIST_SHIFT) ns; the last is +Inf
+const int MET_HIST_SHIFT = 8;      // 256 ns
+const int MET_HIST_BUCKETS = 24;   // .. 2^31 ns ~ 2.1 s
+
+const int MET_MAX_THREADS = 64;
+
+struct alignas(64) met_block {
+    std::atomic<uint64_t> c[M_COUNT];
+    std::atomic<uint64_t> hist[MET_HIST_BUCKETS + 1];
+    std::atomic<uint64_t> histSumNs;
+    bool shared;                   // overflow block: more threads than MET_MAX_THREADS, use RMWs
+};
+
+inline std::atomic<met_block*> metBlocks[MET_MAX_THREADS + 1]; // the last one is the shared overflow block
+inline std::atomic<int> metBlockCount(0);
+inline thread_local met_block* metSelf = nullptr;
+
+inline met_block* metNewBlock(bool shared) {
+    met_block* b = new met_block();
+    for (auto &x : b->c) x.store(0, std::memory_order_relaxed);
+    for (auto &x : b->hist) x.store(0, std::memory_order_relaxed);
+    b->histSumNs.store(0, std::memory_order_relaxed);
+    b->shared = shared;
+    return b;
+}
+
+inline met_block* metRegister() {
+    static met_block* overflow = [] { met_block* b = metNewBlock(true); metBlocks[MET_MAX_THREADS].store(b); return b; }();
+    int i = metBlockCount.load();
+    while (i < MET_MAX_THREADS && !metBlockCount.compare_exchange_weak(i, i+1)) {}
+    if (i >= MET_MAX_THREADS) return metSelf = overflow;
+    metSelf = metNewBlock(false);
+    metBlocks[i].store(metSelf, std::memory_order_release);
+    return metSelf;
+}
+
+inline void metBump(met_block* b, std::atomic<uint64_t> &x, uint64_t n) {
+    if (b->shared) x.fetch_add(n, std::memory_order_relaxed);
+    else x.store(x.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline void metAdd(metric_id id, uint64_t n = 1) {
+    met_block* b = metSelf ? metSelf : metRegister();
+    metBump(b, b->c[id], n);
+}
+
+inline void metRouteLatency(uint64_t ns) {
+    met_block* b = metSelf ? metSelf : metRegister();
+    int i = ns <= (1ull << MET_HIST_SHIFT) ? 0 : (64 - __builtin_clzll(ns - 1)) - MET_HIST_SHIFT;
+    if (i > MET_HIST_BUCKETS) i = MET_HIST_BUCKETS;
+    metBump(b, b->hist[i], 1);
+    metBump(b, b->histSumNs, ns);
+}
+
+inline uint64_t metNowNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// std::mutex that counts its acquisitions and the time spent waiting; the uncontended path
+// costs one try_lock and one counter bump
+struct metered_mutex {
+    std::mutex m;
+    void lock() {
+        metAdd(M_MTX_LOCKS);
+        if (m.try_lock()) return;
+        uint64_t t0 = metNowNs();
+        m.lock();
+        metAdd(M_MTX_CONTENDED);
+        metAdd(M_MTX_WAIT_NS, metNowNs() - t0);
+    }
+    bool try_lock() { return m.try_lock(); }
+    void unlock() { m.unlock(); }
+};
+
+// ---- scrape side ---------------------------------------------------------------------------
+
+// Sum of every thread's blocks
+struct met_totals {
+    uint64_t c[M_COUNT] = {};
+    uint64_t hist[MET_HIST_BUCKETS + 1] = {};
+    uint64_t histSumNs = 0;
+};
+
+inline met_totals metCollect() {
+    met_totals t;
+    for (int i=0;i<=MET_MAX_THREADS;i++) {
+        met_block* b = metBlocks[i].load(std::memory_order_acquire);
+        if (!b) continue;
+        for (int k=0;k<M_COUNT;k++) t.c[k] += b->c[k].load(std::memory_order_relaxed);
+        for (int k=0;k<=MET_HIST_BUCKETS;k++) t.hist[k] += b->hist[k].load(std::memory_order_relaxed);
+        t.histSumNs += b->histSumNs.load(std::memory_order_relaxed);
+    }
+    return t;
+}
+
+// Prometheus text exposition helpers
+inline std::string metEscape(const std::string &s) {
+    std::string o;
+    for (char ch : s) {
+        if (ch == '\\' || ch == '"') { o += '\\'; o += ch; }
+        else if (ch == '\n') o += "\\n";
+        else o += ch;
+    }
+    return o;
+}
+
+inline void metHeader(std::string &out, const char* name, const char* type, const char* help) {
+    out += "# HELP "; out += name; out += ' '; out += help; out += '\n';
+    out += "# TYPE "; out += name; out += ' '; out += type; out += '\n';
+}
+
+inline void metSample(std::string &out, const char* name, const std::string &labels, double v) {
+    char num[32];
+    if (v == (double)(uint64_t)v && v < 9007199254740992.0) snprintf(num, sizeof(num), "%llu", (unsigned long long)v);
+    else snprintf(num, sizeof(num), "%.9g", v);
+    out += name;
+    if (!labels.empty()) { out += '{'; out += labels; out += '}'; }
+    out += ' '; out += num; out += '\n';
+}
+
+inline void metTotalsText(std::string &out, const met_totals &t) {
+    for (int k=0;k<M_COUNT;k++) {
+        metHeader(out, metricDescs[k].name, "counter", metricDescs[k].help);
+        metSample(out, metricDescs[k].name, "", k == M_MTX_WAIT_NS ? t.c[k] / 1e9 : (double)t.c[k]);
+    }
+    const char* h = "campus_route_latency_seconds";
+    metHeader(out, h, "histogram", "Time to route one message request (lookup, spool or enqueue, reply).");
+    uint64_t cum = 0;
+    std::string bucket = std::string(h) + "_bucket";
+    for (int k=0;k<MET_HIST_BUCKETS;k++) {
+        cum += t.hist[k];
+        char le[48];
+        snprintf(le, sizeof(le), "le=\"%.9g\"", (double)(1ull << (k + MET_HIST_SHIFT)) / 1e9);
+        metSample(out, bucket.c_str(), le, (double)cum);
+    }
+    cum += t.hist[MET_HIST_BUCKETS];
+    metSample(out, bucket.c_str(), "le=\"+Inf\"", (double)cum);
+    metSample(out, (std::string(h) + "_sum").c_str(), "", t.histSumNs / 1e9);
+    metSample(out, (std::string(h) + "_count").c_str(), "", (double)cum);
+}
+
+#endif
@@ -0,0 +1,202 @@
+// Framed TCP protocol shared by server.cpp and client.cpp.
+//
+// Negotiated in the auth line: a client that sends "Campus:<Name>;Pass:<Pwd>;Proto:<v>\n"
+// gets "AUTH_OK;Proto:<v>\n" back and from then on both sides exchange frames.
+// An auth line without ";Proto:" stays on the legacy text protocol (SEND|..., FILE|...,
+// one read() per command). Adding ";Comp:lz4" asks for compression (FF_COMPRESSED below); the
+// server grants it by answering "AUTH_OK;Proto:<v>;Comp:lz4". Adding ";Flow:window" asks for
+// flow-controlled file uploads (FT_WINDOW below), granted the same way.
+//
+// Frame = 16-byte header (integers in network order) + `len` payload bytes.
+// Payload fields are separated by '\0'; the last field runs to the end of the payload and may
+// hold arbitrary binary data.
+#ifndef CAMPUS_PROTOCOL_H
+#define CAMPUS_PROTOCOL_H
+#include<cstdint>
+#include<cstring>
+#include<string>
+#include<string_view>
+#include<arpa/inet.h>
+
+const uint8_t PROTO_VERSION = 1;
+const uint8_t FRAME_MAGIC = 0xC5;
+const size_t FRAME_HDR = 16;
+const uint32_t MAX_FRAME = 1u << 20;    // larger frames are a protocol error
+const uint32_t FILE_CHUNK = 64u << 10;  // file data per FT_FILE_CHUNK frame
+const uint32_t FILE_WINDOW = 16 * FILE_CHUNK; // ;Flow:window: chunk payload a stream may send before FT_WINDOW
+
+// Files are streamed: START, any number of CHUNKs, END. The START frame's seq is the transfer
+// id; CHUNK and END frames carry it in hdr.seq. The first START field is the target campus
+// when a client sends and the sender campus when the server delivers.
+enum frame_type : uint8_t {
+    FT_SEND = 1,        // client->server  target\0text
+    FT_MSG = 2,         // server->client  sender\0text               (hdr.target = sender id)
+    FT_REPLY = 3,       // server->client  status text, hdr.seq = seq of the request it answers
+    FT_FILE_START = 4,  // both ways       campus\0filename\0size (decimal, informational)
+    FT_FILE_CHUNK = 5,  // both ways       up to FILE_CHUNK bytes of file data
+    FT_FILE_END = 6,    // both ways       "OK" or "ABORTED"
+    FT_ACK = 7,         // client->server  empty, hdr.seq = seq of an FF_STORED frame that was handled
+    FT_FILE_OFFER = 8,  // client->server  campus\0filename\0size\0 then the file's chunk list (see below)
+    FT_FILE_NEED = 9,   // server->client  bitmap of the offered chunks to send, hdr.seq = transfer id
+    FT_FWD_MSG = 10,    // server->server  sender\0target\0text, hdr.seq = the sender's request seq
+    FT_FWD_FILE = 11,   // server->server  sender\0target\0filename\0size, hdr.seq = trunk transfer id,
+                        //                 hdr.target = the sender's transfer id
+    FT_FWD_REPLY = 12,  // server->server  campus\0status, answers an FT_FWD_* for that campus (hdr.seq as it was)
+    FT_WINDOW = 13,     // server->client  empty, hdr.seq = transfer id, hdr.target = chunk bytes it may send more
+};
+
+// Flow-controlled uploads (";Flow:window"): a client may have FILE_WINDOW bytes of chunk payload
+// of each stream (START or OFFER) unanswered; the server gives them back with FT_WINDOW once
+// the stream's destination has taken them. The server then never stops reading the connection
+// for a slow file target, so messages sent behind a file are not held up by it. A client may
+// overrun its window by at most one chunk.
+
+// Federation trunks (server.cpp --node): servers that shard the campuses between them forward
+// traffic for campuses they do not own over one TCP connection per pair of servers, opened
+// with "Node:<Name>;Addr:<host>:<port>;To:<peer>;Nonce:<hex>;Proto:<v>;Time:<secs>;Mac:<hmac>\n"
+// and framed from then on. Mac is HMAC-SHA256 under the shared --fed-key over everything before
+// ";Mac:"; the peer refuses a hello addressed to another server, one whose Time is off by more
+// than FED_SKEW_SEC (server.cpp), or a replay of one it already accepted. The key never goes
+// on the wire.
+// Requests of many campuses share it, so each FT_FWD_* frame names its sender, and the owner
+// answers with FT_FWD_REPLY naming the campus the reply goes to. A forwarded file's CHUNK and
+// END frames carry the trunk transfer id from its FT_FWD_FILE.
+
+// Deduplicated upload (dedup_store.h): instead of FT_FILE_START a client may send FT_FILE_OFFER
+// listing the file's content-defined chunks, 36 bytes each (SHA-256 + big-endian length). The
+// server answers FT_FILE_NEED (bit i, LSB first, set = send chunk i) or, if it does not keep a
+// store for that target, an FT_REPLY "OFFER_DECLINED" and the client streams the file as usual.
+// The client then sends each needed chunk whole in one FT_FILE_CHUNK, in order, and FT_FILE_END.
+
+// hdr.flags
+const uint8_t FF_STORED = 0x01; // server->client: replayed from the store-and-forward spool.
+                                // FT_MSG and FT_FILE_END frames with it must be answered with
+                                // FT_ACK; whatever is not acknowledged is delivered again on the
+                                // next login.
+const uint8_t FF_COMPRESSED = 0x02; // the body is packed (compress.h): the text after the name
+                                // field of FT_SEND / FT_MSG, or the whole FT_FILE_CHUNK payload.
+                                // Only sent to campuses that negotiated compression; optional
+                                // per frame, small bodies go as they are. The server passes a
+                                // packed body on unopened when the recipient takes them.
+
+// Campus ids travel in hdr.target; 0 means "resolve the name in the payload"
+const uint32_t ID_BY_NAME = 0;
+
+struct frame_hdr {
+    uint8_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t len;      // payload bytes
+    uint32_t target;   // target campus id (client->server) or sender id (server->client)
+    uint32_t seq;      // sender's sequence number
+};
+
+inline void encodeHdr(char* out, uint8_t type, uint32_t len, uint32_t target, uint32_t seq, uint8_t flags = 0) {
+    out[0] = (char)FRAME_MAGIC; out[1] = (char)PROTO_VERSION; out[2] = (char)type; out[3] = (char)flags;
+    uint32_t v;
+    v = htonl(len);    memcpy(out+4, &v, 4);
+    v = htonl(target); memcpy(out+8, &v, 4);
+    v = htonl(seq);    memcpy(out+12, &v, 4);
+}
+
+inline bool decodeHdr(const char* in, frame_hdr &h) {
+    h.magic = (uint8_t)in[0]; h.version = (uint8_t)in[1]; h.type = (uint8_t)in[2]; h.flags = (uint8_t)in[3];
+    uint32_t v;
+    memcpy(&v, in+4, 4);  h.len = ntohl(v);
+    memcpy(&v, in+8, 4);  h.target = ntohl(v);
+    memcpy(&v, in+12, 4); h.seq = ntohl(v);
+    return h.magic == FRAME_MAGIC && h.version == PROTO_VERSION;
+}
+
+// Build a whole frame (header + payload) ready to write()
+inline std::string makeFrame(uint8_t type, uint32_t target, uint32_t seq, const std::string &payload, uint8_t flags = 0) {
+    std::string f(FRAME_HDR, '\0');
+    encodeHdr(&f[0], type, (uint32_t)payload.size(), target, seq, flags);
+    f += payload;
+    return f;
+}
+
+// Join two, three or four payload fields with '\0'
+inline std::string fields(std::string_view a, std::string_view b) {
+    std::string s; s.reserve(a.size()+1+b.size());
+    s += a; s += '\0'; s += b;
+    return s;
+}
+inline std::string fields(std::string_view a, std::string_view b, std::string_view c) {
+    return fields(fields(a, b), c);
+}
+inline std::string fields(std::string_view a, std::string_view b, std::string_view c, std::string_view d) {
+    return fields(fields(a, b, c), d);
+}
+
+// Cut the next '\0'-terminated field off [p, end). Returns false if no terminator is left.
+inline bool takeField(const char* &p, const char* end, std::string &out) {
+    const char* z = (const char*)memchr(p, 0, end-p);
+    if (!z) return false;
+    out.assign(p, z-p);
+    p = z+1;
+    return true;
+}
+// ... as a view into the buffer, for parsers that only look at the field
+inline bool takeField(const char* &p, const char* end, std::string_view &out) {
+    const char* z = (const char*)memchr(p, 0, end-p);
+    if (!z) return false;
+    out = std::string_view(p, z-p);
+    p = z+1;
+    return true;
+}
+
+// Per-connection reassembly buffer: feed() whatever read() returned, then pull whole frames
+// with next(). Several frames in one read and one frame spread over many reads both work.
+// The payload pointer returned by next() stays valid until the following next()/feed().
+// Buf is the buffer's string type (the server's come from its slab allocator).
+template<class Buf> struct basic_frame_reader {
+    Buf buf;
+    size_t head = 0;     // first unconsumed byte
+    bool bad = false;    // bad magic/version or oversized frame: drop the connection
+
+    void feed(const char* p, size_t n) {
+        if (head == buf.size()) { buf.clear(); head = 0; }
+        buf.append(p, n);
+    }
+    bool next(frame_hdr &h, const char* &payload) {
+        if (buf.size()-head < FRAME_HDR) { compact(); return false; }
+        if (!decodeHdr(buf.data()+head, h) || h.len > MAX_FRAME) { bad = true; return false; }
+        if (buf.size()-head-FRAME_HDR < h.len) { compact(); return false; }
+        payload = buf.data()+head+FRAME_HDR;
+        head += FRAME_HDR + h.len;
+        return true;
+    }
+    void compact() {
+        if (head) { buf.erase(0, head); head = 0; }
+    }
+
+    size_t avail() const { return buf.size()-head; }
+
+    // Once everything is consumed, give back a buffer that grew past keep bytes (one large
+    // frame should not pin its size for the life of the connection)
+    void trim(size_t keep) {
+        if (head == buf.size() && buf.capacity() > keep) { Buf().swap(buf); head = 0; }
+    }
+
+    // For receivers that take large payloads straight from the socket (splice): the header at
+    // the front, once it is buffered, even if the payload is not complete yet
+    bool peekHdr(frame_hdr &h) {
+        if (buf.size()-head < FRAME_HDR) return false;
+        if (!decodeHdr(buf.data()+head, h) || h.len > MAX_FRAME) { bad = true; return false; }
+        return true;
+    }
+    // Consume the front frame's header and the part of its payload that is buffered.
+    // Returns that part's length; the remaining h.len - n bytes are still in the socket.
+    size_t takePartial(const frame_hdr &h, const char* &payload) {
+        size_t n = buf.size()-head-FRAME_HDR;
+        if (n > h.len) n = h.len;
+        payload = buf.data()+head+FRAME_HDR;
+        head += FRAME_HDR + n;
+        return n;
+    }
+};
+typedef basic_frame_reader<std::string> frame_reader;
+
+#endif
@@ -0,0 +1,220 @@
+// Campus routing table used by server.cpp: campus name -> slot index in clients[].
+//
+// Open addressing (linear probing) over immutable route entries. Lookups take no lock: they
+// run inside an rcu read section and may race with writers. Writers (insert/erase, under the
+// server's mtx) never modify an entry in place. They publish a new entry or a tombstone, and
+// retire the old one. Retired memory is freed by rcuReclaim() once every reader that could
+// still see it has left its read section.
+#ifndef CAMPUS_ROUTE_TABLE_H
+#define CAMPUS_ROUTE_TABLE_H
+#include<atomic>
+#include<cstdint>
+#include<cstdlib>
+#include<cstring>
+#include<mutex>
+#include<string>
+#include<vector>
+
+// ---- Epoch-based RCU -----------------------------------------------------------------------
+// A reader stores the current global epoch in its per-thread record while it is inside a
+// section and 0 otherwise. Something retired at epoch r is safe to free once no record holds
+// a non-zero epoch <= r.
+
+const int RCU_MAX_THREADS = 256;
+
+struct rcu_reader {
+    std::atomic<uint64_t> epoch;   // 0 = not reading
+    std::atomic<bool> used;
+};
+
+struct rcu_retired {
+    void (*fn)(void*);
+    void* p;
+    uint64_t epoch;
+};
+
+inline std::atomic<uint64_t> rcuEpoch(1);
+inline rcu_reader rcuReaders[RCU_MAX_THREADS];
+inline std::mutex rcuRetireMtx;
+inline std::vector<rcu_retired> rcuRetiredList;
+inline std::atomic<bool> rcuPending(false);
+inline thread_local rcu_reader* rcuSelf = nullptr;
+
+inline rcu_reader* rcuRegister() {
+    for (int i=0;i<RCU_MAX_THREADS;i++) {
+        bool expect = false;
+        if (rcuReaders[i].used.compare_exchange_strong(expect, true)) { rcuSelf = &rcuReaders[i]; return rcuSelf; }
+    }
+    abort(); // more reading threads than RCU_MAX_THREADS
+}
+
+inline void rcuReadLock() {
+    rcu_reader* r = rcuSelf ? rcuSelf : rcuRegister();
+    r->epoch.store(rcuEpoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst); // epoch visible before any table read
+}
+inline void rcuReadUnlock() { rcuSelf->epoch.store(0, std::memory_order_release); }
+
+// RAII read section
+struct rcu_guard {
+    rcu_guard() { rcuReadLock(); }
+    ~rcu_guard() { rcuReadUnlock(); }
+};
+
+// Run fn(p) after a grace period. Call after p has been unpublished.
+inline void rcuRetire(void (*fn)(void*), void* p) {
+    uint64_t e = rcuEpoch.fetch_add(1, std::memory_order_seq_cst);
+    std::lock_guard<std::mutex> lk(rcuRetireMtx);
+    rcuRetiredList.push_back(rcu_retired{fn, p, e});
+    rcuPending.store(true, std::memory_order_release);
+}
+
+// Free whatever has passed its grace period. Cheap when nothing is pending; callbacks run
+// without any table lock held, so they may take the server's mtx.
+inline void rcuReclaim() {
+    if (!rcuPending.load(std::memory_order_acquire)) return;
+    // anything retired before this point is unreachable for readers that start later
+    uint64_t oldest = rcuEpoch.load(std::memory_order_seq_cst);
+    for (int i=0;i<RCU_MAX_THREADS;i++) {
+        uint64_t e = rcuReaders[i].epoch.load(std::memory_order_seq_cst);
+        if (e && e < oldest) oldest = e;
+    }
+    std::vector<rcu_retired> ready;
+    {
+        std::unique_lock<std::mutex> lk(rcuRetireMtx, std::try_to_lock);
+        if (!lk.owns_lock()) return; // another thread is reclaiming
+        size_t keep = 0;
+        for (size_t i=0;i<rcuRetiredList.size();i++) {
+            if (rcuRetiredList[i].epoch < oldest) ready.push_back(rcuRetiredList[i]);
+            else rcuRetiredList[keep++] = rcuRetiredList[i];
+        }
+        rcuRetiredList.resize(keep);
+        rcuPending.store(keep > 0, std::memory_order_release);
+    }
+    for (const rcu_retired &r : ready) r.fn(r.p);
+}
+
+// ---- Routing table -------------------------------------------------------------------------
+
+// Immutable once published
+struct route {
+    uint64_t hash;
+    int slot;
+    std::string name;
+};
+
+inline uint64_t routeHash(const char* s, size_t n) {
+    uint64_t h = 1469598103934665603ull;   // FNV-1a
+    for (size_t i=0;i<n;i++) { h ^= (uint8_t)s[i]; h *= 1099511628211ull; }
+    return h;
+}
+
+struct route_table {
+    struct buckets {
+        size_t mask;
+        std::atomic<route*>* e;
+    };
+    std::atomic<buckets*> cur;
+    size_t live = 0, tombs = 0;    // writer-side counts (under the writers' lock)
+
+    // Room for `capacity` live names at load factor <= 1/2
+    explicit route_table(size_t capacity) { cur.store(makeBuckets(capacity)); }
+
+    // Lock-free lookup. Call inside an rcu read section; the route stays valid until it ends.
+    const route* find(const char* name, size_t n) const {
+        uint64_t h = routeHash(name, n);
+        const buckets* b = cur.load(std::memory_order_acquire);
+        for (size_t i=0, at=h & b->mask; i<=b->mask; i++, at=(at+1) & b->mask) {
+            route* r = b->e[at].load(std::memory_order_acquire);
+            if (!r) return nullptr;
+            if (r == tombstone()) continue;
+            if (r->hash == h && r->name.size() == n && memcmp(r->name.data(), name, n) == 0) return r;
+        }
+        return nullptr;
+    }
+    const route* find(const std::string &name) const { return find(name.data(), name.size()); }
+
+    // Call f(route) for every live entry. Inside an rcu read section, like find().
+    template<class F> void forEach(F f) const {
+        const buckets* b = cur.load(std::memory_order_acquire);
+        for (size_t i=0;i<=b->mask;i++) {
+            route* r = b->e[i].load(std::memory_order_acquire);
+            if (r && r != tombstone()) f(*r);
+        }
+    }
+
+    // Writers only (serialised by the caller). The name must not be present.
+    void insert(const std::string &name, int slot) {
+        if ((live + tombs + 1) * 2 > cur.load()->mask + 1) rebuild();
+        route* r = new route{routeHash(name.data(), name.size()), slot, name};
+        buckets* b = cur.load();
+        for (size_t at=r->hash & b->mask;; at=(at+1) & b->mask) {
+            route* old = b->e[at].load(std::memory_order_relaxed);
+            if (!old || old == tombstone()) {
+                if (old) tombs--;
+                b->e[at].store(r, std::memory_order_release);
+                live++;
+                return;
+            }
+        }
+    }
+
+    // Writers only. Returns the slot the name mapped to, or -1. The entry becomes a tombstone
+    // and is retired; onGone(route) runs after the grace period and must delete it (and may
+    // recycle its slot).
+    int erase(const std::string &name, void (*onGone)(void*)) {
+        uint64_t h = routeHash(name.data(), name.size());
+        buckets* b = cur.load();
+        for (size_t i=0, at=h & b->mask; i<=b->mask; i++, at=(at+1) & b->mask) {
+            route* r = b->e[at].load(std::memory_order_relaxed);
+            if (!r) return -1;
+            if (r == tombstone() || r->hash != h || r->name != name) continue;
+            b->e[at].store(tombstone(), std::memory_order_release);
+            live--; tombs++;
+            int slot = r->slot;
+            rcuRetire(onGone, r);
+            return slot;
+        }
+        return -1;
+    }
+
+private:
+    static route* tombstone() { static route t{0, -1, std::string()}; return &t; }
+
+    static buckets* makeBuckets(size_t capacity) {
+        size_t n = 16;
+        while (n < capacity * 2) n <<= 1;
+        buckets* b = new buckets;
+        b->mask = n - 1;
+        b->e = new std::atomic<route*>[n];
+        for (size_t i=0;i<n;i++) b->e[i].store(nullptr, std::memory_order_relaxed);
+        return b;
+    }
+
+    static void freeBuckets(void* p) {
+        buckets* b = (buckets*)p;
+        delete[] b->e;
+        delete b;
+    }
+
+    // Too many tombstones (or live names): copy the live routes into fresh buckets, publish
+    // them, and retire the old array. Routes are shared, not copied.
+    void rebuild() {
+        buckets* old = cur.load();
+        size_t cap = (old->mask + 1) / 2;
+        if ((live + 1) * 2 > cap) cap *= 2;
+        buckets* b = makeBuckets(cap);
+        for (size_t i=0;i<=old->mask;i++) {
+            route* r = old->e[i].load(std::memory_order_relaxed);
+            if (!r || r == tombstone()) continue;
+            for (size_t at=r->hash & b->mask;; at=(at+1) & b->mask) {
+                if (!b->e[at].load(std::memory_order_relaxed)) { b->e[at].store(r, std::memory_order_relaxed); break; }
+            }
+        }
+        cur.store(b, std::memory_order_release);
+        tombs = 0;
+        rcuRetire(freeBuckets, old);
+    }
+};
+
+#endif
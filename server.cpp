@@ -1,336 +1,3833 @@
 #include<iostream>
 #include<thread>
 #include<string>
+#include<string_view>
 #include<cstring>
 #include<ctime>
 #include<mutex>
+#include<atomic>
 #include<unistd.h>
 #include<arpa/inet.h>
 #include<netinet/in.h>
+#include<netinet/tcp.h>
 #include<fstream>
+#include<vector>
+#include<deque>
+#include<unordered_map>
+#include<algorithm>
+#include<new>
+#include<cerrno>
+#include<climits>
+#include<csignal>
+#include<fcntl.h>
+#include<sys/stat.h>
+#include<sys/epoll.h>
+#include<sys/mman.h>
+#include<poll.h>
+#include<sys/timerfd.h>
+#include<sys/resource.h>
+#include<sys/sendfile.h>
+#include<sys/eventfd.h>
+#include<sys/uio.h>
+#include<sys/un.h>
+#include<sys/random.h>
+#include "protocol.h"
+#include "route_table.h"
+#include "timing_wheel.h"
+#include "async_log.h"
+#include "spool.h"
+#include "metrics.h"
+#include "catalog.h"
+#include "dedup_store.h"
+#include "compress.h"
+#include "work_pool.h"
+#include "uring.h"
+#include "slab.h"
+#include "tls.h"
 using namespace std;
-const int TCP_port = 5000;
-const int UDP_port = 6000;
-const int MAX_CLIENTS = 10;
+int TCP_port = 5000;                // --port N
+int UDP_port = 6000;                // heartbeats (and federation gossip) on the TCP port + 1000
+const int MCAST_port = 6001;        // --mcast announcements (fixed: clients join it); no --port may put heartbeats here
 const int BUF = 8192;               // buffer size for reads
-const int MAX_FILES = 200;          // max number of received files the server will index
+const int MAX_EVENTS = 256;         // epoll events handled per wakeup
+const int HB_SUMMARY_SEC = 10;      // heartbeat summary period
+const int HB_INTERVAL_SEC = 5;      // clients send a heartbeat this often
+const int HB_BATCH = 64;            // datagrams per recvmmsg()
+const int HB_DGRAM_MAX = 480;       // longer datagrams are neither heartbeats nor federation gossip
+const size_t MAX_AUTH_LINE = 1024;  // longest auth line accepted before the connection is dropped
+const int MAX_XFERS = 8;            // concurrent incoming file streams per connection
+const size_t FWD_HIGH_WATER = 16*FILE_CHUNK;  // pause a file sender when its target has this much unsent
+const size_t FWD_LOW_WATER = 4*FILE_CHUNK;    // ...and resume it once the target is back under this
+const size_t LEGACY_FILE_MAX = BUF - 512;     // largest file a legacy text-protocol client can take in one read
+const size_t RX_KEEP = 2*FILE_CHUNK;          // receive buffer a connection keeps once it has consumed it all
+const int PAUSE_RETRY_MS = 10;      // how often paused senders re-check their target's backlog
+const size_t SAVE_HIGH_WATER = 32*FILE_CHUNK; // pause a sender with this much of a saved file waiting for the workers
+const size_t SAVE_LOW_WATER = 8*FILE_CHUNK;   // ...and resume it once they are back under this
+const size_t SPLICE_MIN = 4096;     // chunk payload still in the socket worth splicing instead of reading
+const size_t BULK_QUANTUM = FILE_CHUNK; // file stream bytes the writer takes per round, behind the control lane
+const int NOTSENT_LOWAT = 128 << 10;    // unsent bytes a socket may hold, so chunks do not pile up in the kernel
+const int SPOOL_SYNC_MS = 5;        // group commit period of the store-and-forward spools
+const size_t SESSION_TOKEN_BYTES = 16;  // random bytes in a session token (sent as hex)
+const unsigned URING_ENTRIES = 1024;    // --io uring: SQEs per ring (4x as many completions)
+const unsigned URING_RX_BUFS = 512;     // provided BUF-byte buffers per ring for socket reads
+const unsigned URING_HB_BUFS = 256;     // provided buffers for heartbeat datagrams (reactor 0)
+const unsigned URING_HB_BUF = 512;      // each: recvmsg header, sender address, up to HB_DGRAM_MAX bytes
+const int URING_WRITE_SLOTS = 64;       // registered FILE_CHUNK buffers per ring for saved-file writes
+const int URING_FILES = 65536;          // file table slots: a socket whose fd is below this sits in slot fd
+const int FED_MAX_NODES = 32;       // --node: servers in a federation
+const int FED_VNODES = 64;          // points of each server on the hash ring
+const int FED_DEAD_SEC = 3;         // a server whose gossip stopped this long ago leaves the ring
+const int FED_XFERS = 256;          // file streams in flight on one trunk
+const int FED_SKEW_SEC = 30;        // signed gossip and trunk hellos stamped further than this from our clock are refused
+const size_t FED_SIG_MAX = 6 + 20 + 5 + 64; // ";Time:<secs>;Mac:<hex>" appended by fedSign()
+const int ACCEPT_BATCH = 64;        // connections accepted per wakeup before the reactor serves the ones it has
+const int AUTH_TIMEOUT_SEC = 10;    // a connection that has not sent its auth line by then is dropped
+const int AUTH_EVICT_MS = 1000;     // ...or by then, if a newer one needs its place in a full auth stage
+const int SHED_RETRY_MS = 250;      // retry hint for a connection shed while the auth stage is full, stretched under load
+const int SHED_RETRY_MAX_MS = 30000;
+const int SRC_BUCKET_BITS = 12;     // --src-rate: token buckets, by hashed source address
+const int SRC_LOCKS = 64;
 
-// Hard-coded credentials (campus -> pass).
-struct Cred { const char* campus; const char* pass; };
-Cred creds[] = { {"Lahore","NU-LHR-123"}, {"Karachi","NU-KHI-123"}, {"Multan","NU-MULT-123"}, {"Peshawar","NU-PSH-123"}, {"CFD","NU-CFD-123"} };
-int CRED_COUNT = sizeof(creds)/sizeof(creds[0]);
+int HB_MISS = 3;                    // --hb-miss: missed heartbeat intervals before a campus is offline
+int MAX_CLIENTS = 1024;             // --max-clients: campus slots (TCP or UDP-only) in the routing table
+int REACTORS = 1;                   // event loops (one per core with --reactors N); >1 uses SO_REUSEPORT
+size_t OUTQ_LIMIT = 4u << 20;       // --outq-limit: queued bytes per connection before the overflow policy applies
+enum { OVERFLOW_DROP, OVERFLOW_BLOCK, OVERFLOW_SPILL };
+int OVERFLOW_POLICY = OVERFLOW_BLOCK; // --overflow drop|block|spill
+bool SPLICE_RELAY = true;           // --relay splice|copy: move file chunk payloads socket->pipe->socket/file
+string SPOOL_DIR;                   // --spool DIR: store messages/files for offline campuses here ("" = off)
+size_t SPOOL_MAX = 256u << 20;      // --spool-max: undelivered bytes kept per campus
+int SESSION_TTL = 60;               // --session-ttl: seconds a dropped session can be resumed
+size_t SESSION_REPLAY = 1u << 20;   // --session-replay: bytes of written frames kept per session for resends
+string MCAST_GROUP;                 // --mcast ADDR: admin announcements go to this IPv4 multicast group
+int annSock = -1;                   // admin announcements are sent from here
+string METRICS_ADDR;                // --metrics PORT|unix:PATH: Prometheus text endpoint ("" = off)
+string CATALOG_PATH = "received_files.catalog"; // --catalog: index of the files saved on the server
+const int LIST_PAGE = 20;           // received files shown per page by the admin listing
+string STORE_DIR;                   // --store DIR: keep files saved on the server deduplicated here ("" = off)
+int WORKERS = -1;                   // --workers N: threads that write files saved on the server (-1 = one per core, 0 = none)
+bool IO_URING = false;              // --io epoll|uring: how the reactors do socket and saved-file I/O
+string NODE_NAME, NODE_HOST;        // --node NAME@HOST: federate as NAME, reached by the others at HOST:TCP_port ("" = off)
+vector<pair<string,int>> FED_SEEDS; // --peer HOST:PORT: servers of the federation to announce ourselves to
+string FED_KEY;                     // --fed-key: shared key the servers of a federation sign gossip and trunk hellos with (required with --node)
+int LISTEN_BACKLOG = 4096;          // --backlog N: connections the kernel queues on each listen socket (capped by net.core.somaxconn)
+int AUTH_MAX = 1024;                // --auth-max N: connections waiting for their auth line, server-wide, before new ones are shed (0 = no limit)
+double SRC_RATE = 0, SRC_BURST = 0; // --src-rate R[:BURST]: new connections per second per source address (0 = no limit)
+string TLS_CERT, TLS_KEY, TLS_CA;   // --tls-cert/--tls-key/--tls-ca: PEM files ("" = plaintext; key and CA default to the cert file)
+SSL_CTX* tlsServer = nullptr;       // every TCP connection starts with a TLS handshake (tls.h)
+SSL_CTX* tlsTrunk = nullptr;        // ...and so do trunks we open, checked against --tls-ca
 
-// Simple client slot (fixed array; no STL containers)
+// Hard-coded credentials (campus -> pass), plus any loaded with --creds FILE.
+struct Cred { string campus, pass; };
+vector<Cred> creds = { {"Lahore","NU-LHR-123"}, {"Karachi","NU-KHI-123"}, {"Multan","NU-MULT-123"}, {"Peshawar","NU-PSH-123"}, {"CFD","NU-CFD-123"} };
+int CRED_COUNT = (int)creds.size();
+unordered_map<string_view,int> credIndex; // campus -> index in creds (filled in main, read-only after; views into creds)
+
+// --group NAME=A,B,C: campuses a "@NAME" target fans out to (fixed at startup)
+struct campus_group { string name; vector<string> members; };
+vector<campus_group> groups;
+
+// overflow=spill: records of one writer lane waiting on disk (guarded by the conn's spillMtx)
+struct spill_file {
+    int fd = -1;
+    off_t rd = 0, wr = 0;
+    atomic<bool> on{false};    // records are waiting in it
+    bool failed = false;       // reading it back failed: the connection is being closed
+};
+
+// Anything registered with epoll starts with this header so the loop can tell sources apart
+enum { EV_LISTEN, EV_UDP, EV_TIMER, EV_WAKE, EV_CONN };
+struct evsrc { int kind; int fd; };
+
+// One file stream arriving on a connection (FT_FILE_START .. FT_FILE_END)
+struct xfer : slab_object {
+    uint32_t id;               // seq of the FT_FILE_START frame
+    string target, fname;
+    string from;               // sending campus (on a trunk: the one the stream is forwarded for)
+    uint32_t fromId;           // its wire id
+    uint32_t replyId;          // id its replies carry: id, or on a trunk the sender's own transfer id
+    bool save;                 // target is Islamabad: the file is saved on the server
+    // The save side (fd .. newBytes, and bytes) belongs to the worker running c's strand
+    // under --workers, to the reactor otherwise (and for ring saves)
+    int fd;                    // file being written when the target is Islamabad, -1 otherwise
+    string stored;             // its name on disk
+    string fwdCampus;          // campus the stream is forwarded to
+    int fwdNode;               // ...through the trunk to this server of the federation (-1: it is ours)
+    uint64_t fwdSerial;        // serial of that campus' connection (or the trunk) when the stream started
+    uint32_t fwdId;            // transfer id used towards the target
+    bool fwdLegacy;            // target speaks the text protocol: gather (bounded) and send at END
+    bool fwdComp;              // target takes FF_COMPRESSED chunks: packed ones pass through
+    string legacyBuf;
+    atomic<bool> failed;       // refused or aborted: swallow the remaining chunks (a save worker may set it)
+    uint64_t bytes;
+    spool* sp;                 // target offline: the stream goes into its spool instead
+    uint32_t spXid;            // stream id within that spool
+    // --store: the file is saved as chunks in the dedup store instead of through fd
+    bool toStore;
+    bool offer;                // started by FT_FILE_OFFER: only the chunks in `need` follow
+    cdc_chunker cdc;
+    string chunkBuf;           // current chunk so far
+    vector<chunk_ref> recipe;  // the file's chunks, in order
+    vector<chunk_ref> pins;    // chunks pinned for it so far (released if it never completes)
+    vector<uint32_t> need;     // offer: indexes of the chunks still to come
+    size_t needPos;
+    uint64_t newBytes;         // bytes the store did not have yet
+    // --io uring: a plain save is written through the reactor's ring instead of the workers
+    bool ring;
+    int ringWrites;            // writes in flight
+    bool ringEnd, ringOk;      // FILE_END came (ok or not): saveEnd() once ringWrites is 0
+    // Sender with windows (;Flow:window): chunk bytes not handed back with FT_WINDOW yet
+    size_t owed;
+    bool held;                 // ...because the destination is over its high water (retryWindows)
+    xfer() { id=0; fromId=0; replyId=0; fwdNode=-1; save=false; fd=-1; fwdSerial=0; fwdId=0; fwdLegacy=false; fwdComp=false; failed=false; bytes=0; sp=nullptr; spXid=0; toStore=false; offer=false; needPos=0; newBytes=0;
+             ring=false; ringWrites=0; ringEnd=ringOk=false; owed=0; held=false; }
+};
+
+// One queued outbound unit: inline bytes (a whole frame, or just a frame header) optionally
+// followed by either external bytes the message only points at (a spool mapping, kept alive
+// until release) or a byte range of an open file that the writer sends with sendfile().
+// Allocated as one block with the inline bytes right behind the struct.
+struct out_msg {
+    atomic<out_msg*> next;     // MPSC queue link (producers)
+    out_msg* wnext;            // writer's local list link
+    uint32_t len;              // inline bytes
+    bool bulk;                 // part of a file stream: queued in the bulk lane
+    const char* ext;           // external bytes, written right after the inline ones
+    size_t extLen;
+    void (*release)(void*);    // release(relArg) when the message is freed (nullptr if none)
+    void* relArg;
+    int fileFd;                // -1 if none; closed once sent
+    off_t fileOff;
+    size_t fileLen;
+    char* data() { return (char*)(this+1); }
+    size_t memLen() const { return len + extLen; }
+    size_t size() const { return len + extLen + fileLen; }
+};
+
+// Vyukov intrusive multi-producer / single-consumer queue: push is one atomic exchange,
+// pop is wait-free for the single consumer (the connection's owning reactor)
+struct mpsc_queue {
+    atomic<out_msg*> head;     // producers swap themselves in here
+    out_msg* tail;             // consumer end
+    out_msg stub;
+    mpsc_queue() { stub.next = nullptr; head = &stub; tail = &stub; }
+    void push(out_msg* m) {
+        m->next.store(nullptr, memory_order_relaxed);
+        out_msg* prev = head.exchange(m, memory_order_acq_rel);
+        prev->next.store(m, memory_order_release);
+    }
+    // nullptr if empty or a producer is half way through push() (see empty())
+    out_msg* pop() {
+        out_msg* t = tail;
+        out_msg* nx = t->next.load(memory_order_acquire);
+        if (t == &stub) {
+            if (!nx) return nullptr;
+            tail = nx; t = nx; nx = nx->next.load(memory_order_acquire);
+        }
+        if (nx) { tail = nx; return t; }
+        if (t != head.load(memory_order_acquire)) return nullptr;
+        push(&stub);
+        nx = t->next.load(memory_order_acquire);
+        if (nx) { tail = nx; return t; }
+        return nullptr;
+    }
+    bool empty() { return tail == &stub && !stub.next.load(memory_order_acquire) && head.load(memory_order_acquire) == &stub; }
+};
+
+// One TCP connection, owned by the reactor that accepted it. Its state, receive buffer and
+// queued frames live in the slab (slab.h).
+struct session;
+
+struct conn : evsrc, slab_object {
+    int reactor;               // owning reactor index
+    uint64_t serial;           // unique per connection, tells a reconnected campus apart
+    bool authed;               // passed Campus:...;Pass:... check
+    bool framed;               // negotiated the framed protocol (false = legacy text)
+    bool comp;                 // negotiated compression: takes FF_COMPRESSED frames
+    bool windows;              // negotiated flow control: its file streams run on FT_WINDOW credit
+    bool owing;                // on the reactor's owing list (holds a reference)
+    bool admitted;             // accepted and counted in authPending until its auth line is handled
+    SSL* tls;                  // TLS handshake under way; nothing is read or written in the clear meanwhile
+    uint64_t acceptedNs;       // ...which must come within AUTH_TIMEOUT_SEC of this
+    string campus;             // campus name once authenticated
+    uint32_t campusId;         // id stamped into frames this campus sends
+    int slot;                  // its clients[] slot once authenticated (-1 before)
+    atomic<uint32_t> outSeq;   // sequence number for server-originated frames
+    basic_frame_reader<slab_string> rd; // reassembly buffer (also holds a partial auth line)
+    atomic<size_t> rxMem;      // its capacity, for --metrics (owner reactor writes)
+    atomic<int> refs;          // owner + routing lookups in flight + ready-list membership
+    atomic<bool> closed;       // socket closed; queued output is discarded
+
+    // Outbound side. Any thread may enqueue; only the owning reactor writes to the socket.
+    // Two lanes: q for control and chat, bq for file streams, which the writer interleaves a
+    // BULK_QUANTUM at a time so a message never waits behind a whole file.
+    mpsc_queue q;
+    mpsc_queue bq;
+    atomic<size_t> queued;     // bytes in q, bq and the writer list (excludes spill)
+    atomic<bool> scheduled;    // already on the owner's ready stack
+    atomic<conn*> readyNext;   // ready stack link
+    out_msg* whead;            // writer's local list: popped, not yet fully written
+    out_msg* wtail;
+    size_t wOff;               // bytes of whead already written
+    mutex spillMtx;            // overflow=spill only: guards the spill files
+    spill_file spill[2];       // one per lane (index: bulk), so spilled chunks never hold up chat
+    vector<xfer*, slab_allocator<xfer*>> xfers; // incoming file streams (allocated on FT_FILE_START), MAX_XFERS slots
+    bool paused;               // not reading: a file target is over FWD_HIGH_WATER
+    string blockedOn;          // campus whose backlog paused us
+    int blockedNode;           // ...or server whose trunk did (-1 if none)
+    int node;                  // trunk to this server of the federation (-1: a campus)
+    uint32_t spliceLeft;       // payload bytes of the current FT_FILE_CHUNK still in the socket
+    uint32_t spliceXfer;       // its transfer id
+    work_strand* strand;       // --workers: runs the save side of this connection's files, in order
+    atomic<size_t> saveQueued; // chunk bytes posted to the strand and not yet written
+    // Store-and-forward replay (owner reactor only)
+    spool* sp;                 // this campus' spool while we are attached to it
+    bool spoolHold;            // legacy campus: replay waits for its first command, so stored
+                               // text cannot arrive glued to AUTH_OK in one read
+    deque<pair<uint32_t,uint64_t>> unacked;     // replayed FF_STORED frames: (seq, spool position after it)
+    vector<pair<uint32_t,uint32_t>> replayIds;  // spooled file stream xid -> transfer id towards us
+    vector<pair<uint32_t,uint64_t>> openFiles;  // replayed streams not acknowledged yet: (transfer id, START position)
+    uint64_t replayRecs, replayBytes, replayStartNs; // drain statistics, logged once caught up
+    // Session resumption
+    session* sess;             // session this connection carries (framed campuses that asked for one)
+    uint64_t framesOut;        // frames of the session written so far (owner reactor)
+    session* resumeOf;         // resume waiting for the session's old connection to go away
+    uint64_t resumeLast;       // frames the campus said it had received
+    atomic<bool> resumeGo;     // the old connection is gone: finish the resume (owner reactor)
+    // --io uring (owner reactor only)
+    bool fixed;                // in the ring's file table (at slot fd)
+    bool recvArmed;            // a multishot recv is in flight (holds a reference)
+    bool recvStop;             // ...and it is being cancelled: c must not be read for now
+    bool outArmed;             // a POLLOUT poll is in flight (holds a reference)
+    bool tlsArmed;             // a poll for the TLS handshake is in flight (holds a reference)
+    deque<slab_string> held;   // reads that came in while c must not be read ("" = EOF)
+    conn(int s, int r) {
+        kind=EV_CONN; fd=s; reactor=r; rxMem=0; authed=false; framed=false; comp=false; windows=owing=admitted=false; tls=nullptr; acceptedNs=0; campusId=0; slot=-1; outSeq=0; paused=false; blockedNode=-1; node=-1;
+        spliceLeft=0; spliceXfer=0; strand=nullptr; saveQueued=0; refs=1; closed=false;
+        sp=nullptr; spoolHold=false; replayRecs=replayBytes=replayStartNs=0;
+        sess=nullptr; framesOut=0; resumeOf=nullptr; resumeLast=0; resumeGo=false;
+        fixed=recvArmed=recvStop=outArmed=tlsArmed=false;
+        queued=0; scheduled=false; readyNext=nullptr; whead=wtail=nullptr; wOff=0;
+        static atomic<uint64_t> nextSerial(1);
+        serial = nextSerial++;
+        xfers.assign(MAX_XFERS, nullptr);
+    }
+};
+
+// Per-campus traffic counters for --metrics, on their own cache line. Updated by whichever
+// reactor routes the traffic, read by the metrics thread; reset when the slot is reused.
+struct alignas(64) campus_counters {
+    atomic<uint64_t> msgsSent, bytesSent, msgsRecv, bytesRecv, filesSent, filesRecv;
+    void reset() { msgsSent = 0; bytesSent = 0; msgsRecv = 0; bytesRecv = 0; filesSent = 0; filesRecv = 0; }
+};
+
+// Campus slot (array of MAX_CLIENTS, indexed through the routing table).
+// used/name/tcpSock change under mtx; the atomics are read without it by routing and heartbeats.
 struct client_slot {
     bool used;                 // slot in use?
     char name[64];             // campus name
     int tcpSock;               // TCP socket fd (-1 if none)
-    sockaddr_in udpAddr;       // last UDP heartbeat sender address
-    time_t lastHB;             // last heartbeat time (0 if none)
-    client_slot() { used=false; tcpSock=-1; lastHB=0; memset(name,0,sizeof(name)); memset(&udpAddr,0,sizeof(udpAddr)); }
-} clients[MAX_CLIENTS];
-
-mutex mtx; // protects clients[] and files list and other shared state
-
-// Maintain a simple index of received files (so admin can list & open them)
-struct rcvd_file{
-    bool used;
-    char storedName[256];    // saved filename on server (received_from_<campus>_<filename>)
-    char originalName[128];  // original filename sent by client
-    char sender[64];         // sender campus
-    time_t receivedAt;
-    rcvd_file() { used=false; memset(storedName,0,sizeof(storedName)); memset(originalName,0,sizeof(originalName)); memset(sender,0,sizeof(sender)); receivedAt=0; }
-} receivedFiles[MAX_FILES];
-
-// Simple log with timestamp
-void login(const string &s) {
-    time_t t = time(NULL);
-    char tb[26]; ctime_r(&t, tb); tb[strlen(tb)-1] = 0; // remove newline
-    cout << "[" << tb << "] " << s << endl;
-}
-
-// Validate auth string of form "Campus:Name;Pass:Pwd"
+    atomic<conn*> tcpConn;     // connection behind tcpSock (nullptr if none)
+    atomic<uint64_t> udpKey;   // last UDP heartbeat sender, see udpKeyOf() (0 if none)
+    atomic<time_t> lastHB;     // last heartbeat time (0 if none)
+    atomic<bool> hbOnline;     // heartbeats arriving; false once HB_MISS intervals were missed
+    atomic<uint32_t> gen;      // bumped on every registration of the slot
+    uint64_t hbSeen;           // reactor 0 only: monotonic second of the last heartbeat
+    uint32_t hbGen;            // reactor 0 only: registration the liveness timer belongs to
+    campus_counters stats;
+    client_slot() { stats.reset(); used=false; tcpSock=-1; tcpConn=nullptr; udpKey=0; lastHB=0; hbOnline=false; gen=0; hbSeen=0; hbGen=0; memset(name,0,sizeof(name)); }
+};
+client_slot* clients;          // MAX_CLIENTS slots
+route_table* routes;           // campus name -> slot; lock-free readers, writers hold mtx
+vector<int> freeSlots;         // unused slot indices (under mtx); a slot returns here one grace period after it is unregistered
+timing_wheel* hbWheel;         // liveness timer per slot, in monotonic seconds (reactor 0 only)
+spool** spools;                // --spool: one per credentialed campus (indexed by wire id - 1), nullptr if off
+
+struct uring_io;
+
+// One epoll event loop. Reactor 0 also owns the UDP heartbeat socket and the summary timer.
+struct reactor {
+    int id;
+    int ep;                    // epoll fd (-1 under --io uring)
+    uring_io* io;              // --io uring: the ring that takes epoll's place (nullptr otherwise)
+    evsrc lsrc;                // this reactor's TCP listen socket
+    evsrc usrc;                // UDP heartbeat socket (reactor 0 only, fd -1 otherwise)
+    evsrc tsrc;                // 1 s timerfd: heartbeat expiry and summary (reactor 0 only, fd -1 otherwise)
+    evsrc wsrc;                // eventfd: another thread queued output for one of our connections
+    atomic<conn*> ready;       // lock-free stack of connections with queued output
+    vector<conn*> paused;      // senders waiting for a file or busy target to drain
+    vector<conn*> owing;       // senders with file windows held back until a destination drains
+    deque<conn*> authWait;     // admitted connections in accept order, until their auth line (each holds a reference)
+    bool acceptMore;           // the last accept batch was full: more may be waiting (epoll)
+    int pipeRd, pipeWr;        // splice relay pipe, always empty between events (-1 if unavailable)
+    size_t pipeCap;
+};
+vector<reactor*> reactors;
+
+metered_mutex mtx; // serialises clients[]/routes writers and other shared state
+
+file_catalog* catalog; // files saved on the server (catalog.h), persistent across restarts
+dedup_store* store;    // --store (dedup_store.h), nullptr if off
+work_pool* pool;       // --workers (work_pool.h), nullptr if none
+
+// Log with timestamp: queued for the async logger (async_log.h), never blocks
+void login(int level, const string &s) { logWrite(level, s.data(), s.size()); }
+void login(const string &s) { logWrite(LOG_INFO, s.data(), s.size()); }
+// Log the parts joined, without building a string (for lines logged once per message)
+void logJoin(int level, initializer_list<string_view> parts) {
+    if (!logEnabled(level)) return;
+    char line[LOG_TEXT];
+    size_t n = 0;
+    for (string_view s : parts) {
+        size_t k = min(s.size(), sizeof(line) - n);
+        memcpy(line + n, s.data(), k);
+        n += k;
+    }
+    logWrite(level, line, n);
+}
+
+// Validate auth string of form "Campus:Name;Pass:Pwd[;Proto:N]"
 // Returns true + sets campusOut if valid. Also rejects "Islamabad".
-bool validateAuth(const string &msg, string &campusOut) {
+// protoOut is the framing version the client asked for (0 = legacy text protocol).
+bool validateAuth(const string &msg, string &campusOut, int &protoOut) {
+    protoOut = 0;
     size_t p1 = msg.find("Campus:");
     size_t p2 = msg.find(";Pass:");
     if (p1 == string::npos || p2 == string::npos) return false;
     string camp = msg.substr(p1+7, p2-(p1+7));
     string pass = msg.substr(p2+6);
+    size_t p3 = pass.find(";Proto:");
+    if (p3 != string::npos) { protoOut = atoi(pass.c_str()+p3+7); pass.erase(p3); }
+    while(!pass.empty() && (pass.back()=='\n' || pass.back()=='\r')) pass.pop_back();
     // trim spaces
     while(!camp.empty() && isspace(camp.back())) camp.pop_back();
     while(!camp.empty() && isspace(camp.front())) camp.erase(0,1);
 
-    if (camp == "Islamabad") return false; // server itself; cannot be client
+    if (camp == "Islamabad") return false; // server itself; cannot be client
+
+    auto it = credIndex.find(camp);
+    if (it == credIndex.end() || pass != creds[it->second].pass) return false;
+    campusOut = camp;
+    return true;
+}
+
+// Wire id of a credentialed campus (its position in creds[] + 1), ID_BY_NAME if unknown
+uint32_t campusId(string_view name) {
+    auto it = credIndex.find(name);
+    return it == credIndex.end() ? ID_BY_NAME : (uint32_t)it->second + 1;
+}
+
+// Name for a wire id, or "" if the id is not a known campus
+const string &campusName(uint32_t id) {
+    static const string none;
+    if (id == ID_BY_NAME || id > (uint32_t)CRED_COUNT) return none;
+    return creds[id-1].campus;
+}
+
+// Is the campus name registered (TCP or UDP-only)? Lock-free.
+bool campusRegistered(const string &name) {
+    rcu_guard g;
+    return routes->find(name) != nullptr;
+}
+
+// IPv4 heartbeat address packed into one atomic word: addr << 16 | port (both network order)
+uint64_t udpKeyOf(const sockaddr_in &a) { return ((uint64_t)a.sin_addr.s_addr << 16) | a.sin_port; }
+sockaddr_in udpAddrOf(uint64_t key) {
+    sockaddr_in a; memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET; a.sin_addr.s_addr = (uint32_t)(key >> 16); a.sin_port = (uint16_t)key;
+    return a;
+}
+
+// Claim a free slot for name and publish it in the routing table; -1 if full. Caller holds mtx.
+int registerCampus(const string &name, conn* c) {
+    if (freeSlots.empty()) return -1;
+    int idx = freeSlots.back();
+    freeSlots.pop_back();
+    client_slot &s = clients[idx];
+    s.used = true;
+    strncpy(s.name, name.c_str(), sizeof(s.name)-1);
+    s.tcpSock = c ? c->fd : -1;
+    s.lastHB = 0;
+    s.udpKey = 0;
+    s.hbOnline = false;
+    s.gen++;
+    s.stats.reset();
+    if (c) c->slot = idx;
+    s.tcpConn.store(c, memory_order_release);
+    routes->insert(name, idx);
+    return idx;
+}
+
+// Register name on connection c. A UDP-only entry (heartbeats kept coming while the campus'
+// TCP connection was down) is taken over. Returns the slot, -2 if another connection holds the
+// campus, -1 if full. Caller holds mtx.
+int claimCampus(const string &name, conn* c) {
+    const route* r = routes->find(name);
+    if (!r) return registerCampus(name, c);
+    client_slot &s = clients[r->slot];
+    if (s.tcpConn.load()) return -2;
+    s.tcpSock = c->fd;
+    c->slot = r->slot;
+    s.tcpConn.store(c, memory_order_release);
+    return r->slot;
+}
+
+// Runs one grace period after a campus was unregistered: no reader can still reach the slot
+void slotGone(void* p) {
+    route* r = (route*)p;
+    lock_guard<metered_mutex> lk(mtx);
+    client_slot &s = clients[r->slot];
+    s.lastHB = 0;
+    s.udpKey = 0;
+    memset(s.name, 0, sizeof(s.name));
+    freeSlots.push_back(r->slot);
+    delete r;
+}
+
+// Remove a campus from the routing table. Caller holds mtx.
+void unregisterCampus(int idx, const string &name) {
+    clients[idx].used = false;
+    clients[idx].tcpSock = -1;
+    clients[idx].tcpConn = nullptr;
+    routes->erase(name, slotGone);
+}
+
+// Set O_NONBLOCK on a descriptor
+int setNonBlocking(int fd) {
+    int fl = fcntl(fd, F_GETFL, 0);
+    if (fl < 0) return -1;
+    return fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+void epollAdd(int ep, evsrc* s, uint32_t events) {
+    epoll_event ev; memset(&ev,0,sizeof(ev));
+    ev.events = events; ev.data.ptr = s;
+    epoll_ctl(ep, EPOLL_CTL_ADD, s->fd, &ev);
+}
+
+thread_local reactor* curReactor = nullptr; // reactor running on this thread (nullptr: admin console)
+
+// Heap allocations are counted as campus_heap_allocations_total by threads that keep metrics.
+// The C allocator's entry points are replaced here and passed on to glibc, so every allocation
+// is seen: operator new in all its forms (libstdc++ calls malloc, aligned_alloc), strdup and
+// the like, and direct calls. Routing a steady stream of messages leaves it flat (loadgen
+// --alloc-check fails otherwise).
+extern "C" {
+void* __libc_malloc(size_t);
+void* __libc_calloc(size_t, size_t);
+void* __libc_realloc(void*, size_t);
+void* __libc_memalign(size_t, size_t);
+void* __libc_valloc(size_t);
+void* __libc_pvalloc(size_t);
+}
+inline void countAlloc() { if (met_block* b = metSelf) metBump(b, b->c[M_HEAP_ALLOCS], 1); }
+extern "C" {
+void* malloc(size_t n) { countAlloc(); return __libc_malloc(n); }
+void* calloc(size_t k, size_t n) { countAlloc(); return __libc_calloc(k, n); }
+void* realloc(void* p, size_t n) { countAlloc(); return __libc_realloc(p, n); }
+void* memalign(size_t a, size_t n) { countAlloc(); return __libc_memalign(a, n); }
+void* aligned_alloc(size_t a, size_t n) { countAlloc(); return __libc_memalign(a, n); }
+void* valloc(size_t n) { countAlloc(); return __libc_valloc(n); }
+void* pvalloc(size_t n) { countAlloc(); return __libc_pvalloc(n); }
+int posix_memalign(void** out, size_t a, size_t n) {
+    if (a % sizeof(void*) || (a & (a - 1))) return EINVAL;
+    countAlloc();
+    void* p = __libc_memalign(a, n);
+    if (!p) return ENOMEM;
+    *out = p;
+    return 0;
+}
+}
+
+out_msg* newMsg(size_t inlineLen) {
+    out_msg* m = new (slabAlloc(sizeof(out_msg) + inlineLen)) out_msg();
+    m->next = nullptr; m->wnext = nullptr;
+    m->len = (uint32_t)inlineLen; m->bulk = false; m->fileFd = -1; m->fileOff = 0; m->fileLen = 0;
+    m->ext = nullptr; m->extLen = 0; m->release = nullptr; m->relArg = nullptr;
+    return m;
+}
+out_msg* newMsg(const char* p, size_t n) {
+    out_msg* m = newMsg(n);
+    memcpy(m->data(), p, n);
+    return m;
+}
+// Frames of a live file stream, which go in the bulk lane (replayed ones from a spool do not:
+// their acknowledgements must come back in the order they were queued)
+bool bulkFrame(uint8_t type) { return type == FT_FILE_START || type == FT_FILE_CHUNK || type == FT_FILE_END || type == FT_FWD_FILE; }
+
+// Whole frame (header + payload) as one message
+out_msg* newFrame(uint8_t type, uint32_t target, uint32_t seq, const char* p, size_t n, uint8_t flags = 0) {
+    out_msg* m = newMsg(FRAME_HDR + n);
+    encodeHdr(m->data(), type, (uint32_t)n, target, seq, flags);
+    m->bulk = bulkFrame(type);
+    memcpy(m->data()+FRAME_HDR, p, n);
+    return m;
+}
+out_msg* newFrame(uint8_t type, uint32_t target, uint32_t seq, string_view payload, uint8_t flags = 0) {
+    return newFrame(type, target, seq, payload.data(), payload.size(), flags);
+}
+// Immutable payload shared by every recipient of a fan-out; the last message freed drops it
+struct shared_buf {
+    atomic<int> refs;
+    uint32_t len;
+    char* data() { return (char*)(this+1); }
+};
+// len bytes, filled in by the caller
+shared_buf* newShared(size_t len) {
+    shared_buf* b = new (slabAlloc(sizeof(shared_buf) + len)) shared_buf();
+    b->refs = 1;
+    b->len = (uint32_t)len;
+    return b;
+}
+void sharedUnref(void* p) {
+    shared_buf* b = (shared_buf*)p;
+    if (b->refs.fetch_sub(1) != 1) return;
+    b->~shared_buf();
+    slabFree(b);
+}
+// Message whose bytes are hdrLen inline bytes followed by the shared payload
+out_msg* newSharedMsg(size_t hdrLen, shared_buf* b) {
+    out_msg* m = newMsg(hdrLen);
+    b->refs.fetch_add(1);
+    m->ext = b->data(); m->extLen = b->len;
+    m->release = sharedUnref; m->relArg = b;
+    return m;
+}
+
+void freeMsg(out_msg* m) {
+    if (m->fileFd != -1) close(m->fileFd);
+    if (m->release) m->release(m->relArg);
+    m->~out_msg();
+    slabFree(m);
+}
+
+void connRef(conn* c) { c->refs.fetch_add(1); }
+
+// Take a reference on a connection found through the routing table (inside an rcu section):
+// fails if its last reference is already gone
+bool connTryRef(conn* c) {
+    int r = c->refs.load();
+    while (r > 0) if (c->refs.compare_exchange_weak(r, r+1)) return true;
+    return false;
+}
+
+void freeConn(void* p) {
+    conn* c = (conn*)p;
+    while (out_msg* m = c->q.pop()) freeMsg(m);
+    while (out_msg* m = c->bq.pop()) freeMsg(m);
+    while (out_msg* m = c->whead) { c->whead = m->wnext; freeMsg(m); }
+    for (spill_file &s : c->spill) if (s.fd != -1) close(s.fd);
+    if (c->strand) strandUnref(c->strand);
+    delete c;
+}
+
+// Drop a reference; the last one frees the connection and anything still queued on it once
+// lock-free routing lookups can no longer be looking at it
+void connUnref(conn* c) {
+    if (c->refs.fetch_sub(1) == 1) rcuRetire(freeConn, c);
+}
+
+// Interrupt R's epoll_wait (from another thread)
+void wakeReactor(reactor* R) {
+    uint64_t one = 1;
+    if (write(R->wsrc.fd, &one, sizeof(one)) < 0) {} // counter saturated: a wakeup is pending anyway
+}
+
+// Make sure the owning reactor drains c soon. Connections are pushed onto the reactor's
+// lock-free ready stack; the eventfd is only poked when the stack was empty and we are
+// some other thread (the reactor itself checks the stack before it sleeps).
+void scheduleWrite(conn* c) {
+    if (c->scheduled.exchange(true)) return;
+    reactor* R = reactors[c->reactor];
+    connRef(c);
+    conn* old = R->ready.load();
+    do { c->readyNext.store(old); } while (!R->ready.compare_exchange_weak(old, c));
+    if (old == nullptr && curReactor != R) wakeReactor(R);
+}
+
+// overflow=spill: append the message to the spill file of its lane as [u32 len][bytes] (file
+// ranges are copied in with copy_file_range). The writer replays a lane's file once that
+// lane's in-memory queue has drained.
+bool spillMsg(conn* c, out_msg* m) {
+    lock_guard<mutex> lk(c->spillMtx);
+    spill_file &s = c->spill[m->bulk];
+    if (s.fd == -1) {
+        s.fd = open(".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (s.fd < 0) {
+            char tmpl[] = "spill_XXXXXX";
+            s.fd = mkstemp(tmpl);
+            if (s.fd >= 0) unlink(tmpl);
+        }
+        if (s.fd < 0) return false;
+    }
+    uint32_t n = (uint32_t)m->size();
+    off_t wr = s.wr;
+    if (pwrite(s.fd, &n, 4, wr) != 4) return false;
+    if (pwrite(s.fd, m->data(), m->len, wr+4) != (ssize_t)m->len) return false;
+    if (m->extLen && pwrite(s.fd, m->ext, m->extLen, wr+4+m->len) != (ssize_t)m->extLen) return false;
+    off_t dst = wr + 4 + m->memLen(), src = m->fileOff;
+    size_t left = m->fileLen;
+    while (left > 0) {
+        ssize_t k = copy_file_range(m->fileFd, &src, s.fd, &dst, left, 0);
+        if (k <= 0) return false;
+        left -= k;
+    }
+    s.wr = wr + 4 + n;
+    s.on = true;
+    freeMsg(m);
+    metAdd(M_SPILLED);
+    return true;
+}
+
+// Queue a message for c and make sure its reactor will write it. Control traffic (replies,
+// auth answers, stream ends) passes force and is never refused for size. Returns false if
+// the message was dropped (closed connection, or over OUTQ_LIMIT under --overflow drop).
+bool connEnqueue(conn* c, out_msg* m, bool force = false) {
+    if (c->closed) { freeMsg(m); return false; }
+    bool over = c->queued.load() + m->size() > OUTQ_LIMIT;
+    if (OVERFLOW_POLICY == OVERFLOW_SPILL && (c->spill[m->bulk].on.load() || (over && !force))) {
+        if (spillMsg(c, m)) { scheduleWrite(c); return true; }
+        // spill file unusable: keep it in memory rather than lose it
+    }
+    else if (OVERFLOW_POLICY == OVERFLOW_DROP && over && !force) {
+        freeMsg(m);
+        return false;
+    }
+    c->queued += m->size();
+    (m->bulk ? c->bq : c->q).push(m);
+    scheduleWrite(c);
+    return true;
+}
+
+void connSend(conn* c, string_view s) { connEnqueue(c, newMsg(s.data(), s.size()), true); }
+
+bool connSendFrame(conn* c, uint8_t type, uint32_t target, uint32_t seq, const char* p, size_t n, uint8_t flags = 0) {
+    return connEnqueue(c, newFrame(type, target, seq, p, n, flags));
+}
+
+// Writer side (owning reactor only) -------------------------------------------------
+
+void writerAppend(conn* c, out_msg* m) {
+    m->wnext = nullptr;
+    if (c->wtail) c->wtail->wnext = m; else c->whead = m;
+    c->wtail = m;
+}
+
+void sessionKeep(conn* c, out_msg* m);
+
+void writerPopFront(conn* c) {
+    out_msg* m = c->whead;
+    c->whead = m->wnext;
+    if (!c->whead) c->wtail = nullptr;
+    c->wOff = 0;
+    c->queued -= m->size();
+    if (c->sess) sessionKeep(c, m); // kept for resends after a reconnect
+    else freeMsg(m);
+}
+
+// Read exactly n bytes at off
+bool preadAll(int fd, char* p, size_t n, off_t off) {
+    while (n > 0) {
+        ssize_t r = pread(fd, p, n, off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r; n -= r; off += r;
+    }
+    return true;
+}
+
+// Bring up to `budget` bytes of a lane's spilled records back into the writer list. The file is
+// only emptied once every record in it has been read; if one cannot be read back, the lane
+// would lose it or come out of order, so the connection is shut down (its reactor closes it).
+void loadSpill(conn* c, bool bulk, size_t budget) {
+    lock_guard<mutex> lk(c->spillMtx);
+    spill_file &s = c->spill[bulk];
+    if (s.failed) return;
+    size_t loaded = 0;
+    while (s.rd < s.wr && loaded < budget) {
+        uint32_t n;
+        out_msg* m = nullptr;
+        errno = 0;
+        if (!preadAll(s.fd, (char*)&n, 4, s.rd) || n > (size_t)(s.wr - s.rd - 4)
+            || !preadAll(s.fd, (m = newMsg(n))->data(), n, s.rd+4)) {
+            int e = errno;
+            if (m) freeMsg(m);
+            s.failed = true;
+            metAdd(M_SPILL_ERRORS);
+            logJoin(LOG_ERROR, {"Reading back the spill file of ", c->campus, " failed at offset ", to_string((long long)s.rd),
+                                ": ", e ? strerror(e) : "short or corrupt record", "; ", to_string((long long)(s.wr - s.rd)), " bytes lost, disconnecting."});
+            shutdown(c->fd, SHUT_RDWR);
+            return;
+        }
+        m->bulk = bulk;
+        s.rd += 4 + n;
+        loaded += n;
+        c->queued += n;
+        writerAppend(c, m);
+    }
+    if (s.rd >= s.wr) {
+        if (ftruncate(s.fd, 0) < 0) {}
+        s.rd = s.wr = 0;
+        s.on = false;
+    }
+}
+
+const int IOV_BATCH = 64;           // iovecs gathered into one writev()
+
+void spoolReplay(conn* c);
+void ringWantWrite(conn* c);
+
+// Push queued output to the socket: writev() over a batch of messages, sendfile() for file
+// ranges, until everything is out or the socket is full (EPOLLOUT, or a ring poll, brings us back).
+// Each time the writer list runs low it takes up to IOV_BATCH control messages, then at most
+// BULK_QUANTUM of file stream frames: a message queued behind a file waits for one quantum (and
+// NOTSENT_LOWAT in the kernel), and a flood of messages still leaves the files a share.
+void connDrain(conn* c) {
+    if (c->tls) return; // the handshake is not through: its end drains
+    while (!c->closed) {
+        if (!c->whead || !c->whead->wnext) {
+            if (c->sp && c->queued.load() < FWD_LOW_WATER) spoolReplay(c);
+            int i = 0;
+            for (; i<IOV_BATCH; i++) {
+                out_msg* m = c->q.pop();
+                if (!m) break;
+                writerAppend(c, m);
+            }
+            // a spilled lane carries on once its queue is empty; control still goes first
+            if (i < IOV_BATCH && c->spill[0].on.load()) loadSpill(c, false, BULK_QUANTUM);
+            size_t b = 0;
+            while (b < BULK_QUANTUM) {
+                out_msg* m = c->bq.pop();
+                if (!m) break;
+                writerAppend(c, m);
+                b += m->size();
+            }
+            if (b < BULK_QUANTUM && c->spill[1].on.load()) loadSpill(c, true, BULK_QUANTUM - b);
+        }
+        if (!c->whead) {
+            if (c->q.empty() && c->bq.empty()) return;
+            this_thread::yield(); // a producer is between its two push steps
+            continue;
+        }
+        out_msg* h = c->whead;
+        if (c->wOff >= h->memLen()) {
+            // inline part is out: the file range follows
+            off_t off = h->fileOff + (c->wOff - h->memLen());
+            ssize_t s = sendfile(c->fd, h->fileFd, &off, h->size() - c->wOff);
+            if (s > 0) { c->wOff += s; if (c->wOff == h->size()) writerPopFront(c); continue; }
+            if (s < 0 && errno == EINTR) continue;
+            if (s < 0 && errno == EAGAIN) ringWantWrite(c);
+            return; // EAGAIN: wait for EPOLLOUT; errors surface on the read side
+        }
+        iovec iov[IOV_BATCH];
+        int n = 0;
+        for (out_msg* m = h; m && n < IOV_BATCH-1; m = m->wnext) {
+            size_t skip = (m == h) ? c->wOff : 0;
+            if (skip < m->len) { iov[n].iov_base = m->data() + skip; iov[n].iov_len = m->len - skip; n++; skip = 0; }
+            else skip -= m->len;
+            if (m->extLen) { iov[n].iov_base = (char*)m->ext + skip; iov[n].iov_len = m->extLen - skip; n++; }
+            if (m->fileLen) break; // its file range must go before anything behind it
+        }
+        ssize_t w = writev(c->fd, iov, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && errno == EAGAIN) ringWantWrite(c);
+        if (w <= 0) return;
+        size_t left = w;
+        while (left > 0) {
+            out_msg* m = c->whead;
+            size_t inl = m->memLen() - c->wOff;
+            if (left < inl) { c->wOff += left; break; }
+            left -= inl;
+            c->wOff = m->memLen();
+            if (m->fileLen) break;
+            writerPopFront(c);
+        }
+    }
+}
+
+void finishResume(reactor* R, conn* c);
+
+// Drain every connection other threads (or this one) queued output for, including any that
+// got scheduled again meanwhile (a finished resume queues its replay from here)
+void processReady(reactor* R) {
+    while (conn* c = R->ready.exchange(nullptr)) {
+        while (c) {
+            conn* nx = c->readyNext.load();
+            c->scheduled = false;
+            if (c->resumeGo.exchange(false)) finishResume(R, c);
+            connDrain(c);
+            connUnref(c);
+            c = nx;
+        }
+    }
+}
+
+// Read exactly k bytes out of the relay pipe (they are already in it)
+void pipeRead(int pipeRd, char* p, size_t k) {
+    while (k > 0) {
+        ssize_t r = read(pipeRd, p, k);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        p += r; k -= r;
+    }
+}
+
+void pipeDiscard(int pipeRd, size_t k) {
+    char buf[BUF];
+    while (k > 0) {
+        size_t n = min(k, sizeof(buf));
+        pipeRead(pipeRd, buf, n);
+        k -= n;
+    }
+}
+
+// Frame whose k payload bytes sit in the reactor's relay pipe. When this thread owns c and
+// nothing is queued ahead, the payload goes pipe -> socket without passing through user
+// space; whatever the socket will not take right now (or everything, for a connection on
+// another reactor) is copied into a message. Returns false if the frame was dropped.
+bool connSpliceFrame(conn* c, uint8_t type, uint32_t target, uint32_t seq, int pipeRd, size_t k) {
+    char hdr[FRAME_HDR];
+    encodeHdr(hdr, type, (uint32_t)k, target, seq);
+    // a session keeps every frame it writes, so its frames must exist as messages
+    if (curReactor != reactors[c->reactor] || c->closed || c->whead || !c->q.empty() || !c->bq.empty() || c->spill[0].on.load() || c->spill[1].on.load() || c->sess) {
+        out_msg* m = newMsg(FRAME_HDR + k);
+        memcpy(m->data(), hdr, FRAME_HDR);
+        m->bulk = bulkFrame(type);
+        pipeRead(pipeRd, m->data()+FRAME_HDR, k);
+        return connEnqueue(c, m);
+    }
+    size_t hOff = 0;
+    while (hOff < FRAME_HDR) {
+        ssize_t w = write(c->fd, hdr+hOff, FRAME_HDR-hOff);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        hOff += w;
+    }
+    while (hOff == FRAME_HDR && k > 0) {
+        ssize_t s = splice(pipeRd, nullptr, c->fd, nullptr, k, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (s < 0 && errno == EINTR) continue;
+        if (s <= 0) break;
+        k -= s;
+    }
+    if (hOff == FRAME_HDR && k == 0) return true;
+    // the rest becomes the writer's head, so it stays in front of anything queued meanwhile
+    out_msg* m = newMsg(FRAME_HDR - hOff + k);
+    memcpy(m->data(), hdr+hOff, FRAME_HDR-hOff);
+    pipeRead(pipeRd, m->data()+(FRAME_HDR-hOff), k);
+    c->queued += m->size();
+    writerAppend(c, m);
+    return true;
+}
+
+// Frame whose payload is bytes [off, off+n) of a file; the writer sends them with sendfile()
+bool connSendFileFrame(conn* c, uint8_t type, uint32_t target, uint32_t seq, int fd, off_t off, size_t n) {
+    out_msg* m = newMsg(FRAME_HDR);
+    encodeHdr(m->data(), type, (uint32_t)n, target, seq);
+    m->fileFd = dup(fd);
+    m->fileOff = off;
+    m->fileLen = n;
+    m->bulk = bulkFrame(type);
+    if (m->fileFd < 0) { freeMsg(m); return false; }
+    return connEnqueue(c, m);
+}
+
+char* put(char* o, string_view s) { memcpy(o, s.data(), s.size()); return o + s.size(); }
+
+// Status reply to a request: a FT_REPLY frame echoing its seq, or the bare word for legacy peers.
+// A request that came in over a trunk is answered through it, for the campus `to` that made it.
+void replyAs(conn* c, string_view to, uint32_t seq, string_view status) {
+    if (c->node >= 0) {
+        out_msg* m = newMsg(FRAME_HDR + to.size() + 1 + status.size());
+        encodeHdr(m->data(), FT_FWD_REPLY, m->len - FRAME_HDR, 0, seq);
+        char* o = put(m->data() + FRAME_HDR, to);
+        *o++ = 0;
+        put(o, status);
+        connEnqueue(c, m, true);
+    }
+    else if (c->framed) connEnqueue(c, newFrame(FT_REPLY, 0, seq, status), true);
+    else connSend(c, status);
+}
+void reply(conn* c, uint32_t seq, string_view status) { replyAs(c, c->campus, seq, status); }
+
+// Status for the sender of stream x
+void xferReply(conn* c, const xfer* x, string_view status) { replyAs(c, x->from, x->replyId, status); }
+
+// Text of a message as it arrived: plain, or packed (FF_COMPRESSED). A packed text goes on
+// packed to campuses that negotiated compression and is only unpacked for anyone else (plain
+// or legacy campuses, spools, the console).
+// Both are views into the sender's receive buffer, valid while its frame or command is handled.
+struct msg_body {
+    string_view text;          // plain text; for a packed one filled in by plain()
+    string_view packed;        // as received, empty if it arrived plain
+    string raw;                // unpacked text of a packed one
+    bool unpacked = false;
+    size_t size() const { return packed.empty() ? text.size() : packedRawLen(packed.data(), packed.size()); }
+    string_view plain() {
+        if (!packed.empty() && !unpacked) text = unpackBody(packed.data(), packed.size(), raw) ? string_view(raw) : string_view();
+        unpacked = true;
+        return text;
+    }
+};
+
+// Hand a routed message to its target in whatever protocol the target speaks, assembled in
+// place in one message block. Returns false if the target's queue refused it (--overflow drop).
+bool deliverMessage(conn* t, const conn* from, msg_body &m) {
+    const string &who = from->campus;
+    if (t->framed) {
+        bool packed = t->comp && !m.packed.empty();
+        string_view body = packed ? m.packed : m.plain();
+        out_msg* f = newMsg(FRAME_HDR + who.size() + 1 + body.size());
+        encodeHdr(f->data(), FT_MSG, f->len - FRAME_HDR, from->campusId, ++t->outSeq, packed ? FF_COMPRESSED : 0);
+        char* o = put(f->data() + FRAME_HDR, who);
+        *o++ = 0;
+        put(o, body);
+        return connEnqueue(t, f);
+    }
+    string_view text = m.plain();
+    out_msg* f = newMsg(5 + who.size() + 2 + text.size());
+    put(put(put(put(f->data(), "From "), who), ": "), text);
+    return connEnqueue(t, f);
+}
+
+// Counters for one message handed from `from` to the connected campus t
+void countMessage(const conn* from, const conn* t, size_t n) {
+    metAdd(M_MSGS_ROUTED);
+    metAdd(M_MSG_BYTES, n);
+    if (from->slot >= 0) { // not for a sender on another server
+        campus_counters &a = clients[from->slot].stats;
+        a.msgsSent.fetch_add(1, memory_order_relaxed); a.bytesSent.fetch_add(n, memory_order_relaxed);
+    }
+    campus_counters &b = clients[t->slot].stats;
+    b.msgsRecv.fetch_add(1, memory_order_relaxed); b.bytesRecv.fetch_add(n, memory_order_relaxed);
+}
+
+// Connected campus by name with a reference held (connUnref when done), or nullptr. Lock-free.
+conn* lookupConn(string_view name) {
+    rcu_guard g;
+    const route* r = routes->find(name.data(), name.size());
+    if (!r) return nullptr;
+    conn* t = clients[r->slot].tcpConn.load(memory_order_acquire);
+    return (t && connTryRef(t)) ? t : nullptr;
+}
+
+// Stop reading c until t (a campus or a trunk) has drained; retryPaused() looks it up again
+void blockOn(conn* c, const conn* t) {
+    c->paused = true;
+    c->blockedNode = t->node;
+    if (t->node < 0) c->blockedOn = t->campus;
+    else c->blockedOn.clear(); // a trunk's campus changes with every frame it carries
+}
+
+// --overflow block: a sender whose target is over OUTQ_LIMIT is not read until it drains
+void checkOverflow(conn* from, conn* t) {
+    if (OVERFLOW_POLICY == OVERFLOW_BLOCK && t->queued.load() > OUTQ_LIMIT) blockOn(from, t);
+}
+
+// ---- Federation (--node) ------------------------------------------------------------------
+// Servers started with --node share the campuses out between them. A campus belongs to the
+// server its name hashes to on a consistent-hash ring of the live servers (FED_VNODES points
+// each, so a server joining or leaving only moves the campuses next to its points). It logs in
+// there (the others answer AUTH_REDIRECT) and traffic for it is routed there: a server forwards
+// SEND and FILE requests for a campus it does not own over its trunk to the owner, one TCP
+// connection per pair of servers that carries every campus' requests (protocol.h). Servers find
+// each other through gossip datagrams on the heartbeat port, once a second; one not heard from
+// for FED_DEAD_SEC leaves the ring and its campuses move on.
+
+struct fed_node {
+    string name, host;         // fixed once published (fedCount)
+    int port;                  // TCP port; gossip goes to its heartbeat port
+    atomic<bool> alive;        // on the ring
+    atomic<conn*> trunk;       // connection to it (nullptr if none)
+    uint64_t seen;             // reactor 0 only: monotonic second of its last gossip
+    time_t stamp;              // reactor 0 only: ";Time:" of its last gossip accepted (replays are older or equal)
+};
+fed_node fedNodes[FED_MAX_NODES]; // [0] is this server; entries are never removed
+atomic<int> fedCount(0);
+mutex fedMtx;                     // serialises fedAdd()
+
+// (hash, server) points of the live servers, sorted by hash then server name so every server
+// builds the same ring; replaced whole, read lock-free
+struct fed_ring { vector<pair<uint32_t,int>> points; };
+atomic<fed_ring*> fedRing(nullptr);
+
+// FNV-1a: campus names and ring points hash the same on every server. FNV alone barely moves
+// the high bits for names that differ only in their last characters (CAMPUS01, CAMPUS02, ...),
+// which then all land on one arc of the ring; the murmur3 finaliser spreads them.
+uint32_t fedHash(string_view s) {
+    uint32_t h = 2166136261u;
+    for (char ch : s) { h ^= (uint8_t)ch; h *= 16777619u; }
+    h ^= h >> 16; h *= 0x85ebca6bu; h ^= h >> 13; h *= 0xc2b2ae35u; h ^= h >> 16;
+    return h;
+}
+
+int fedFind(string_view name) {
+    int n = fedCount.load(memory_order_acquire);
+    for (int i=0;i<n;i++) if (fedNodes[i].name == name) return i;
+    return -1;
+}
+
+// Index of server name, added (not alive yet) if it is new; -1 if the table is full
+int fedAdd(const string &name, const string &host, int port) {
+    lock_guard<mutex> lk(fedMtx);
+    int i = fedFind(name);
+    if (i >= 0) return i;
+    int n = fedCount.load();
+    if (n == FED_MAX_NODES) return -1;
+    fed_node &N = fedNodes[n];
+    N.name = name; N.host = host; N.port = port;
+    N.alive = false; N.trunk = nullptr; N.seen = 0; N.stamp = 0;
+    fedCount.store(n + 1, memory_order_release);
+    return n;
+}
+
+// Server that owns campus name: -1 if it is this one (or federation is off). Lock-free; the
+// caller must not be inside an rcu section already.
+int fedOwner(string_view name) {
+    if (NODE_NAME.empty()) return -1;
+    rcu_guard g;
+    const fed_ring* r = fedRing.load(memory_order_acquire);
+    if (!r || r->points.empty()) return -1;
+    uint32_t h = fedHash(name);
+    auto it = lower_bound(r->points.begin(), r->points.end(), h, [](const pair<uint32_t,int> &a, uint32_t v) { return a.first < v; });
+    int n = (it == r->points.end() ? r->points.front() : *it).second;
+    return n == 0 ? -1 : n;
+}
+
+// Trunk to server n with a reference held (connUnref when done), or nullptr. Lock-free.
+conn* fedTrunk(int n) {
+    rcu_guard g;
+    conn* t = fedNodes[n].trunk.load(memory_order_acquire);
+    return (t && connTryRef(t)) ? t : nullptr;
+}
+
+// Pass a message from c on to trunk t: FT_FWD_MSG carrying the sender, the target and the text
+// as it arrived (still packed if it was). False if t's queue refused it.
+bool fedSendMessage(conn* t, const conn* c, uint32_t seq, string_view target, const msg_body &body) {
+    bool packed = !body.packed.empty();
+    string_view text = packed ? body.packed : body.text;
+    out_msg* f = newMsg(FRAME_HDR + c->campus.size() + 1 + target.size() + 1 + text.size());
+    encodeHdr(f->data(), FT_FWD_MSG, f->len - FRAME_HDR, c->campusId, seq, packed ? FF_COMPRESSED : 0);
+    char* o = put(f->data() + FRAME_HDR, c->campus);
+    *o++ = 0;
+    o = put(o, target);
+    *o++ = 0;
+    put(o, text);
+    return connEnqueue(t, f);
+}
+
+// A message for a campus server n owns: the owner delivers (or spools) it and answers the
+// sender through the trunk
+void fedRouteMessage(conn* c, int n, uint32_t seq, string_view target, msg_body &body) {
+    conn* t = fedTrunk(n);
+    if (!t) {
+        reply(c, seq, "TARGET_OFFLINE");
+        metAdd(M_MSGS_OFFLINE);
+        logJoin(LOG_WARN, {"Failed to route message from ", c->campus, " to ", target, " (no trunk to ", fedNodes[n].name, ")."});
+        return;
+    }
+    if (fedSendMessage(t, c, seq, target, body)) {
+        metAdd(M_FED_MSGS);
+        logJoin(LOG_DEBUG, {"Forwarded message from ", c->campus, " to ", target, " via ", fedNodes[n].name});
+        checkOverflow(c, t);
+    } else {
+        reply(c, seq, "TARGET_BUSY");
+        metAdd(M_MSGS_BUSY);
+    }
+    connUnref(t);
+}
+
+// ---- Store-and-forward (--spool) ----------------------------------------------------------
+// Traffic for a credentialed campus that is not connected goes into its spool; the sender is
+// answered once the group commit has made it durable. When the campus logs in, its reactor
+// replays the spool in order straight from the mapped segments while newer traffic keeps
+// going to the spool behind it, so nothing overtakes a stored message. Framed campuses
+// acknowledge each replayed message / file (FT_ACK) and the spool forgets it; anything not
+// acknowledged comes again on the next login.
+
+uint64_t monoNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+spool* spoolFor(string_view campus) {
+    if (!spools) return nullptr;
+    uint32_t id = campusId(campus);
+    return id == ID_BY_NAME ? nullptr : spools[id-1];
+}
+
+// Must traffic for sp's campus go into the spool rather than to t (nullptr: not connected)?
+// Yes unless t is attached and has been handed everything stored. Caller holds sp->m.
+bool mustSpool(spool* sp, conn* t) {
+    return !t || sp->attached != t || sp->sent != sp->head;
+}
+
+// Tell campus `to` (sending through c) once everything appended so far is on disk. Caller
+// holds sp->m.
+void replyOnCommit(spool* sp, conn* c, const string &to, uint32_t seq, const char* status) {
+    connRef(c);
+    sp->onCommit.push_back([c, to, seq, status] { replyAs(c, to, seq, status); connUnref(c); });
+}
+
+enum { SPOOL_LIVE, SPOOL_STORED, SPOOL_REFUSED };
+
+// Append a routed message for an offline (or still replaying) campus. SPOOL_LIVE: the target
+// is live and caught up, deliver directly instead. With answer, the sender gets the status
+// (after the group commit when stored); fan-out answers once for all recipients itself.
+int spoolMessage(spool* sp, conn* t, conn* c, uint32_t seq, string_view text, bool answer) {
+    unique_lock<mutex> lk(sp->m);
+    if (!mustSpool(sp, t)) return SPOOL_LIVE;
+    spool_rec* r = sp->reserve(FT_MSG, c->campusId, 0, (uint32_t)(c->campus.size() + 1 + text.size()));
+    if (!r) {
+        lk.unlock();
+        if (answer) reply(c, seq, "SPOOL_FULL");
+        metAdd(M_MSGS_BUSY);
+        login(LOG_WARN, "Spool for " + sp->campus + " is full; message from " + c->campus + " dropped.");
+        return SPOOL_REFUSED;
+    }
+    memcpy(r->payload(), c->campus.data(), c->campus.size());
+    r->payload()[c->campus.size()] = 0;
+    memcpy(r->payload() + c->campus.size() + 1, text.data(), text.size());
+    sp->finish(r);
+    metAdd(M_MSGS_STORED);
+    if (!answer) return SPOOL_STORED;
+    replyOnCommit(sp, c, c->campus, seq, "STORED_FOR_DELIVERY");
+    lk.unlock();
+    login("Stored message from " + c->campus + " for " + sp->campus);
+    return SPOOL_STORED;
+}
+
+// Spooled stream ran out of room: close it in the spool as aborted and tell the sender.
+// Caller holds sp->m.
+void spoolStreamFull(conn* c, xfer* x) {
+    x->sp->append(FT_FILE_END, x->fromId, x->spXid, "ABORTED", 7, nullptr, 0, true);
+    x->failed = true;
+    xferReply(c, x, "SPOOL_FULL");
+    login(LOG_WARN, "Spool for " + x->sp->campus + " is full; file '" + x->fname + "' from " + x->from + " dropped.");
+}
+
+// FT_FILE_START for a campus that must be spooled: returns false if it can take the stream live
+bool spoolFileStart(spool* sp, conn* t, conn* c, xfer* x, const string &size) {
+    lock_guard<mutex> lk(sp->m);
+    if (!mustSpool(sp, t)) return false;
+    x->sp = sp;
+    x->spXid = (uint32_t)(sp->head >> 3); // records are 8-aligned: unique for the next 32 GB
+    string p = fields(x->from, x->fname, size);
+    if (!sp->append(FT_FILE_START, x->fromId, x->spXid, p.data(), p.size())) {
+        x->sp = nullptr;
+        x->failed = true;
+        xferReply(c, x, "SPOOL_FULL");
+        login(LOG_WARN, "Spool for " + sp->campus + " is full; file '" + x->fname + "' from " + x->from + " refused.");
+    }
+    return true;
+}
+
+// k bytes of a spooled stream: from memory (p) or, when p is nullptr, out of the relay pipe
+void spoolChunk(conn* c, xfer* x, const char* p, int pipeRd, size_t k) {
+    lock_guard<mutex> lk(x->sp->m);
+    spool_rec* r = x->sp->reserve(FT_FILE_CHUNK, x->fromId, x->spXid, (uint32_t)k);
+    if (!r) {
+        if (!p) pipeDiscard(pipeRd, k);
+        spoolStreamFull(c, x);
+        return;
+    }
+    if (p) memcpy(r->payload(), p, k);
+    else pipeRead(pipeRd, r->payload(), k);
+    x->sp->finish(r);
+}
+
+void spoolFileEnd(conn* c, xfer* x, bool ok) {
+    lock_guard<mutex> lk(x->sp->m);
+    x->sp->append(FT_FILE_END, x->fromId, x->spXid, ok ? "OK" : "ABORTED", ok ? 2 : 7, nullptr, 0, true);
+    if (!ok) return;
+    metAdd(M_FILES_STORED);
+    metAdd(M_FILE_BYTES, x->bytes);
+    replyOnCommit(x->sp, c, x->from, x->replyId, "FILE_STORED_FOR_DELIVERY");
+    login("Stored file '" + x->fname + "' from " + x->from + " for " + x->sp->campus + " (" + to_string(x->bytes) + " bytes)");
+}
+
+// Transfer id towards c of a replayed stream, 0 if its START is not ours
+uint32_t replayId(conn* c, uint32_t xid, bool erase) {
+    for (size_t i=0;i<c->replayIds.size();i++) {
+        if (c->replayIds[i].first != xid) continue;
+        uint32_t id = c->replayIds[i].second;
+        if (erase) c->replayIds.erase(c->replayIds.begin() + i);
+        return id;
+    }
+    return 0;
+}
+
+// Log how fast the spool drained: from login until the last stored record was acknowledged
+// (queued, for a legacy campus). Caller holds c->sp->m.
+void replayDone(conn* c) {
+    if (!c->replayRecs) return;
+    double sec = (monoNs() - c->replayStartNs) / 1e9 + 1e-9;
+    char stats[192];
+    snprintf(stats, sizeof(stats), "Drained spool of %s: %llu records (%.1f MB) in %.1f ms, %.0f records/s, %.1f MB/s",
+             c->campus.c_str(), (unsigned long long)c->replayRecs, c->replayBytes / 1e6, sec * 1e3,
+             c->replayRecs / sec, c->replayBytes / 1e6 / sec);
+    login(stats);
+    c->replayRecs = c->replayBytes = 0;
+}
+
+// Queue stored records for c, at most FWD_HIGH_WATER ahead of the socket. Framed campuses get
+// a header per record with the payload pointing into the mapped segment (no copy); legacy
+// campuses get the message text and nothing to acknowledge (files cannot be replayed to them).
+// Owner reactor only.
+void spoolReplay(conn* c) {
+    spool* sp = c->sp;
+    if (c->spoolHold) return;
+    lock_guard<mutex> lk(sp->m);
+    if (sp->attached != c) return;
+    while (sp->sent < sp->synced && c->queued.load() < FWD_HIGH_WATER) {
+        uint64_t pos = sp->sent;
+        spool_seg* seg;
+        spool_rec* r = sp->at(pos, &seg);
+        if (!r) break;
+        uint64_t next = pos + spoolRecSize(r->len);
+        sp->sent = next;
+        c->replayRecs++;
+        c->replayBytes += r->len;
+        if (!c->framed) {
+            if (r->type == FT_MSG) {
+                const char* z = (const char*)memchr(r->payload(), 0, r->len);
+                if (z) connSend(c, "From " + string(r->payload(), z - r->payload()) + ": " + string(z+1, r->payload() + r->len - (z+1)));
+            } else if (r->type == FT_FILE_START) {
+                login(LOG_WARN, "Stored file for " + sp->campus + " dropped: campus uses the legacy text protocol.");
+            }
+            spoolSegUnref(seg);
+            sp->acked = next; // delivered as far as a legacy campus can tell us
+            continue;
+        }
+        uint32_t seq = 0;
+        uint8_t flags = 0;
+        if (r->type == FT_MSG) {
+            seq = ++c->outSeq;
+            flags = FF_STORED;
+            c->unacked.push_back({seq, next});
+        } else if (r->type == FT_FILE_START) {
+            seq = ++c->outSeq;
+            c->replayIds.push_back({r->xid, seq});
+            c->openFiles.push_back({seq, pos});
+        } else if (r->type == FT_FILE_END) {
+            seq = replayId(c, r->xid, true);
+            flags = FF_STORED;
+            if (seq) c->unacked.push_back({seq, next});
+        } else {
+            seq = replayId(c, r->xid, false);
+        }
+        if (!seq) { spoolSegUnref(seg); continue; } // rest of a stream whose START was acknowledged (cannot happen) or lost
+        out_msg* m = newMsg(FRAME_HDR);
+        encodeHdr(m->data(), r->type, r->len, r->sender, seq, flags);
+        m->ext = r->payload();
+        m->extLen = r->len;
+        m->release = spoolSegUnref;
+        m->relArg = seg;
+        connEnqueue(c, m, true);
+    }
+    if (!c->framed && sp->sent == sp->head) replayDone(c);
+}
+
+// FT_ACK: the campus handled every stored frame up to seq. The spool may forget them, except
+// from the START of a replayed stream that is still open.
+void spoolAck(conn* c, uint32_t seq) {
+    if (!c->sp) return;
+    uint64_t pos = 0;
+    bool found = false;
+    while (!found && !c->unacked.empty()) {
+        pair<uint32_t,uint64_t> e = c->unacked.front();
+        c->unacked.pop_front();
+        for (size_t i=0;i<c->openFiles.size();i++)
+            if (c->openFiles[i].first == e.first) { c->openFiles.erase(c->openFiles.begin() + i); break; }
+        pos = e.second;
+        found = (e.first == seq);
+    }
+    if (!found) return;
+    for (const pair<uint32_t,uint64_t> &f : c->openFiles) pos = min(pos, f.second);
+    lock_guard<mutex> lk(c->sp->m);
+    if (c->sp->attached != c || pos <= c->sp->acked) return;
+    c->sp->acked = pos;
+    if (pos == c->sp->head) replayDone(c);
+}
+
+// After login: replay c's spool from the last acknowledged record
+void spoolAttach(conn* c) {
+    spool* sp = spoolFor(c->campus);
+    if (!sp) return;
+    lock_guard<mutex> lk(sp->m);
+    sp->attached = c;
+    sp->sent = sp->acked;
+    c->sp = sp;
+    c->spoolHold = !c->framed;
+    c->replayStartNs = monoNs();
+    if (sp->head != sp->acked) login("Replaying " + to_string(sp->head - sp->acked) + " stored bytes to " + c->campus);
+}
+
+void spoolDetach(conn* c) {
+    if (!c->sp) return;
+    lock_guard<mutex> lk(c->sp->m);
+    if (c->sp->attached == c) c->sp->attached = nullptr;
+    c->sp = nullptr;
+}
+
+// Group commit: every SPOOL_SYNC_MS one msync per spool covers everything appended since the
+// last round; only then are the senders answered, and newly durable records replayed.
+void spoolSyncLoop() {
+    while (true) {
+        this_thread::sleep_for(chrono::milliseconds(SPOOL_SYNC_MS));
+        for (int i=0;i<CRED_COUNT;i++) {
+            spool* sp = spools[i];
+            if (!sp || sp->idle()) continue;
+            sp->sync();
+            lock_guard<mutex> lk(sp->m);
+            if (sp->attached && sp->sent < sp->synced) scheduleWrite((conn*)sp->attached);
+        }
+    }
+}
+
+// ---- Session resumption ------------------------------------------------------------------
+// A framed campus that asks for it ("...;Proto:1;Session:new") gets a session token with
+// AUTH_OK. While connected, the writer keeps the last SESSION_REPLAY bytes of frames it wrote
+// (the messages themselves: no copy). When the connection drops, what was never written is
+// parked with the session. For SESSION_TTL seconds the campus can come back with
+// "Resume:<token>;Last:<frames received>;Proto:1": no credential check, one round trip, and
+// it gets "RESUMED;Proto:1" followed by every frame after the ones it had, in the original
+// order. Spool deliveries (FF_STORED) are not kept: the spool redelivers whatever was not
+// acknowledged. If the old connection still looks alive (a flap the server never saw), it is
+// shut down and the resume completes once its reactor has let go of it.
+
+struct session {
+    string token, campus;
+    uint64_t serial;           // connection serial the campus keeps across resumes, so file
+                               // streams being forwarded to it carry on
+    uint32_t outSeq;
+    bool comp;                 // the campus negotiated compression (kept on resume)
+    bool windows;              // ...and flow-controlled uploads
+    uint64_t frames;           // frames written when it was detached
+    uint64_t dropped;          // frames up to this one can no longer be resent
+    conn* live;                // attached connection, nullptr while detached
+    conn* waiter;              // resume waiting for `live` to close (holds a reference)
+    deque<pair<uint64_t,out_msg*>> ring; // (frame number, frame) written, oldest first
+    size_t ringBytes;
+    vector<out_msg*> pending;  // queued but never written when the connection dropped
+    uint64_t expires;          // monoSec after which a detached session is dropped
+};
+
+// Token -> session. The ring and pending list belong to the live connection's reactor; while
+// the session is detached, and for attach/detach, sessMtx guards them.
+mutex sessMtx;
+unordered_map<string, session*> sessions;
+
+string newSessionToken() {
+    unsigned char b[SESSION_TOKEN_BYTES];
+    size_t got = 0;
+    while (got < sizeof(b)) {
+        ssize_t r = getrandom(b + got, sizeof(b) - got, 0);
+        if (r > 0) got += r;
+        else if (errno != EINTR) break;
+    }
+    static const char hex[] = "0123456789abcdef";
+    string t;
+    for (unsigned char x : b) { t += hex[x >> 4]; t += hex[x & 15]; }
+    return t;
+}
+
+// Frames start with FRAME_MAGIC; the only other thing a framed connection is sent is its
+// auth answer line
+bool isFrame(out_msg* m) { return m->len >= FRAME_HDR && (uint8_t)m->data()[0] == FRAME_MAGIC; }
+bool isStored(out_msg* m) { return ((uint8_t)m->data()[3] & FF_STORED) != 0; }
+
+// Writer (owner reactor): frame m is fully written, count it and keep it for resends
+void sessionKeep(conn* c, out_msg* m) {
+    if (!isFrame(m)) { freeMsg(m); return; }
+    session* S = c->sess;
+    c->framesOut++;
+    if (isStored(m)) { freeMsg(m); return; }
+    if (SESSION_REPLAY == 0) { S->dropped = c->framesOut; freeMsg(m); return; }
+    S->ring.push_back(make_pair(c->framesOut, m));
+    S->ringBytes += m->size();
+    while (S->ringBytes > SESSION_REPLAY) {
+        S->ringBytes -= S->ring.front().second->size();
+        S->dropped = S->ring.front().first;
+        freeMsg(S->ring.front().second);
+        S->ring.pop_front();
+    }
+}
+
+void freeSession(session* S) {
+    for (auto &e : S->ring) freeMsg(e.second);
+    for (out_msg* m : S->pending) freeMsg(m);
+    delete S;
+}
+
+// New session for a campus that just logged in on c
+string sessionCreate(conn* c) {
+    session* S = new session();
+    S->campus = c->campus;
+    S->serial = c->serial;
+    S->comp = c->comp;
+    S->windows = c->windows;
+    S->outSeq = 0; S->frames = 0; S->dropped = 0;
+    S->live = c; S->waiter = nullptr;
+    S->ringBytes = 0; S->expires = 0;
+    lock_guard<mutex> lk(sessMtx);
+    do S->token = newSessionToken(); while (sessions.count(S->token));
+    sessions[S->token] = S;
+    c->sess = S;
+    c->framesOut = 0;
+    return S->token;
+}
+
+uint64_t monoSec();
+
+// closeConn: park the session with everything c never wrote, and hand it to a waiting resume
+void sessionDetach(conn* c) {
+    if (!c->sess) return;
+    lock_guard<mutex> lk(sessMtx);
+    session* S = c->sess;
+    c->sess = nullptr;
+    S->live = nullptr;
+    S->outSeq = c->outSeq;
+    S->frames = c->framesOut;
+    S->expires = monoSec() + SESSION_TTL;
+    c->closed = true; // producers now free what they bring instead of queueing it
+    c->wOff = 0;      // a half-written frame goes again whole
+    auto park = [S](out_msg* m) {
+        if (isFrame(m) && !isStored(m)) S->pending.push_back(m);
+        else freeMsg(m);
+    };
+    while (out_msg* m = c->whead) { c->whead = m->wnext; park(m); }
+    c->wtail = nullptr;
+    while (out_msg* m = c->q.pop()) park(m);
+    while (out_msg* m = c->bq.pop()) park(m);
+    c->queued = 0;
+    if (S->waiter) {
+        conn* w = S->waiter;
+        S->waiter = nullptr;
+        w->resumeGo = true;
+        scheduleWrite(w);
+        connUnref(w);
+    }
+}
+
+// Attach c to the detached session S (sessMtx held): register the campus on c and line up
+// RESUMED, the frames after `last` and the parked ones in c's writer list. False if the
+// frames the campus is missing are no longer all kept, or the campus logged in again meanwhile.
+bool sessionAttach(conn* c, session* S, uint64_t last) {
+    if (last > S->frames || last < S->dropped) return false;
+    c->campus = S->campus;
+    c->campusId = campusId(S->campus);
+    c->framed = true;
+    c->comp = S->comp;
+    c->windows = S->windows;
+    c->serial = S->serial;
+    c->outSeq = S->outSeq;
+    mtx.lock();
+    int slot = claimCampus(S->campus, c);
+    if (slot < 0) { mtx.unlock(); return false; }
+    c->authed = true;
+    mtx.unlock();
+    c->sess = S;
+    c->framesOut = last;
+    S->live = c;
+    string ok = "RESUMED;Proto:" + to_string(PROTO_VERSION) + "\n";
+    out_msg* r = newMsg(ok.data(), ok.size());
+    c->queued += r->size();
+    writerAppend(c, r);
+    size_t resent = 0;
+    for (auto &e : S->ring) {
+        if (e.first <= last) { freeMsg(e.second); continue; }
+        c->queued += e.second->size();
+        writerAppend(c, e.second);
+        resent++;
+    }
+    S->ring.clear();
+    S->ringBytes = 0;
+    for (out_msg* m : S->pending) { c->queued += m->size(); writerAppend(c, m); }
+    login("Resumed session of " + c->campus + ": " + to_string(resent) + " frames resent, " + to_string(S->pending.size()) + " never sent");
+    S->pending.clear();
+    scheduleWrite(c);
+    return true;
+}
+
+// "Resume:<token>;Last:<n>;Proto:1". Returns false if the connection must close.
+bool handleResume(conn* c, const string &line) {
+    size_t p1 = line.find(';');
+    size_t p2 = line.find(";Last:");
+    string token = line.substr(7, p1 == string::npos ? string::npos : p1 - 7);
+    uint64_t last = p2 == string::npos ? 0 : strtoull(line.c_str() + p2 + 6, nullptr, 10);
+    bool ok = false;
+    {
+        lock_guard<mutex> lk(sessMtx);
+        auto it = sessions.find(token);
+        session* S = it == sessions.end() ? nullptr : it->second;
+        if (S && S->live && !S->waiter) {
+            // the old connection still looks alive: make its reactor close it, and finish
+            // when sessionDetach() hands the session over. c is not read until then.
+            S->waiter = c;
+            connRef(c);
+            c->resumeOf = S;
+            c->resumeLast = last;
+            shutdown(S->live->fd, SHUT_RDWR);
+            login("Resume for " + S->campus + " is taking over its old connection");
+            return true;
+        }
+        // a campus that moved to another server of the federation logs in there
+        ok = S && !S->live && !S->waiter && fedOwner(S->campus) < 0 && sessionAttach(c, S, last);
+    }
+    if (!ok) {
+        connSend(c, "RESUME_FAIL\n");
+        metAdd(M_RESUME_FAIL);
+        login(LOG_WARN, "Rejected session resume (unknown, expired or too far behind)");
+        return false;
+    }
+    metAdd(M_RESUME_OK);
+    spoolAttach(c);
+    return true;
+}
+
+void closeConn(reactor* R, conn* c);
+void onConnReadable(reactor* R, conn* c);
+
+// Owner reactor of a waiting resume, once the old connection let go of the session. The
+// waiting connection was not read meanwhile (see onConnReadable), so it is still open.
+void finishResume(reactor* R, conn* c) {
+    bool ok;
+    {
+        lock_guard<mutex> lk(sessMtx);
+        session* S = c->resumeOf;
+        c->resumeOf = nullptr;
+        ok = !S->live && sessionAttach(c, S, c->resumeLast);
+    }
+    if (!ok) {
+        connSend(c, "RESUME_FAIL\n");
+        metAdd(M_RESUME_FAIL);
+        login(LOG_WARN, "Rejected session resume (too far behind, or the campus logged in again)");
+        closeConn(R, c);
+        return;
+    }
+    metAdd(M_RESUME_OK);
+    spoolAttach(c);
+    onConnReadable(R, c); // anything that arrived meanwhile (edge-triggered)
+}
+
+// Reactor 0, every tick: drop sessions that were not resumed in time
+void sessionSweep(uint64_t tick) {
+    lock_guard<mutex> lk(sessMtx);
+    for (auto it = sessions.begin(); it != sessions.end();) {
+        session* S = it->second;
+        if (S->live || S->waiter || S->expires > tick) { ++it; continue; }
+        it = sessions.erase(it);
+        freeSession(S);
+    }
+}
+
+xfer* findXfer(conn* c, uint32_t id) {
+    for (xfer* x : c->xfers) if (x && x->id == id) return x;
+    return nullptr;
+}
+
+void detachXfer(conn* c, xfer* x) {
+    for (xfer* &y : c->xfers) if (y == x) y = nullptr;
+}
+
+void deleteXfer(xfer* x) {
+    if (x->fd != -1) close(x->fd);
+    if (!x->pins.empty()) store->unref(x->pins);
+    delete x;
+}
+
+void freeXfer(conn* c, xfer* x) {
+    detachXfer(c, x);
+    deleteXfer(x);
+}
+
+// Run the save side of a file on c's strand (in order with everything else posted for c) and
+// account n chunk bytes to it until it has run; without workers, run it right here
+void onSaver(conn* c, size_t n, function<void()> f) {
+    if (!pool) { f(); return; }
+    connRef(c);
+    c->saveQueued += n;
+    pool->post(c->strand, [c, n, f = move(f)] {
+        f();
+        size_t was = c->saveQueued.fetch_sub(n);
+        if (was >= SAVE_LOW_WATER && was - n < SAVE_LOW_WATER) wakeReactor(reactors[c->reactor]); // may be paused on us
+        connUnref(c);
+    });
+}
+
+// Open the file a save is written to
+void saveOpen(conn* c, xfer* x) {
+    x->fd = open(x->stored.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (x->fd < 0) {
+        x->failed = true;
+        xferReply(c, x, "SERVER_SAVE_ERR");
+        login(LOG_ERROR, "Error saving file from " + x->from + ": " + x->fname);
+    }
+}
+
+// Connection a stream is forwarded to (referenced), or nullptr if that campus (or the trunk to
+// its server) left or reconnected
+conn* xferTarget(const xfer* x) {
+    conn* t = x->fwdNode >= 0 ? fedTrunk(x->fwdNode) : lookupConn(x->fwdCampus);
+    if (t && t->serial != x->fwdSerial) { connUnref(t); return nullptr; }
+    return t;
+}
+
+// A stream for a campus server n owns: announce it on the trunk (FT_FWD_FILE); its chunks follow
+// like those to a campus, and the owner answers the sender at the end
+void fedFileStart(conn* c, xfer* x, int n, const string &size) {
+    x->fwdCampus = x->target;
+    conn* t = fedTrunk(n);
+    if (!t) {
+        x->failed = true;
+        xferReply(c, x, "TARGET_OFFLINE");
+        login(LOG_WARN, "File forward failed from " + x->from + " to " + x->target + " (no trunk to " + fedNodes[n].name + ").");
+        return;
+    }
+    x->fwdNode = n;
+    x->fwdSerial = t->serial;
+    x->fwdComp = true; // packed chunks pass through; the owner unpacks them if its campus needs it
+    x->fwdId = ++t->outSeq;
+    if (connEnqueue(t, newFrame(FT_FWD_FILE, x->id, x->fwdId, fields(x->from, x->target, x->fname, size)))) metAdd(M_FED_FILES);
+    else { x->failed = true; xferReply(c, x, "TARGET_BUSY"); }
+    connUnref(t);
+}
+
+// FT_FILE_START: open the stored file (Islamabad) or announce the stream to the target campus.
+// replyId is the id the sender's replies carry (id, except for a stream arriving on a trunk).
+void fileStart(conn* c, uint32_t id, uint32_t replyId, const string &target, const string &fname, const string &size) {
+    auto slot = find(c->xfers.begin(), c->xfers.end(), nullptr);
+    if (slot == c->xfers.end() || findXfer(c, id)) { replyAs(c, c->campus, replyId, "TOO_MANY_TRANSFERS"); return; }
+    xfer* x = new xfer();
+    x->id = id; x->target = target; x->fname = fname;
+    x->from = c->campus; x->fromId = c->campusId; x->replyId = replyId;
+    *slot = x;
+
+    if (target == "Islamabad" && store) {
+        x->save = x->toStore = true;
+        x->stored = store->manifestPath("received_from_" + x->from + "_" + fname);
+        return;
+    }
+    if (target == "Islamabad") {
+        // Save file on server disk
+        x->save = true;
+        x->stored = "received_from_" + x->from + "_" + fname;
+        x->ring = reactors[c->reactor]->io != nullptr;
+        if (x->ring) saveOpen(c, x);
+        else onSaver(c, 0, [c, x] { saveOpen(c, x); });
+        return;
+    }
+    // Forward file to target client if connected (or into its spool), or to the server that owns it
+    int n = c->node < 0 ? fedOwner(target) : -1;
+    if (n >= 0) { fedFileStart(c, x, n, size); return; }
+    conn* t = lookupConn(target);
+    spool* sp = spoolFor(target);
+    if (sp && spoolFileStart(sp, t, c, x, size)) { if (t) connUnref(t); return; }
+    if (!t) {
+        x->failed = true;
+        xferReply(c, x, "TARGET_OFFLINE");
+        login(LOG_WARN, "File forward failed from " + x->from + " to " + target + " (offline).");
+        return;
+    }
+    x->fwdCampus = target;
+    x->fwdSerial = t->serial;
+    x->fwdLegacy = !t->framed;
+    x->fwdComp = t->framed && t->comp;
+    if (t->framed) {
+        x->fwdId = ++t->outSeq;
+        if (!connEnqueue(t, newFrame(FT_FILE_START, x->fromId, x->fwdId, fields(x->from, fname, size)))) {
+            x->failed = true;
+            xferReply(c, x, "TARGET_BUSY");
+        }
+    }
+    connUnref(t);
+}
+
+// FT_FILE_OFFER: the file as its chunk list. Pin the chunks the store already has and ask
+// for the rest with FT_FILE_NEED; with nothing missing the sender goes straight to END.
+void fileOffer(conn* c, uint32_t id, const string &target, const string &fname, const string &size, const char* p, const char* end) {
+    if (!store || target != "Islamabad") { reply(c, id, "OFFER_DECLINED"); return; }
+    if ((end - p) % CHUNK_REF_WIRE) { reply(c, id, "BAD_FORMAT"); return; }
+    bool dup = findXfer(c, id) != nullptr;
+    fileStart(c, id, id, target, fname, size);
+    xfer* x = findXfer(c, id);
+    if (dup || !x || !x->toStore) return;
+    x->offer = true;
+    for (; p < end; p += CHUNK_REF_WIRE) x->recipe.push_back(getChunkRef(p));
+    string need((x->recipe.size() + 7) / 8, '\0');
+    for (size_t i=0;i<x->recipe.size();i++) {
+        const chunk_ref &r = x->recipe[i];
+        if (r.len == 0 || r.len > CDC_MAX) { x->failed = true; reply(c, id, "BAD_FORMAT"); return; }
+        if (store->pin(r)) { x->pins.push_back(r); continue; }
+        x->need.push_back((uint32_t)i);
+        need[i / 8] |= (char)(1 << (i % 8));
+    }
+    connEnqueue(c, newFrame(FT_FILE_NEED, 0, id, need), true);
+}
+
+// Stored copy could not be written: drop it and tell the sender
+void saveFailed(conn* c, xfer* x, const string &status = "SERVER_SAVE_ERR") {
+    x->failed = true;
+    if (x->toStore) { store->unref(x->pins); x->pins.clear(); }
+    else { close(x->fd); x->fd = -1; unlink(x->stored.c_str()); }
+    xferReply(c, x, status);
+    login(LOG_ERROR, "Error saving file from " + x->from + ": " + x->fname);
+}
+
+// Forward target disconnected mid-stream
+void targetLeft(conn* c, xfer* x) {
+    x->failed = true;
+    xferReply(c, x, "TRANSFER_ABORTED");
+    login(LOG_WARN, "File forward from " + x->from + " to " + x->fwdCampus + " aborted (target left).");
+}
+
+// --overflow drop refused a chunk: the target gets an aborted stream, the sender a busy reply
+void targetBusy(conn* c, xfer* x, conn* t) {
+    x->failed = true;
+    connEnqueue(t, newFrame(FT_FILE_END, x->fromId, x->fwdId, "ABORTED"), true);
+    xferReply(c, x, "TARGET_BUSY");
+    login(LOG_WARN, "File forward from " + x->from + " to " + x->fwdCampus + " dropped (target queue full).");
+}
+
+void legacyTooLarge(conn* c, xfer* x) {
+    x->failed = true;
+    x->legacyBuf.clear();
+    xferReply(c, x, "FILE_TOO_LARGE_FOR_TARGET");
+}
+
+// Stop reading this sender until the target catches up (a sender with windows is held back
+// per stream instead, see windowChunk)
+void checkBackPressure(conn* c, conn* t) {
+    if (!c->windows && t->queued.load() > FWD_HIGH_WATER) blockOn(c, t);
+}
+
+// Whether stream x's destination is under its high water mark (or, to hand back a held
+// window, under its low one)
+bool xferHasRoom(conn* c, const xfer* x, bool resume) {
+    if (x->failed || x->sp || x->fwdLegacy) return true;
+    if (x->save) return c->saveQueued.load() < (resume ? SAVE_LOW_WATER : SAVE_HIGH_WATER);
+    conn* t = xferTarget(x);
+    bool room = !t || t->queued.load() < (resume ? FWD_LOW_WATER : FWD_HIGH_WATER);
+    if (t) connUnref(t);
+    return room;
+}
+
+void grantWindow(conn* c, xfer* x) {
+    connEnqueue(c, newFrame(FT_WINDOW, (uint32_t)x->owed, x->id, "", 0), true);
+    x->owed = 0;
+}
+
+// n chunk bytes of x arrived from a sender with windows: give them back right away while the
+// destination keeps up, else hold them until it drained (retryWindows). Only this stream
+// waits; the connection is still read, so the sender's messages are not held up.
+void windowChunk(conn* c, xfer* x, size_t n) {
+    x->owed += n;
+    if (x->held) return;
+    if (xferHasRoom(c, x, false)) { grantWindow(c, x); return; }
+    x->held = true;
+    metAdd(M_WINDOWS_HELD);
+    if (!c->owing) { c->owing = true; connRef(c); curReactor->owing.push_back(c); }
+}
+
+// Put the buffered chunk in the store and pin it. False on a write error.
+bool storeChunk(xfer* x, const chunk_ref &r) {
+    int res = store->put(r, x->chunkBuf.data(), x->chunkBuf.size());
+    x->chunkBuf.clear();
+    if (res < 0) return false;
+    if (res) x->newBytes += r.len;
+    x->pins.push_back(r);
+    return true;
+}
+
+// File data for the store. A streamed file is cut into chunks here; after an offer each
+// needed chunk arrives whole and must match the hash it was offered with.
+bool storeFeed(xfer* x, const char* p, size_t n) {
+    if (x->offer) {
+        if (x->needPos == x->need.size()) return false;
+        const chunk_ref &r = x->recipe[x->need[x->needPos]];
+        if (x->chunkBuf.size() + n > r.len) return false;
+        x->chunkBuf.append(p, n);
+        if (x->chunkBuf.size() < r.len) return true;
+        chunk_ref got = chunkOf(x->chunkBuf.data(), x->chunkBuf.size());
+        if (memcmp(got.hash, r.hash, CHUNK_HASH) != 0) return false;
+        x->needPos++;
+        return storeChunk(x, r);
+    }
+    while (n > 0) {
+        bool cut;
+        size_t k = x->cdc.scan(p, n, &cut);
+        x->chunkBuf.append(p, k);
+        p += k; n -= k;
+        if (!cut) continue;
+        chunk_ref r = chunkOf(x->chunkBuf.data(), x->chunkBuf.size());
+        x->recipe.push_back(r);
+        if (!storeChunk(x, r)) return false;
+    }
+    return true;
+}
+
+void fileEnd(conn* c, uint32_t id, bool ok);
+
+// Counters for a packed body that arrived (raw = its unpacked size)
+void countPacked(size_t n, size_t raw) {
+    metAdd(M_PACKED_FRAMES);
+    if (raw > n) metAdd(M_PACKED_SAVED, raw - n);
+}
+
+// Save side of a chunk: unpack it and append it to the file or the store
+void saveWrite(conn* c, xfer* x, const char* p, size_t n, bool packed) {
+    if (x->failed) return;
+    if (packed) {
+        static thread_local string raw;
+        if (!unpackBody(p, n, raw)) { saveFailed(c, x, "BAD_FORMAT"); return; }
+        p = raw.data(); n = raw.size();
+    }
+    x->bytes += n;
+    if (x->toStore) { if (!storeFeed(x, p, n)) saveFailed(c, x); return; }
+    while (n > 0) {
+        ssize_t w = write(x->fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) { saveFailed(c, x); return; }
+        p += w; n -= w;
+    }
+}
+
+void ringSave(conn* c, xfer* x, const char* p, size_t n, bool packed);
+
+// A chunk of a file saved on the server goes to the workers as a copy. Reading the sender
+// stops while too much of it is waiting for them; retryPaused() resumes it.
+void saveChunk(conn* c, xfer* x, const char* p, size_t n, bool packed) {
+    if (x->ring) { ringSave(c, x, p, n, packed); return; }
+    if (!pool) { saveWrite(c, x, p, n, packed); return; }
+    onSaver(c, n, [c, x, packed, data = string(p, n)] { saveWrite(c, x, data.data(), data.size(), packed); });
+    if (!c->windows && c->saveQueued.load() > SAVE_HIGH_WATER) { c->paused = true; c->blockedOn.clear(); c->blockedNode = -1; }
+}
+
+// FT_FILE_CHUNK: append to disk or pass straight on; nothing is kept beyond the current chunk.
+// A packed chunk (FF_COMPRESSED) goes on packed to a campus that takes them, and is unpacked
+// for anything else.
+void fileChunk(conn* c, uint32_t id, const char* p, size_t n, bool packed = false) {
+    xfer* x = findXfer(c, id);
+    if (x && c->windows) windowChunk(c, x, n);
+    if (!x || x->failed) return;
+    if (packed) countPacked(n, packedRawLen(p, n));
+    if (x->save) { saveChunk(c, x, p, n, packed); return; }
+    if (packed) {
+        if (x->fwdComp && !x->sp) {
+            x->bytes += packedRawLen(p, n);
+        } else {
+            static thread_local string raw;
+            if (!unpackBody(p, n, raw)) { xferReply(c, x, "BAD_FORMAT"); fileEnd(c, id, false); return; }
+            p = raw.data(); n = raw.size(); packed = false;
+        }
+    }
+    if (!packed) x->bytes += n;
+    if (x->sp) { spoolChunk(c, x, p, -1, n); return; }
+    conn* t = xferTarget(x);
+    if (!t) { targetLeft(c, x); return; }
+    if (x->fwdLegacy) {
+        if (x->legacyBuf.size() + n > LEGACY_FILE_MAX) legacyTooLarge(c, x);
+        else x->legacyBuf.append(p, n);
+    } else if (!connSendFrame(t, FT_FILE_CHUNK, x->fromId, x->fwdId, p, n, packed ? FF_COMPRESSED : 0)) {
+        targetBusy(c, x, t);
+    } else {
+        checkBackPressure(c, t);
+    }
+    connUnref(t);
+}
+
+// Same as fileChunk for k payload bytes the reactor spliced into its pipe. Leaves the pipe empty.
+// Files saved on the server only get here without workers (see spliceable()).
+void fileChunkPiped(conn* c, xfer* x, int pipeRd, size_t k) {
+    x->bytes += k;
+    if (x->sp) { spoolChunk(c, x, nullptr, pipeRd, k); return; }
+    if (x->toStore) {
+        string b(k, '\0'); // not normally reached: drainFrames does not splice chunks for the store
+        pipeRead(pipeRd, &b[0], k);
+        if (!storeFeed(x, b.data(), k)) saveFailed(c, x);
+        return;
+    }
+    if (x->fd != -1) {
+        while (k > 0) {
+            ssize_t s = splice(pipeRd, nullptr, x->fd, nullptr, k, SPLICE_F_MOVE);
+            if (s < 0 && errno == EINTR) continue;
+            if (s <= 0) { pipeDiscard(pipeRd, k); saveFailed(c, x); return; }
+            k -= s;
+        }
+        return;
+    }
+    conn* t = xferTarget(x);
+    if (!t) { pipeDiscard(pipeRd, k); targetLeft(c, x); return; }
+    if (x->fwdLegacy) {
+        if (x->legacyBuf.size() + k > LEGACY_FILE_MAX) { pipeDiscard(pipeRd, k); legacyTooLarge(c, x); }
+        else { size_t was = x->legacyBuf.size(); x->legacyBuf.resize(was + k); pipeRead(pipeRd, &x->legacyBuf[was], k); }
+    } else if (!connSpliceFrame(t, FT_FILE_CHUNK, x->fromId, x->fwdId, pipeRd, k)) {
+        targetBusy(c, x, t);
+    } else {
+        checkBackPressure(c, t);
+    }
+    connUnref(t);
+}
+
+// End of a file for the store: write its manifest (the pins become its references) or, if it
+// is incomplete, leave the pins for freeXfer to release
+void storeFileEnd(conn* c, xfer* x, bool ok) {
+    if (!ok) return;
+    bool whole = x->offer ? x->needPos == x->need.size() && x->chunkBuf.empty() : true;
+    if (whole && !x->offer && !x->chunkBuf.empty()) {
+        chunk_ref r = chunkOf(x->chunkBuf.data(), x->chunkBuf.size());
+        x->recipe.push_back(r);
+        whole = storeChunk(x, r);
+    }
+    uint64_t size = 0;
+    for (const chunk_ref &r : x->recipe) size += r.len;
+    string name = x->stored.substr(store->manifestPath("").size());
+    if (!whole || !store->commit(name, x->recipe, size)) {
+        xferReply(c, x, whole ? "SERVER_SAVE_ERR" : "TRANSFER_INCOMPLETE");
+        login(LOG_ERROR, "Error saving file from " + x->from + ": " + x->fname);
+        return;
+    }
+    x->pins.clear();
+    catalog->add(x->from, x->fname, x->stored);
+    metAdd(M_FILES_SAVED);
+    metAdd(M_FILE_BYTES, size);
+    metAdd(M_STORE_NEW_BYTES, x->newBytes);
+    metAdd(M_STORE_DEDUP_BYTES, size - x->newBytes);
+    xferReply(c, x, "FILE_SAVED_ON_SERVER");
+    login("Saved file from " + x->from + " as " + name + " (" + to_string(size) + " bytes, " + to_string(x->recipe.size())
+          + " chunks, " + to_string(x->newBytes) + " bytes new" + (x->offer ? ", " + to_string(x->bytes) + " sent)" : ")"));
+}
+
+// Save side of the end of a file: commit it (catalog, reply) or drop what was written, then
+// free the stream
+void saveEnd(conn* c, xfer* x, bool ok) {
+    if (x->failed) { deleteXfer(x); return; }
+    if (x->toStore) { storeFileEnd(c, x, ok); deleteXfer(x); return; }
+    close(x->fd); x->fd = -1;
+    if (ok) {
+        catalog->add(x->from, x->fname, x->stored);
+        metAdd(M_FILES_SAVED);
+        metAdd(M_FILE_BYTES, x->bytes);
+        xferReply(c, x, "FILE_SAVED_ON_SERVER");
+        login("Saved file from " + x->from + " as " + x->stored + " (" + to_string(x->bytes) + " bytes)");
+    } else {
+        unlink(x->stored.c_str());
+    }
+    deleteXfer(x);
+}
+
+// FT_FILE_END (ok) or sender gone / aborted (!ok): finish the stream and report back
+void fileEnd(conn* c, uint32_t id, bool ok) {
+    xfer* x = findXfer(c, id);
+    if (!x) return;
+    if (x->save) {
+        detachXfer(c, x);
+        if (!x->ring) onSaver(c, 0, [c, x, ok] { saveEnd(c, x, ok); });
+        else if (x->ringWrites) { x->ringEnd = true; x->ringOk = ok; } // the last write to complete ends it
+        else saveEnd(c, x, ok);
+        return;
+    }
+    if (x->failed) { freeXfer(c, x); return; }
+    if (x->sp) { spoolFileEnd(c, x, ok); freeXfer(c, x); return; }
+    conn* t = xferTarget(x);
+    if (t && x->fwdLegacy) {
+        if (ok) connSend(t, "FILE|" + x->from + "|" + x->fname + "|" + x->legacyBuf);
+    } else if (t) {
+        connEnqueue(t, newFrame(FT_FILE_END, x->fromId, x->fwdId, ok ? "OK" : "ABORTED"), true);
+    }
+    if (ok && t && t->node >= 0) {
+        // passed on to the owner's server, which answers once it has forwarded the file
+    } else if (ok && t) {
+        metAdd(M_FILES_FORWARDED);
+        metAdd(M_FILE_BYTES, x->bytes);
+        if (c->slot >= 0) clients[c->slot].stats.filesSent.fetch_add(1, memory_order_relaxed);
+        clients[t->slot].stats.filesRecv.fetch_add(1, memory_order_relaxed);
+        xferReply(c, x, "FILE_FORWARDED");
+        login("Forwarded file '" + x->fname + "' from " + x->from + " to " + x->fwdCampus + " (" + to_string(x->bytes) + " bytes)");
+    } else if (ok) {
+        xferReply(c, x, "TRANSFER_ABORTED");
+    }
+    if (t) connUnref(t);
+    freeXfer(c, x);
+}
+
+// Value of "Key:" up to the next ';' in a federation line ("" if absent)
+string_view fedField(string_view line, string_view key) {
+    size_t p = line.find(key);
+    if (p == string_view::npos) return string_view();
+    line.remove_prefix(p + key.size());
+    return line.substr(0, line.find(';'));
+}
+
+// "host:port"
+bool fedParseAddr(string_view a, string &host, int &port) {
+    size_t c = a.rfind(':');
+    if (c == string_view::npos || c == 0) return false;
+    host.assign(a.data(), c);
+    port = atoi(string(a.substr(c + 1)).c_str());
+    return port > 0 && port < 65536;
+}
+
+// c becomes the trunk to server n: framed, compression on, room for FED_XFERS streams
+void fedTrunkUp(conn* c, int n) {
+    c->node = n;
+    c->authed = c->framed = c->comp = true;
+    c->xfers.resize(FED_XFERS, nullptr);
+    conn* old = fedNodes[n].trunk.exchange(c);
+    if (old) {
+        // the server came back (restarted, say) while its old trunk still looks open
+        rcu_guard g;
+        if (!old->closed) shutdown(old->fd, SHUT_RDWR);
+    }
+}
+
+// HMAC-SHA256 of msg under FED_KEY (RFC 2104), in hex
+string fedMac(string_view msg) {
+    uint8_t k[64] = {0}, d[32], pad[64];
+    if (FED_KEY.size() > sizeof(k)) { sha256_ctx h; h.update(FED_KEY.data(), FED_KEY.size()); h.final(k); }
+    else memcpy(k, FED_KEY.data(), FED_KEY.size());
+    for (int i=0;i<64;i++) pad[i] = k[i] ^ 0x36;
+    sha256_ctx in;
+    in.update(pad, 64); in.update(msg.data(), msg.size()); in.final(d);
+    for (int i=0;i<64;i++) pad[i] = k[i] ^ 0x5c;
+    sha256_ctx out;
+    out.update(pad, 64); out.update(d, 32); out.final(d);
+    static const char hex[] = "0123456789abcdef";
+    string m;
+    for (uint8_t x : d) { m += hex[x >> 4]; m += hex[x & 15]; }
+    return m;
+}
+
+// line + ";Time:<now>;Mac:<hmac>", the MAC taken over everything before ";Mac:". The key
+// itself never goes on the wire.
+string fedSign(string line) {
+    line += ";Time:" + to_string((long long)time(nullptr));
+    return line + ";Mac:" + fedMac(line);
+}
+
+// Whether line ends in a good ";Mac:" and its ";Time:" is within FED_SKEW_SEC of our clock;
+// stamp is set to that time
+bool fedVerify(string_view line, time_t &stamp) {
+    size_t m = line.rfind(";Mac:");
+    if (m == string_view::npos) return false;
+    string_view mac = line.substr(m + 5);
+    string want = fedMac(line.substr(0, m));
+    if (mac.size() != want.size()) return false;
+    unsigned char diff = 0;
+    for (size_t i=0;i<want.size();i++) diff |= (unsigned char)(mac[i] ^ want[i]);
+    if (diff) return false;
+    stamp = (time_t)atoll(string(fedField(line.substr(0, m), ";Time:")).c_str());
+    time_t now = time(nullptr);
+    return stamp > now - FED_SKEW_SEC && stamp < now + FED_SKEW_SEC;
+}
+
+// MACs of the trunk hellos accepted in the last 2*FED_SKEW_SEC: a recorded hello replayed
+// while its time still passes is refused
+mutex fedHelloMtx;
+deque<pair<time_t,string>> fedHellos;
+
+bool fedFreshHello(string_view line, time_t now) {
+    string mac(line.substr(line.rfind(";Mac:") + 5));
+    lock_guard<mutex> lk(fedHelloMtx);
+    while (!fedHellos.empty() && fedHellos.front().first < now - 2*FED_SKEW_SEC) fedHellos.pop_front();
+    for (auto &h : fedHellos) if (h.second == mac) return false;
+    fedHellos.push_back({now, mac});
+    return true;
+}
+
+// "Node:<name>;Addr:<host>:<port>;To:<us>;Nonce:<hex>;Proto:1;Time:<secs>;Mac:<hmac>" from a
+// server opening its trunk to us. Returns false if the connection must close.
+bool fedAccept(conn* c, const string &line) {
+    string name(fedField(line, "Node:")), host;
+    int port;
+    time_t stamp;
+    if (NODE_NAME.empty() || name.empty() || name == NODE_NAME || !fedVerify(line, stamp) || fedField(line, ";To:") != NODE_NAME
+        || !fedParseAddr(fedField(line, ";Addr:"), host, port) || !fedFreshHello(line, time(nullptr))) {
+        login(LOG_WARN, "Rejected trunk from " + (name.empty() ? string("?") : name) + " (not federated, bad signature, replayed or bad address).");
+        return false;
+    }
+    int n = fedAdd(name, host, port);
+    if (n < 0) { login(LOG_WARN, "Rejected trunk from " + name + ": federation is full"); return false; }
+    fedTrunkUp(c, n);
+    login("Trunk from server " + name + " up");
+    return true;
+}
+
+void ringForget(reactor* R, conn* c);
+
+void authDone(conn* c, bool served);
+
+// Drop a connection: unregister it from clients[] (or the federation) and release the owner's reference
+void closeConn(reactor* R, conn* c) {
+    authDone(c, false);
+    for (xfer* x : c->xfers) if (x) fileEnd(c, x->id, false);
+    if (c->node >= 0) {
+        conn* me = c;
+        fedNodes[c->node].trunk.compare_exchange_strong(me, nullptr);
+        login(LOG_WARN, "Trunk to server " + fedNodes[c->node].name + " closed");
+    }
+    else if (c->authed) {
+        mtx.lock();
+        const route* r = routes->find(c->campus);
+        if (r && clients[r->slot].tcpConn.load() == c) unregisterCampus(r->slot, c->campus);
+        mtx.unlock();
+        login("Client disconnected: " + c->campus);
+    }
+    spoolDetach(c);
+    connDrain(c); // best effort: the peer may still read a final status
+    sessionDetach(c); // before close(): a resume may be shutting this fd down
+    if (R->io) ringForget(R, c);
+    else epoll_ctl(R->ep, EPOLL_CTL_DEL, c->fd, nullptr);
+    if (c->tls) { tlsEnd(c->tls); c->tls = nullptr; }
+    c->closed = true;
+    close(c->fd);
+    connUnref(c); // senders holding a reference may still enqueue; that is discarded
+}
+
+// First packet on a connection: "Campus:Name;Pass:Pwd[;Proto:N[;Comp:lz4][;Flow:window][;Session:new]]",
+// a session resume (handleResume) or a federation trunk (fedAccept). Returns false if the
+// connection must close.
+bool handleAuth(conn* c, const string &auth) {
+    if (auth.compare(0, 7, "Resume:") == 0) return handleResume(c, auth);
+    if (auth.compare(0, 5, "Node:") == 0) return fedAccept(c, auth);
+    string campus;
+    int proto = 0;
+    if (!validateAuth(auth, campus, proto)) {
+        // Before refusing, check if it was "Islamabad" attempt or bad creds
+        // Also check duplicate login
+        if (campusRegistered(campus)) {
+            connSend(c, "AUTH_FAIL_DUPLICATE");
+            metAdd(M_AUTH_DUPLICATE);
+            login(LOG_WARN, "Rejected duplicate login attempt for " + campus);
+        } else {
+            connSend(c, "AUTH_FAIL");
+            metAdd(M_AUTH_FAIL);
+            login(LOG_WARN, "Rejected authentication (bad creds or Islamabad attempt).");
+        }
+        return false;
+    }
+
+    // another server of the federation owns the campus: send it there
+    int owner = fedOwner(campus);
+    if (owner >= 0) {
+        const fed_node &N = fedNodes[owner];
+        connSend(c, "AUTH_REDIRECT:" + N.host + ":" + to_string(N.port) + (proto >= 1 ? "\n" : ""));
+        metAdd(M_AUTH_REDIRECT);
+        login("Redirected login of " + campus + " to server " + N.name);
+        return false;
+    }
+
+    // set up the connection before it becomes reachable, then register in clients[]/routes
+    // (duplicate login is checked again under the lock, even if creds were correct)
+    c->campus = campus;
+    c->campusId = campusId(campus);
+    c->framed = (proto >= 1);
+    c->comp = c->framed && auth.find(";Comp:lz4") != string::npos;
+    c->windows = c->framed && auth.find(";Flow:window") != string::npos;
+    mtx.lock();
+    int slot = claimCampus(campus, c);
+    if (slot == -2) {
+        mtx.unlock();
+        connSend(c, "AUTH_FAIL_DUPLICATE");
+        metAdd(M_AUTH_DUPLICATE);
+        login(LOG_WARN, "Rejected duplicate login attempt for " + campus);
+        return false;
+    }
+    if (slot == -1) {
+        mtx.unlock();
+        connSend(c, "SERVER_FULL");
+        metAdd(M_AUTH_FULL);
+        login(LOG_WARN, "Rejected auth: server full for " + campus);
+        return false;
+    }
+    c->authed = true;
+    mtx.unlock();
+    metAdd(M_AUTH_OK);
+
+    login("Authenticated and connected TCP: " + campus + (c->framed ? " (framed)" : " (legacy text)"));
+    if (c->framed) {
+        string ok = "AUTH_OK;Proto:" + to_string(PROTO_VERSION) + (c->comp ? ";Comp:lz4" : "") + (c->windows ? ";Flow:window" : "");
+        if (auth.find(";Session:new") != string::npos) ok += ";Session:" + sessionCreate(c);
+        connSend(c, ok + "\n");
+    }
+    else connSend(c, "AUTH_OK");
+    spoolAttach(c); // stored traffic follows AUTH_OK
+    return true;
+}
+
+const campus_group* findGroup(string_view name) {
+    for (const campus_group &g : groups) if (g.name == name) return &g;
+    return nullptr;
+}
+
+// Fan-out target: "*" is every connected campus, "@name" a --group. The text is serialised once
+// per protocol into a shared buffer and each recipient only queues a 16-byte frame header that
+// points at it. Offline group members (and campuses still replaying) go to their spools.
+// In a federation the request also goes to the other servers that own recipients, each of which
+// fans it out to its own campuses; the sender is answered for ours, plus ";SERVERS:n".
+// Nothing here allocates once a thread's scratch lists have grown to MAX_CLIENTS.
+struct fan_scratch {
+    vector<conn*> to;          // referenced
+    vector<string_view> away;  // group members not connected (names in groups, fixed)
+};
+thread_local fan_scratch fanScratch;
+
+void fanOut(conn* c, uint32_t seq, string_view target, msg_body &body) {
+    vector<conn*> &to = fanScratch.to;
+    vector<string_view> &away = fanScratch.away;
+    to.clear(); away.clear();
+    if (to.capacity() < (size_t)MAX_CLIENTS) { to.reserve(MAX_CLIENTS); away.reserve(MAX_CLIENTS); }
+    bool remote[FED_MAX_NODES] = {}; // servers that own recipients
+    if (target == "*") {
+        {
+            rcu_guard g;
+            for (int i=0;i<MAX_CLIENTS;i++) {
+                conn* t = clients[i].tcpConn.load(memory_order_acquire);
+                if (t && t != c && connTryRef(t)) to.push_back(t);
+            }
+        }
+        if (!NODE_NAME.empty()) for (int i=1;i<fedCount.load();i++) remote[i] = fedNodes[i].alive.load();
+    } else {
+        const campus_group* grp = findGroup(target.substr(1));
+        if (!grp) { reply(c, seq, "UNKNOWN_GROUP"); return; }
+        for (const string &name : grp->members) {
+            if (name == c->campus) continue;
+            int n = fedOwner(name);
+            if (n >= 0) { remote[n] = true; continue; }
+            conn* t = lookupConn(name);
+            if (t) to.push_back(t); else away.push_back(name);
+        }
+    }
+    int servers = 0;
+    if (c->node < 0) {
+        for (int i=1;i<FED_MAX_NODES;i++) {
+            if (!remote[i]) continue;
+            conn* t = fedTrunk(i);
+            if (t && fedSendMessage(t, c, seq, target, body)) { servers++; metAdd(M_FED_MSGS); checkOverflow(c, t); }
+            if (t) connUnref(t);
+        }
+    }
+    shared_buf* framedBuf = nullptr;   // FT_MSG payload: sender\0text
+    shared_buf* packedBuf = nullptr;   // ... with the text packed as it arrived
+    shared_buf* legacyBuf = nullptr;   // "From <sender>: <text>"
+    int delivered = 0, stored = 0, refused = 0, offline = 0;
+    for (conn* t : to) {
+        spool* sp = spoolFor(t->campus);
+        int st = sp ? spoolMessage(sp, t, c, seq, body.plain(), false) : SPOOL_LIVE;
+        if (st == SPOOL_STORED) stored++;
+        else if (st == SPOOL_REFUSED) refused++;
+        else {
+            out_msg* m;
+            if (t->framed) {
+                bool packed = t->comp && !body.packed.empty();
+                shared_buf* &b = packed ? packedBuf : framedBuf;
+                if (!b) {
+                    string_view text = packed ? body.packed : body.plain();
+                    b = newShared(c->campus.size() + 1 + text.size());
+                    char* o = put(b->data(), c->campus);
+                    *o++ = 0;
+                    put(o, text);
+                }
+                m = newSharedMsg(FRAME_HDR, b);
+                encodeHdr(m->data(), FT_MSG, b->len, c->campusId, ++t->outSeq, packed ? FF_COMPRESSED : 0);
+            } else {
+                if (!legacyBuf) {
+                    string_view text = body.plain();
+                    legacyBuf = newShared(5 + c->campus.size() + 2 + text.size());
+                    put(put(put(put(legacyBuf->data(), "From "), c->campus), ": "), text);
+                }
+                m = newSharedMsg(0, legacyBuf);
+            }
+            if (connEnqueue(t, m)) { delivered++; countMessage(c, t, body.size()); checkOverflow(c, t); }
+            else { refused++; metAdd(M_MSGS_BUSY); }
+        }
+        connUnref(t);
+    }
+    for (string_view name : away) {
+        spool* sp = spoolFor(name);
+        if (sp && spoolMessage(sp, nullptr, c, seq, body.plain(), false) == SPOOL_STORED) stored++;
+        else offline++;
+    }
+    metAdd(M_FANOUTS);
+    if (offline) metAdd(M_MSGS_OFFLINE, offline);
+    if (framedBuf) sharedUnref(framedBuf);
+    if (packedBuf) sharedUnref(packedBuf);
+    if (legacyBuf) sharedUnref(legacyBuf);
+    char line[128];
+    int n = snprintf(line, sizeof(line), "BROADCAST_DELIVERED:%d", delivered);
+    if (stored) n += snprintf(line + n, sizeof(line) - n, ";STORED:%d", stored);
+    if (offline) n += snprintf(line + n, sizeof(line) - n, ";OFFLINE:%d", offline);
+    if (refused) n += snprintf(line + n, sizeof(line) - n, ";BUSY:%d", refused);
+    if (servers) n += snprintf(line + n, sizeof(line) - n, ";SERVERS:%d", servers);
+    string_view status(line, n);
+    if (c->node < 0) reply(c, seq, status); // the origin server answers for the whole federation
+    logJoin(LOG_INFO, {"Broadcast from ", c->campus, " to ", target, ": ", status});
+}
+
+// Route a text message from c to target
+void routeMessage(conn* c, uint32_t seq, string_view target, msg_body &body) {
+    const string &campus = c->campus;
+    if (target == "*" || (!target.empty() && target[0] == '@')) { fanOut(c, seq, target, body); return; }
+    if (target == "Islamabad") {
+        // Message intended to server => show it on server console explicitly
+        logJoin(LOG_INFO, {"MESSAGE TO SERVER from ", campus, ": ", body.plain()});
+        reply(c, seq, "DELIVERED_TO_SERVER");
+        return;
+    }
+    // another server's campus: hand it over (a request that came in over a trunk is ours)
+    int n = c->node < 0 ? fedOwner(target) : -1;
+    if (n >= 0) { fedRouteMessage(c, n, seq, target, body); return; }
+    conn* t = lookupConn(target);
+    spool* sp = spoolFor(target);
+    if (sp && spoolMessage(sp, t, c, seq, body.plain(), true) != SPOOL_LIVE) { if (t) connUnref(t); return; }
+    if (!t) {
+        reply(c, seq, "TARGET_OFFLINE");
+        metAdd(M_MSGS_OFFLINE);
+        logJoin(LOG_WARN, {"Failed to route message from ", campus, " to ", target, " (offline)."});
+        return;
+    }
+    if (deliverMessage(t, c, body)) {
+        reply(c, seq, "DELIVERED");
+        countMessage(c, t, body.size());
+        logJoin(LOG_INFO, {"Routed message from ", campus, " to ", target});
+        checkOverflow(c, t);
+    } else {
+        reply(c, seq, "TARGET_BUSY");
+        metAdd(M_MSGS_BUSY);
+        logJoin(LOG_WARN, {"Dropped message from ", campus, " to ", target, " (target queue full)."});
+    }
+    connUnref(t);
+}
+
+// Handle one packet read from a legacy (text protocol) client: SEND and FILE commands.
+// inc is a view of the read buffer; the fields are parsed as slices of it.
+void handleClient(conn* c, string_view inc) {
+    // Two supported patterns:
+    // 1) SEND|Target|Message
+    // 2) FILE|Target|Filename|<content>
+    if (c->spoolHold) { c->spoolHold = false; scheduleWrite(c); } // past its auth read: stored text can follow
+    if (inc.rfind("SEND|",0) == 0) {
+        size_t p1 = inc.find("|",5);
+        if (p1 == string::npos) { reply(c, 0, "BAD_FORMAT"); return; }
+        uint64_t t0 = monoNs();
+        msg_body body;
+        body.text = inc.substr(p1+1);
+        routeMessage(c, 0, inc.substr(5, p1-5), body);
+        metRouteLatency(monoNs() - t0);
+    }
+    else if (inc.rfind("FILE|",0) == 0) {
+        // parse: FILE|Target|Filename|<content>
+        size_t p1 = inc.find("|",5);
+        size_t p2 = string::npos;
+        if (p1 != string::npos) p2 = inc.find("|", p1+1);
+        if (p1==string::npos || p2==string::npos) {
+            reply(c, 0, "INVALID_FILE_FORMAT");
+            return;
+        }
+        // the whole file is in this packet: run it through the stream path as one chunk
+        string_view content = inc.substr(p2+1);
+        fileStart(c, 0, 0, string(inc.substr(5, p1-5)), string(inc.substr(p1+1, p2-(p1+1))), to_string(content.size()));
+        fileChunk(c, 0, content.data(), content.size());
+        fileEnd(c, 0, true);
+    }
+    else {
+        reply(c, 0, "UNKNOWN_CMD");
+    }
+}
+
+// A request forwarded by another server of the federation, or its answer to one of ours. The
+// trunk stands in for the sending campus while its request is handled: c->campus is set to it.
+void trunkFrame(conn* c, const frame_hdr &h, const char* payload) {
+    const char* p = payload;
+    const char* end = payload + h.len;
+    string_view from, target, fname;
+    if (h.type == FT_FWD_REPLY) {
+        if (!takeField(p, end, target)) return;
+        if (fedOwner(target) >= 0) {
+            // answers only come back for requests our own campuses sent
+            logJoin(LOG_WARN, {"Trunk from ", fedNodes[c->node].name, " answered for ", target, ", which we do not own; dropped."});
+            return;
+        }
+        conn* t = lookupConn(target);
+        if (t) { reply(t, h.seq, string_view(p, end-p)); connUnref(t); }
+        return;
+    }
+    if ((h.type != FT_FWD_MSG && h.type != FT_FWD_FILE) || !takeField(p, end, from) || !takeField(p, end, target)) {
+        login(LOG_WARN, "Unexpected frame on the trunk from " + fedNodes[c->node].name + ", ignored.");
+        return;
+    }
+    if (fedOwner(from) != c->node) {
+        // a server only speaks for the campuses it owns; this one is not its (or rings disagree briefly)
+        logJoin(LOG_WARN, {"Trunk from ", fedNodes[c->node].name, " sent for ", from, ", which it does not own; refused."});
+        replyAs(c, from, h.type == FT_FWD_MSG ? h.seq : h.target, "SENDER_NOT_OWNED");
+        return;
+    }
+    c->campus.assign(from.data(), from.size());
+    c->campusId = campusId(from);
+    if (h.type == FT_FWD_MSG) {
+        uint64_t t0 = monoNs();
+        msg_body body;
+        if (h.flags & FF_COMPRESSED) {
+            body.packed = string_view(p, end-p);
+            if (body.size() > MAX_FRAME) { reply(c, h.seq, "BAD_FORMAT"); return; }
+        } else {
+            body.text = string_view(p, end-p);
+        }
+        routeMessage(c, h.seq, target, body);
+        metRouteLatency(monoNs() - t0);
+        return;
+    }
+    if (!takeField(p, end, fname)) { replyAs(c, c->campus, h.target, "INVALID_FILE_FORMAT"); return; }
+    fileStart(c, h.seq, h.target, string(target), string(fname), string(p, end-p));
+}
+
+// Handle one complete frame from a framed client
+void handleFrame(conn* c, const frame_hdr &h, const char* payload) {
+    const char* p = payload;
+    const char* end = payload + h.len;
+    string_view target, fname;
+    if (c->node >= 0 && h.type != FT_FILE_CHUNK && h.type != FT_FILE_END) { trunkFrame(c, h, payload); return; }
+    if (h.type == FT_FILE_CHUNK) { fileChunk(c, h.seq, p, h.len, h.flags & FF_COMPRESSED); return; }
+    if (h.type == FT_FILE_END) { fileEnd(c, h.seq, string_view(p, end-p) == "OK"); return; }
+    if (h.type == FT_ACK) { spoolAck(c, h.seq); return; }
+    if (h.type != FT_SEND && h.type != FT_FILE_START && h.type != FT_FILE_OFFER) { reply(c, h.seq, "UNKNOWN_CMD"); return; }
+    if (!takeField(p, end, target)) { reply(c, h.seq, "BAD_FORMAT"); return; }
+    if (h.target != ID_BY_NAME) target = campusName(h.target);
+    if (h.type == FT_SEND) {
+        uint64_t t0 = monoNs();
+        msg_body body;
+        if (h.flags & FF_COMPRESSED) {
+            body.packed = string_view(p, end-p);
+            if (body.size() > MAX_FRAME) { reply(c, h.seq, "BAD_FORMAT"); return; }
+            countPacked(body.packed.size(), body.size());
+        } else {
+            body.text = string_view(p, end-p);
+        }
+        routeMessage(c, h.seq, target, body);
+        metRouteLatency(monoNs() - t0);
+    } else {
+        if (!takeField(p, end, fname)) { reply(c, h.seq, "INVALID_FILE_FORMAT"); return; }
+        if (h.type == FT_FILE_START) { fileStart(c, h.seq, h.seq, string(target), string(fname), string(p, end-p)); return; }
+        string_view size;
+        if (!takeField(p, end, size)) { reply(c, h.seq, "INVALID_FILE_FORMAT"); return; }
+        fileOffer(c, h.seq, string(target), string(fname), string(size), p, end);
+    }
+}
+
+// Bytes arrived before authentication. A ";Proto:" line is complete at '\n' and anything after
+// it is already framed; a legacy auth line is whatever the first read() returned.
+// Returns false if the connection must close.
+bool onPreAuthData(conn* c) {
+    slab_string &b = c->rd.buf;
+    bool wantsFrames = b.find(";Proto:") != string::npos;
+    size_t nl = b.find('\n');
+    if (wantsFrames && nl == string::npos) return b.size() <= MAX_AUTH_LINE; // wait for the rest of the line
+    string line(b.data(), wantsFrames ? nl : b.size());
+    b.erase(0, wantsFrames ? nl+1 : b.size());
+    authDone(c, true);
+    return handleAuth(c, line);
+}
+
+// Whether a chunk's payload may be spliced past the reader. Not for the dedup store, which
+// hashes chunks in memory anyway, nor for saves the workers write.
+bool spliceable(conn* c, uint32_t id) {
+    xfer* x = findXfer(c, id);
+    return !(x && x->save && (x->toStore || pool));
+}
+
+// Run every complete buffered frame; stops early when a file target pushes back or when a
+// file chunk's payload is better spliced straight off the socket.
+// Returns false if the connection was closed.
+bool drainFrames(reactor* R, conn* c) {
+    frame_hdr h; const char* payload;
+    while (!c->paused && !c->spliceLeft) {
+        if (c->rd.next(h, payload)) { handleFrame(c, h, payload); continue; }
+        if (SPLICE_RELAY && R->pipeRd != -1 && c->rd.peekHdr(h) && h.type == FT_FILE_CHUNK && !(h.flags & FF_COMPRESSED)
+            && h.len - (c->rd.avail()-FRAME_HDR) >= SPLICE_MIN && spliceable(c, h.seq)) {
+            size_t have = c->rd.takePartial(h, payload);
+            if (have) fileChunk(c, h.seq, payload, have);
+            c->spliceLeft = h.len - have;
+            c->spliceXfer = h.seq;
+        }
+        break;
+    }
+    if (c->rd.bad) {
+        login(LOG_WARN, "Protocol error from " + c->campus + ", dropping connection.");
+        closeConn(R, c);
+        return false;
+    }
+    c->rd.trim(RX_KEEP);
+    c->rxMem.store(c->rd.buf.capacity(), memory_order_relaxed);
+    return true;
+}
+
+// Move the rest of a large FT_FILE_CHUNK payload from the socket into the reactor's pipe and
+// on to the stored file or the target socket.
+// Returns -1 on EOF/error, 0 once the socket has nothing more right now, 1 after progress.
+int spliceChunk(reactor* R, conn* c) {
+    xfer* x = findXfer(c, c->spliceXfer);
+    size_t want = min((size_t)c->spliceLeft, R->pipeCap);
+    ssize_t k;
+    if (!x || x->failed) {
+        char buf[BUF];
+        k = read(c->fd, buf, min(want, sizeof(buf))); // nobody wants these bytes
+    } else {
+        k = splice(c->fd, nullptr, R->pipeWr, nullptr, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    }
+    if (k < 0 && errno == EINTR) return 1;
+    if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (k <= 0) return -1;
+    c->spliceLeft -= k;
+    if (x && c->windows) windowChunk(c, x, k);
+    if (x && !x->failed) fileChunkPiped(c, x, R->pipeRd, k);
+    return 1;
+}
+
+// Bytes read from c: a legacy command, or more of the auth line or the frame stream.
+// Returns false if the connection was closed.
+bool connInput(reactor* R, conn* c, const char* buf, size_t n) {
+    if (c->authed && !c->framed) {
+        // legacy text protocol: one read() is one command
+        handleClient(c, string_view(buf, strnlen(buf, n)));
+        return true;
+    }
+    c->rd.feed(buf, n);
+    c->rxMem.store(c->rd.buf.capacity(), memory_order_relaxed);
+    if (!c->authed && !onPreAuthData(c)) { closeConn(R, c); return false; }
+    return true;
+}
+
+void ringPump(reactor* R, conn* c);
+
+// Edge-triggered: read until EAGAIN, processing as we go.
+// A paused connection is left unread until retryPaused() picks it up again, a waiting
+// session resume until finishResume().
+void onConnReadable(reactor* R, conn* c) {
+    if (c->paused || c->resumeOf) return;
+    if (R->io) { ringPump(R, c); return; } // the ring reads for us
+    char buf[BUF];
+    while (true) {
+        // finish what is buffered or mid-splice before reading more
+        if (c->framed && !drainFrames(R, c)) return;
+        if (c->paused) { R->paused.push_back(c); return; }
+        if (c->spliceLeft) {
+            int r = spliceChunk(R, c);
+            if (r < 0) { closeConn(R, c); return; }
+            if (c->paused) { R->paused.push_back(c); return; }
+            if (r == 0) return;
+            continue;
+        }
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) { closeConn(R, c); return; } // disconnected
+        if (!connInput(R, c, buf, n)) return;
+        if (c->resumeOf) return; // waits for finishResume()
+    }
+}
+
+// Give paused senders another go once their target drained (or went away) and the workers
+// caught up with the files they are saving
+void retryPaused(reactor* R) {
+    vector<conn*> waiting;
+    waiting.swap(R->paused);
+    for (conn* c : waiting) {
+        conn* t = c->blockedNode >= 0 ? fedTrunk(c->blockedNode) : c->blockedOn.empty() ? nullptr : lookupConn(c->blockedOn);
+        bool drained = (!t || t->queued.load() < FWD_LOW_WATER) && c->saveQueued.load() < SAVE_LOW_WATER;
+        if (t) connUnref(t);
+        if (!drained) { R->paused.push_back(c); continue; }
+        c->paused = false;
+        onConnReadable(R, c);
+    }
+}
+
+// Hand back the windows held for streams whose destination drained (or went away)
+void retryWindows(reactor* R) {
+    vector<conn*> waiting;
+    waiting.swap(R->owing);
+    for (conn* c : waiting) {
+        bool still = false;
+        if (!c->closed) {
+            for (xfer* x : c->xfers) {
+                if (!x || !x->held) continue;
+                if (xferHasRoom(c, x, true)) { x->held = false; grantWindow(c, x); }
+                else still = true;
+            }
+        }
+        if (still) { R->owing.push_back(c); continue; }
+        c->owing = false;
+        connUnref(c);
+    }
+}
+
+conn* newConn(reactor* R, int fd) {
+    conn* c = new conn(fd, R->id);
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &NOTSENT_LOWAT, sizeof(NOTSENT_LOWAT));
+    if (pool) c->strand = new work_strand((int)(c->serial % pool->size()));
+    return c;
+}
+
+void ringAdopt(reactor* R, conn* c);
+void ringWantHandshake(reactor* R, conn* c, bool write);
+
+// Move c's TLS handshake on, in userspace. Once it is through the kernel has the keys, and c
+// goes on like any other connection: its auth line (or a trunk's hello) is read and written
+// in plaintext on our side, sendfile() and splice() included.
+void tlsHandshake(reactor* R, conn* c) {
+    bool wantWrite = false;
+    string err;
+    int r = tlsStep(c->tls, wantWrite, err);
+    if (r == 0) {
+        if (R->io) ringWantHandshake(R, c, wantWrite); // epoll: the next edge brings us back
+        return;
+    }
+    if (r < 0) {
+        metAdd(M_TLS_FAIL);
+        login(LOG_WARN, "TLS handshake " + (c->node >= 0 ? "with server " + fedNodes[c->node].name + " " : "") + "failed: " + err);
+        closeConn(R, c);
+        return;
+    }
+    metAdd(M_TLS_OK);
+    tlsEnd(c->tls);
+    c->tls = nullptr;
+    connRef(c); // reading may close c and drop the owner's reference
+    if (R->io) ringAdopt(R, c);
+    else onConnReadable(R, c); // edge-triggered: what came right behind the handshake is waiting
+    connDrain(c);
+    connUnref(c);
+}
+
+// Start watching a new connection on R (accepted, or a trunk we opened)
+void connAdopt(reactor* R, conn* c) {
+    if (R->io) { if (c->tls) tlsHandshake(R, c); else ringAdopt(R, c); }
+    else epollAdd(R->ep, c, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+}
+
+// ---- Admission ----------------------------------------------------------------------------
+// When the backbone comes back every campus reconnects at once. The listen sockets queue up to
+// --backlog of them; each wakeup accepts at most ACCEPT_BATCH, so the auth lines of the ones
+// already in are read between batches. At most --auth-max connections (server-wide) wait for
+// their auth line, none longer than AUTH_TIMEOUT_SEC, and with --src-rate each source address
+// has a token bucket. A connection over either limit is shed before a conn exists for it:
+// "SERVER_BUSY;Retry:MS", then closed. Clients come back after a jittered MS. The hint puts
+// each shed connection behind the ones shed before it, at the rate the server gets through
+// logins (for a full stage that is AUTH_MAX per average stay in it) or the address's rate, so
+// the storm comes back spread out instead of all at once.
+
+atomic<int> authPending(0);         // admitted connections whose auth line has not been handled
+atomic<uint64_t> authStayNs(1000000); // time from accept to auth line, moving average
+atomic<uint32_t> shedRecent(0);     // shed for a full auth stage and not yet due back
+
+struct src_bucket { double tokens, owed; uint64_t at; }; // owed: shed connections not yet due back
+src_bucket* srcBuckets;             // --src-rate: 2^SRC_BUCKET_BITS, addresses that hash alike share one
+mutex srcLocks[SRC_LOCKS];
+
+// Take a token from the bucket of addr (network order). False if it has none, with the wait
+// for a token that no earlier shed connection will take in retryMs.
+bool srcTake(uint32_t addr, int &retryMs) {
+    uint32_t h = (ntohl(addr) * 2654435761u) >> (32 - SRC_BUCKET_BITS);
+    src_bucket &b = srcBuckets[h];
+    lock_guard<mutex> lk(srcLocks[h % SRC_LOCKS]);
+    uint64_t now = monoNs();
+    double refill = b.at ? (now - b.at) / 1e9 * SRC_RATE : SRC_BURST;
+    b.tokens = min(SRC_BURST, b.tokens + refill);
+    b.owed = max(0.0, b.owed - refill);
+    b.at = now;
+    if (b.tokens >= 1) { b.tokens -= 1; return true; }
+    retryMs = (int)((1 - b.tokens + b.owed) / SRC_RATE * 1000) + 1;
+    b.owed += 1;
+    return false;
+}
+
+// Turn a connection away. Whatever it sent already is read first, so the close is a FIN and
+// the hint is not lost to a reset.
+void shed(int fd, int retryMs, metric_id m) {
+    char junk[MAX_AUTH_LINE];
+    while (recv(fd, junk, sizeof(junk), MSG_DONTWAIT) > 0) {}
+    string line = "SERVER_BUSY;Retry:" + to_string(retryMs) + "\n";
+    if (send(fd, line.data(), line.size(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {} // it is going anyway
+    close(fd);
+    metAdd(m);
+}
+
+// Drop up to `limit` of R's connections that have waited longer than maxNs for their auth
+// line, oldest first, and let go of the ones that have sent it. Cheap when nothing is due:
+// only the oldest is looked at. Returns how many were dropped.
+int authSweep(reactor* R, uint64_t maxNs, int limit) {
+    uint64_t now = monoNs();
+    int dropped = 0;
+    while (!R->authWait.empty() && dropped < limit) {
+        conn* c = R->authWait.front();
+        if (c->admitted && !c->closed && now - c->acceptedNs < maxNs) break;
+        R->authWait.pop_front();
+        if (c->admitted && !c->closed) {
+            metAdd(M_AUTH_TIMEOUT);
+            login(LOG_WARN, "Dropped a connection that sent no auth line within " + to_string(maxNs / 1000000) + " ms");
+            closeConn(R, c);
+            dropped++;
+        }
+        connUnref(c);
+    }
+    return dropped;
+}
+
+// A connection just accepted: shed it, or start watching it with its auth deadline running.
+// from may be null (io_uring accept); it is looked up when --src-rate needs it.
+void admit(reactor* R, int fd, const sockaddr_in* from) {
+    int n = authPending.fetch_add(1) + 1;
+    // a full stage first makes room by dropping our oldest if it looks stuck
+    if (AUTH_MAX && n > AUTH_MAX && !authSweep(R, AUTH_EVICT_MS * 1000000ull, 1)) {
+        authPending--;
+        uint64_t ahead = shedRecent.fetch_add(1);
+        shed(fd, (int)min<uint64_t>(SHED_RETRY_MAX_MS, SHED_RETRY_MS + ahead * authStayNs.load() / AUTH_MAX / 1000000), M_SHED_AUTH);
+        return;
+    }
+    if (srcBuckets) {
+        sockaddr_in a; socklen_t al = sizeof(a);
+        if (!from && getpeername(fd, (sockaddr*)&a, &al) == 0) from = &a;
+        int retryMs;
+        if (from && from->sin_family == AF_INET && !srcTake(from->sin_addr.s_addr, retryMs)) {
+            authPending--;
+            shed(fd, min(retryMs, SHED_RETRY_MAX_MS), M_SHED_RATE);
+            return;
+        }
+    }
+    SSL* tls = nullptr;
+    if (tlsServer && !(tls = tlsBegin(tlsServer, fd, true))) { authPending--; close(fd); return; }
+    conn* c = newConn(R, fd);
+    c->tls = tls;
+    c->admitted = true;
+    c->acceptedNs = monoNs();
+    connRef(c);
+    R->authWait.push_back(c);
+    connAdopt(R, c);
+}
+
+// Its auth line is in (served) or it is closing: it no longer counts against --auth-max
+void authDone(conn* c, bool served) {
+    if (!c->admitted) return;
+    c->admitted = false;
+    authPending--;
+    if (served) {
+        uint64_t avg = authStayNs.load(memory_order_relaxed); // racy between reactors, an estimate anyway
+        int64_t d = (int64_t)(monoNs() - c->acceptedNs) - (int64_t)avg;
+        authStayNs.store(max<int64_t>(1000, (int64_t)avg + d / 16), memory_order_relaxed);
+    }
+}
+
+// Reactor 0, every tick: a second's worth of shed connections are due back
+void authTick() {
+    uint64_t back = AUTH_MAX ? (uint64_t)AUTH_MAX * 1000000000ull / authStayNs.load() : 0;
+    uint32_t r = shedRecent.load();
+    shedRecent.store(r > back ? r - (uint32_t)back : 0);
+}
 
-    for (int i=0;i<CRED_COUNT;i++) {
-        if (camp == creds[i].campus && pass == creds[i].pass) { campusOut = camp; return true; }
+// Accept up to ACCEPT_BATCH pending connections on this reactor's listen socket. If there may
+// be more, acceptMore makes the loop come back for them once the current events are served.
+void onAccept(reactor* R) {
+    R->acceptMore = false;
+    for (int k=0;k<ACCEPT_BATCH;k++) {
+        sockaddr_in clientAddr; socklen_t cl = sizeof(clientAddr);
+        int cs = accept4(R->lsrc.fd, (sockaddr*)&clientAddr, &cl, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cs < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) login(LOG_ERROR, "Accept failed: " + string(strerror(errno)));
+            return;
+        }
+        admit(R, cs, &clientAddr);
     }
-    return false;
+    R->acceptMore = true;
 }
 
-// Find index by campus name, or -1 if not present
-int findClientByName(const string &name) {
-    for (int i=0;i<MAX_CLIENTS;i++) if (clients[i].used && name == string(clients[i].name)) return i;
-    return -1;
+uint64_t monoSec() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec;
 }
 
-// Find an empty client slot index or -1
-int findEmptySlot() {
-    for (int i=0;i<MAX_CLIENTS;i++) if (!clients[i].used) return i;
-    return -1;
+// Record a heartbeat for slot idx and make sure its liveness timer is running. Reactor 0 only;
+// the slot must be registered (caller is inside an rcu section or holds mtx).
+void touchHeartbeat(int idx, const sockaddr_in &sender, uint64_t tick, time_t wall) {
+    client_slot &s = clients[idx];
+    bool wasLost = !s.hbOnline.load() && s.lastHB.load() != 0;
+    s.udpKey = udpKeyOf(sender);
+    s.lastHB = wall;
+    s.hbSeen = tick;
+    s.hbOnline = true;
+    uint32_t g = s.gen.load();
+    // the timer is not moved per heartbeat: when it fires, onHeartbeatTimer() pushes it on
+    if (!hbWheel->armed(idx) || s.hbGen != g) {
+        s.hbGen = g;
+        hbWheel->arm(idx, tick + (uint64_t)HB_INTERVAL_SEC*HB_MISS);
+    }
+    if (wasLost) login("Heartbeats from " + string(s.name) + " resumed; campus back online.");
 }
 
-// Add a received file to index; returns true if added
-bool indexReceivedFile(const string &storedName, const string &origName, const string &sender) {
-    for (int i=0;i<MAX_FILES;i++) {
-        if (!receivedFiles[i].used) {
-            receivedFiles[i].used = true;
-            strncpy(receivedFiles[i].storedName, storedName.c_str(), sizeof(receivedFiles[i].storedName)-1);
-            strncpy(receivedFiles[i].originalName, origName.c_str(), sizeof(receivedFiles[i].originalName)-1);
-            strncpy(receivedFiles[i].sender, sender.c_str(), sizeof(receivedFiles[i].sender)-1);
-            receivedFiles[i].receivedAt = time(NULL);
-            return true;
+// ---- Federation membership (reactor 0) ----------------------------------------------------
+
+bool fedChanged = false;           // a server joined or left: rebuild the ring on the next tick
+
+void freeRing(void* p) { delete (fed_ring*)p; }
+
+// Publish a ring of the live servers; the old one is freed once no lookup can be using it
+void fedRebuild() {
+    fed_ring* r = new fed_ring();
+    string members;
+    int n = fedCount.load();
+    for (int i=0;i<n;i++) {
+        if (!fedNodes[i].alive) continue;
+        for (int v=0;v<FED_VNODES;v++) r->points.push_back({fedHash(fedNodes[i].name + "#" + to_string(v)), i});
+        members += (members.empty() ? "" : ", ") + fedNodes[i].name;
+    }
+    sort(r->points.begin(), r->points.end(), [](const pair<uint32_t,int> &a, const pair<uint32_t,int> &b) {
+        return a.first != b.first ? a.first < b.first : fedNodes[a.second].name < fedNodes[b.second].name;
+    });
+    if (fed_ring* old = fedRing.exchange(r, memory_order_acq_rel)) rcuRetire(freeRing, old);
+    login("Federation ring: " + members);
+}
+
+// Campuses logged in here that the new ring gives to another server are disconnected; they
+// log in again, get AUTH_REDIRECT and move to their owner
+void fedRebalance() {
+    vector<conn*> here;
+    {
+        rcu_guard g;
+        for (int i=0;i<MAX_CLIENTS;i++) {
+            conn* t = clients[i].tcpConn.load();
+            if (t && connTryRef(t)) here.push_back(t);
         }
     }
-    return false;
+    int moved = 0;
+    for (conn* t : here) {
+        if (!t->closed && fedOwner(t->campus) >= 0) { shutdown(t->fd, SHUT_RDWR); moved++; }
+        connUnref(t);
+    }
+    if (moved) login(to_string(moved) + " campus(es) moved to other servers; disconnected.");
 }
 
-// Handle one TCP client connection: authenticate, then receive SEND and FILE commands
-void handleClient(int clientSock) {
-    char buf[BUF];
-    memset(buf,0,sizeof(buf));
-    ssize_t r = read(clientSock, buf, sizeof(buf)-1);
-    if (r <= 0) { close(clientSock); return; }
-    string auth(buf);
-    string campus;
-    if (!validateAuth(auth, campus)) {
-        // Before refusing, check if it was "Islamabad" attempt or bad creds
-        // Also check duplicate login
-        mtx.lock();
-        bool duplicate = (findClientByName(campus) != -1);
-        mtx.unlock();
-        if (duplicate) {
-            string resp = "AUTH_FAIL_DUPLICATE";
-            write(clientSock, resp.c_str(), resp.size());
-            login("Rejected duplicate login attempt for " + campus);
-        } else {
-            string resp = "AUTH_FAIL";
-            write(clientSock, resp.c_str(), resp.size());
-            login("Rejected authentication (bad creds or Islamabad attempt).");
+// "Node:<name>;Addr:<host>:<port>;Members:<name>@<host>:<port>,...;Time:<secs>;Mac:<hmac>"
+// from another server: it is alive, and the servers it knows are worth gossiping to. Only
+// gossip signed with the federation key counts, and only if it is newer than the last one
+// from that server, so a recorded datagram cannot be replayed.
+void fedGossip(const char* p, size_t n, uint64_t tick) {
+    string_view g(p, n);
+    string name(fedField(g, "Node:")), host;
+    int port;
+    time_t stamp;
+    if (NODE_NAME.empty() || name.empty() || name == NODE_NAME || !fedVerify(g, stamp)
+        || !fedParseAddr(fedField(g, ";Addr:"), host, port)) return;
+    int i = fedAdd(name, host, port);
+    if (i < 0) return;
+    fed_node &N = fedNodes[i];
+    if (stamp <= N.stamp) return;
+    N.stamp = stamp;
+    N.seen = tick;
+    if (!N.alive) {
+        N.alive = true;
+        fedChanged = true;
+        login("Server " + name + " at " + host + ":" + to_string(port) + " joined the federation");
+    }
+    string_view members = fedField(g.substr(0, g.rfind(";Time:")), ";Members:");
+    while (!members.empty()) {
+        string_view m = members.substr(0, members.find(','));
+        members.remove_prefix(min(members.size(), m.size() + 1));
+        size_t at = m.find('@');
+        string mh;
+        int mp;
+        if (at == string_view::npos || m.substr(0, at) == NODE_NAME || !fedParseAddr(m.substr(at + 1), mh, mp)) continue;
+        fedAdd(string(m.substr(0, at)), mh, mp);
+    }
+}
+
+sockaddr_in fedAddr(const string &host, int port) {
+    sockaddr_in a;
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &a.sin_addr) != 1) a.sin_port = 0;
+    return a;
+}
+
+// "Node:<name>;Addr:<host>:<port>": how this server introduces itself (signed by the caller)
+string fedHello() {
+    return "Node:" + NODE_NAME + ";Addr:" + NODE_HOST + ":" + to_string(TCP_port);
+}
+
+// Open the trunk to server n. The connect finishes in the background; the hello line and
+// anything routed meanwhile wait in its queue.
+void fedDial(reactor* R, int n) {
+    const fed_node &N = fedNodes[n];
+    sockaddr_in a = fedAddr(N.host, N.port);
+    if (!a.sin_port) return;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
+    if (connect(fd, (sockaddr*)&a, sizeof(a)) < 0 && errno != EINPROGRESS) { close(fd); return; }
+    SSL* tls = nullptr;
+    if (tlsTrunk && !(tls = tlsBegin(tlsTrunk, fd, false, N.host))) { close(fd); return; }
+    conn* c = newConn(R, fd);
+    c->tls = tls;
+    fedTrunkUp(c, n);
+    connSend(c, fedSign(fedHello() + ";To:" + N.name + ";Nonce:" + newSessionToken() + ";Proto:" + to_string(PROTO_VERSION)) + "\n");
+    connAdopt(R, c);
+    login("Opening trunk to server " + N.name + " at " + N.host + ":" + to_string(N.port));
+}
+
+// Once a second: drop servers gone silent, rebuild the ring if it changed, gossip to every
+// server known (and the --peer seeds), open missing trunks. Of each pair of servers, the one
+// whose name sorts first opens the trunk.
+void fedTick(reactor* R, uint64_t tick) {
+    if (NODE_NAME.empty()) return;
+    int n = fedCount.load();
+    for (int i=1;i<n;i++) {
+        fed_node &N = fedNodes[i];
+        if (N.alive && tick - N.seen >= (uint64_t)FED_DEAD_SEC) {
+            N.alive = false;
+            fedChanged = true;
+            login(LOG_WARN, "Server " + N.name + " left the federation (silent for " + to_string(FED_DEAD_SEC) + " s)");
         }
-        close(clientSock);
-        return;
     }
+    if (fedChanged) {
+        fedChanged = false;
+        fedRebuild();
+        fedRebalance();
+    }
+    string g = fedHello() + ";Members:";
+    size_t bare = g.size();
+    for (int i=1;i<n;i++) {
+        const fed_node &N = fedNodes[i];
+        string m = N.name + "@" + N.host + ":" + to_string(N.port);
+        if (!N.alive || g.size() + 1 + m.size() + FED_SIG_MAX > (size_t)HB_DGRAM_MAX) continue;
+        g += (g.size() == bare ? "" : ",") + m;
+    }
+    g = fedSign(g);
+    auto gossip = [&](const string &host, int port) {
+        sockaddr_in a = fedAddr(host, port + (UDP_port - TCP_port));
+        if (a.sin_port) sendto(R->usrc.fd, g.data(), g.size(), MSG_DONTWAIT, (sockaddr*)&a, sizeof(a));
+    };
+    for (int i=1;i<n;i++) gossip(fedNodes[i].host, fedNodes[i].port);
+    for (auto &s : FED_SEEDS) gossip(s.first, s.second);
+    for (int i=1;i<n;i++)
+        if (fedNodes[i].alive && NODE_NAME < fedNodes[i].name && !fedNodes[i].trunk.load()) fedDial(R, i);
+}
 
-    // Prevent duplicate login even if creds were correct: check again under lock
+// Handle one heartbeat like "Campus:Name;HB:online" (n bytes, not NUL-terminated):
+// stores sender address and updates lastHB. Will register UDP-only clients if needed.
+// A known campus costs one lock-free lookup and no allocation.
+void handleHeartbeat(const char* p, size_t n, const sockaddr_in &sender, uint64_t tick, time_t wall) {
+    if (n > 5 && memcmp(p, "Node:", 5) == 0) { fedGossip(p, n, tick); return; }
+    const char* c = (const char*)memmem(p, n, "Campus:", 7);
+    if (!c) return;
+    const char* name = c + 7;
+    const char* end = (const char*)memchr(name, ';', p + n - name);
+    if (!end) end = p + n;
+    size_t len = end - name;
+    if (len == 0 || len >= sizeof(clients[0].name)) return;
+    metAdd(M_HEARTBEATS);
+
+    {
+        rcu_guard g;
+        const route* r = routes->find(name, len);
+        if (r) { touchHeartbeat(r->slot, sender, tick, wall); return; }
+    }
+    // otherwise register as UDP-only
+    string nm(name, len);
     mtx.lock();
-    if (findClientByName(campus) != -1) {
-        mtx.unlock();
-        string resp = "AUTH_FAIL_DUPLICATE";
-        write(clientSock, resp.c_str(), resp.size());
-        login("Rejected duplicate login attempt for " + campus);
-        close(clientSock);
-        return;
+    const route* r = routes->find(nm);
+    int e = r ? r->slot : registerCampus(nm, nullptr); // UDP-only for now
+    if (e != -1) {
+        touchHeartbeat(e, sender, tick, wall);
+        if (!r) login("Registered UDP-only campus: " + nm);
+    } else {
+        login(LOG_WARN, "No slot free to register heartbeat from " + nm);
     }
-    // register in clients[]
-    int idx = findEmptySlot();
-    if (idx == -1) {
-        mtx.unlock();
-        string resp = "SERVER_FULL";
-        write(clientSock, resp.c_str(), resp.size());
-        login("Rejected auth: server full for " + campus);
-        close(clientSock);
-        return;
+    mtx.unlock();
+}
+
+// UDP socket readable: drain all queued heartbeats, HB_BATCH per recvmmsg()
+void onUdpReadable(reactor* R) {
+    static char bufs[HB_BATCH][HB_DGRAM_MAX];
+    static iovec iov[HB_BATCH];
+    static sockaddr_in from[HB_BATCH];
+    static mmsghdr msgs[HB_BATCH];
+    while (true) {
+        for (int i=0;i<HB_BATCH;i++) {
+            iov[i].iov_base = bufs[i]; iov[i].iov_len = HB_DGRAM_MAX;
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_iov = &iov[i]; msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &from[i]; msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        }
+        int n = recvmmsg(R->usrc.fd, msgs, HB_BATCH, MSG_DONTWAIT, nullptr);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return; // EAGAIN: drained
+        uint64_t tick = monoSec();
+        time_t wall = time(NULL);
+        for (int i=0;i<n;i++) {
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+            handleHeartbeat(bufs[i], msgs[i].msg_len, from[i], tick, wall);
+        }
+        // keep going until EAGAIN even after a short batch: UDP only signals readiness again
+        // when its queue goes from empty to non-empty
+    }
+}
+
+// Liveness timer of slot idx fired. If a heartbeat came in meanwhile the timer is pushed on to
+// HB_MISS intervals after it; otherwise the campus is marked offline, and a UDP-only campus is
+// dropped from the routing table altogether.
+void onHeartbeatTimer(int idx, uint64_t tick) {
+    client_slot &s = clients[idx];
+    if (s.hbGen != s.gen.load()) return; // re-registered since; its first heartbeat re-arms
+    uint64_t due = s.hbSeen + (uint64_t)HB_INTERVAL_SEC*HB_MISS;
+    if (due > tick) { hbWheel->arm(idx, due); return; }
+    lock_guard<metered_mutex> lk(mtx);
+    if (!s.used || s.gen.load() != s.hbGen) return;
+    if (!s.tcpConn.load()) {
+        login(LOG_WARN, "UDP-only campus " + string(s.name) + " missed " + to_string(HB_MISS) + " heartbeats; removed.");
+        unregisterCampus(idx, s.name);
+    } else {
+        s.hbOnline = false;
+        login(LOG_WARN, "Campus " + string(s.name) + " missed " + to_string(HB_MISS) + " heartbeats; marked offline.");
+    }
+}
+
+// Heartbeat summary: prints only when >=1 client is registered.
+// Stops printing once all disconnect (i.e., only prints if at least one clients[].used == true).
+void printHeartbeatSummary() {
+    mtx.lock();
+    bool any = false;
+    for (int i=0;i<MAX_CLIENTS;i++) if (clients[i].used) { any = true; break; }
+    if (!any) { mtx.unlock(); return; } // skip printing if no clients
+    cout << "\n===== HEARTBEAT SUMMARY =====\n";
+    time_t now = time(NULL);
+    for (int i=0;i<MAX_CLIENTS;i++) {
+        if (clients[i].used) {
+            cout << "["<<i<<"] " << clients[i].name;
+            if (clients[i].tcpSock != -1) cout << " (TCP)";
+            else cout << " (UDP-only)";
+            if (clients[i].lastHB == 0) cout << " | lastHB: never\n";
+            else cout << " | lastHB: " << (now - clients[i].lastHB.load()) << "s ago" << (clients[i].hbOnline ? "" : " (offline)") << "\n";
+        }
     }
-    clients[idx].used = true;
-    strncpy(clients[idx].name, campus.c_str(), sizeof(clients[idx].name)-1);
-    clients[idx].tcpSock = clientSock;
-    clients[idx].lastHB = 0; // will be updated when UDP heartbeat arrives
-    memset(&clients[idx].udpAddr, 0, sizeof(clients[idx].udpAddr));
+    cout << "=============================\n";
     mtx.unlock();
+}
+
+// One-second tick: advance the liveness wheel, expire dropped sessions, print the summary every HB_SUMMARY_SEC
+void onTimer(reactor* R) {
+    uint64_t expirations;
+    while (read(R->tsrc.fd, &expirations, sizeof(expirations)) > 0) {}
+    static uint64_t nextSummary = monoSec() + HB_SUMMARY_SEC;
+    uint64_t tick = monoSec();
+    hbWheel->advance(tick, [tick](int idx) { onHeartbeatTimer(idx, tick); });
+    sessionSweep(tick);
+    fedTick(R, tick);
+    authTick();
+    if (tick >= nextSummary) {
+        nextSummary = tick + HB_SUMMARY_SEC;
+        printHeartbeatSummary();
+    }
+}
+
+// ---- io_uring backend (--io uring) --------------------------------------------------------
+// The same reactor with a ring (uring.h) in place of epoll. The listen socket has a multishot
+// accept; each connection is put in the ring's file table and gets a multishot recv into
+// provided buffers, whose bytes are handled like a read() in onConnReadable(); heartbeats
+// arrive through a multishot recvmsg. The timer, the wake eventfd and a full socket are polls.
+// Output still goes out with writev()/sendfile() from connDrain(). Plain files saved on the
+// server are written by the ring too, from registered buffers at their offsets.
+
+// Completions carry the object they are for, with its kind in the low bits
+enum { UD_NONE, UD_ACCEPT, UD_RECV, UD_POLLOUT, UD_HB, UD_TIMER, UD_WAKE, UD_WRITE, UD_FILES, UD_TLS };
+const uint64_t UD_KIND = 15;
+static_assert(__STDCPP_DEFAULT_NEW_ALIGNMENT__ >= 16, "user_data tags need 16-byte aligned objects");
+const uint16_t URING_RX_GROUP = 0, URING_HB_GROUP = 1;
+const int NO_FD = -1;               // clears a file table slot
+
+uint64_t udOf(const void* p, int kind) { return (uint64_t)(uintptr_t)p | kind; }
+
+// A saved-file write in flight, in a registered buffer slot
+struct alignas(16) ring_write { conn* c; xfer* x; uint32_t len; };
+
+struct uring_io {
+    uring ring;
+    uring_bufs rx;             // socket reads
+    uring_bufs hb;             // heartbeat datagrams (reactor 0)
+    msghdr hbMsg;              // what a heartbeat recvmsg asks for: just the sender's address
+    int files;                 // file table slots (0: no table, sockets are used by fd)
+    bool fixedBufs;            // wmem is registered
+    char* wmem;                // URING_WRITE_SLOTS x FILE_CHUNK
+    ring_write writes[URING_WRITE_SLOTS];
+    vector<int> wfree;         // free slots of wmem
+    bool acceptOn;             // the multishot accept is armed
+};
+
+void ringArmAccept(reactor* R) {
+    R->io->ring.acceptMulti(R->lsrc.fd, SOCK_NONBLOCK | SOCK_CLOEXEC, udOf(R, UD_ACCEPT));
+    R->io->acceptOn = true;
+}
+
+void ringArmRecv(reactor* R, conn* c) {
+    connRef(c);
+    c->recvArmed = true;
+    c->recvStop = false;
+    R->io->ring.recvMulti(c->fd, c->fixed, URING_RX_GROUP, udOf(c, UD_RECV));
+}
+
+// Stop reading c until ringPump() wants more
+void ringStopRecv(reactor* R, conn* c) {
+    if (!c->recvArmed || c->recvStop) return;
+    c->recvStop = true;
+    R->io->ring.cancel(udOf(c, UD_RECV));
+}
+
+// connDrain() hit a full socket: come back when it has room
+void ringWantWrite(conn* c) {
+    reactor* R = reactors[c->reactor];
+    if (!R->io || c->outArmed) return;
+    connRef(c);
+    c->outArmed = true;
+    R->io->ring.poll(c->fd, POLLOUT, false, udOf(c, UD_POLLOUT));
+}
+
+// The TLS handshake waits for c's socket: readable, or writable if write
+void ringWantHandshake(reactor* R, conn* c, bool write) {
+    connRef(c);
+    c->tlsArmed = true;
+    R->io->ring.poll(c->fd, write ? POLLOUT : POLLIN, false, udOf(c, UD_TLS));
+}
+
+// closeConn(): stop what the ring still does for c and take it out of the file table
+void ringForget(reactor* R, conn* c) {
+    uring &u = R->io->ring;
+    if (c->recvArmed) u.cancel(udOf(c, UD_RECV));
+    if (c->outArmed) u.cancel(udOf(c, UD_POLLOUT));
+    if (c->tlsArmed) u.cancel(udOf(c, UD_TLS));
+    if (c->fixed) u.filesUpdate(&NO_FD, 1, c->fd, 0, UD_NONE);
+    c->held.clear();
+}
+
+// Handle what c has buffered until it pauses: complete frames, then reads held back meanwhile;
+// then make sure it is being read
+void ringPump(reactor* R, conn* c) {
+    while (!c->closed && !c->resumeOf) {
+        if (c->framed && !drainFrames(R, c)) return;
+        if (c->paused) { R->paused.push_back(c); ringStopRecv(R, c); return; }
+        if (c->held.empty()) {
+            c->recvStop = false; // a cancel still in flight: its completion re-arms
+            if (!c->recvArmed) ringArmRecv(R, c);
+            return;
+        }
+        slab_string s = move(c->held.front());
+        c->held.pop_front();
+        if (s.empty()) { closeConn(R, c); return; }
+        if (!connInput(R, c, s.data(), s.size())) return;
+    }
+}
+
+// What c's recv brought (p == nullptr: EOF or an error). Handled right away unless c must not
+// be read now; then it waits in c->held and the recv is stopped.
+void ringInput(reactor* R, conn* c, const char* p, size_t n) {
+    if (c->closed) return;
+    if (c->paused || c->resumeOf || !c->held.empty()) {
+        c->held.emplace_back(p ? slab_string(p, n) : slab_string());
+        ringStopRecv(R, c);
+        return;
+    }
+    if (!p) { closeConn(R, c); return; }
+    if (!connInput(R, c, p, n)) return;
+    ringPump(R, c);
+}
 
-    login("Authenticated and connected TCP: " + campus);
-    write(clientSock, string("AUTH_OK").c_str(), 7);
+// c's multishot recv completed: bytes in a provided buffer, EOF or an error. It ends after
+// EOF or an error, when the buffers ran out or when it was cancelled, and is armed again as
+// long as c is being read.
+void ringReceived(reactor* R, conn* c, const io_uring_cqe &e) {
+    if (e.res > 0) {
+        unsigned bid = e.flags >> IORING_CQE_BUFFER_SHIFT;
+        ringInput(R, c, R->io->rx.at(bid), e.res);
+        R->io->rx.give(bid);
+    } else if (e.res != -ENOBUFS && e.res != -ECANCELED) {
+        ringInput(R, c, nullptr, 0);
+    }
+    if (e.flags & IORING_CQE_F_MORE) return;
+    c->recvArmed = false;
+    if (!c->closed && !c->recvStop) ringArmRecv(R, c);
+    connUnref(c);
+}
+
+// A new connection goes into the file table (linked to its first recv, which then uses it)
+void ringAdopt(reactor* R, conn* c) {
+    uring_io* io = R->io;
+    c->fixed = c->fd < io->files;
+    if (c->fixed) io->ring.filesUpdate(&c->fd, 1, c->fd, IOSQE_IO_LINK, udOf(c, UD_FILES));
+    ringArmRecv(R, c);
+}
+
+void ringAccepted(reactor* R, const io_uring_cqe &e) {
+    uring_io* io = R->io;
+    if (e.res >= 0) {
+        admit(R, e.res, nullptr);
+    } else if (e.res != -ECANCELED) {
+        login(LOG_ERROR, "Accept failed: " + string(strerror(-e.res)));
+    }
+    // after an error (out of descriptors, say) the loop re-arms it PAUSE_RETRY_MS later
+    if (!(e.flags & IORING_CQE_F_MORE)) { io->acceptOn = false; if (e.res >= 0) ringArmAccept(R); }
+}
+
+// A heartbeat datagram: io_uring_recvmsg_out, the sender's address, the payload
+void ringHeartbeat(reactor* R, const io_uring_cqe &e) {
+    uring_io* io = R->io;
+    if (e.res > 0) {
+        unsigned bid = e.flags >> IORING_CQE_BUFFER_SHIFT;
+        const io_uring_recvmsg_out* o = (const io_uring_recvmsg_out*)io->hb.at(bid);
+        if (!(o->flags & MSG_TRUNC) && o->namelen >= sizeof(sockaddr_in)) {
+            sockaddr_in from;
+            memcpy(&from, o + 1, sizeof(from));
+            const char* p = (const char*)(o + 1) + io->hbMsg.msg_namelen + io->hbMsg.msg_controllen;
+            handleHeartbeat(p, o->payloadlen, from, monoSec(), time(NULL));
+        }
+        io->hb.give(bid);
+    }
+    if (!(e.flags & IORING_CQE_F_MORE)) io->ring.recvmsgMulti(R->usrc.fd, &io->hbMsg, URING_HB_GROUP, udOf(R, UD_HB));
+}
+
+// Write n bytes at off without the ring
+bool pwriteAll(int fd, const char* p, size_t n, off_t off) {
+    while (n > 0) {
+        ssize_t w = pwrite(fd, p, n, off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w; n -= w; off += w;
+    }
+    return true;
+}
+
+// Save side of a chunk under --io uring: unpack it, copy it into registered buffers and write
+// it at its offset, so writes need not complete in order. With every buffer in flight the
+// piece is written right here. Reading the sender stops while too much is in flight.
+void ringSave(conn* c, xfer* x, const char* p, size_t n, bool packed) {
+    if (x->failed) return;
+    if (packed) {
+        static thread_local string raw;
+        if (!unpackBody(p, n, raw)) { saveFailed(c, x, "BAD_FORMAT"); return; }
+        p = raw.data(); n = raw.size();
+    }
+    uring_io* io = reactors[c->reactor]->io;
+    while (n > 0) {
+        size_t k = min(n, (size_t)FILE_CHUNK);
+        off_t off = (off_t)x->bytes;
+        x->bytes += k;
+        if (io->wfree.empty()) {
+            if (!pwriteAll(x->fd, p, k, off)) { saveFailed(c, x); return; }
+        } else {
+            int i = io->wfree.back();
+            io->wfree.pop_back();
+            char* b = io->wmem + (size_t)i * FILE_CHUNK;
+            memcpy(b, p, k);
+            ring_write &w = io->writes[i];
+            w.c = c; w.x = x; w.len = (uint32_t)k;
+            connRef(c);
+            x->ringWrites++;
+            c->saveQueued += k;
+            io->ring.write(x->fd, b, (unsigned)k, off, io->fixedBufs ? i : -1, udOf(&w, UD_WRITE));
+        }
+        p += k; n -= k;
+    }
+    if (!c->windows && c->saveQueued.load() > SAVE_HIGH_WATER) { c->paused = true; c->blockedOn.clear(); c->blockedNode = -1; }
+}
+
+void ringWritten(reactor* R, ring_write* w, int res) {
+    conn* c = w->c;
+    xfer* x = w->x;
+    if (res != (int)w->len && !x->failed) saveFailed(c, x);
+    R->io->wfree.push_back((int)(w - R->io->writes));
+    c->saveQueued -= w->len;
+    if (--x->ringWrites == 0 && x->ringEnd) saveEnd(c, x, x->ringOk);
+    connUnref(c);
+}
+
+void onCompletion(reactor* R, const io_uring_cqe &e) {
+    void* p = (void*)(uintptr_t)(e.user_data & ~UD_KIND);
+    bool more = e.flags & IORING_CQE_F_MORE;
+    switch (e.user_data & UD_KIND) {
+    case UD_ACCEPT: ringAccepted(R, e); break;
+    case UD_RECV:   ringReceived(R, (conn*)p, e); break;
+    case UD_POLLOUT: {
+        conn* c = (conn*)p;
+        c->outArmed = false;
+        connDrain(c);
+        connUnref(c);
+        break;
+    }
+    case UD_TLS: {
+        conn* c = (conn*)p;
+        c->tlsArmed = false;
+        if (!c->closed) tlsHandshake(R, c);
+        connUnref(c);
+        break;
+    }
+    case UD_HB:     ringHeartbeat(R, e); break;
+    case UD_TIMER:
+        onTimer(R);
+        if (!more) R->io->ring.poll(R->tsrc.fd, POLLIN, true, udOf(R, UD_TIMER));
+        break;
+    case UD_WAKE: {
+        uint64_t cnt;
+        while (read(R->wsrc.fd, &cnt, sizeof(cnt)) > 0) {}
+        if (!more) R->io->ring.poll(R->wsrc.fd, POLLIN, true, udOf(R, UD_WAKE));
+        break;
+    }
+    case UD_WRITE:  ringWritten(R, (ring_write*)p, e.res); break;
+    case UD_FILES:  ((conn*)p)->fixed = false; break; // not installed: the linked recv fails and is re-armed on the fd
+    }
+}
 
-    // Main loop: read commands from client
+// Create R's ring (from main) and register its buffers and file table. False if this kernel
+// cannot run the backend.
+bool uringSetup(reactor* R) {
+    uring_io* io = new uring_io();
+    if (!io->ring.init(URING_ENTRIES)) return false;
+    if (!io->rx.init(io->ring, URING_RX_GROUP, URING_RX_BUFS, BUF)) return false;
+    if (R->usrc.fd != -1 && !io->hb.init(io->ring, URING_HB_GROUP, URING_HB_BUFS, URING_HB_BUF)) return false;
+    memset(&io->hbMsg, 0, sizeof(io->hbMsg));
+    io->hbMsg.msg_namelen = sizeof(sockaddr_in);
+    rlimit rl;
+    io_uring_rsrc_register files;
+    memset(&files, 0, sizeof(files));
+    files.nr = URING_FILES;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < files.nr) files.nr = (unsigned)rl.rlim_cur;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    io->files = io->ring.reg(IORING_REGISTER_FILES2, &files, sizeof(files)) == 0 ? (int)files.nr : 0;
+    io->wmem = (char*)mmap(nullptr, (size_t)URING_WRITE_SLOTS * FILE_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (io->wmem == MAP_FAILED) return false;
+    iovec iov[URING_WRITE_SLOTS];
+    for (int i=0;i<URING_WRITE_SLOTS;i++) { iov[i].iov_base = io->wmem + (size_t)i * FILE_CHUNK; iov[i].iov_len = FILE_CHUNK; }
+    io->fixedBufs = io->ring.reg(IORING_REGISTER_BUFFERS, iov, URING_WRITE_SLOTS) == 0; // may exceed RLIMIT_MEMLOCK
+    for (int i=URING_WRITE_SLOTS-1;i>=0;i--) io->wfree.push_back(i);
+    if (!io->files || !io->fixedBufs)
+        login(LOG_WARN, string("io_uring: no ") + (io->files ? "registered buffers" : "file table") + " on reactor " + to_string(R->id) + ", using plain ones");
+    io->acceptOn = false;
+    R->io = io;
+    return true;
+}
+
+// Event loop of a reactor under --io uring: one io_uring_enter() submits everything queued
+// and waits for the next completions
+void uringLoop(reactor* R) {
+    uring_io* io = R->io;
+    if (!io->ring.enable()) { login(LOG_ERROR, "io_uring enable failed: " + string(strerror(errno))); return; }
+    ringArmAccept(R);
+    if (R->usrc.fd != -1) io->ring.recvmsgMulti(R->usrc.fd, &io->hbMsg, URING_HB_GROUP, udOf(R, UD_HB));
+    if (R->tsrc.fd != -1) io->ring.poll(R->tsrc.fd, POLLIN, true, udOf(R, UD_TIMER));
+    io->ring.poll(R->wsrc.fd, POLLIN, true, udOf(R, UD_WAKE));
     while (true) {
-        memset(buf,0,sizeof(buf));
-        ssize_t n = read(clientSock, buf, sizeof(buf)-1);
-        if (n <= 0) break; // disconnected
-
-        string inc(buf);
-        // Two supported patterns:
-        // 1) SEND|Target|Message
-        // 2) FILE|Target|Filename|<content>
-        if (inc.rfind("SEND|",0) == 0) {
-            size_t p1 = inc.find("|",5);
-            if (p1 == string::npos) { write(clientSock, "BAD_FORMAT",9); continue; }
-            string target = inc.substr(5, p1-5);
-            string text = inc.substr(p1+1);
-
-            if (target == "Islamabad") {
-                // Message intended to server => show it on server console explicitly
-                login("MESSAGE TO SERVER from " + campus + ": " + text);
-                write(clientSock, "DELIVERED_TO_SERVER",18);
-            } else {
-                mtx.lock();
-                int tid = findClientByName(target);
-                if (tid != -1 && clients[tid].used && clients[tid].tcpSock != -1) {
-                    string fwd = "From " + campus + ": " + text;
-                    write(clients[tid].tcpSock, fwd.c_str(), fwd.size());
-                    write(clientSock, "DELIVERED",9);
-                    login("Routed message from " + campus + " to " + target);
-                } else {
-                    write(clientSock, "TARGET_OFFLINE",14);
-                    login("Failed to route message from " + campus + " to " + target + " (offline).");
-                }
-                mtx.unlock();
-            }
+        bool retry = !R->paused.empty() || !R->owing.empty() || rcuPending.load() || !io->acceptOn;
+        timespec ts = { 0, PAUSE_RETRY_MS * 1000000L };
+        if (!retry && !R->authWait.empty()) ts = { 1, 0 }; // auth deadlines
+        if (io->ring.enter(true, retry || !R->authWait.empty() ? &ts : nullptr) < 0 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+            login(LOG_ERROR, "io_uring_enter failed: " + string(strerror(errno)));
+            return;
         }
-        else if (inc.rfind("FILE|",0) == 0) {
-            // parse: FILE|Target|Filename|<content>
-            size_t p1 = inc.find("|",5);
-            size_t p2 = string::npos;
-            if (p1 != string::npos) p2 = inc.find("|", p1+1);
-            if (p1==string::npos || p2==string::npos) {
-                write(clientSock, "INVALID_FILE_FORMAT",19);
-                continue;
+        if (!io->acceptOn) ringArmAccept(R);
+        io->ring.reap([R](const io_uring_cqe &e) { onCompletion(R, e); });
+        if (!R->paused.empty()) retryPaused(R);
+        if (!R->owing.empty()) retryWindows(R);
+        if (!R->authWait.empty()) authSweep(R, AUTH_TIMEOUT_SEC * 1000000000ull, INT_MAX);
+        processReady(R); // output queued during this round, by us or by other reactors
+        rcuReclaim();    // routes, slots and connections unregistered a grace period ago
+    }
+}
+
+// Event loop: one thread per reactor, no per-connection threads
+void reactorLoop(reactor* R) {
+    curReactor = R;
+    if (!metSelf) metRegister(); // count its heap allocations from the first one
+    if (R->io) { uringLoop(R); return; }
+    epoll_event evs[MAX_EVENTS];
+    while (true) {
+        bool retry = !R->paused.empty() || !R->owing.empty() || rcuPending.load();
+        int n = epoll_wait(R->ep, evs, MAX_EVENTS, R->acceptMore ? 0 : retry ? PAUSE_RETRY_MS : !R->authWait.empty() ? 1000 : -1);
+        if (n < 0) { if (errno == EINTR) continue; login(LOG_ERROR, "epoll_wait failed"); return; }
+        for (int i=0;i<n;i++) {
+            evsrc* s = (evsrc*)evs[i].data.ptr;
+            switch (s->kind) {
+            case EV_LISTEN: onAccept(R); break;
+            case EV_UDP:    onUdpReadable(R); break;
+            case EV_TIMER:  onTimer(R); break;
+            case EV_WAKE: {
+                uint64_t cnt;
+                while (read(R->wsrc.fd, &cnt, sizeof(cnt)) > 0) {}
+                break;
+            }
+            case EV_CONN: {
+                conn* c = (conn*)s;
+                if (c->tls) { tlsHandshake(R, c); break; }
+                if (evs[i].events & EPOLLOUT) connDrain(c);
+                if (evs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) onConnReadable(R, c);
+                break;
             }
-            string target = inc.substr(5, p1-5);
-            string fname = inc.substr(p1+1, p2-(p1+1));
-            string content = inc.substr(p2+1);
-
-            if (target == "Islamabad") {
-                // Save file on server disk
-                string stored = "received_from_" + campus + "_" + fname;
-                ofstream ofs(stored.c_str(), ios::out | ios::binary);
-                if (!ofs) {
-                    write(clientSock, "SERVER_SAVE_ERR",16);
-                    login("Error saving file from " + campus + ": " + fname);
-                } else {
-                    ofs << content;
-                    ofs.close();
-                    mtx.lock();
-                    indexReceivedFile(stored, fname, campus);
-                    mtx.unlock();
-                    write(clientSock, "FILE_SAVED_ON_SERVER",20);
-                    login("Saved file from " + campus + " as " + stored);
-                }
-            } else {
-                // Forward file to target client if connected
-                mtx.lock();
-                int tid = findClientByName(target);
-                if (tid != -1 && clients[tid].used && clients[tid].tcpSock != -1) {
-                    // forward raw packet exactly as received
-                    write(clients[tid].tcpSock, inc.c_str(), inc.size());
-                    write(clientSock, "FILE_FORWARDED",14);
-                    login("Forwarded file '" + fname + "' from " + campus + " to " + target);
-                } else {
-                    write(clientSock, "TARGET_OFFLINE",14);
-                    login("File forward failed from " + campus + " to " + target + " (offline).");
-                }
-                mtx.unlock();
             }
         }
-        else {
-            write(clientSock, "UNKNOWN_CMD",11);
+        if (!R->paused.empty()) retryPaused(R);
+        if (!R->owing.empty()) retryWindows(R);
+        if (R->acceptMore) onAccept(R); // the rest of a storm, now that this round's auth lines are read
+        if (!R->authWait.empty()) authSweep(R, AUTH_TIMEOUT_SEC * 1000000000ull, INT_MAX);
+        processReady(R); // output queued during this round, by us or by other reactors
+        rcuReclaim();    // routes, slots and connections unregistered a grace period ago
+    }
+}
+
+// TCP listen socket for one reactor; SO_REUSEPORT lets every reactor bind the same port
+int makeListenSocket() {
+    int ss = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ss < 0) return -1;
+    sockaddr_in saddr; memset(&saddr,0,sizeof(saddr));
+    saddr.sin_family = AF_INET; saddr.sin_port = htons(TCP_port); saddr.sin_addr.s_addr = INADDR_ANY;
+    int opt = 1; setsockopt(ss, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (REACTORS > 1) setsockopt(ss, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    if (bind(ss, (sockaddr*)&saddr, sizeof(saddr)) < 0) { close(ss); return -1; }
+    if (listen(ss, LISTEN_BACKLOG) < 0) { close(ss); return -1; }
+    return ss;
+}
+
+// UDP heartbeat socket (non-blocking, polled by reactor 0)
+int makeUdpSocket() {
+    int usock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (usock < 0) return -1;
+    sockaddr_in addr; memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET; addr.sin_port = htons(UDP_port); addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(usock, (sockaddr*)&addr, sizeof(addr)) < 0) { close(usock); return -1; }
+    int rcv = 4 << 20; // absorb heartbeat bursts from many campuses (capped by net.core.rmem_max)
+    setsockopt(usock, SOL_SOCKET, SO_RCVBUF, &rcv, sizeof(rcv));
+    int all = 0; // no multicast datagrams for groups this socket never joined (Linux delivers them by default)
+    setsockopt(usock, IPPROTO_IP, IP_MULTICAST_ALL, &all, sizeof(all));
+    return usock;
+}
+
+// One-second timer that drives heartbeat expiry and the summary
+int makeTickTimer() {
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd < 0) return -1;
+    itimerspec its; memset(&its,0,sizeof(its));
+    its.it_interval.tv_sec = 1; its.it_value.tv_sec = 1;
+    timerfd_settime(tfd, 0, &its, nullptr);
+    return tfd;
+}
+
+// ---- Metrics endpoint (--metrics) ---------------------------------------------------------
+// Prometheus text over HTTP, on 127.0.0.1:PORT or a Unix socket. Served by its own thread from
+// the per-thread counters (metrics.h) and lock-free reads of the routing table, so a scrape
+// never takes mtx and never stalls a reactor.
+
+struct campus_row {
+    string name;
+    const campus_counters* st;
+    bool tcp;
+    size_t queued;
+    size_t memory;     // the connection, its receive buffer and queued output
+    bool hbOnline;
+};
+
+string metricsText() {
+    string out;
+    metTotalsText(out, metCollect());
+
+    rcu_guard g; // slots and connections reached through routes stay valid until the end
+    vector<campus_row> rows;
+    routes->forEach([&](const route &r) {
+        client_slot &s = clients[r.slot];
+        conn* t = s.tcpConn.load(memory_order_acquire);
+        size_t q = t ? t->queued.load(memory_order_relaxed) : 0;
+        size_t mem = t ? sizeof(conn) + t->rxMem.load(memory_order_relaxed) + q : 0;
+        rows.push_back(campus_row{metEscape(r.name), &s.stats, t != nullptr, q, mem, s.hbOnline.load()});
+    });
+    size_t tcp = 0, queued = 0;
+    for (const campus_row &r : rows) { tcp += r.tcp; queued += r.queued; }
+    metHeader(out, "campus_registered", "gauge", "Campuses in the routing table (TCP and UDP-only).");
+    metSample(out, "campus_registered", "", (double)rows.size());
+    metHeader(out, "campus_connected", "gauge", "Campuses connected over TCP.");
+    metSample(out, "campus_connected", "", (double)tcp);
+    metHeader(out, "campus_queued_bytes_all", "gauge", "Output queued for all campuses, in memory.");
+    metSample(out, "campus_queued_bytes_all", "", (double)queued);
+    metHeader(out, "campus_auth_pending", "gauge", "Connections accepted and waiting to authenticate (--auth-max).");
+    metSample(out, "campus_auth_pending", "", (double)authPending.load());
+    if (!NODE_NAME.empty()) {
+        int n = fedCount.load(memory_order_acquire), live = 0;
+        for (int i=0;i<n;i++) live += fedNodes[i].alive.load();
+        metHeader(out, "campus_federation_servers", "gauge", "Live servers on the federation ring, this one included.");
+        metSample(out, "campus_federation_servers", "", (double)live);
+        metHeader(out, "campus_federation_trunk_queued_bytes", "gauge", "Output queued on the trunk to each server.");
+        for (int i=1;i<n;i++) {
+            conn* t = fedNodes[i].trunk.load(memory_order_acquire);
+            if (t) metSample(out, "campus_federation_trunk_queued_bytes", "server=\"" + metEscape(fedNodes[i].name) + "\"", (double)t->queued.load(memory_order_relaxed));
         }
     }
 
-    // cleanup on disconnect
-    mtx.lock();
-    int idxNow = findClientByName(campus);
-    if (idxNow != -1) {
-        clients[idxNow].used = false;
-        clients[idxNow].tcpSock = -1;
-        clients[idxNow].lastHB = 0;
-        memset(&clients[idxNow].udpAddr, 0, sizeof(clients[idxNow].udpAddr));
-        memset(clients[idxNow].name, 0, sizeof(clients[idxNow].name));
+    struct per_campus { const char* name; const char* type; const char* help; double (*get)(const campus_row &); bool tcpOnly; };
+    static const per_campus cols[] = {
+        {"campus_sent_messages_total", "counter", "Messages this campus sent that were delivered.", [](const campus_row &r) { return (double)r.st->msgsSent.load(); }, true},
+        {"campus_sent_bytes_total", "counter", "Text bytes of those messages.", [](const campus_row &r) { return (double)r.st->bytesSent.load(); }, true},
+        {"campus_received_messages_total", "counter", "Messages delivered to this campus.", [](const campus_row &r) { return (double)r.st->msgsRecv.load(); }, true},
+        {"campus_received_bytes_total", "counter", "Text bytes of those messages.", [](const campus_row &r) { return (double)r.st->bytesRecv.load(); }, true},
+        {"campus_sent_files_total", "counter", "Files this campus sent that were forwarded.", [](const campus_row &r) { return (double)r.st->filesSent.load(); }, true},
+        {"campus_received_files_total", "counter", "Files forwarded to this campus.", [](const campus_row &r) { return (double)r.st->filesRecv.load(); }, true},
+        {"campus_queued_bytes", "gauge", "Output queued for this campus, in memory.", [](const campus_row &r) { return (double)r.queued; }, true},
+        {"campus_memory_bytes", "gauge", "Memory held for this campus's connection: state, receive buffer, queued output.", [](const campus_row &r) { return (double)r.memory; }, true},
+        {"campus_heartbeat_online", "gauge", "1 while heartbeats from this campus arrive in time.", [](const campus_row &r) { return r.hbOnline ? 1.0 : 0.0; }, false},
+    };
+    for (const per_campus &col : cols) {
+        metHeader(out, col.name, col.type, col.help);
+        for (const campus_row &r : rows)
+            if (r.tcp || !col.tcpOnly) metSample(out, col.name, "campus=\"" + r.name + "\"", col.get(r));
     }
-    mtx.unlock();
-    login("Client disconnected: " + campus);
-    close(clientSock);
+
+    slab_stats sl = slabCollect();
+    metHeader(out, "campus_slab_mapped_bytes", "gauge", "Memory mapped for the slab (connections, buffers, queued frames).");
+    metSample(out, "campus_slab_mapped_bytes", "", (double)sl.mapped);
+    metHeader(out, "campus_slab_hugepage_bytes", "gauge", "Part of it backed by hugetlb pages (--hugepages).");
+    metSample(out, "campus_slab_hugepage_bytes", "", (double)sl.huge);
+    metHeader(out, "campus_slab_used_bytes", "gauge", "Bytes in slab blocks handed out (whole blocks, headers included).");
+    metSample(out, "campus_slab_used_bytes", "", (double)sl.used);
+    metHeader(out, "campus_slab_remote_frees_total", "counter", "Slab blocks freed by a thread other than the one that allocated them.");
+    metSample(out, "campus_slab_remote_frees_total", "", (double)sl.remoteFrees);
+    metHeader(out, "campus_slab_blocks", "gauge", "Slab blocks in use per size class.");
+    for (int k=0;k<SLAB_CLASSES;k++)
+        if (sl.inUse[k]) metSample(out, "campus_slab_blocks", "size=\"" + to_string(slabClassSize[k]) + "\"", (double)sl.inUse[k]);
+
+    if (pool) {
+        metHeader(out, "campus_worker_tasks_total", "counter", "Save tasks (file opens, chunks, ends) run by the workers.");
+        metSample(out, "campus_worker_tasks_total", "", (double)pool->tasksRun());
+        metHeader(out, "campus_worker_steals_total", "counter", "Connections a worker took from another worker's queue.");
+        metSample(out, "campus_worker_steals_total", "", (double)pool->steals());
+    }
+
+    if (spools) {
+        metHeader(out, "campus_spool_backlog_bytes", "gauge", "Stored bytes not yet acknowledged by the campus.");
+        for (int i=0;i<CRED_COUNT;i++) {
+            uint64_t backlog;
+            { lock_guard<mutex> lk(spools[i]->m); backlog = spools[i]->head - spools[i]->acked; }
+            if (backlog) metSample(out, "campus_spool_backlog_bytes", "campus=\"" + metEscape(creds[i].campus) + "\"", (double)backlog);
+        }
+    }
+    return out;
 }
 
-// UDP listener: receives heartbeats like "Campus:Name;HB:online",
- // stores sender address and updates lastHB. Will register UDP-only clients if needed.
-void udpListener() {
-    int usock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (usock < 0) { login("UDP socket create failed"); return; }
-    sockaddr_in addr; addr.sin_family = AF_INET; addr.sin_port = htons(UDP_port); addr.sin_addr.s_addr = INADDR_ANY;
-    bind(usock, (sockaddr*)&addr, sizeof(addr));
-    login("UDP listening on port " + to_string(UDP_port));
+// Listening socket for --metrics: "unix:PATH" or a TCP port on the loopback address
+int makeMetricsSocket(const string &addr) {
+    if (addr.rfind("unix:", 0) == 0) {
+        string path = addr.substr(5);
+        sockaddr_un un; memset(&un, 0, sizeof(un));
+        if (path.empty() || path.size() >= sizeof(un.sun_path)) return -1;
+        un.sun_family = AF_UNIX;
+        memcpy(un.sun_path, path.c_str(), path.size());
+        int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (s < 0) return -1;
+        unlink(path.c_str()); // left over from an earlier run
+        if (bind(s, (sockaddr*)&un, sizeof(un)) < 0 || listen(s, 16) < 0) { close(s); return -1; }
+        return s;
+    }
+    int port = atoi(addr.c_str());
+    if (port <= 0 || port > 65535) return -1;
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0) return -1;
+    int opt = 1; setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    sockaddr_in a; memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET; a.sin_port = htons(port); a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(s, (sockaddr*)&a, sizeof(a)) < 0 || listen(s, 16) < 0) { close(s); return -1; }
+    return s;
+}
 
-    char buf[BUF];
+// One scrape per connection: read the request line, answer, close
+void metricsLoop(int ls) {
     while (true) {
-        memset(buf,0,sizeof(buf));
-        sockaddr_in sender; socklen_t sl = sizeof(sender);
-        ssize_t r = recvfrom(usock, buf, sizeof(buf)-1, 0, (sockaddr*)&sender, &sl);
-        if (r <= 0) continue;
-        string msg(buf);
-        size_t p = msg.find("Campus:");
-        if (p == string::npos) continue;
-        size_t semi = msg.find(";", p);
-        string name = (semi==string::npos) ? msg.substr(p+7) : msg.substr(p+7, semi-(p+7));
-
-        // update clients[] info or register as UDP-only
-        mtx.lock();
-        int idx = findClientByName(name);
-        if (idx != -1) {
-            clients[idx].lastHB = time(NULL);
-            clients[idx].udpAddr = sender;
-        } else {
-            int e = findEmptySlot();
-            if (e != -1) {
-                clients[e].used = true;
-                strncpy(clients[e].name, name.c_str(), sizeof(clients[e].name)-1);
-                clients[e].tcpSock = -1; // UDP-only for now
-                clients[e].lastHB = time(NULL);
-                clients[e].udpAddr = sender;
-                login("Registered UDP-only campus: " + name);
-            } else {
-                login("No slot free to register heartbeat from " + name);
-            }
+        int fd = accept4(ls, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) { if (errno == EINTR || errno == ECONNABORTED) continue; login(LOG_ERROR, "metrics accept failed"); return; }
+        timeval tv{1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        char req[2048];
+        size_t got = 0;
+        while (got < sizeof(req) - 1) {
+            ssize_t r = read(fd, req + got, sizeof(req) - 1 - got);
+            if (r <= 0) break;
+            got += r;
+            req[got] = 0;
+            if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
         }
-        mtx.unlock();
+        req[got] = 0;
+        string body, status = "200 OK";
+        if (strncmp(req, "GET /metrics ", 13) == 0 || strncmp(req, "GET / ", 6) == 0) body = metricsText();
+        else { status = "404 Not Found"; body = "try GET /metrics\n"; }
+        string resp = "HTTP/1.0 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                    + to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        for (size_t off = 0; off < resp.size();) {
+            ssize_t w = write(fd, resp.data() + off, resp.size() - off);
+            if (w <= 0) break;
+            off += w;
+        }
+        close(fd);
     }
-    close(usock);
 }
 
-// Heartbeat summary printer: prints summary only when >=1 client is registered.
-// Stops printing once all disconnect (i.e., only prints if at least one clients[].used == true).
-void hbPrinter() {
+// Copy a stored file to the console with sendfile(); plain read/write where stdout refuses it
+void printFile(int fd) {
+    cout.flush();
+    off_t off = 0;
     while (true) {
-        this_thread::sleep_for(chrono::seconds(10)); // print every 10 seconds
-        mtx.lock();
-        bool any = false;
-        for (int i=0;i<MAX_CLIENTS;i++) if (clients[i].used) { any = true; break; }
-        if (!any) { mtx.unlock(); continue; } // skip printing if no clients
-        cout << "\n===== HEARTBEAT SUMMARY =====\n";
-        time_t now = time(NULL);
-        for (int i=0;i<MAX_CLIENTS;i++) {
-            if (clients[i].used) {
-                cout << "["<<i<<"] " << clients[i].name;
-                if (clients[i].tcpSock != -1) cout << " (TCP)";
-                else cout << " (UDP-only)";
-                if (clients[i].lastHB == 0) cout << " | lastHB: never\n";
-                else cout << " | lastHB: " << (now - clients[i].lastHB) << "s ago\n";
-            }
+        ssize_t s = sendfile(STDOUT_FILENO, fd, &off, 1 << 20);
+        if (s > 0) continue;
+        if (s < 0 && errno == EINTR) continue;
+        if (s == 0) return;
+        break; // EINVAL etc.: fall back to copying
+    }
+    char buf[BUF];
+    ssize_t r;
+    while ((r = pread(fd, buf, sizeof(buf), off)) > 0) {
+        if (write(STDOUT_FILENO, buf, r) != r) return;
+        off += r;
+    }
+}
+
+// Queue bytes [0, size) of fd to t as FILE_CHUNK frames of transfer id, waiting while more
+// than FWD_HIGH_WATER bytes are queued
+bool sendFileRange(conn* t, uint32_t id, int fd, off_t size) {
+    off_t off = 0;
+    while (off < size) {
+        if (t->closed) return false;
+        if (t->queued.load() > FWD_HIGH_WATER) { this_thread::sleep_for(chrono::milliseconds(PAUSE_RETRY_MS)); continue; }
+        size_t n = min((off_t)FILE_CHUNK, size - off);
+        if (!connSendFileFrame(t, FT_FILE_CHUNK, 0, id, fd, off, n)) return false;
+        off += n;
+    }
+    return true;
+}
+
+// Server-to-campus resend of a stored file, sent as a normal stream from "Islamabad".
+// Chunks are queued as file ranges the campus' reactor sends with sendfile(); the console
+// thread waits whenever more than FWD_HIGH_WATER bytes are queued, so nothing beyond that
+// is ever buffered.
+// A file from the dedup store goes out the same way, one chunk blob after the other.
+bool resendFile(const string &path, const string &name, const string &target) {
+    bool chunked = store && store->isManifest(path);
+    vector<chunk_ref> chunks;
+    uint64_t size = 0;
+    int fd = -1;
+    if (chunked) {
+        if (!dedup_store::readManifest(path, chunks, &size)) { cout << "Failed to open file: " << path << "\n"; return false; }
+    } else {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) { cout << "Failed to open file: " << path << "\n"; return false; }
+        struct stat st;
+        fstat(fd, &st);
+        size = st.st_size;
+    }
+
+    conn* t = lookupConn(target);
+    if (!t || !t->framed) {
+        if (t) connUnref(t);
+        if (fd != -1) close(fd);
+        cout << (t ? "Campus uses the legacy text protocol; cannot stream files to it.\n" : "Campus is not connected.\n");
+        return false;
+    }
+    uint32_t id = ++t->outSeq;
+    bool ok = connEnqueue(t, newFrame(FT_FILE_START, 0, id, fields("Islamabad", name, to_string(size))));
+    if (chunked) {
+        for (size_t i=0; ok && i<chunks.size(); i++) {
+            int cfd = open(store->chunkPath(chunks[i]).c_str(), O_RDONLY | O_CLOEXEC);
+            ok = cfd >= 0 && sendFileRange(t, id, cfd, chunks[i].len); // missing: replaced meanwhile
+            if (cfd >= 0) close(cfd);
         }
-        cout << "=============================\n";
-        mtx.unlock();
+    } else {
+        ok = ok && sendFileRange(t, id, fd, size);
+        close(fd);
+    }
+    connEnqueue(t, newFrame(FT_FILE_END, 0, id, ok ? "OK" : "ABORTED"), true);
+    ok = ok && !t->closed;
+    connUnref(t);
+    return ok;
+}
+
+// Admin announcement to every campus whose heartbeats arrive. The addresses are copied out under
+// mtx; the datagrams then go out in sendmmsg() batches that all point at the one payload. With
+// --mcast it is a single datagram to the multicast group instead. Returns the campuses
+// addressed (-1 for the multicast group).
+int announce(const string &ann) {
+    iovec iov{(void*)ann.data(), ann.size()};
+    if (!MCAST_GROUP.empty()) {
+        sockaddr_in to; memset(&to, 0, sizeof(to));
+        to.sin_family = AF_INET; to.sin_port = htons(MCAST_port);
+        inet_pton(AF_INET, MCAST_GROUP.c_str(), &to.sin_addr);
+        if (sendto(annSock, ann.data(), ann.size(), 0, (sockaddr*)&to, sizeof(to)) < 0)
+            login(LOG_ERROR, "Multicast announcement failed: " + string(strerror(errno)));
+        return -1;
+    }
+    vector<sockaddr_in> dest;
+    mtx.lock();
+    for (int i=0;i<MAX_CLIENTS;i++)
+        if (clients[i].used && clients[i].hbOnline) dest.push_back(udpAddrOf(clients[i].udpKey));
+    mtx.unlock();
+    mmsghdr msgs[HB_BATCH];
+    for (size_t at=0; at<dest.size();) {
+        int n = (int)min(dest.size() - at, (size_t)HB_BATCH);
+        for (int i=0;i<n;i++) {
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_name = &dest[at+i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = &iov;
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int sent = sendmmsg(annSock, msgs, n, 0);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) { at++; continue; } // that destination failed: skip it
+        at += sent;
     }
+    return (int)dest.size();
 }
 
 // Admin console (in server terminal) with options:
 // 1. View clients
 // 2. Broadcast announcement (UDP) to all known clients that sent heartbeat
 // 3. List & open received files (show content in console)
-// 4. Exit server
+// 4. Send a received file on to a campus
+// 5. Exit server
+// Admin listing filter: "" (all), "from CAMPUS", "name FILE" or "dates FROM TO" (YYYY-MM-DD,
+// local time, both days included)
+bool parseFileFilter(const string &f, catalog_cursor &cur) {
+    if (f.empty()) { cur = catalog->all(); return true; }
+    if (f.compare(0, 5, "from ") == 0) { cur = catalog->bySender(f.substr(5)); return true; }
+    if (f.compare(0, 5, "name ") == 0) { cur = catalog->byName(f.substr(5)); return true; }
+    tm a, b;
+    memset(&a, 0, sizeof(a)); memset(&b, 0, sizeof(b));
+    const char* p = f.compare(0, 6, "dates ") == 0 ? strptime(f.c_str()+6, "%Y-%m-%d", &a) : nullptr;
+    if (!p || !strptime(p, " %Y-%m-%d", &b)) return false;
+    a.tm_isdst = b.tm_isdst = -1;
+    b.tm_mday++;
+    cur = catalog->byTime(mktime(&a), mktime(&b));
+    return true;
+}
+
+// Page through a listing, newest first; the catalog is only locked while a page is read
+void listReceivedFiles(catalog_cursor &cur) {
+    cout << "\n---- Received Files Index (" << catalog->size() << " in total) ----\n";
+    size_t shown = 0;
+    while (true) {
+        vector<catalog_entry> page = catalog->page(cur, LIST_PAGE);
+        for (const catalog_entry &e : page) {
+            char tb[26]; ctime_r(&e.at, tb); tb[strlen(tb)-1]=0;
+            cout << e.id << ") " << e.stored << " (from " << e.sender << ") at " << tb << "\n";
+        }
+        shown += page.size();
+        if (cur.done) break;
+        cout << "-- Enter for more, q to stop -- ";
+        string more; getline(cin, more);
+        if (more == "q") break;
+    }
+    if (!shown) cout << "(none)\n";
+}
+
 void adminConsole() {
     while (true) {
-        cout << "\n--- ADMIN MENU ---\n1) View clients\n2) Broadcast announcement\n3) List received files\n4) Open a received file\n5) Exit\nChoice: ";
+        cout << "\n--- ADMIN MENU ---\n1) View clients\n2) Broadcast announcement\n3) List received files\n4) Open a received file\n5) Send a received file to a campus\n6) Exit\nChoice: ";
         int ch;
         if (!(cin >> ch)) { cin.clear(); string dum; getline(cin,dum); continue; }
         cin.ignore(); // remove newline
@@ -344,7 +3841,7 @@ void adminConsole() {
                     if (clients[i].tcpSock != -1) cout << " | Y ";
                     else cout << " | N ";
                     if (clients[i].lastHB == 0) cout << " | never\n";
-                    else cout << " | " << (now - clients[i].lastHB) << "s\n";
+                    else cout << " | " << (now - clients[i].lastHB.load()) << "s" << (clients[i].hbOnline ? "" : " (offline)") << "\n";
                 }
             }
             mtx.unlock();
@@ -353,56 +3850,63 @@ void adminConsole() {
             cout << "Enter announcement text: ";
             string ann;
             getline(cin, ann);
-            // Send UDP to all clients that have lastHB != 0 (we have sender address)
-            int usock = socket(AF_INET, SOCK_DGRAM, 0);
-            if (usock < 0) { cout << "UDP socket error\n"; continue; }
-            mtx.lock();
-            int sentCount = 0;
-            for (int i=0;i<MAX_CLIENTS;i++) {
-                if (clients[i].used && clients[i].lastHB != 0) {
-                    sendto(usock, ann.c_str(), ann.size(), 0, (sockaddr*)&clients[i].udpAddr, sizeof(clients[i].udpAddr));
-                    sentCount++;
-                }
-            }
-            mtx.unlock();
-            close(usock);
-            login("Admin broadcast sent to " + to_string(sentCount) + " clients.");
+            // UDP to all clients whose heartbeats are arriving (we have sender address), or the multicast group
+            int sentCount = announce(ann);
+            if (sentCount < 0) login("Admin broadcast sent to multicast group " + MCAST_GROUP + ".");
+            else login("Admin broadcast sent to " + to_string(sentCount) + " clients.");
         }
         else if (ch == 3) {
-            mtx.lock();
-            cout << "\n---- Received Files Index ----\n";
-            for (int i=0;i<MAX_FILES;i++) {
-                if (receivedFiles[i].used) {
-                    time_t t = receivedFiles[i].receivedAt;
-                    char tb[26]; ctime_r(&t,tb); tb[strlen(tb)-1]=0;
-                    cout << i << ") " << receivedFiles[i].storedName << " (from " << receivedFiles[i].sender << ") at " << tb << "\n";
-                }
-            }
-            mtx.unlock();
+            cout << "Filter (Enter = all, from CAMPUS, name FILE, dates YYYY-MM-DD YYYY-MM-DD): ";
+            string f; getline(cin, f);
+            catalog_cursor cur;
+            if (!parseFileFilter(f, cur)) { cout << "Invalid filter\n"; continue; }
+            listReceivedFiles(cur);
         }
         else if (ch == 4) {
             cout << "Enter index of received file to open (see list): ";
-            int idx; if (!(cin >> idx)) { cin.clear(); string d; getline(cin,d); cout<<"Invalid index\n"; continue; }
+            long long idx; if (!(cin >> idx)) { cin.clear(); string d; getline(cin,d); cout<<"Invalid index\n"; continue; }
             cin.ignore();
-            mtx.lock();
-            if (idx < 0 || idx >= MAX_FILES || !receivedFiles[idx].used) {
-                mtx.unlock();
+            catalog_entry e;
+            if (idx < 0 || !catalog->get(idx, e)) {
                 cout << "Invalid file index\n";
                 continue;
             }
-            string path = receivedFiles[idx].storedName;
-            mtx.unlock();
+            string path = e.stored;
+            if (store && store->isManifest(path)) {
+                // a deduplicated file: print its chunks in order
+                cout << "\n----- Content of " << path << " -----\n";
+                bool whole = store->forEachChunk(path, [](int fd, size_t) { printFile(fd); return true; });
+                cout << "\n----- " << (whole ? "End of file" : "File is incomplete or was replaced") << " -----\n";
+                continue;
+            }
             // open and print content
-            ifstream ifs(path.c_str(), ios::in | ios::binary);
-            if (!ifs) { cout << "Failed to open file: " << path << "\n"; continue; }
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) { cout << "Failed to open file: " << path << "\n"; continue; }
             cout << "\n----- Content of " << path << " -----\n";
-            string line;
-            while (getline(ifs, line)) cout << line << "\n";
-            cout << "----- End of file -----\n";
-            ifs.close();
+            printFile(fd);
+            cout << "\n----- End of file -----\n";
+            close(fd);
         }
         else if (ch == 5) {
+            cout << "Enter index of received file to send (see list): ";
+            long long idx; if (!(cin >> idx)) { cin.clear(); string d; getline(cin,d); cout<<"Invalid index\n"; continue; }
+            cin.ignore();
+            cout << "Send to which campus? ";
+            string target; getline(cin, target);
+            catalog_entry e;
+            if (idx < 0 || !catalog->get(idx, e)) {
+                cout << "Invalid file index\n";
+                continue;
+            }
+            string path = e.stored;
+            string name = e.name;
+            if (resendFile(path, name, target)) login("Admin sent " + path + " to " + target);
+            else cout << "File was not sent.\n";
+        }
+        else if (ch == 6) {
             login("Admin requested exit. Shutting down.");
+            catalog->flush();
+            logFlushNow();
             exit(0);
         }
         else {
@@ -410,38 +3914,263 @@ void adminConsole() {
         }
     }
 }
-int main() {
-    // Start UDP listener thread (heartbeat)
-    thread udpThread(udpListener);
-    udpThread.detach();
+int main(int argc, char** argv) {
+    // Options: --reactors N      N event loops sharing the TCP port via SO_REUSEPORT
+    //          --max-clients N    campus slots in the routing table (default 1024)
+    //          --hb-miss N        missed 5 s heartbeats before a campus counts as offline (default 3)
+    //          --log FILE         append the log here instead of the console
+    //          --log-level error|warn|info|debug  (default info)
+    //          --log-rate N       info/debug lines per second per thread before lines are dropped (default 10000)
+    //          --relay splice|copy  how file chunk payloads are moved (default splice)
+    //          --outq-limit BYTES   per-connection output queue size (default 4 MB)
+    //          --overflow drop|block|spill  what happens to a sender past that limit (default block)
+    //          --spool DIR        store messages and files for offline campuses under DIR
+    //          --spool-max BYTES  undelivered bytes kept per campus (default 256 MB)
+    //          --session-ttl SECS       how long a dropped session can be resumed (default 60)
+    //          --session-replay BYTES   written frames kept per session for resends (default 1 MB)
+    //          --group NAME=A,B   "@NAME" targets campuses A and B (repeatable)
+    //          --mcast ADDR       send admin announcements to this multicast group (port 6001)
+    //          --creds FILE       extra "Campus Pass" lines to accept (e.g. from loadgen --emit-creds)
+    //          --metrics PORT|unix:PATH  serve Prometheus text metrics on 127.0.0.1:PORT or a Unix socket
+    //          --catalog PATH     received-files catalog (default received_files.catalog, plus PATH.idx)
+    //          --store DIR        save files sent to Islamabad deduplicated (content-defined chunks) under DIR
+    //          --workers N        threads that write and hash files saved on the server (default: one per core, 0: the reactors do it)
+    //          --io epoll|uring   reactor I/O: epoll readiness and system calls, or io_uring (default epoll)
+    //          --hugepages        back the slab (connections, buffers, queued frames) with 2 MB huge pages
+    //          --port N           TCP port (default 5000); heartbeats and gossip use N+1000 (not 5001: 6001 is the --mcast port)
+    //          --node NAME@HOST   join a federation as server NAME, reachable at IPv4 address HOST
+    //          --peer HOST:PORT   a federation server to gossip with until the others are known (repeatable)
+    //          --fed-key KEY      key federation servers sign gossip and trunk hellos with (required with --node)
+    //          --backlog N        connections queued by the kernel per listen socket (default 4096)
+    //          --auth-max N       connections waiting to authenticate before new ones are shed (default 1024, 0: no limit)
+    //          --src-rate R[:B]   new connections per second per source address, bursts of B (default off)
+    //          --tls-cert FILE    TLS on every TCP connection: certificate chain (PEM); needs kernel TLS and a -DCAMPUS_TLS build
+    //          --tls-key FILE     its private key (default: in the --tls-cert file)
+    //          --tls-ca FILE      certificates trunks we open must chain to (default: the --tls-cert file)
+    for (int i=1;i<argc;i++) {
+        string a = argv[i];
+        string v = (i+1 < argc) ? argv[i+1] : "";
+        if (a == "--reactors" && !v.empty()) { REACTORS = max(1, atoi(v.c_str())); i++; }
+        else if (a == "--max-clients" && atoi(v.c_str()) > 0) { MAX_CLIENTS = atoi(v.c_str()); i++; }
+        else if (a == "--hb-miss" && atoi(v.c_str()) > 0) { HB_MISS = atoi(v.c_str()); i++; }
+        else if (a == "--log" && !v.empty()) {
+            logFd = open(v.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (logFd < 0) { cerr << "Cannot open log file " << v << "\n"; return 1; }
+            i++;
+        }
+        else if (a == "--log-level" && (v == "error" || v == "warn" || v == "info" || v == "debug")) {
+            logLevel = (v == "error") ? LOG_ERROR : (v == "warn") ? LOG_WARN : (v == "info") ? LOG_INFO : LOG_DEBUG; i++;
+        }
+        else if (a == "--log-rate" && atoi(v.c_str()) > 0) { logRate = atoi(v.c_str()); i++; }
+        else if (a == "--relay" && (v == "splice" || v == "copy")) { SPLICE_RELAY = (v == "splice"); i++; }
+        else if (a == "--outq-limit" && atoll(v.c_str()) > 0) { OUTQ_LIMIT = (size_t)atoll(v.c_str()); i++; }
+        else if (a == "--overflow" && (v == "drop" || v == "block" || v == "spill")) {
+            OVERFLOW_POLICY = (v == "drop") ? OVERFLOW_DROP : (v == "spill") ? OVERFLOW_SPILL : OVERFLOW_BLOCK; i++;
+        }
+        else if (a == "--spool" && !v.empty()) { SPOOL_DIR = v; i++; }
+        else if (a == "--spool-max" && atoll(v.c_str()) > 0) { SPOOL_MAX = (size_t)atoll(v.c_str()); i++; }
+        else if (a == "--session-ttl" && atoi(v.c_str()) > 0) { SESSION_TTL = atoi(v.c_str()); i++; }
+        else if (a == "--session-replay" && !v.empty() && atoll(v.c_str()) >= 0) { SESSION_REPLAY = (size_t)atoll(v.c_str()); i++; }
+        else if (a == "--group" && v.find('=') != string::npos && v.find('=') > 0) {
+            campus_group g;
+            g.name = v.substr(0, v.find('='));
+            string list = v.substr(v.find('=') + 1) + ",";
+            for (size_t p = 0, q; (q = list.find(',', p)) != string::npos; p = q + 1)
+                if (q > p) g.members.push_back(list.substr(p, q - p));
+            groups.push_back(g);
+            i++;
+        }
+        else if (a == "--mcast" && !v.empty()) {
+            in_addr ia;
+            if (inet_pton(AF_INET, v.c_str(), &ia) != 1 || !IN_MULTICAST(ntohl(ia.s_addr))) { cerr << "Not an IPv4 multicast address: " << v << "\n"; return 1; }
+            MCAST_GROUP = v; i++;
+        }
+        else if (a == "--metrics" && !v.empty()) { METRICS_ADDR = v; i++; }
+        else if (a == "--catalog" && !v.empty()) { CATALOG_PATH = v; i++; }
+        else if (a == "--store" && !v.empty()) { STORE_DIR = v; i++; }
+        else if (a == "--workers" && !v.empty() && atoi(v.c_str()) >= 0) { WORKERS = atoi(v.c_str()); i++; }
+        else if (a == "--io" && (v == "epoll" || v == "uring")) { IO_URING = (v == "uring"); i++; }
+        else if (a == "--hugepages") slabHuge = true;
+        else if (a == "--port" && atoi(v.c_str()) > 0 && atoi(v.c_str()) < 64536) { TCP_port = atoi(v.c_str()); UDP_port = TCP_port + 1000; i++; }
+        else if (a == "--node" && v.find('@') != string::npos && v.find('@') > 0) {
+            NODE_NAME = v.substr(0, v.find('@'));
+            NODE_HOST = v.substr(v.find('@') + 1);
+            in_addr ia;
+            if (inet_pton(AF_INET, NODE_HOST.c_str(), &ia) != 1 || NODE_NAME.find_first_of(";:@,") != string::npos) { cerr << "Bad --node (NAME@IPv4): " << v << "\n"; return 1; }
+            i++;
+        }
+        else if (a == "--peer" && !v.empty()) {
+            string host;
+            int port;
+            if (!fedParseAddr(v, host, port)) { cerr << "Bad --peer (HOST:PORT): " << v << "\n"; return 1; }
+            FED_SEEDS.push_back({host, port});
+            i++;
+        }
+        else if (a == "--fed-key" && !v.empty()) { FED_KEY = v; i++; }
+        else if (a == "--backlog" && atoi(v.c_str()) > 0) { LISTEN_BACKLOG = atoi(v.c_str()); i++; }
+        else if (a == "--auth-max" && !v.empty() && atoi(v.c_str()) >= 0) { AUTH_MAX = atoi(v.c_str()); i++; }
+        else if (a == "--src-rate" && atof(v.c_str()) > 0) {
+            SRC_RATE = atof(v.c_str());
+            SRC_BURST = v.find(':') != string::npos ? atof(v.c_str() + v.find(':') + 1) : SRC_RATE;
+            if (SRC_BURST < 1) SRC_BURST = 1;
+            i++;
+        }
+        else if (a == "--tls-cert" && !v.empty()) { TLS_CERT = v; i++; }
+        else if (a == "--tls-key" && !v.empty()) { TLS_KEY = v; i++; }
+        else if (a == "--tls-ca" && !v.empty()) { TLS_CA = v; i++; }
+        else if (a == "--creds" && !v.empty()) {
+            ifstream in(v);
+            if (!in) { cerr << "Cannot open credentials file " << v << "\n"; return 1; }
+            string camp, pass;
+            while (in >> camp >> pass) if (camp != "Islamabad") creds.push_back(Cred{camp, pass});
+            i++;
+        }
+        else {
+            cerr << "Usage: " << argv[0] << " [--reactors N] [--max-clients N] [--hb-miss N] [--log FILE] [--log-level L] [--log-rate N] [--relay splice|copy] [--outq-limit BYTES] [--overflow drop|block|spill] [--spool DIR] [--spool-max BYTES] [--session-ttl SECS] [--session-replay BYTES] [--group NAME=A,B] [--mcast ADDR] [--creds FILE] [--metrics PORT|unix:PATH] [--catalog PATH] [--store DIR] [--workers N] [--io epoll|uring] [--hugepages] [--port N] [--node NAME@HOST] [--peer HOST:PORT] [--fed-key KEY] [--backlog N] [--auth-max N] [--src-rate R[:BURST]] [--tls-cert FILE] [--tls-key FILE] [--tls-ca FILE]\n";
+            return 1;
+        }
+    }
+    if (UDP_port == MCAST_port) {
+        cerr << "--port " << TCP_port << ": its heartbeat port " << UDP_port << " is the announcement multicast port\n";
+        return 1;
+    }
+    if (IO_URING) SPLICE_RELAY = false; // the ring's recv has taken the bytes off the socket already
+    if (!TLS_CERT.empty()) {
+        // records are the kernel's job; without kernel TLS there is no encrypted transport
+        string why = ktlsMissing(), err;
+        if (!why.empty()) { cerr << "--tls-cert: " << why << "\n"; return 1; }
+        tlsServer = tlsServerContext(TLS_CERT, TLS_KEY.empty() ? TLS_CERT : TLS_KEY, err);
+        if (tlsServer) tlsTrunk = tlsClientContext(TLS_CA.empty() ? TLS_CERT : TLS_CA, err);
+        if (!tlsTrunk) { cerr << "TLS: " << err << "\n"; return 1; }
+        // the record keys are handed to the kernel by hand: prove they work before serving anyone
+        string bad = tlsSelfCheck(tlsServer);
+        if (!bad.empty()) { cerr << "TLS self-check failed: " << bad << "\n"; return 1; }
+    } else if (!TLS_KEY.empty() || !TLS_CA.empty()) {
+        cerr << "--tls-key and --tls-ca need --tls-cert\n";
+        return 1;
+    }
+    CRED_COUNT = (int)creds.size();
+    for (int i=CRED_COUNT-1;i>=0;i--) credIndex[creds[i].campus] = i; // first entry wins on duplicates
+    signal(SIGPIPE, SIG_IGN); // a campus vanishing mid-write must not kill the server
+    if (!NODE_NAME.empty() && FED_KEY.empty()) {
+        cerr << "--node needs --fed-key: gossip and trunks are authenticated with it\n";
+        return 1;
+    }
+    logStart();
+    if (!NODE_NAME.empty()) {
+        fedAdd(NODE_NAME, NODE_HOST, TCP_port);
+        fedNodes[0].alive = true;
+        fedRebuild();
+    } else if (!FED_SEEDS.empty() || !FED_KEY.empty()) {
+        cerr << "--peer and --fed-key need --node\n";
+        return 1;
+    }
+
+    // Idle connections only cost a descriptor and a conn; lift the fd limit as far as allowed
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) { rl.rlim_cur = rl.rlim_max; setrlimit(RLIMIT_NOFILE, &rl); }
+
+    clients = new client_slot[MAX_CLIENTS];
+    routes = new route_table(MAX_CLIENTS);
+    hbWheel = new timing_wheel(MAX_CLIENTS, monoSec());
+    for (int i=MAX_CLIENTS-1;i>=0;i--) freeSlots.push_back(i); // lowest index handed out first
+    if (SRC_RATE > 0) srcBuckets = new src_bucket[1 << SRC_BUCKET_BITS](); // all empty: a new address starts with a full burst
+
+    ifstream somax("/proc/sys/net/core/somaxconn");
+    int kmax = 0;
+    if (somax >> kmax && kmax < LISTEN_BACKLOG)
+        login(LOG_WARN, "--backlog " + to_string(LISTEN_BACKLOG) + " is capped at net.core.somaxconn = " + to_string(kmax));
+
+    annSock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (annSock < 0) { cerr << "UDP socket error\n"; return 1; }
+    int sndbuf = 4 << 20; // a whole announcement round fits without blocking
+    setsockopt(annSock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    string catErr;
+    catalog = new file_catalog(); // never destroyed: its thread waits on it until exit
+    if (!catalog->open(CATALOG_PATH, catErr)) { cerr << "Received-files catalog: " << catErr << "\n"; return 1; }
+    if (catalog->size()) login("Received-files catalog " + CATALOG_PATH + " holds " + to_string(catalog->size()) + " files");
+    thread([] { catalog->writerLoop(); }).detach();
+
+    if (!STORE_DIR.empty()) {
+        store = new dedup_store();
+        if (!store->open(STORE_DIR)) { cerr << "Cannot open file store in " << STORE_DIR << "\n"; return 1; }
+        login("File store " + STORE_DIR + " holds " + to_string(store->chunkCount()) + " chunks");
+    }
 
-    // Start heartbeat summary printer
-    thread hbThread(hbPrinter);
-    hbThread.detach();
+    if (WORKERS < 0) WORKERS = max(1, (int)thread::hardware_concurrency());
+    if (WORKERS > 0) {
+        pool = new work_pool();
+        pool->start(WORKERS);
+    }
+
+    if (!SPOOL_DIR.empty()) {
+        mkdir(SPOOL_DIR.c_str(), 0755);
+        spools = new spool*[CRED_COUNT];
+        for (int i=0;i<CRED_COUNT;i++) {
+            spools[i] = new spool();
+            if (!spools[i]->open(SPOOL_DIR + "/" + creds[i].campus, creds[i].campus, SPOOL_MAX)) {
+                cerr << "Cannot open spool in " << SPOOL_DIR << "/" << creds[i].campus << "\n";
+                return 1;
+            }
+            if (spools[i]->head != spools[i]->acked)
+                login("Spool for " + creds[i].campus + " holds " + to_string(spools[i]->head - spools[i]->acked) + " undelivered bytes");
+        }
+        thread(spoolSyncLoop).detach();
+    }
+
+    if (!METRICS_ADDR.empty()) {
+        int ms = makeMetricsSocket(METRICS_ADDR);
+        if (ms < 0) { cerr << "Cannot serve metrics on " << METRICS_ADDR << "\n"; return 1; }
+        thread(metricsLoop, ms).detach();
+        login("Metrics at " + METRICS_ADDR);
+    }
+
+    for (int i=0;i<REACTORS;i++) {
+        reactor* R = new reactor();
+        R->id = i;
+        R->io = nullptr;
+        R->ep = IO_URING ? -1 : epoll_create1(EPOLL_CLOEXEC);
+        if (!IO_URING && R->ep < 0) { cerr << "epoll_create failed\n"; return 1; }
+        R->lsrc.kind = EV_LISTEN; R->lsrc.fd = makeListenSocket();
+        if (R->lsrc.fd < 0) { cerr << "TCP listen failed\n"; return 1; }
+        if (!IO_URING) epollAdd(R->ep, &R->lsrc, EPOLLIN | EPOLLET);
+        R->ready = nullptr;
+        R->acceptMore = false;
+        R->wsrc.kind = EV_WAKE; R->wsrc.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (R->wsrc.fd < 0) { cerr << "eventfd failed\n"; return 1; }
+        if (!IO_URING) epollAdd(R->ep, &R->wsrc, EPOLLIN | EPOLLET);
+        R->pipeRd = R->pipeWr = -1; R->pipeCap = 0;
+        int pfd[2];
+        if (SPLICE_RELAY && pipe2(pfd, O_NONBLOCK | O_CLOEXEC) == 0) {
+            fcntl(pfd[1], F_SETPIPE_SZ, (int)(16*FILE_CHUNK)); // best effort; capped by pipe-max-size
+            int cap = fcntl(pfd[1], F_GETPIPE_SZ);
+            R->pipeRd = pfd[0]; R->pipeWr = pfd[1]; R->pipeCap = cap > 0 ? cap : FILE_CHUNK;
+        }
+        R->usrc.kind = EV_UDP; R->usrc.fd = -1;
+        R->tsrc.kind = EV_TIMER; R->tsrc.fd = -1;
+        if (i == 0) {
+            R->usrc.fd = makeUdpSocket();
+            if (R->usrc.fd < 0) login(LOG_ERROR, "UDP socket create failed");
+            else { if (!IO_URING) epollAdd(R->ep, &R->usrc, EPOLLIN | EPOLLET); login("UDP listening on port " + to_string(UDP_port)); }
+            R->tsrc.fd = makeTickTimer();
+            if (R->tsrc.fd >= 0 && !IO_URING) epollAdd(R->ep, &R->tsrc, EPOLLIN | EPOLLET);
+        }
+        if (IO_URING && !uringSetup(R)) { cerr << "io_uring unavailable: " << strerror(errno) << "\n"; return 1; }
+        reactors.push_back(R);
+    }
+    login("TCP listening on port " + to_string(TCP_port) + " (" + to_string(REACTORS) + " reactor(s), " + (IO_URING ? "io_uring, " : "epoll, ")
+          + (SPLICE_RELAY ? "splice" : "copy") + " file relay, " + to_string(WORKERS) + " save worker(s))");
 
     // Start admin console
     thread adminThread(adminConsole);
     adminThread.detach();
 
-    // Start TCP listener
-    int ss = socket(AF_INET, SOCK_STREAM, 0);
-    if (ss < 0) { cerr << "TCP socket create failed\n"; return 1; }
-    sockaddr_in saddr; saddr.sin_family = AF_INET; saddr.sin_port = htons(TCP_port); saddr.sin_addr.s_addr = INADDR_ANY;
-    int opt = 1; setsockopt(ss, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    if (bind(ss, (sockaddr*)&saddr, sizeof(saddr)) < 0) { cerr << "Bind failed\n"; return 1; }
-    if (listen(ss, 5) < 0) { cerr << "Listen failed\n"; return 1; }
-    login("TCP listening on port " + to_string(TCP_port));
-
-    // Accept loop
-    while (true) {
-        sockaddr_in clientAddr; socklen_t cl = sizeof(clientAddr);
-        int cs = accept(ss, (sockaddr*)&clientAddr, &cl);
-        if (cs < 0) { login("Accept failed"); continue; }
-        // Spawn a handler thread
-        thread t(handleClient, cs);
+    // Reactor 0 runs on the main thread, the rest get one thread each
+    for (int i=1;i<REACTORS;i++) {
+        thread t(reactorLoop, reactors[i]);
         t.detach();
     }
-    close(ss);
+    reactorLoop(reactors[0]);
     return 0;
 }
-
@@ -0,0 +1,201 @@
+// Slab allocator used by server.cpp for connection objects, receive buffers and queued frames.
+//
+// Every thread that allocates gets its own heap: one free list per size class, refilled from
+// SLAB_CHUNK-sized chunks of mapped memory (huge pages with --hugepages). A block starts with
+// a 16-byte header naming its heap and class. A block freed by the thread that owns it goes
+// straight back on that thread's free list. A block freed anywhere else goes on the owner's
+// lock-free remote list, which the owner takes back in one exchange once a free list runs dry.
+// That covers a routed frame freed by the target's reactor, or a connection freed by the rcu
+// reclaim. So recycled blocks move between threads without going through malloc.
+// Chunks are never returned to the system: a heap keeps its high-water mark. Requests above
+// the largest class go to operator new.
+#ifndef CAMPUS_SLAB_H
+#define CAMPUS_SLAB_H
+#include<algorithm>
+#include<atomic>
+#include<cstdint>
+#include<cstring>
+#include<new>
+#include<string>
+#include<sys/mman.h>
+
+const size_t SLAB_CHUNK = 2u << 20;    // mapped at a time (one huge page)
+const size_t SLAB_RUN = 64u << 10;     // a class is refilled with this much, at least 4 blocks
+const size_t SLAB_HDR = 16;
+const int SLAB_MAX_HEAPS = 64;         // threads with a heap; any others use operator new
+const uint16_t SLAB_NO_HEAP = 0xFFFF;  // header of a block that came from operator new
+
+// Block sizes, header included. A queued frame is an out_msg (88 bytes), a frame header, the
+// sender's name and the payload, and payloads are mostly powers of two (message texts,
+// FILE_CHUNK). So besides a geometric series, each power of two from 4 KB up has a class just
+// above it that takes it with its overhead.
+const uint32_t slabClassSize[] = {
+    64, 128, 192, 256, 384, 512, 768, 1024, 1280, 1536, 2048, 2560, 3072,
+    4096, 4608, 6144, 8192, 8704, 12288, 16384, 16896, 24576, 32768, 33280, 49152, 65536, 66048,
+};
+const int SLAB_CLASSES = sizeof(slabClassSize) / sizeof(slabClassSize[0]);
+const size_t SLAB_MAX = 66048 - SLAB_HDR;   // largest request a class serves
+
+inline bool slabHuge = false;          // --hugepages
+
+struct slab_hdr {
+    uint16_t heap;                     // owner's index in slabHeaps, or SLAB_NO_HEAP
+    uint16_t cls;
+    uint32_t pad;
+    slab_hdr* next;                    // free and remote list link
+};
+
+struct slab_heap {
+    int id;
+    slab_hdr* free[SLAB_CLASSES];
+    char* cur;                         // unused rest of the current chunk
+    size_t left;
+    // Owner writes, the metrics thread reads
+    std::atomic<uint64_t> inUse[SLAB_CLASSES]; // blocks handed out; a remote free counts once taken back
+    std::atomic<uint64_t> mapped, huge, remoteFrees;
+    alignas(64) std::atomic<slab_hdr*> remote; // freed by other threads
+};
+
+inline std::atomic<slab_heap*> slabHeaps[SLAB_MAX_HEAPS];
+inline std::atomic<int> slabHeapCount(0);
+inline thread_local slab_heap* slabSelf = nullptr;
+inline thread_local bool slabNoHeap = false;  // this thread found every heap taken
+
+inline slab_heap* slabRegister() {
+    if (slabNoHeap) return nullptr;
+    int i = slabHeapCount.fetch_add(1);
+    if (i >= SLAB_MAX_HEAPS) { slabHeapCount--; slabNoHeap = true; return nullptr; }
+    slab_heap* h = new slab_heap();
+    h->id = i;
+    for (int k=0;k<SLAB_CLASSES;k++) { h->free[k] = nullptr; h->inUse[k] = 0; }
+    h->cur = nullptr; h->left = 0;
+    h->mapped = 0; h->huge = 0; h->remoteFrees = 0; h->remote = nullptr;
+    slabHeaps[i].store(h, std::memory_order_release);
+    return slabSelf = h;
+}
+
+inline void slabBump(std::atomic<uint64_t> &x, int64_t n) { x.store(x.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+
+inline int slabClass(size_t n) {
+    return (int)(std::lower_bound(slabClassSize, slabClassSize + SLAB_CLASSES, (uint32_t)n) - slabClassSize);
+}
+
+// A fresh chunk, aligned to its size so transparent huge pages can back it when hugetlb pages
+// are not available
+inline char* slabMap(slab_heap* h) {
+    if (slabHuge) {
+        void* p = mmap(nullptr, SLAB_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) { slabBump(h->mapped, SLAB_CHUNK); slabBump(h->huge, SLAB_CHUNK); return (char*)p; }
+    }
+    char* q = (char*)mmap(nullptr, 2*SLAB_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (q == MAP_FAILED) return nullptr;
+    char* a = (char*)(((uintptr_t)q + SLAB_CHUNK - 1) & ~(uintptr_t)(SLAB_CHUNK - 1));
+    if (a > q) munmap(q, a - q);
+    munmap(a + SLAB_CHUNK, q + SLAB_CHUNK - a);
+    if (slabHuge) madvise(a, SLAB_CHUNK, MADV_HUGEPAGE);
+    slabBump(h->mapped, SLAB_CHUNK);
+    return a;
+}
+
+// Carve blocks of class k: a run from the current chunk, or whatever of it is left before
+// moving on to a new one
+inline bool slabRefill(slab_heap* h, int k) {
+    size_t sz = slabClassSize[k];
+    size_t n = std::max<size_t>(SLAB_RUN / sz, 4);
+    if (h->left < sz) {
+        char* c = slabMap(h);
+        if (!c) return false;
+        h->cur = c; h->left = SLAB_CHUNK;
+    }
+    n = std::min(n, h->left / sz);
+    for (size_t i=0;i<n;i++) {
+        slab_hdr* b = (slab_hdr*)(h->cur + i*sz);
+        b->heap = (uint16_t)h->id; b->cls = (uint16_t)k;
+        b->next = h->free[k]; h->free[k] = b;
+    }
+    h->cur += n*sz; h->left -= n*sz;
+    return true;
+}
+
+// Take back what other threads freed
+inline void slabReclaim(slab_heap* h) {
+    slab_hdr* b = h->remote.exchange(nullptr, std::memory_order_acquire);
+    while (b) {
+        slab_hdr* nx = b->next;
+        b->next = h->free[b->cls]; h->free[b->cls] = b;
+        slabBump(h->inUse[b->cls], -1);
+        slabBump(h->remoteFrees, 1);
+        b = nx;
+    }
+}
+
+inline void* slabAlloc(size_t n) {
+    slab_heap* h = slabSelf ? slabSelf : slabRegister();
+    if (h && n <= SLAB_MAX) {
+        int k = slabClass(n + SLAB_HDR);
+        if (!h->free[k]) slabReclaim(h);
+        if (h->free[k] || slabRefill(h, k)) {
+            slab_hdr* b = h->free[k];
+            h->free[k] = b->next;
+            slabBump(h->inUse[k], 1);
+            return (char*)b + SLAB_HDR;
+        }
+    }
+    slab_hdr* b = (slab_hdr*)::operator new(n + SLAB_HDR);
+    b->heap = SLAB_NO_HEAP;
+    return (char*)b + SLAB_HDR;
+}
+
+inline void slabFree(void* p) {
+    if (!p) return;
+    slab_hdr* b = (slab_hdr*)((char*)p - SLAB_HDR);
+    if (b->heap == SLAB_NO_HEAP) { ::operator delete(b); return; }
+    slab_heap* h = slabSelf;
+    if (h && h->id == b->heap) {
+        b->next = h->free[b->cls]; h->free[b->cls] = b;
+        slabBump(h->inUse[b->cls], -1);
+        return;
+    }
+    slab_heap* o = slabHeaps[b->heap].load(std::memory_order_relaxed);
+    slab_hdr* top = o->remote.load(std::memory_order_relaxed);
+    do { b->next = top; } while (!o->remote.compare_exchange_weak(top, b, std::memory_order_release, std::memory_order_relaxed));
+}
+
+// Totals over all heaps, for --metrics
+struct slab_stats {
+    uint64_t mapped = 0, huge = 0, used = 0, remoteFrees = 0;
+    uint64_t inUse[SLAB_CLASSES] = {};
+};
+inline slab_stats slabCollect() {
+    slab_stats s;
+    for (int i=0;i<SLAB_MAX_HEAPS;i++) {
+        slab_heap* h = slabHeaps[i].load(std::memory_order_acquire);
+        if (!h) continue;
+        s.mapped += h->mapped.load(std::memory_order_relaxed);
+        s.huge += h->huge.load(std::memory_order_relaxed);
+        s.remoteFrees += h->remoteFrees.load(std::memory_order_relaxed);
+        for (int k=0;k<SLAB_CLASSES;k++) s.inUse[k] += h->inUse[k].load(std::memory_order_relaxed);
+    }
+    for (int k=0;k<SLAB_CLASSES;k++) s.used += s.inUse[k] * slabClassSize[k];
+    return s;
+}
+
+// Allocator for containers whose buffers should come from the slab (receive buffers)
+template<class T> struct slab_allocator {
+    typedef T value_type;
+    slab_allocator() {}
+    template<class U> slab_allocator(const slab_allocator<U> &) {}
+    T* allocate(size_t n) { return (T*)slabAlloc(n * sizeof(T)); }
+    void deallocate(T* p, size_t) { slabFree(p); }
+    bool operator==(const slab_allocator &) const { return true; }
+    bool operator!=(const slab_allocator &) const { return false; }
+};
+typedef std::basic_string<char, std::char_traits<char>, slab_allocator<char>> slab_string;
+
+// Base for objects allocated with new/delete that should live in the slab
+struct slab_object {
+    static void* operator new(size_t n) { return slabAlloc(n); }
+    static void operator delete(void* p) { slabFree(p); }
+};
+
+#endif
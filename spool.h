@@ -0,0 +1,240 @@
+// Store-and-forward spool used by server.cpp: one per campus, under <spool dir>/<campus>/.
+//
+// An append-only log split into fixed-size segment files (seg_<base>.log, SPOOL_SEG bytes,
+// mmap'd shared). Positions are logical byte offsets that keep growing across segments.
+// Records never straddle a segment; a SPOOL_SEG_END marker sends readers to the next one.
+//
+//   head    next append position
+//   synced  everything before it is on disk (msync by the group commit); replay stops here
+//   acked   everything before it was delivered and acknowledged; persisted in "cursor"
+//
+// All fields are guarded by spool::m. Segments wholly below acked are unlinked; a segment that
+// replay messages still point into stays mapped until the last of them is written (refs).
+#ifndef CAMPUS_SPOOL_H
+#define CAMPUS_SPOOL_H
+#include<atomic>
+#include<cstdint>
+#include<cstdio>
+#include<cstring>
+#include<functional>
+#include<mutex>
+#include<string>
+#include<vector>
+#include<algorithm>
+#include<dirent.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+
+const size_t SPOOL_SEG = 8u << 20;           // segment file size
+const uint32_t SPOOL_SEG_END = 0xFFFFFFFF;   // record length marking "continue in next segment"
+
+// 8-byte aligned; payload follows, padded to 8
+struct spool_rec {
+    uint32_t len;          // payload bytes (0 = end of log, SPOOL_SEG_END = next segment)
+    uint32_t sum;          // FNV-1a of the payload: a torn tail after a crash fails this check
+    uint32_t sender;       // sender campus id
+    uint32_t xid;          // file records: stream id within this spool
+    uint8_t type;          // frame type to deliver (FT_MSG, FT_FILE_*)
+    uint8_t pad[7];
+    char* payload() { return (char*)(this+1); }
+};
+
+inline size_t spoolRecSize(uint32_t len) { return (sizeof(spool_rec) + len + 7) & ~(size_t)7; }
+
+inline uint32_t spoolSum(const char* p, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i=0;i<n;i++) { h ^= (uint8_t)p[i]; h *= 16777619u; }
+    return h;
+}
+
+struct spool_seg {
+    uint64_t base;         // logical position of byte 0
+    int fd;
+    char* map;
+    std::string path;
+    std::atomic<int> refs; // 1 while part of the spool, +1 per in-flight replay message
+};
+
+inline void spoolSegUnref(void* p) {
+    spool_seg* s = (spool_seg*)p;
+    if (s->refs.fetch_sub(1) != 1) return;
+    munmap(s->map, SPOOL_SEG);
+    close(s->fd);
+    delete s;
+}
+
+struct spool {
+    std::string campus, dir;
+    std::mutex m;
+    std::vector<spool_seg*> segs;   // ascending base
+    uint64_t head = 0, synced = 0, acked = 0;
+    uint64_t durableAck = 0;        // acked value last written to the cursor file
+    size_t maxBytes = 0;            // head - acked may not grow past this
+    int cursorFd = -1;
+    std::vector<std::function<void()>> onCommit; // run once the appends before them are durable
+    void* attached = nullptr;       // server: connection replaying this spool, if any
+    uint64_t sent = 0;              // server: replay position of the attached connection
+
+    std::string segPath(uint64_t base) const {
+        char nm[40]; snprintf(nm, sizeof(nm), "/seg_%016llx.log", (unsigned long long)base);
+        return dir + nm;
+    }
+
+    spool_seg* mapSeg(uint64_t base, bool create) {
+        spool_seg* s = new spool_seg();
+        s->base = base; s->path = segPath(base); s->refs = 1;
+        s->fd = ::open(s->path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+        if (s->fd < 0 || (create && ftruncate(s->fd, SPOOL_SEG) < 0)) { if (s->fd >= 0) close(s->fd); delete s; return nullptr; }
+        void* p = mmap(nullptr, SPOOL_SEG, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+        if (p == MAP_FAILED) { close(s->fd); delete s; return nullptr; }
+        s->map = (char*)p;
+        return s;
+    }
+
+    spool_seg* segFor(uint64_t pos) {
+        for (size_t i=segs.size(); i-- > 0;) if (segs[i]->base <= pos) return segs[i];
+        return nullptr;
+    }
+
+    // Open (or create) the spool in dir and recover head from the last segment
+    bool open(const std::string &d, const std::string &name, size_t maxB) {
+        dir = d; campus = name; maxBytes = maxB;
+        mkdir(dir.c_str(), 0755);
+        cursorFd = ::open((dir + "/cursor").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (cursorFd < 0) return false;
+        uint64_t cur = 0;
+        if (pread(cursorFd, &cur, sizeof(cur), 0) != (ssize_t)sizeof(cur)) cur = 0;
+        std::vector<uint64_t> bases;
+        if (DIR* dp = opendir(dir.c_str())) {
+            while (dirent* e = readdir(dp)) {
+                unsigned long long b;
+                if (sscanf(e->d_name, "seg_%llx.log", &b) == 1) bases.push_back(b);
+            }
+            closedir(dp);
+        }
+        std::sort(bases.begin(), bases.end());
+        for (uint64_t b : bases) {
+            if (b + SPOOL_SEG <= cur && b != bases.back()) { unlink(segPath(b).c_str()); continue; } // fully acked
+            if (spool_seg* s = mapSeg(b, false)) segs.push_back(s);
+        }
+        if (segs.empty()) {
+            uint64_t base = cur - cur % SPOOL_SEG;
+            spool_seg* s = mapSeg(base, true);
+            if (!s) return false;
+            segs.push_back(s);
+            head = base;
+        } else {
+            head = std::max(cur, segs.back()->base);
+        }
+        // find the end of the log: first empty, torn or out-of-range record
+        spool_seg* last = segs.back();
+        uint64_t pos = std::max(head, last->base);
+        if (cur > last->base) pos = last->base; // rescan the whole segment; records below cur stay acked
+        while (true) {
+            size_t off = pos - last->base;
+            if (off + sizeof(spool_rec) > SPOOL_SEG) break;
+            spool_rec* r = (spool_rec*)(last->map + off);
+            if (r->len == 0 || r->len == SPOOL_SEG_END) break;
+            if (off + spoolRecSize(r->len) > SPOOL_SEG || spoolSum(r->payload(), r->len) != r->sum) break;
+            pos += spoolRecSize(r->len);
+        }
+        head = std::max(pos, cur);
+        // clear a torn tail so the next append starts clean
+        size_t off = head - last->base;
+        if (off < SPOOL_SEG) memset(last->map + off, 0, std::min(SPOOL_SEG - off, (size_t)sizeof(spool_rec)));
+        acked = durableAck = cur;
+        synced = head;
+        return true;
+    }
+
+    // Reserve a record of len payload bytes and return it with its header filled in (sum is
+    // computed by finish()). nullptr if the spool is over maxBytes or a segment can't be made.
+    spool_rec* reserve(uint8_t type, uint32_t sender, uint32_t xid, uint32_t len, bool force = false) {
+        size_t need = spoolRecSize(len);
+        if (!force && head + need - acked > maxBytes) return nullptr;
+        spool_seg* last = segs.back();
+        size_t off = head - last->base;
+        if (off + need > SPOOL_SEG) {
+            spool_seg* s = mapSeg(last->base + SPOOL_SEG, true);
+            if (!s) return nullptr;
+            if (off + sizeof(uint32_t) <= SPOOL_SEG) ((spool_rec*)(last->map + off))->len = SPOOL_SEG_END;
+            segs.push_back(s);
+            last = s;
+            head = s->base;
+            off = 0;
+        }
+        spool_rec* r = (spool_rec*)(last->map + off);
+        r->sum = 0; r->sender = sender; r->xid = xid; r->type = type;
+        memset(r->pad, 0, sizeof(r->pad));
+        if (off + need + sizeof(uint32_t) <= SPOOL_SEG) ((spool_rec*)(last->map + off + need))->len = 0; // terminator
+        r->len = len;
+        head += need;
+        return r;
+    }
+    void finish(spool_rec* r) { r->sum = spoolSum(r->payload(), r->len); }
+
+    // Append a record whose payload is a followed by b
+    bool append(uint8_t type, uint32_t sender, uint32_t xid, const char* a, size_t an, const char* b = nullptr, size_t bn = 0, bool force = false) {
+        spool_rec* r = reserve(type, sender, xid, (uint32_t)(an + bn), force);
+        if (!r) return false;
+        memcpy(r->payload(), a, an);
+        if (bn) memcpy(r->payload() + an, b, bn);
+        finish(r);
+        return true;
+    }
+
+    // Record at pos (following SPOOL_SEG_END markers); pos is moved onto it. Holds a segment
+    // reference in *seg that the caller must drop with spoolSegUnref().
+    spool_rec* at(uint64_t &pos, spool_seg** seg) {
+        spool_seg* s = segFor(pos);
+        if (!s) return nullptr;
+        spool_rec* r = (spool_rec*)(s->map + (pos - s->base));
+        if (pos - s->base + sizeof(uint32_t) > SPOOL_SEG || r->len == SPOOL_SEG_END) {
+            pos = s->base + SPOOL_SEG;
+            return at(pos, seg);
+        }
+        s->refs++;
+        *seg = s;
+        return r;
+    }
+
+    // Group commit, called by the sync thread: make [synced, head) durable, persist the ack
+    // cursor, drop segments nobody needs, then run the waiters whose appends are now safe.
+    void sync() {
+        std::unique_lock<std::mutex> lk(m);
+        uint64_t from = synced, to = head, ack = acked;
+        std::vector<std::function<void()>> done;
+        done.swap(onCommit);
+        std::vector<spool_seg*> range;
+        for (spool_seg* s : segs) if (s->base + SPOOL_SEG > from && s->base < to) { s->refs++; range.push_back(s); }
+        lk.unlock();
+        for (spool_seg* s : range) {
+            uint64_t a = std::max(from, s->base), b = std::min(to, s->base + SPOOL_SEG);
+            uint64_t pa = (a - s->base) & ~(uint64_t)4095;
+            if (b > a) msync(s->map + pa, (b - s->base) - pa, MS_SYNC);
+            spoolSegUnref(s);
+        }
+        if (ack != durableAck) {
+            if (pwrite(cursorFd, &ack, sizeof(ack), 0) == (ssize_t)sizeof(ack)) fdatasync(cursorFd);
+            durableAck = ack;
+        }
+        lk.lock();
+        if (to > synced) synced = to;
+        while (segs.size() > 1 && segs[0]->base + SPOOL_SEG <= acked) {
+            unlink(segs[0]->path.c_str());
+            spoolSegUnref(segs[0]);
+            segs.erase(segs.begin());
+        }
+        lk.unlock();
+        for (auto &f : done) f();
+    }
+
+    bool idle() {
+        std::lock_guard<std::mutex> lk(m);
+        return synced == head && durableAck == acked && onCommit.empty();
+    }
+};
+
+#endif
@@ -0,0 +1,102 @@
+// Hierarchical timing wheel used by server.cpp for heartbeat liveness.
+//
+// One timer per campus slot (index 0..n-1), kept in intrusive doubly-linked bucket lists, so
+// arm/disarm are O(1) and a tick touches only the bucket that is due. The wheel has three
+// levels of 64 buckets (1, 64 and 4096 ticks per bucket). A timer further out than that is
+// parked in the last level and re-filed when its bucket comes round.
+// Single-threaded: only the reactor that owns the UDP socket uses it.
+#ifndef CAMPUS_TIMING_WHEEL_H
+#define CAMPUS_TIMING_WHEEL_H
+#include<cstdint>
+#include<vector>
+
+struct timing_wheel {
+    static const int BITS = 6;
+    static const int SIZE = 1 << BITS;
+    static const int LEVELS = 3;
+
+    struct node {
+        int prev, next;        // bucket list links (-1 = none)
+        int bucket;            // level*SIZE + index, -1 if not armed
+        uint64_t expires;      // tick the timer is due
+    };
+    std::vector<node> nodes;
+    int head[LEVELS*SIZE];
+    uint64_t now;              // last tick processed
+
+    timing_wheel(int n, uint64_t start) : nodes(n) {
+        for (node &x : nodes) { x.prev = x.next = x.bucket = -1; x.expires = 0; }
+        for (int i=0;i<LEVELS*SIZE;i++) head[i] = -1;
+        now = start;
+    }
+
+    bool armed(int i) const { return nodes[i].bucket != -1; }
+
+    // (Re)arm timer i to fire at tick `expires` (a tick already passed fires on the next one)
+    void arm(int i, uint64_t expires) {
+        if (armed(i)) unlink(i);
+        nodes[i].expires = expires;
+        file(i, now + 1);
+    }
+
+    void disarm(int i) { if (armed(i)) unlink(i); }
+
+    // Move time forward to tick `to`, calling expired(i) for every timer that came due.
+    // A callback may re-arm (or disarm) its own timer.
+    template<class F> void advance(uint64_t to, F expired) {
+        while (now < to) {
+            now++;
+            // crossing a boundary: pull the next bucket of the coarser levels down
+            for (int lvl=1; lvl<LEVELS; lvl++) {
+                if ((now & ((1ull << (BITS*lvl)) - 1)) != 0) break;
+                cascade(lvl*SIZE + (int)((now >> (BITS*lvl)) & (SIZE-1)));
+            }
+            int b = (int)(now & (SIZE-1));
+            while (head[b] != -1) {
+                int i = head[b];
+                unlink(i);
+                if (nodes[i].expires > now) file(i, now);  // parked from a coarser level
+                else expired(i);
+            }
+        }
+    }
+
+private:
+    // earliest: the first tick the timer may land on (now+1 from arm(), now while cascading,
+    // since the current tick's bucket is processed right after)
+    void file(int i, uint64_t earliest) {
+        node &x = nodes[i];
+        uint64_t when = x.expires > earliest ? x.expires : earliest;
+        uint64_t delta = when - now;
+        int lvl = 0;
+        while (lvl < LEVELS-1 && delta >= (1ull << (BITS*(lvl+1)))) lvl++;
+        int b = lvl*SIZE + (int)((when >> (BITS*lvl)) & (SIZE-1));
+        if (lvl == LEVELS-1 && delta >= (1ull << (BITS*LEVELS)))
+            b = lvl*SIZE + (int)(((now >> (BITS*lvl)) - 1) & (SIZE-1)); // too far: last bucket of the top level
+        x.bucket = b;
+        x.prev = -1;
+        x.next = head[b];
+        if (head[b] != -1) nodes[head[b]].prev = i;
+        head[b] = i;
+    }
+
+    void unlink(int i) {
+        node &x = nodes[i];
+        if (x.prev != -1) nodes[x.prev].next = x.next; else head[x.bucket] = x.next;
+        if (x.next != -1) nodes[x.next].prev = x.prev;
+        x.prev = x.next = x.bucket = -1;
+    }
+
+    void cascade(int b) {
+        int i = head[b];
+        head[b] = -1;
+        while (i != -1) {
+            int nx = nodes[i].next;
+            nodes[i].prev = nodes[i].next = nodes[i].bucket = -1;
+            file(i, now);
+            i = nx;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,375 @@
+// Optional TLS transport, used by server.cpp (--tls-cert) and campus_client.h (clientTls).
+// Build with -DCAMPUS_TLS and link -lssl -lcrypto; without it the same functions exist and
+// report that the build has no TLS.
+//
+// Only the handshake runs in userspace, through OpenSSL: TLS 1.3 with AES-GCM or
+// ChaCha20-Poly1305, no session tickets. The traffic secrets come out through the key log
+// callback. The record keys are derived from them (RFC 8446 7.3) and handed to the kernel
+// (kTLS: TCP_ULP "tls", then TLS_TX and TLS_RX), and the SSL object is dropped. From then on
+// read(), write(), sendfile() and splice() on the socket see plaintext and the wire carries
+// records, so the server's copy-avoiding file paths work unchanged on encrypted connections.
+// OpenSSL reads no further than the peer's Finished (no read-ahead) and nothing is sent after
+// our own, so the kernel starts both directions at record sequence 0.
+#ifndef CAMPUS_TLS_H
+#define CAMPUS_TLS_H
+#include<cerrno>
+#include<cstdint>
+#include<cstring>
+#include<string>
+#include<unistd.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+
+#ifdef CAMPUS_TLS
+#include<algorithm>
+#include<fcntl.h>
+#include<poll.h>
+#include<arpa/inet.h>
+#include<linux/tls.h>
+#include<sys/mman.h>
+#include<sys/sendfile.h>
+#include<openssl/err.h>
+#include<openssl/kdf.h>
+#include<openssl/ssl.h>
+#include<openssl/x509v3.h>
+
+const char* const TLS_SUITES = "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256";
+const int TLS_HANDSHAKE_MS = 10000; // a client gives up on a silent server after this
+
+inline thread_local std::string tlsFailure; // why the last tlsConnect() on this thread failed
+
+// Application traffic secrets of one handshake, filled in by the key log callback
+struct tls_secrets {
+    unsigned char client[EVP_MAX_MD_SIZE], server[EVP_MAX_MD_SIZE];
+    size_t clientLen = 0, serverLen = 0;
+};
+
+// Key log lines look like "CLIENT_TRAFFIC_SECRET_0 <client random> <secret>" (hex)
+inline void tlsKeylog(const SSL* s, const char* line) {
+    tls_secrets* k = (tls_secrets*)SSL_get_app_data(s);
+    if (!k) return;
+    unsigned char* out; size_t* len;
+    if (!strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24)) { out = k->client; len = &k->clientLen; }
+    else if (!strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24)) { out = k->server; len = &k->serverLen; }
+    else return;
+    const char* hex = strrchr(line, ' ') + 1;
+    size_t n = strlen(hex) / 2;
+    if (n > EVP_MAX_MD_SIZE) return;
+    for (size_t i=0;i<n;i++) {
+        auto nib = [](char c) { return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10; };
+        out[i] = (unsigned char)(nib(hex[2*i]) << 4 | nib(hex[2*i+1]));
+    }
+    *len = n;
+}
+
+inline std::string tlsErrors() {
+    unsigned long e = ERR_get_error();
+    if (!e) return "unknown error";
+    char buf[256];
+    ERR_error_string_n(e, buf, sizeof(buf));
+    ERR_clear_error();
+    return buf;
+}
+
+// Settings both sides share: TLS 1.3 only, suites the kernel can take, no tickets (a ticket
+// would be a record sent after the handshake, behind the kernel's back)
+inline SSL_CTX* tlsContext(bool server) {
+    SSL_CTX* ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+    if (!ctx) return nullptr;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+    SSL_CTX_set_max_proto_version(ctx, TLS1_3_VERSION);
+    SSL_CTX_set_ciphersuites(ctx, TLS_SUITES);
+    SSL_CTX_set_num_tickets(ctx, 0);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    SSL_CTX_set_keylog_callback(ctx, tlsKeylog);
+    return ctx;
+}
+
+// Server side: certificate chain and private key (PEM). nullptr with err on failure.
+inline SSL_CTX* tlsServerContext(const std::string &cert, const std::string &key, std::string &err) {
+    SSL_CTX* ctx = tlsContext(true);
+    if (!ctx) { err = tlsErrors(); return nullptr; }
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert.c_str()) != 1) err = cert + ": " + tlsErrors();
+    else if (SSL_CTX_use_PrivateKey_file(ctx, key.c_str(), SSL_FILETYPE_PEM) != 1) err = key + ": " + tlsErrors();
+    else if (SSL_CTX_check_private_key(ctx) != 1) err = key + ": " + tlsErrors();
+    else return ctx;
+    SSL_CTX_free(ctx);
+    return nullptr;
+}
+
+// Client side: the server's certificate must chain to one in caFile (PEM), which may also be
+// the server's own certificate, and name the address or host dialled
+inline SSL_CTX* tlsClientContext(const std::string &caFile, std::string &err) {
+    SSL_CTX* ctx = tlsContext(false);
+    if (!ctx) { err = tlsErrors(); return nullptr; }
+    if (SSL_CTX_load_verify_locations(ctx, caFile.c_str(), nullptr) != 1) {
+        err = caFile + ": " + tlsErrors();
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    X509_VERIFY_PARAM_set_flags(SSL_CTX_get0_param(ctx), X509_V_FLAG_PARTIAL_CHAIN);
+    return ctx;
+}
+
+// Why the kernel cannot take TLS records on TCP sockets, "" if it can. An unconnected socket
+// only gets as far as ENOTCONN when the tls module is there.
+inline std::string ktlsMissing() {
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0) return strerror(errno);
+    int r = setsockopt(s, SOL_TCP, TCP_ULP, "tls", sizeof("tls"));
+    int e = errno;
+    close(s);
+    if (r == 0 || e == ENOTCONN) return "";
+    if (e == ENOENT) return "the kernel has no TLS support (CONFIG_TLS; try modprobe tls)";
+    return strerror(e);
+}
+
+// HKDF-Expand-Label(secret, label, "", n) of RFC 8446
+inline bool tlsExpandLabel(const EVP_MD* md, const unsigned char* secret, size_t len, const char* label, unsigned char* out, size_t n) {
+    unsigned char info[2 + 1 + 255 + 1];
+    size_t l = strlen(label) + 6;
+    info[0] = (unsigned char)(n >> 8); info[1] = (unsigned char)n;
+    info[2] = (unsigned char)l;
+    memcpy(info + 3, "tls13 ", 6);
+    memcpy(info + 9, label, l - 6);
+    info[3 + l] = 0; // empty context
+    EVP_PKEY_CTX* p = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+    bool ok = p && EVP_PKEY_derive_init(p) > 0
+        && EVP_PKEY_CTX_set_hkdf_mode(p, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0
+        && EVP_PKEY_CTX_set_hkdf_md(p, md) > 0
+        && EVP_PKEY_CTX_set1_hkdf_key(p, secret, (int)len) > 0
+        && EVP_PKEY_CTX_add1_hkdf_info(p, info, (int)(4 + l)) > 0
+        && EVP_PKEY_derive(p, out, &n) > 0;
+    EVP_PKEY_CTX_free(p);
+    return ok;
+}
+
+// Give the kernel one direction (TLS_TX or TLS_RX) of the session, keyed from secret
+inline bool ktlsDirection(int fd, int dir, uint16_t suite, const EVP_MD* md, const unsigned char* secret, size_t len, std::string &err) {
+    union {
+        tls12_crypto_info_aes_gcm_128 g128;
+        tls12_crypto_info_aes_gcm_256 g256;
+        tls12_crypto_info_chacha20_poly1305 cc;
+    } ci;
+    memset(&ci, 0, sizeof(ci));
+    unsigned char key[32], iv[12];
+    size_t keyLen = suite == 0x1301 ? 16 : 32;
+    if (!len || !tlsExpandLabel(md, secret, len, "key", key, keyLen) || !tlsExpandLabel(md, secret, len, "iv", iv, sizeof(iv))) {
+        err = "no traffic secret";
+        return false;
+    }
+    socklen_t n;
+    if (suite == 0x1301) {
+        ci.g128.info.version = TLS_1_3_VERSION; ci.g128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(ci.g128.key, key, 16); memcpy(ci.g128.salt, iv, 4); memcpy(ci.g128.iv, iv + 4, 8);
+        n = sizeof(ci.g128);
+    } else if (suite == 0x1302) {
+        ci.g256.info.version = TLS_1_3_VERSION; ci.g256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(ci.g256.key, key, 32); memcpy(ci.g256.salt, iv, 4); memcpy(ci.g256.iv, iv + 4, 8);
+        n = sizeof(ci.g256);
+    } else {
+        ci.cc.info.version = TLS_1_3_VERSION; ci.cc.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        memcpy(ci.cc.key, key, 32); memcpy(ci.cc.iv, iv, 12);
+        n = sizeof(ci.cc);
+    }
+    int r = setsockopt(fd, SOL_TLS, dir, &ci, n);
+    if (r < 0) err = std::string("kernel TLS: ") + strerror(errno);
+    OPENSSL_cleanse(&ci, sizeof(ci));
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(iv, sizeof(iv));
+    return r == 0;
+}
+
+// The handshake is through: hand both directions to the kernel
+inline bool ktlsInstall(SSL* s, std::string &err) {
+    tls_secrets* k = (tls_secrets*)SSL_get_app_data(s);
+    const SSL_CIPHER* c = SSL_get_current_cipher(s);
+    uint16_t suite = SSL_CIPHER_get_protocol_id(c);
+    const EVP_MD* md = SSL_CIPHER_get_handshake_digest(c);
+    int fd = SSL_get_fd(s);
+    bool server = SSL_is_server(s);
+    if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) { err = std::string("kernel TLS: ") + strerror(errno); return false; }
+    if (!ktlsDirection(fd, TLS_TX, suite, md, server ? k->server : k->client, server ? k->serverLen : k->clientLen, err)
+        || !ktlsDirection(fd, TLS_RX, suite, md, server ? k->client : k->server, server ? k->clientLen : k->serverLen, err)) return false;
+    int one = 1;
+    setsockopt(fd, SOL_TLS, TLS_RX_EXPECT_NO_PAD, &one, sizeof(one)); // decrypt in place (6.0+); we never pad
+    return true;
+}
+
+// Start a handshake on fd (connected, or connecting). A client checks the certificate against
+// peer, the address or host name it dialled.
+inline SSL* tlsBegin(SSL_CTX* ctx, int fd, bool server, const std::string &peer = "") {
+    SSL* s = SSL_new(ctx);
+    if (!s) return nullptr;
+    SSL_set_app_data(s, new tls_secrets());
+    SSL_set_fd(s, fd);
+    if (server) SSL_set_accept_state(s);
+    else {
+        in_addr a;
+        X509_VERIFY_PARAM* vp = SSL_get0_param(s);
+        if (inet_pton(AF_INET, peer.c_str(), &a) == 1) X509_VERIFY_PARAM_set1_ip_asc(vp, peer.c_str());
+        else { X509_VERIFY_PARAM_set1_host(vp, peer.c_str(), 0); SSL_set_tlsext_host_name(s, peer.c_str()); }
+        SSL_set_connect_state(s);
+    }
+    return s;
+}
+
+inline void tlsEnd(SSL* s) {
+    tls_secrets* k = (tls_secrets*)SSL_get_app_data(s);
+    if (k) { OPENSSL_cleanse(k, sizeof(*k)); delete k; }
+    SSL_free(s); // leaves fd open, sends nothing
+}
+
+// Move the handshake on: 1 when it is through and the kernel has the keys, 0 when it has to
+// wait for the socket (readable, or writable if wantWrite), -1 with err if it failed
+inline int tlsStep(SSL* s, bool &wantWrite, std::string &err) {
+    ERR_clear_error();
+    int r = SSL_do_handshake(s);
+    if (r == 1) return ktlsInstall(s, err) ? 1 : -1;
+    int e = SSL_get_error(s, r);
+    if (e == SSL_ERROR_WANT_READ || e == SSL_ERROR_WANT_WRITE) { wantWrite = e == SSL_ERROR_WANT_WRITE; return 0; }
+    long v = SSL_get_verify_result(s);
+    if (v != X509_V_OK) err = std::string("certificate: ") + X509_verify_cert_error_string(v);
+    else if (e == SSL_ERROR_SYSCALL && !ERR_peek_error()) err = errno ? strerror(errno) : "connection closed";
+    else err = tlsErrors();
+    return -1;
+}
+
+// First bytes the server sent, as OpenSSL reads them (a record header, or not)
+struct tls_first { unsigned char b[5]; size_t n = 0; };
+
+inline long tlsFirstBytes(BIO* bio, int oper, const char* p, size_t, int, long, int ret, size_t* done) {
+    tls_first* f = (tls_first*)BIO_get_callback_arg(bio);
+    if (oper == (BIO_CB_READ | BIO_CB_RETURN) && ret > 0 && f->n < sizeof(f->b)) {
+        size_t k = std::min(*done, sizeof(f->b) - f->n);
+        memcpy(f->b + f->n, p, k);
+        f->n += k;
+    }
+    return ret;
+}
+
+// Client handshake on a connected socket, given up after TLS_HANDSHAKE_MS. False with the
+// reason in tlsFailure if it failed. A server that turned the connection away before any
+// handshake (SERVER_BUSY) sent a plaintext line where a record should be: it goes to plain.
+inline bool tlsConnect(SSL_CTX* ctx, int fd, const std::string &host, std::string* plain = nullptr) {
+    SSL* s = tlsBegin(ctx, fd, false, host);
+    if (!s) { tlsFailure = tlsErrors(); return false; }
+    tls_first first;
+    BIO_set_callback_ex(SSL_get_rbio(s), tlsFirstBytes);
+    BIO_set_callback_arg(SSL_get_rbio(s), (char*)&first);
+    // our Finished goes unanswered, so with Nagle the first request after it would wait for
+    // the server's delayed ACK (40 ms)
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int fl = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+    bool wantWrite = false;
+    int r;
+    while ((r = tlsStep(s, wantWrite, tlsFailure)) == 0) {
+        pollfd p = { fd, (short)(wantWrite ? POLLOUT : POLLIN), 0 };
+        if (poll(&p, 1, TLS_HANDSHAKE_MS) <= 0) { tlsFailure = "handshake timed out"; break; }
+    }
+    if (r < 0 && first.n && (first.b[0] < 0x14 || first.b[0] > 0x17)) { // not a TLS content type
+        std::string line((const char*)first.b, first.n);
+        char c;
+        pollfd p = { fd, POLLIN, 0 };
+        while (line.size() < 256 && line.back() != '\n' && poll(&p, 1, TLS_HANDSHAKE_MS) > 0 && recv(fd, &c, 1, 0) == 1) line += c;
+        while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.pop_back();
+        tlsFailure = "server answered in plaintext: " + line;
+        if (plain) *plain = line;
+    }
+    fcntl(fd, F_SETFL, fl);
+    tlsEnd(s);
+    return r == 1;
+}
+
+// Exactly n bytes from fd (blocking, under its receive timeout)
+inline bool tlsReadAll(int fd, char* p, size_t n) {
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r; n -= r;
+    }
+    return true;
+}
+
+// Loopback round trip through kernel TLS with the server's own context: a handshake against a
+// client that does not check the certificate, then a record each way and a sendfile() from the
+// server side, compared byte for byte. "" if it all came back intact, otherwise what failed.
+// The record keys are derived here rather than by the kernel, so a mistake in that would
+// garble every connection; the server runs this once at startup and refuses to start on it.
+inline std::string tlsSelfCheck(SSL_CTX* server) {
+    std::string why;
+    int l = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0), cfd = -1, sfd = -1, mfd = -1;
+    SSL_CTX* cctx = tlsContext(false);
+    SSL *ss = nullptr, *cs = nullptr;
+    sockaddr_in a;
+    socklen_t al = sizeof(a);
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET; a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (l < 0 || !cctx || bind(l, (sockaddr*)&a, sizeof(a)) < 0 || listen(l, 1) < 0 || getsockname(l, (sockaddr*)&a, &al) < 0
+        || (cfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 || connect(cfd, (sockaddr*)&a, sizeof(a)) < 0
+        || (sfd = accept4(l, nullptr, nullptr, SOCK_CLOEXEC)) < 0) {
+        why = std::string("loopback connection: ") + strerror(errno);
+    }
+    if (why.empty()) {
+        fcntl(cfd, F_SETFL, O_NONBLOCK); fcntl(sfd, F_SETFL, O_NONBLOCK);
+        ss = tlsBegin(server, sfd, true);
+        cs = tlsBegin(cctx, cfd, false, "127.0.0.1");
+        int rs = 0, rc = 0;
+        bool w;
+        for (int ms = 0; why.empty() && (rs != 1 || rc != 1); ms++) {
+            if (rs == 0 && (rs = tlsStep(ss, w, why)) < 0) why = "server handshake: " + why;
+            else if (rc == 0 && (rc = tlsStep(cs, w, why)) < 0) why = "client handshake: " + why;
+            else if (ms > TLS_HANDSHAKE_MS) why = "handshake timed out";
+            else if (rs != 1 || rc != 1) { pollfd p[2] = { { sfd, POLLIN, 0 }, { cfd, POLLIN, 0 } }; poll(p, 2, 1); }
+        }
+    }
+    if (why.empty()) {
+        timeval tv = { 2, 0 };
+        for (int fd : {cfd, sfd}) { fcntl(fd, F_SETFL, 0); setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)); }
+        const char up[] = "campus tls self-check: client to server";
+        const char down[] = "campus tls self-check: server to client";
+        char got[sizeof(up)];
+        std::string file(3 * 16384 + 1000, '\0');  // several records through sendfile()
+        for (size_t i=0;i<file.size();i++) file[i] = (char)(i * 131 + (i >> 8));
+        std::string back(file.size(), '\0');
+        off_t off = 0;
+        if (write(cfd, up, sizeof(up)) != (ssize_t)sizeof(up) || !tlsReadAll(sfd, got, sizeof(up)) || memcmp(got, up, sizeof(up)))
+            why = "client to server record did not come through intact";
+        else if (write(sfd, down, sizeof(down)) != (ssize_t)sizeof(down) || !tlsReadAll(cfd, got, sizeof(down)) || memcmp(got, down, sizeof(down)))
+            why = "server to client record did not come through intact";
+        else if ((mfd = memfd_create("tls-self-check", MFD_CLOEXEC)) < 0 || write(mfd, file.data(), file.size()) != (ssize_t)file.size()
+            || sendfile(sfd, mfd, &off, file.size()) != (ssize_t)file.size() || !tlsReadAll(cfd, &back[0], back.size()) || back != file)
+            why = "sendfile() over kernel TLS did not come through intact";
+    }
+    if (ss) tlsEnd(ss);
+    if (cs) tlsEnd(cs);
+    if (cctx) SSL_CTX_free(cctx);
+    for (int fd : {l, cfd, sfd, mfd}) if (fd >= 0) close(fd);
+    return why;
+}
+
+#else // no TLS in this build
+
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+
+const char* const TLS_NOT_BUILT = "built without TLS (compile with -DCAMPUS_TLS, link -lssl -lcrypto)";
+
+inline thread_local std::string tlsFailure;
+
+inline SSL_CTX* tlsServerContext(const std::string &, const std::string &, std::string &err) { err = TLS_NOT_BUILT; return nullptr; }
+inline SSL_CTX* tlsClientContext(const std::string &, std::string &err) { err = TLS_NOT_BUILT; return nullptr; }
+inline std::string ktlsMissing() { return TLS_NOT_BUILT; }
+inline SSL* tlsBegin(SSL_CTX*, int, bool, const std::string & = "") { return nullptr; }
+inline void tlsEnd(SSL*) {}
+inline int tlsStep(SSL*, bool &, std::string &err) { err = TLS_NOT_BUILT; return -1; }
+inline bool tlsConnect(SSL_CTX*, int, const std::string &, std::string* = nullptr) { tlsFailure = TLS_NOT_BUILT; return false; }
+inline std::string tlsSelfCheck(SSL_CTX*) { return TLS_NOT_BUILT; }
+
+#endif
+#endif
@@ -0,0 +1,193 @@
+// Minimal io_uring driver used by server.cpp (--io uring), on the raw system calls (no
+// liburing): the submission and completion rings, SQE preparation for the few operations the
+// server uses, and rings of provided buffers for multishot receives.
+//
+// A ring is created disabled so its buffers and files can be registered from main(); the
+// reactor thread then enables it and is its only submitter (SINGLE_ISSUER, DEFER_TASKRUN:
+// completions are only produced while that thread waits in enter()).
+#ifndef CAMPUS_URING_H
+#define CAMPUS_URING_H
+#include<cerrno>
+#include<cstdint>
+#include<cstring>
+#include<ctime>
+#include<linux/io_uring.h>
+#include<sys/mman.h>
+#include<sys/socket.h>
+#include<sys/syscall.h>
+#include<unistd.h>
+
+struct uring {
+    int fd = -1;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask, sqEntries;
+    unsigned sqLocal = 0;      // our tail: SQEs prepared so far
+    io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    io_uring_cqe* cqes;
+
+    // Returns false (errno set) if the kernel has no io_uring with the features used here
+    bool init(unsigned entries) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_R_DISABLED | IORING_SETUP_SUBMIT_ALL
+                | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        p.cq_entries = entries * 4;
+        fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+        if (fd < 0) return false;
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) { close(fd); fd = -1; errno = ENOSYS; return false; }
+        size_t sqSz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        size_t cqSz = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        char* r = (char*)mmap(nullptr, sqSz > cqSz ? sqSz : cqSz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        void* s = mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (r == MAP_FAILED || s == MAP_FAILED) { close(fd); fd = -1; return false; }
+        sqHead = (unsigned*)(r + p.sq_off.head);
+        sqTail = (unsigned*)(r + p.sq_off.tail);
+        sqMask = *(unsigned*)(r + p.sq_off.ring_mask);
+        sqEntries = p.sq_entries;
+        unsigned* array = (unsigned*)(r + p.sq_off.array);
+        for (unsigned i=0;i<sqEntries;i++) array[i] = i; // SQE i always sits in slot i
+        sqes = (io_uring_sqe*)s;
+        cqHead = (unsigned*)(r + p.cq_off.head);
+        cqTail = (unsigned*)(r + p.cq_off.tail);
+        cqMask = *(unsigned*)(r + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(r + p.cq_off.cqes);
+        return true;
+    }
+
+    int reg(unsigned op, const void* arg, unsigned nr) { return (int)syscall(__NR_io_uring_register, fd, op, arg, nr); }
+
+    // Called on the thread that will submit
+    bool enable() { return reg(IORING_REGISTER_ENABLE_RINGS, nullptr, 0) == 0; }
+
+    // Hand prepared SQEs to the kernel; with wait, also sleep until a completion arrives or
+    // ts (if given) passes
+    int enter(bool wait, const timespec* ts = nullptr) {
+        __atomic_store_n(sqTail, sqLocal, __ATOMIC_RELEASE);
+        unsigned pending = sqLocal - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+        io_uring_getevents_arg arg;
+        __kernel_timespec kts;
+        if (wait && ts) {
+            memset(&arg, 0, sizeof(arg));
+            kts.tv_sec = ts->tv_sec; kts.tv_nsec = ts->tv_nsec;
+            arg.ts = (uint64_t)(uintptr_t)&kts;
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+        return (int)syscall(__NR_io_uring_enter, fd, pending, wait ? 1 : 0, flags, wait && ts ? &arg : nullptr, sizeof(arg));
+    }
+
+    // Next SQE, zeroed. A full queue is submitted first.
+    io_uring_sqe* sqe() {
+        while (sqLocal - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries) enter(false);
+        io_uring_sqe* e = &sqes[sqLocal & sqMask];
+        memset(e, 0, sizeof(*e));
+        sqLocal++;
+        return e;
+    }
+
+    // f(cqe) for every completion posted so far
+    template<class F> void reap(F f) {
+        unsigned head = *cqHead;
+        while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe c = cqes[head & cqMask];
+            __atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+            f(c); // may queue more SQEs
+        }
+    }
+
+    io_uring_sqe* op(uint8_t opcode, int fd, uint64_t ud) {
+        io_uring_sqe* e = sqe();
+        e->opcode = opcode; e->fd = fd; e->user_data = ud;
+        return e;
+    }
+    void acceptMulti(int lfd, int flags, uint64_t ud) {
+        io_uring_sqe* e = op(IORING_OP_ACCEPT, lfd, ud);
+        e->ioprio = IORING_ACCEPT_MULTISHOT;
+        e->accept_flags = flags;
+    }
+    // Multishot receive into buffers of group bgid; fixed: fd is an index in the file table
+    void recvMulti(int fd, bool fixed, uint16_t bgid, uint64_t ud) {
+        io_uring_sqe* e = op(IORING_OP_RECV, fd, ud);
+        e->ioprio = IORING_RECV_MULTISHOT;
+        e->flags = IOSQE_BUFFER_SELECT | (fixed ? IOSQE_FIXED_FILE : 0);
+        e->buf_group = bgid;
+    }
+    // Each completion's buffer holds an io_uring_recvmsg_out, the name, the control data (as
+    // long as m asks for) and the payload
+    void recvmsgMulti(int fd, msghdr* m, uint16_t bgid, uint64_t ud) {
+        io_uring_sqe* e = op(IORING_OP_RECVMSG, fd, ud);
+        e->addr = (uint64_t)(uintptr_t)m;
+        e->len = 1;
+        e->ioprio = IORING_RECV_MULTISHOT;
+        e->flags = IOSQE_BUFFER_SELECT;
+        e->buf_group = bgid;
+    }
+    void poll(int fd, unsigned events, bool multi, uint64_t ud) {
+        io_uring_sqe* e = op(IORING_OP_POLL_ADD, fd, ud);
+        e->poll32_events = events;
+        if (multi) e->len = IORING_POLL_ADD_MULTI;
+    }
+    // Cancel the request(s) submitted with user_data target; only failures complete
+    void cancel(uint64_t target) {
+        io_uring_sqe* e = op(IORING_OP_ASYNC_CANCEL, -1, 0);
+        e->addr = target;
+        e->flags = IOSQE_CQE_SKIP_SUCCESS;
+    }
+    // Point file table slots off.. at fds[0..n) (-1 clears). fds is read when the SQE is
+    // submitted. Only failures complete.
+    void filesUpdate(const int* fds, unsigned n, unsigned off, uint8_t flags, uint64_t ud) {
+        io_uring_sqe* e = op(IORING_OP_FILES_UPDATE, -1, ud);
+        e->addr = (uint64_t)(uintptr_t)fds;
+        e->len = n;
+        e->off = off;
+        e->flags = flags | IOSQE_CQE_SKIP_SUCCESS;
+    }
+    // Write n bytes at file offset off, from registered buffer index buf (-1: p is not in one)
+    void write(int fd, const char* p, unsigned n, uint64_t off, int buf, uint64_t ud) {
+        io_uring_sqe* e = op(buf < 0 ? IORING_OP_WRITE : IORING_OP_WRITE_FIXED, fd, ud);
+        e->addr = (uint64_t)(uintptr_t)p;
+        e->len = n;
+        e->off = off;
+        if (buf >= 0) e->buf_index = (uint16_t)buf;
+    }
+};
+
+// A group of equal-size provided buffers (IORING_REGISTER_PBUF_RING). The kernel picks one
+// per receive and names it in the completion; give() hands it back once it is consumed.
+// The ring is used as a plain io_uring_buf array with the tail in bufs[0].resv: under C++
+// the uapi io_uring_buf_ring puts bufs at offset 8 (its empty flex-array struct takes a byte).
+struct uring_bufs {
+    io_uring_buf* bufs;
+    char* mem;
+    unsigned count, size;
+    uint16_t tail;
+
+    bool init(uring &u, uint16_t bgid, unsigned n, unsigned sz) {
+        count = n; size = sz; tail = 0;
+        bufs = (io_uring_buf*)mmap(nullptr, n * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        mem = (char*)mmap(nullptr, (size_t)n * sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (bufs == MAP_FAILED || mem == MAP_FAILED) return false;
+        io_uring_buf_reg r;
+        memset(&r, 0, sizeof(r));
+        r.ring_addr = (uint64_t)(uintptr_t)bufs;
+        r.ring_entries = n;
+        r.bgid = bgid;
+        if (u.reg(IORING_REGISTER_PBUF_RING, &r, 1) < 0) return false;
+        for (unsigned i=0;i<n;i++) give(i);
+        return true;
+    }
+    char* at(unsigned bid) { return mem + (size_t)bid * size; }
+    void give(unsigned bid) {
+        io_uring_buf* b = &bufs[tail & (count - 1)];
+        b->addr = (uint64_t)(uintptr_t)at(bid);
+        b->len = size;
+        b->bid = (uint16_t)bid;
+        __atomic_store_n(&bufs[0].resv, ++tail, __ATOMIC_RELEASE);
+    }
+};
+
+#endif
@@ -0,0 +1,124 @@
+// Work-stealing task pool used by server.cpp (--workers N) for the slow side of files saved on
+// the server: disk writes, dedup chunking and hashing, unpacking and the final commit.
+//
+// Work is posted to a strand, not to the pool. A strand runs its tasks one at a time in the
+// order they were posted, so everything posted for one connection stays in order. A strand
+// that gets work joins the deque of its home worker (chosen by the caller, one per connection);
+// a worker serves its own deque front to back and, once that is empty, steals from the back of
+// the others. After STRAND_BATCH tasks a busy strand goes to the back of the line, so one large
+// upload cannot keep a worker from the other connections queued behind it.
+#ifndef CAMPUS_WORK_POOL_H
+#define CAMPUS_WORK_POOL_H
+#include<atomic>
+#include<condition_variable>
+#include<cstdint>
+#include<deque>
+#include<functional>
+#include<mutex>
+#include<thread>
+#include<vector>
+
+const int STRAND_BATCH = 8;        // tasks a strand runs before letting others have the worker
+
+struct work_strand {
+    std::mutex m;
+    std::deque<std::function<void()>> tasks;
+    bool queued = false;           // on a worker's deque or running (under m)
+    int home;                      // worker whose deque it joins when it gets work
+    std::atomic<int> refs;         // owner + one while queued
+    explicit work_strand(int h) : home(h), refs(1) {}
+};
+
+inline void strandUnref(work_strand* s) { if (s->refs.fetch_sub(1) == 1) delete s; }
+
+inline thread_local int workSelf = -1; // index of the worker running on this thread
+
+struct work_pool {
+    struct alignas(64) worker {
+        std::mutex m;
+        std::deque<work_strand*> q;    // strands with work; the owner takes the front, thieves the back
+        std::atomic<uint64_t> ran{0}, stolen{0}; // written by the owner only
+    };
+    std::vector<worker*> ws;
+    std::atomic<int> runnable{0};  // strands sitting on deques
+    std::atomic<int> sleeping{0};  // workers waiting on idleCv
+    std::mutex idleM;
+    std::condition_variable idleCv;
+
+    void start(int n) {
+        for (int i=0;i<n;i++) ws.push_back(new worker());
+        for (int i=0;i<n;i++) std::thread([this, i] { loop(i); }).detach();
+    }
+    int size() const { return (int)ws.size(); }
+
+    // Queue f on strand s. Any thread; f runs after everything posted to s before it.
+    void post(work_strand* s, std::function<void()> f) {
+        bool idle;
+        {
+            std::lock_guard<std::mutex> lk(s->m);
+            s->tasks.push_back(std::move(f));
+            idle = !s->queued;
+            s->queued = true;
+        }
+        if (!idle) return;
+        s->refs.fetch_add(1);
+        push(workSelf >= 0 ? workSelf : s->home, s);
+    }
+
+    uint64_t tasksRun() const { uint64_t n = 0; for (worker* w : ws) n += w->ran.load(std::memory_order_relaxed); return n; }
+    uint64_t steals() const { uint64_t n = 0; for (worker* w : ws) n += w->stolen.load(std::memory_order_relaxed); return n; }
+
+    void push(int i, work_strand* s) {
+        { std::lock_guard<std::mutex> lk(ws[i]->m); ws[i]->q.push_back(s); }
+        runnable.fetch_add(1);
+        if (sleeping.load()) { std::lock_guard<std::mutex> lk(idleM); idleCv.notify_one(); }
+    }
+
+    // Next strand for worker i: its own oldest, else another worker's newest
+    work_strand* take(int i) {
+        int n = size();
+        for (int k=0;k<n;k++) {
+            worker* w = ws[(i + k) % n];
+            std::lock_guard<std::mutex> lk(w->m);
+            if (w->q.empty()) continue;
+            work_strand* s;
+            if (k == 0) { s = w->q.front(); w->q.pop_front(); }
+            else { s = w->q.back(); w->q.pop_back(); bump(ws[i]->stolen); }
+            runnable.fetch_sub(1);
+            return s;
+        }
+        return nullptr;
+    }
+
+    // Run up to STRAND_BATCH of s's tasks, then requeue it or let it go idle
+    void run(int i, work_strand* s) {
+        for (int k=0;;k++) {
+            std::function<void()> f;
+            {
+                std::lock_guard<std::mutex> lk(s->m);
+                if (s->tasks.empty()) { s->queued = false; break; }
+                if (k == STRAND_BATCH) { push(i, s); return; } // still queued: keeps its reference
+                f = std::move(s->tasks.front());
+                s->tasks.pop_front();
+            }
+            f();
+            bump(ws[i]->ran);
+        }
+        strandUnref(s);
+    }
+
+    void loop(int i) {
+        workSelf = i;
+        while (true) {
+            if (work_strand* s = take(i)) { run(i, s); continue; }
+            std::unique_lock<std::mutex> lk(idleM);
+            sleeping.fetch_add(1);
+            idleCv.wait(lk, [this] { return runnable.load() > 0; });
+            sleeping.fetch_sub(1);
+        }
+    }
+
+    static void bump(std::atomic<uint64_t> &x) { x.store(x.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+};
+
+#endif